@@ -9,9 +9,13 @@
  *
  * Initializing the disk structure requires that the seek,
  * tell, read and write methods be implemented and assigned
- * to the structure. See the @ref BMFSDisk structure for
- * details. If you plan on using a file to represent a disk,
- * you can use @ref bmfs_disk_init_file.
+ * to the structure. The pread and pwrite methods are
+ * optional, but should be implemented if the disk can read
+ * and write at an offset in a single operation. Start by
+ * calling @ref bmfs_disk_init, so that the methods that are
+ * not implemented are set to NULL. See the @ref BMFSDisk
+ * structure for details. If you plan on using a file to
+ * represent a disk, you can use @ref bmfs_disk_init_file.
  *
  * Once the disk is initialized, you can use any of the other
  * functions in the library (see Modules for details).
@@ -0,0 +1,188 @@
+#ifndef BMFS_AIO_H
+#define BMFS_AIO_H
+
+#include "disk.h"
+
+#include <stdint.h>
+
+/** @file */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup aio-api Asynchronous I/O
+ * Keep several disk reads and writes
+ * in flight at the same time.
+ */
+
+/** The maximum number of requests that
+ * may be in flight on one queue.
+ * @ingroup aio-api
+ */
+
+#define BMFS_AIO_DEPTH_MAX 4096
+
+/** A queue of asynchronous disk requests.
+ * On Linux, the requests are passed to the
+ * kernel with io_uring. Where io_uring is not
+ * available, or the kernel can't do plain reads
+ * and writes with it (before Linux 5.6), they are
+ * carried out by a pool of threads using the
+ * positional methods of the disk.
+ *
+ * With io_uring, submitted requests are queued
+ * and passed to the kernel together, by the next
+ * call to @ref bmfs_aio_flush or @ref bmfs_disk_reap.
+ * @ingroup aio-api
+ */
+
+struct BMFSAio;
+
+/** Describes a request that has completed.
+ * @ingroup aio-api
+ */
+
+struct BMFSAioCompletion
+{
+	/** The pointer that was passed
+	 * when the request was submitted. */
+	void *user_data;
+	/** Zero on success, a negative
+	 * error code on failure. */
+	int err;
+	/** The number of bytes that were
+	 * read or written. This may be less
+	 * than the length of the request, if
+	 * the end of the disk was reached. */
+	uint64_t len;
+};
+
+/** Creates a request queue.
+ * @param aio A pointer to the variable that
+ *  will receive the address of the queue.
+ * @param disk The disk that requests are made
+ *  on. This is used by the thread pool, so its
+ *  pread and pwrite methods must be safe to call
+ *  from several threads at once.
+ * @param fd The file descriptor of the disk, used
+ *  with io_uring. If this is negative, the thread
+ *  pool is always used. Since requests made with
+ *  io_uring go straight to the file descriptor,
+ *  the disk must not buffer data itself.
+ * @param depth The maximum number of requests that
+ *  may be in flight at once.
+ * @returns Zero on success, a negative error code
+ *  on failure.
+ * @ingroup aio-api
+ */
+
+int bmfs_aio_create(struct BMFSAio **aio,
+                    struct BMFSDisk *disk,
+                    int fd,
+                    unsigned int depth);
+
+/** Waits for all requests in flight to
+ * complete and releases the queue.
+ * @param aio A queue created with
+ *  @ref bmfs_aio_create.
+ * @ingroup aio-api
+ */
+
+void bmfs_aio_destroy(struct BMFSAio *aio);
+
+/** Indicates whether or not the queue
+ * is backed by io_uring.
+ * @param aio An initialized queue.
+ * @returns One if io_uring is used, zero
+ *  if the thread pool is used.
+ * @ingroup aio-api
+ */
+
+int bmfs_aio_is_uring(const struct BMFSAio *aio);
+
+/** Submits a read request.
+ * @param aio An initialized queue.
+ * @param buf Where to put the data. It must
+ *  remain valid until the request is reaped.
+ * @param len The number of bytes to read.
+ * @param offset The offset of the disk to
+ *  read from.
+ * @param user_data A pointer that is passed
+ *  back in the completion of the request.
+ * @returns Zero on success, a negative error
+ *  code on failure. If the maximum number of
+ *  requests are already in flight, -EAGAIN is
+ *  returned and some requests must be reaped.
+ * @ingroup aio-api
+ */
+
+int bmfs_disk_submit_read(struct BMFSAio *aio,
+                          void *buf,
+                          uint64_t len,
+                          uint64_t offset,
+                          void *user_data);
+
+/** Submits a write request.
+ * @param aio An initialized queue.
+ * @param buf The data to write. It must
+ *  remain valid until the request is reaped.
+ * @param len The number of bytes to write.
+ * @param offset The offset of the disk to
+ *  write to.
+ * @param user_data A pointer that is passed
+ *  back in the completion of the request.
+ * @returns Zero on success, a negative error
+ *  code on failure. If the maximum number of
+ *  requests are already in flight, -EAGAIN is
+ *  returned and some requests must be reaped.
+ * @ingroup aio-api
+ */
+
+int bmfs_disk_submit_write(struct BMFSAio *aio,
+                           const void *buf,
+                           uint64_t len,
+                           uint64_t offset,
+                           void *user_data);
+
+/** Passes the requests that were submitted
+ * since the last call to the kernel, without
+ * waiting for any of them to complete. This
+ * only has to be called if the requests should
+ * start before the next call to @ref bmfs_disk_reap.
+ * @param aio An initialized queue.
+ * @returns Zero on success, a negative error
+ *  code on failure.
+ * @ingroup aio-api
+ */
+
+int bmfs_aio_flush(struct BMFSAio *aio);
+
+/** Retrieves completed requests.
+ * Requests that were submitted but not yet
+ * passed to the kernel are passed first.
+ * @param aio An initialized queue.
+ * @param completions An array that receives
+ *  the completed requests.
+ * @param max The number of elements in
+ *  @p completions.
+ * @param min The minimum number of completions
+ *  to wait for. This is limited to the number
+ *  of requests in flight. If this is zero, the
+ *  function does not block.
+ * @returns The number of completions stored
+ *  in @p completions, or a negative error
+ *  code on failure.
+ * @ingroup aio-api
+ */
+
+int bmfs_disk_reap(struct BMFSAio *aio,
+                   struct BMFSAioCompletion *completions,
+                   unsigned int max,
+                   unsigned int min);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* BMFS_AIO_H */
@@ -5,9 +5,12 @@
 #ifndef BMFS_H
 #define BMFS_H
 
+#include "cache.h"
 #include "entry.h"
+#include "file.h"
 #include "dir.h"
 #include "disk.h"
+#include "extent.h"
 #include "limits.h"
 #include "sspec.h"
 #include "version.h"
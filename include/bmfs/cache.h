@@ -0,0 +1,182 @@
+#ifndef BMFS_CACHE_H
+#define BMFS_CACHE_H
+
+#include "disk.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup cache-api Block Cache
+ * Cache pages of another disk in memory.
+ */
+
+/** Specifies when the writes made to
+ * a cache reach the underlying disk.
+ * @ingroup cache-api
+ */
+
+enum bmfs_cache_mode
+{
+	/** Writes are passed to the underlying
+	 * disk immediately. Cached pages that
+	 * are written to are updated as well. */
+	BMFS_CACHE_WRITE_THROUGH,
+	/** Writes only modify the cached pages.
+	 * Modified pages are written to the
+	 * underlying disk when they are evicted
+	 * or when the cache is flushed. */
+	BMFS_CACHE_WRITE_BACK
+};
+
+/** A page in the cache.
+ * @ingroup cache-api
+ */
+
+struct BMFSCachePage
+{
+	/** The offset of the page on the
+	 * underlying disk, divided by the
+	 * page size. */
+	uint64_t index;
+	/** The number of valid bytes in the
+	 * page. This is less than the page size
+	 * if the page is at the end of the disk. */
+	uint64_t len;
+	/** The next page in the same hash bucket. */
+	uint32_t hash_next;
+	/** The next most recently used page. */
+	uint32_t lru_prev;
+	/** The next least recently used page. */
+	uint32_t lru_next;
+	/** Non-zero if the page contains data. */
+	uint8_t valid;
+	/** Non-zero if the page was modified and
+	 * not yet written to the underlying disk. */
+	uint8_t dirty;
+};
+
+/** A disk that caches the pages of another disk.
+ * The cache uses memory that is given by the
+ * caller, so that it may be used where there is
+ * no memory allocator. It is not safe to use a
+ * cache from more than one thread at a time.
+ * @ingroup cache-api
+ */
+
+struct BMFSCache
+{
+	/** The disk that is being cached. */
+	struct BMFSDisk *base;
+	/** The write mode of the cache. */
+	enum bmfs_cache_mode mode;
+	/** The number of bytes in a page. */
+	uint64_t page_size;
+	/** The number of pages in the cache. */
+	uint32_t page_count;
+	/** The page structures. */
+	struct BMFSCachePage *pages;
+	/** The page data. */
+	unsigned char *data;
+	/** The first page of each hash bucket.
+	 * There is one bucket for each page. */
+	uint32_t *buckets;
+	/** The most recently used page. */
+	uint32_t lru_head;
+	/** The least recently used page. */
+	uint32_t lru_tail;
+	/** The location used by the seek, tell,
+	 * read and write methods. */
+	uint64_t pos;
+	/** The number of page lookups that
+	 * were found in the cache. */
+	uint64_t hits;
+	/** The number of page lookups that
+	 * had to go to the underlying disk. */
+	uint64_t misses;
+	/** The number of modified pages written
+	 * to the underlying disk. */
+	uint64_t writebacks;
+};
+
+/** Calculates the number of bytes of memory
+ * needed for a cache.
+ * @param page_size The number of bytes in a page.
+ * @param page_count The number of pages in the cache.
+ * @returns The number of bytes to pass to
+ *  @ref bmfs_cache_init.
+ * @ingroup cache-api
+ */
+
+uint64_t bmfs_cache_memory_size(uint64_t page_size, uint32_t page_count);
+
+/** Initializes a cache.
+ * @param cache An uninitialized cache.
+ * @param base The disk to cache. It must
+ *  remain valid while the cache is used.
+ * @param memory The memory used to store
+ *  the cached pages. It must be aligned to
+ *  at least eight bytes and remain valid
+ *  while the cache is used.
+ * @param memory_size The number of bytes in
+ *  @p memory. As many pages as will fit are
+ *  used.
+ * @param page_size The number of bytes in a
+ *  page. This must be a power of two, of at
+ *  least 512 bytes.
+ * @param mode The write mode of the cache.
+ * @returns Zero on success, a negative error
+ *  code on failure. If @p memory can't fit at
+ *  least one page, -ENOMEM is returned.
+ * @ingroup cache-api
+ */
+
+int bmfs_cache_init(struct BMFSCache *cache,
+                    struct BMFSDisk *base,
+                    void *memory,
+                    uint64_t memory_size,
+                    uint64_t page_size,
+                    enum bmfs_cache_mode mode);
+
+/** Writes all modified pages to the
+ * underlying disk.
+ * @param cache An initialized cache.
+ * @returns Zero on success, a negative
+ *  error code on failure.
+ * @ingroup cache-api
+ */
+
+int bmfs_cache_flush(struct BMFSCache *cache);
+
+/** Flushes the cache and then discards
+ * all cached pages, so that the next
+ * reads come from the underlying disk.
+ * This should be called if the underlying
+ * disk is modified without using the cache.
+ * @param cache An initialized cache.
+ * @returns Zero on success, a negative
+ *  error code on failure.
+ * @ingroup cache-api
+ */
+
+int bmfs_cache_invalidate(struct BMFSCache *cache);
+
+/** Initializes a disk structure with
+ * a cache, so that the cache may be used
+ * wherever a disk is expected.
+ * @param disk The disk to initialize.
+ * @param cache An initialized cache.
+ * @returns Zero on success. If @p disk or
+ *  @p cache are NULL, -EFAULT is returned.
+ * @ingroup cache-api
+ */
+
+int bmfs_disk_init_cache(struct BMFSDisk *disk, struct BMFSCache *cache);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* BMFS_CACHE_H */
@@ -16,26 +16,107 @@ extern "C" {
  * or deletion and sorting.
  */
 
+/** The number of entries in a 4 KiB page
+ * of the directory. This is also the number
+ * of entries in a version 1 directory.
+ * @ingroup dir-api
+ */
+
+#define BMFS_DIR_PAGE_ENTRIES 64
+
+/** The maximum number of entries in an
+ * extended directory. With this many entries,
+ * the directory has 64 pages, so the modified
+ * pages fit in one 64-bit mask.
+ * @ingroup dir-api
+ */
+
+#define BMFS_DIR_ENTRIES_MAX 4096
+
+/** The minimum number of deleted entries
+ * before @ref bmfs_dir_should_compact suggests
+ * compacting the directory.
+ * @ingroup dir-api
+ */
+
+#define BMFS_DIR_COMPACT_MIN 8
+
+/** The number of slots in a directory
+ * index. This is a power of two, and twice
+ * the maximum number of entries, so that
+ * lookups rarely have to probe more than
+ * one slot.
+ * @ingroup dir-api
+ */
+
+#define BMFS_DIR_INDEX_SIZE 8192
+
+/** A hash table that maps file names
+ * to the entries of a directory.
+ * @ingroup dir-api
+ */
+
+struct BMFSDirIndex
+{
+	/** For each slot, one more than the
+	 * position of the entry in the directory,
+	 * or zero if the slot is not used. */
+	uint16_t Slots[BMFS_DIR_INDEX_SIZE];
+};
+
 /** A BMFS directory.
- * Contains up to sixty-four entries.
+ * A version 1 directory contains up to sixty-four
+ * entries. An extended directory contains up to
+ * @ref BMFS_DIR_ENTRIES_MAX entries.
  * @ingroup dir-api
  */
 
 struct BMFSDir
 {
-	/** The entries array */
-	struct BMFSEntry Entries[64];
+	/** The entries array. Only the first
+	 * @ref BMFSDir::EntryCount entries are
+	 * used. */
+	struct BMFSEntry Entries[BMFS_DIR_ENTRIES_MAX];
+	/** The number of entries that the directory
+	 * has room for. This is a multiple of @ref
+	 * BMFS_DIR_PAGE_ENTRIES. */
+	uint64_t EntryCount;
+	/** One bit for each page of entries that
+	 * was modified since the directory was read
+	 * or written. This is not stored on disk.
+	 */
+	uint64_t DirtyPages;
+	/** An index of the entries by file
+	 * name, or NULL if the directory is not
+	 * indexed. This is not stored on disk.
+	 * See @ref bmfs_dir_set_index.
+	 */
+	struct BMFSDirIndex *Index;
 };
 
 /** Initializes the directory by going
  * through and initializing all sixty
- * four entries.
+ * four entries. The directory is not
+ * indexed afterwards.
  * @param dir An uninitialized directory.
  * @ingroup dir-api
  */
 
 void bmfs_dir_init(struct BMFSDir *dir);
 
+/** Initializes an extended directory.
+ * @param dir An uninitialized directory.
+ * @param entry_count The number of entries
+ *  that the directory has room for. This must
+ *  be a multiple of @ref BMFS_DIR_PAGE_ENTRIES,
+ *  no more than @ref BMFS_DIR_ENTRIES_MAX.
+ * @returns Zero on success, a negative error code
+ *  on failure.
+ * @ingroup dir-api
+ */
+
+int bmfs_dir_init_extended(struct BMFSDir *dir, uint64_t entry_count);
+
 /** Adds an entry to the directory.
  *
  * This function fails if the entry already exists.
@@ -71,7 +152,37 @@ int bmfs_dir_add_file(struct BMFSDir *dir, const char *filename);
 
 int bmfs_dir_delete_file(struct BMFSDir *dir, const char *filename);
 
-/** Sorts the directory.
+/** Moves the entries of the directory forward,
+ * over the entries of deleted files, and moves
+ * the terminator to just after the last file.
+ * The files stay in the same order. Lookups then
+ * no longer have to go past deleted entries.
+ * @param dir An initialized directory.
+ * @returns The number of deleted entries that
+ *  were removed, or a negative error code on
+ *  failure.
+ * @ingroup dir-api
+ */
+
+int bmfs_dir_compact(struct BMFSDir *dir);
+
+/** Checks whether enough files were deleted
+ * from the directory for @ref bmfs_dir_compact
+ * to be worthwhile. This is the case when at
+ * least @ref BMFS_DIR_COMPACT_MIN entries before
+ * the last file are deleted, and they make up at
+ * least a quarter of those entries.
+ * @param dir An initialized directory.
+ * @returns One if the directory should be
+ *  compacted, zero if not.
+ * @ingroup dir-api
+ */
+
+int bmfs_dir_should_compact(const struct BMFSDir *dir);
+
+/** Sorts the directory. Entries that compare
+ * equal may end up in any order, use @ref
+ * bmfs_dir_sort_stable if their order matters.
  * @param dir An initialized directory.
  * @param entry_cmp The function used to
  *  compare two directory entries. If this
@@ -83,6 +194,56 @@ int bmfs_dir_delete_file(struct BMFSDir *dir, const char *filename);
 
 int bmfs_dir_sort(struct BMFSDir *dir, int (*entry_cmp)(const struct BMFSEntry *a, const struct BMFSEntry *b));
 
+/** Sorts the directory, keeping entries that
+ * compare equal in the order they were in.
+ * @param dir An initialized directory.
+ * @param entry_cmp The function used to
+ *  compare two directory entries. If this
+ *  parameter is NULL, then the directory
+ *  is sorted alphabetically.
+ * @returns Zero on success, a negative error code on failure.
+ * @ingroup dir-api
+ */
+
+int bmfs_dir_sort_stable(struct BMFSDir *dir, int (*entry_cmp)(const struct BMFSEntry *a, const struct BMFSEntry *b));
+
+/** Indexes the entries of the directory by
+ * file name, so that @ref bmfs_dir_find does
+ * not have to go through every entry. The index
+ * is kept up to date by @ref bmfs_dir_add, @ref
+ * bmfs_dir_delete_file, @ref bmfs_dir_compact
+ * and @ref bmfs_dir_sort.
+ * @param dir An initialized directory.
+ * @param index The index to use. It must remain
+ *  valid while it is used by the directory. If
+ *  this parameter is NULL, the directory is no
+ *  longer indexed.
+ * @ingroup dir-api
+ */
+
+void bmfs_dir_set_index(struct BMFSDir *dir, struct BMFSDirIndex *index);
+
+/** Marks the page that holds an entry as modified.
+ * This must be called after modifying an entry
+ * directly, if the directory is going to be written
+ * with @ref bmfs_disk_sync_dir.
+ * @param dir An initialized directory.
+ * @param entry An entry of the directory.
+ * @ingroup dir-api
+ */
+
+void bmfs_dir_mark_dirty(struct BMFSDir *dir, const struct BMFSEntry *entry);
+
+/** Rebuilds the index of the directory. This must
+ * be called after modifying the entries directly.
+ * If the directory is not indexed, this function
+ * does nothing.
+ * @param dir An initialized directory.
+ * @ingroup dir-api
+ */
+
+void bmfs_dir_rebuild_index(struct BMFSDir *dir);
+
 /** Locates an entry by filename.
  * @param dir An initialized directory.
  * @param filename The filename to search
@@ -95,6 +256,53 @@ int bmfs_dir_sort(struct BMFSDir *dir, int (*entry_cmp)(const struct BMFSEntry *
 
 struct BMFSEntry * bmfs_dir_find(struct BMFSDir *dir, const char *filename);
 
+/** The ways that a directory that is not
+ * indexed may be searched for a file name.
+ * @ingroup dir-api
+ */
+
+enum bmfs_dir_lookup
+{
+	/** Compare one byte at a time. This is
+	 * available everywhere. */
+	BMFS_DIR_LOOKUP_SCALAR,
+	/** Compare a name with two SSE2 loads. */
+	BMFS_DIR_LOOKUP_SSE2,
+	/** Compare a name with one AVX2 load. */
+	BMFS_DIR_LOOKUP_AVX2
+};
+
+/** Indicates whether or not a lookup can be
+ * used on this build and processor.
+ * @param lookup The lookup to check.
+ * @returns One if the lookup can be used,
+ *  zero if it can't.
+ * @ingroup dir-api
+ */
+
+int bmfs_dir_lookup_supported(enum bmfs_dir_lookup lookup);
+
+/** Locates an entry by filename, going through
+ * the entries with a specific lookup. Unlike
+ * @ref bmfs_dir_find, the index isn't used and
+ * the lookup isn't chosen for the processor.
+ * This is meant for testing and benchmarking
+ * each lookup.
+ * @param dir An initialized directory.
+ * @param filename The filename to search for.
+ * @param lookup The lookup to use. It must be
+ *  supported, according to @ref bmfs_dir_lookup_supported.
+ * @returns If the entry is found, a pointer
+ *  to the structure is returned. If it is not
+ *  found, or the lookup is not supported, NULL
+ *  is returned instead.
+ * @ingroup dir-api
+ */
+
+struct BMFSEntry * bmfs_dir_find_with(struct BMFSDir *dir,
+                                      const char *filename,
+                                      enum bmfs_dir_lookup lookup);
+
 #ifdef __cplusplus
 } /* extern "C" { */
 #endif
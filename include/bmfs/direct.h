@@ -0,0 +1,134 @@
+#ifndef BMFS_DIRECT_H
+#define BMFS_DIRECT_H
+
+#include "disk.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/** @file */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup direct-api Direct I/O Disks
+ * Access a disk image or device without
+ * going through the page cache.
+ */
+
+/** The alignment, in bytes, of the offsets,
+ * lengths and buffers used to access a disk
+ * opened with O_DIRECT.
+ * @ingroup direct-api
+ */
+
+#define BMFS_DIRECT_ALIGNMENT 4096ULL
+
+/** The maximum number of buffers in the
+ * buffer pool of a direct disk.
+ * @ingroup direct-api
+ */
+
+#define BMFS_DIRECT_BUFFERS_MAX 16
+
+/** The number of locks that serialize the
+ * read-modify-write of partially written sectors.
+ * Sectors share the locks by their number, modulo
+ * this value.
+ * @ingroup direct-api
+ */
+
+#define BMFS_DIRECT_SECTOR_LOCKS 64
+
+/** A disk image or device opened with O_DIRECT.
+ *
+ * Transfers that have an aligned offset, length
+ * and buffer go straight between the caller's
+ * buffer and the disk. All other transfers go
+ * through a pool of buffers, each one block in
+ * size, and the unaligned head and tail of a
+ * write are handled with a read-modify-write.
+ * The sectors being modified are locked for the
+ * read-modify-write, so concurrent writes to
+ * different bytes of one sector are not lost.
+ * Concurrent writes to the same bytes are not
+ * ordered.
+ * @ingroup direct-api
+ */
+
+struct BMFSDirect
+{
+	/** The file descriptor of the disk. */
+	int fd;
+	/** The number of bytes on the disk. */
+	uint64_t size;
+	/** The location used by the seek, tell,
+	 * read and write methods. */
+	uint64_t pos;
+	/** The buffers in the pool. Each buffer is
+	 * @ref BMFS_BLOCK_SIZE bytes, aligned to a
+	 * block boundary. */
+	void *buffers[BMFS_DIRECT_BUFFERS_MAX];
+	/** The number of buffers in the pool. */
+	unsigned int buffer_count;
+	/** A bit mask of the buffers that are
+	 * currently in use. */
+	uint32_t buffers_used;
+	/** Protects the buffer pool. */
+	pthread_mutex_t lock;
+	/** Signaled when a buffer is returned
+	 * to the pool. */
+	pthread_cond_t cond;
+	/** Held while a partially written sector
+	 * is read, modified and written back. */
+	pthread_mutex_t sector_locks[BMFS_DIRECT_SECTOR_LOCKS];
+};
+
+/** Opens a disk image or device with O_DIRECT.
+ * @param direct An uninitialized direct disk structure.
+ * @param path The path of the disk image or device.
+ * @param writable Non-zero if the disk should be opened
+ *  for reading and writing.
+ * @param buffer_count The number of buffers to allocate
+ *  for unaligned transfers. This is the number of unaligned
+ *  transfers that may be done concurrently. If this is zero,
+ *  two buffers are allocated.
+ * @returns Zero on success, a negative error code on failure.
+ *  If the file system of @p path does not support O_DIRECT,
+ *  -EINVAL is returned.
+ * @ingroup direct-api
+ */
+
+int bmfs_direct_init(struct BMFSDirect *direct,
+                     const char *path,
+                     int writable,
+                     unsigned int buffer_count);
+
+/** Closes the disk and releases the buffer pool.
+ * @param direct An initialized direct disk structure.
+ * @ingroup direct-api
+ */
+
+void bmfs_direct_done(struct BMFSDirect *direct);
+
+/** Initializes a disk structure with
+ * a disk opened with O_DIRECT. The size of
+ * the disk is fixed when it's opened, so
+ * writes that go past its end fail with
+ * -ENOSPC.
+ * @param disk The disk to initialize.
+ * @param direct An initialized direct disk. It must
+ *  remain valid for as long as the disk is used.
+ * @returns Zero on success. If @p disk or @p direct
+ *  are NULL, this function returns -EFAULT.
+ * @ingroup direct-api
+ */
+
+int bmfs_disk_init_direct(struct BMFSDisk *disk, struct BMFSDirect *direct);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* BMFS_DIRECT_H */
@@ -7,6 +7,7 @@
 
 #include "entry.h"
 #include "dir.h"
+#include "extent.h"
 
 #include <stdio.h>
 #include <sys/types.h>
@@ -45,8 +46,58 @@ struct BMFSDisk
 	/** Writes data to the disk.
 	 */
 	int (*write)(void *disk, const void *buf, uint64_t len, uint64_t *write_len);
+	/** Reads data from a particular offset of the
+	 * disk, without using the current location of the
+	 * disk. This method is optional. If it is NULL, a
+	 * seek followed by a read is used instead.
+	 */
+	int (*pread)(void *disk, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len);
+	/** Writes data to a particular offset of the disk,
+	 * without using the current location of the disk.
+	 * This method is optional. If it is NULL, a seek
+	 * followed by a write is used instead.
+	 */
+	int (*pwrite)(void *disk, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len);
+	/** A copy of the root directory that is kept
+	 * in memory, or NULL if the root directory is
+	 * not cached. See @ref bmfs_disk_cache_dir.
+	 */
+	struct BMFSDir *dir;
+	/** The free space of the disk, or NULL
+	 * if it is not cached. See @ref
+	 * bmfs_disk_cache_extents.
+	 */
+	struct BMFSExtentMap *extents;
+	/** Incremented each time the root directory is
+	 * modified through this disk, or is found to have
+	 * been modified by someone else. This may be used
+	 * to find out whether information taken from the
+	 * directory is still current.
+	 */
+	uint64_t dir_generation;
+	/** The generation counter stored on the disk,
+	 * as of the last time the cached directory was
+	 * read or written.
+	 */
+	uint64_t dir_disk_generation;
+	/** Set while writes of the cached root
+	 * directory are deferred. See @ref
+	 * bmfs_disk_defer_dir.
+	 */
+	int dir_deferred;
 };
 
+/** Initializes the disk structure.
+ * All the methods are set to NULL,
+ * so that optional methods that are
+ * not assigned by the implementation
+ * are not called.
+ * @param disk An uninitialized disk.
+ * @ingroup disk-api
+ */
+
+void bmfs_disk_init(struct BMFSDisk *disk);
+
 /** Points the disk to a particular offset.
  * @param disk An initialized disk.
  * @param offset The offset to point the disk to.
@@ -112,6 +163,56 @@ int bmfs_disk_write(struct BMFSDisk *disk,
                     uint64_t len,
                     uint64_t *write_len);
 
+/** Reads data from a particular offset of the disk.
+ * If the disk implements the pread method, the current
+ * location of the disk is not used or modified.
+ * @param disk An initialized disk.
+ * @param buf Where to put the data
+ *  read from the disk.
+ * @param len The number of bytes
+ *  available in @p buf.
+ * @param offset The offset of the disk
+ *  to read the data from.
+ * @param read_len A pointer to the
+ *  variable that will receive the
+ *  number of bytes read from the
+ *  disk. This field may be NULL.
+ * @returns Zero on success, a negative
+ *  error code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_pread(struct BMFSDisk *disk,
+                    void *buf,
+                    uint64_t len,
+                    uint64_t offset,
+                    uint64_t *read_len);
+
+/** Writes data to a particular offset of the disk.
+ * If the disk implements the pwrite method, the current
+ * location of the disk is not used or modified.
+ * @param disk An initialized disk.
+ * @param buf Contains the data to
+ *  be written to disk.
+ * @param len The number of bytes in
+ *  @p buf to write to the disk.
+ * @param offset The offset of the disk
+ *  to write the data to.
+ * @param write_len A pointer to the
+ *  variable that will receive the
+ *  number of bytes written to disk.
+ *  This field may be NULL.
+ * @returns Zero on success, a negative
+ *  error code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_pwrite(struct BMFSDisk *disk,
+                     const void *buf,
+                     uint64_t len,
+                     uint64_t offset,
+                     uint64_t *write_len);
+
 /** Determines the amount of bytes
  * available in the disk.
  * @param disk An initialized disk.
@@ -190,6 +291,19 @@ int bmfs_disk_allocate_mebibytes(struct BMFSDisk *disk,
                                  uint64_t mebibytes,
                                  uint64_t *starting_block);
 
+/** Removes the entries of deleted files from
+ * the root directory. See @ref bmfs_dir_compact.
+ * This is also done by @ref bmfs_disk_delete_file,
+ * once enough files were deleted. Only the pages
+ * of the directory that changed are written.
+ * @param disk An initialized disk.
+ * @returns The number of entries that were
+ *  removed, or a negative error code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_compact_dir(struct BMFSDisk *disk);
+
 /** Locates a file entry.
  * @param disk An initialized disk.
  * @param filename The name of the file
@@ -211,11 +325,30 @@ int bmfs_disk_find_file(struct BMFSDisk *disk,
                         struct BMFSEntry *entry,
                         int *number);
 
+/** Changes the size of a file. Only the
+ * entry of the file is written to the disk.
+ * @param disk An initialized disk.
+ * @param number The index of the file in
+ *  the root directory, as returned by
+ *  @ref bmfs_disk_find_file.
+ * @param size The new size of the file,
+ *  in bytes. This may not be more than the
+ *  number of bytes reserved for the file.
+ * @returns Zero on success, a negative
+ *  error code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_set_file_size(struct BMFSDisk *disk,
+                            int number,
+                            uint64_t size);
+
 /** Reads the root directory on disk.
  * @param disk An initialized disk.
  * @param dir A pointer to a directory
  *  structure that will receive all the
- *  entries in the root directory.
+ *  entries in the root directory. It is
+ *  not indexed afterwards.
  * @returns Zero on success, a negative
  *  error code on failure.
  * @ingroup disk-api
@@ -224,6 +357,81 @@ int bmfs_disk_find_file(struct BMFSDisk *disk,
 int bmfs_disk_read_dir(struct BMFSDisk *disk,
                        struct BMFSDir *dir);
 
+/** Enables caching of the root directory.
+ * The directory is read once and kept in memory.
+ * Functions that look up entries in the directory
+ * use the cached copy, and the directory is only
+ * written to the disk when it is modified.
+ *
+ * Every time the directory is written, a generation
+ * counter in the disk info section is incremented.
+ * Call @ref bmfs_disk_refresh_dir to check the counter
+ * and reload the directory if it was modified by
+ * someone else.
+ *
+ * To look up entries in constant time, index
+ * the cached directory afterwards with @ref
+ * bmfs_dir_set_index.
+ * @param disk An initialized disk.
+ * @param dir The memory to keep the directory in.
+ *  It must remain valid until caching is disabled.
+ * @returns Zero on success, a negative error code
+ *  on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_cache_dir(struct BMFSDisk *disk,
+                        struct BMFSDir *dir);
+
+/** Disables caching of the root directory.
+ * @param disk An initialized disk.
+ * @ingroup disk-api
+ */
+
+void bmfs_disk_uncache_dir(struct BMFSDisk *disk);
+
+/** Keeps a map of the free space on the disk,
+ * so that allocating space for a file doesn't
+ * require going through the whole directory.
+ * The map is updated when files are created or
+ * deleted through this disk, and rebuilt if the
+ * directory is modified in any other way. This
+ * should be used together with @ref
+ * bmfs_disk_cache_dir, so that the directory
+ * isn't read again when the map is rebuilt.
+ * @param disk An initialized disk.
+ * @param map The extent map to use. Its fit
+ *  policy is kept. It must remain valid until
+ *  @ref bmfs_disk_uncache_extents is called.
+ * @returns Zero on success, a negative
+ *  error code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_cache_extents(struct BMFSDisk *disk,
+                            struct BMFSExtentMap *map);
+
+/** Stops keeping a map of the free space.
+ * @param disk An initialized disk.
+ * @ingroup disk-api
+ */
+
+void bmfs_disk_uncache_extents(struct BMFSDisk *disk);
+
+/** Reloads the cached root directory, if the
+ * generation counter on disk shows that it was
+ * modified without using this disk structure.
+ * If the directory is not cached, this function
+ * does nothing. If the cached directory is indexed,
+ * the index is rebuilt.
+ * @param disk An initialized disk.
+ * @returns Zero on success, a negative error
+ *  code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_refresh_dir(struct BMFSDisk *disk);
+
 /** Writes to the root directory.
  * All previous entries in the root
  * directory are replaced.
@@ -238,6 +446,74 @@ int bmfs_disk_read_dir(struct BMFSDisk *disk,
 int bmfs_disk_write_dir(struct BMFSDisk *disk,
                         const struct BMFSDir *dir);
 
+/** Writes the pages of the root directory
+ * that were modified since it was last read
+ * or written, instead of the whole directory.
+ * The modified pages are then cleared.
+ * @param disk An initialized disk.
+ * @param dir The directory to write to the
+ *  disk. It must have been read from the disk.
+ * @returns Zero on success, a negative
+ *  error code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_sync_dir(struct BMFSDisk *disk,
+                       struct BMFSDir *dir);
+
+/** Defers writes of the cached root directory.
+ * Functions that modify the directory only change
+ * the cached copy, until @ref bmfs_disk_flush_dir
+ * writes the modified pages at once. This is meant
+ * for a program that owns the disk and makes many
+ * changes in a row. Other users of the disk don't
+ * see the changes until they are flushed, and the
+ * cached directory isn't refreshed in the meantime.
+ * @param disk An initialized disk. Its root
+ *  directory must be cached.
+ * @returns Zero on success, a negative
+ *  error code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_defer_dir(struct BMFSDisk *disk);
+
+/** Writes the pages of the cached root directory
+ * that were modified since @ref bmfs_disk_defer_dir
+ * was called, and stops deferring writes. This
+ * must be called before the directory is uncached,
+ * or the changes are lost.
+ * @param disk An initialized disk.
+ * @returns Zero on success, a negative
+ *  error code on failure. On failure, writes
+ *  are still deferred.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_flush_dir(struct BMFSDisk *disk);
+
+/** Makes room for more entries in the root
+ * directory. The first sixty-four entries stay
+ * where a version 1 directory keeps them, and
+ * the rest are placed at 1 MiB, in the first
+ * block of the disk. The boot loader and the
+ * kernel are also in the first block, so the
+ * new pages must be all zeros.
+ * @param disk An initialized disk.
+ * @param entry_count The new number of entries.
+ *  This must be a multiple of @ref
+ *  BMFS_DIR_PAGE_ENTRIES, no more than @ref
+ *  BMFS_DIR_ENTRIES_MAX and no less than the
+ *  current number of entries.
+ * @returns Zero on success, a negative
+ *  error code on failure. If the new pages
+ *  aren't all zeros, -ENOSPC is returned.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_extend_dir(struct BMFSDisk *disk,
+                         uint64_t entry_count);
+
 /** Checks to make sure that the
  * BMFS tag exists in the disk info
  * section. If the tag is not present,
@@ -279,9 +555,60 @@ int bmfs_disk_create_file(struct BMFSDisk *disk,
                           const char *filename,
                           uint64_t mebibytes);
 
+/** Creates several files on the disk. If one
+ * of the files can't be created, none of them
+ * are. If the directory is cached, it is written
+ * once, after all of the entries are added.
+ * @param disk An initialized disk.
+ * @param filenames The names of the new files.
+ * @param mebibytes The number of mebibytes to
+ *  reserve for each file.
+ * @param count The number of files to create.
+ * @returns Zero on success, a negative error
+ *  code on failure.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_create_files(struct BMFSDisk *disk,
+                           const char *const *filenames,
+                           const uint64_t *mebibytes,
+                           uint64_t count);
+
+/** Changes the amount of space reserved for
+ * a file. The file grows in place if the blocks
+ * after it are free. Otherwise, it is moved to
+ * free space that is large enough, and the first
+ * @p data_size bytes of the file are moved with it.
+ * The file always shrinks in place.
+ * @param disk An initialized disk.
+ * @param filename The name of the file.
+ * @param mebibytes The new number of mebibytes
+ *  to reserve for the file.
+ * @param data_size The number of bytes of the file
+ *  to keep, if it has to be moved. This may be more
+ *  than the file size on disk, if the file size
+ *  hasn't been written yet.
+ * @param buf The buffer used to move the data. This
+ *  may be NULL if @p data_size is zero.
+ * @param buf_size The number of bytes in @p buf.
+ * @returns Zero on success, a negative error code on
+ *  failure. If there isn't enough free space, -ENOSPC
+ *  is returned and the file is left as it was.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_resize_file(struct BMFSDisk *disk,
+                          const char *filename,
+                          uint64_t mebibytes,
+                          uint64_t data_size,
+                          void *buf,
+                          uint64_t buf_size);
+
 /** Deletes a file from the disk.
  * If the file doesn't exist, this
- * function fails.
+ * function fails. The directory is
+ * compacted when enough of its entries
+ * belong to deleted files.
  * @param disk An initialized disk.
  * @param filename The name of the
  *  file to delete.
@@ -304,6 +631,23 @@ int bmfs_disk_delete_file(struct BMFSDisk *disk,
 
 int bmfs_disk_format(struct BMFSDisk *disk);
 
+/** Formats the disk, like @ref bmfs_disk_format,
+ * with room for more than sixty-four entries in
+ * the root directory.
+ * @param disk An initialized disk.
+ * @param entry_count The number of entries. See
+ *  @ref bmfs_disk_extend_dir for the valid values.
+ * @returns Zero on success, a negative
+ *  error code on failure. Like @ref
+ *  bmfs_disk_extend_dir, if the pages that
+ *  weren't already part of the directory
+ *  aren't all zeros, -ENOSPC is returned.
+ * @ingroup disk-api
+ */
+
+int bmfs_disk_format_extended(struct BMFSDisk *disk,
+                              uint64_t entry_count);
+
 /** Reads content of a specified file.
  * @param disk An initialized disk.
  * @param filename The name of the entry to read from.
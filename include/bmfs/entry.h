@@ -129,6 +129,8 @@ int bmfs_entry_get_offset(const struct BMFSEntry *entry,
                           uint64_t *offset);
 
 /** Sets the file name of an entry.
+ * The bytes after the name are cleared,
+ * so nothing else is written to the disk.
  * @param entry An initialized or
  *  uninitialized entry.
  * @param filename The new file name
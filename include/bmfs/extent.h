@@ -0,0 +1,258 @@
+#ifndef BMFS_EXTENT_H
+#define BMFS_EXTENT_H
+
+#include "dir.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup extent-api Extent API
+ * Track the free space of a disk.
+ */
+
+/** The maximum number of free extents.
+ * Since every file is contiguous, the
+ * files of a directory can divide the
+ * free space into at most one more
+ * extent than there are entries.
+ * @ingroup extent-api
+ */
+
+#define BMFS_EXTENT_MAX (BMFS_DIR_ENTRIES_MAX + 1)
+
+/** A range of blocks.
+ * @ingroup extent-api
+ */
+
+struct BMFSExtent
+{
+	/** The first block of the range. */
+	uint64_t start;
+	/** The number of blocks in the range. */
+	uint64_t length;
+};
+
+/** Marks the absence of a node in an
+ * extent map.
+ * @ingroup extent-api
+ */
+
+#define BMFS_EXTENT_NONE UINT32_MAX
+
+/** The index of the tree of an extent
+ * map that is ordered by starting block.
+ * @ingroup extent-api
+ */
+
+#define BMFS_EXTENT_BY_START 0
+
+/** The index of the tree of an extent
+ * map that is ordered by length.
+ * @ingroup extent-api
+ */
+
+#define BMFS_EXTENT_BY_LENGTH 1
+
+/** A free extent, as a node of the
+ * trees of an extent map.
+ * @ingroup extent-api
+ */
+
+struct BMFSExtentNode
+{
+	/** The free blocks. */
+	struct BMFSExtent extent;
+	/** The largest length in the subtree
+	 * of this node, in the tree ordered
+	 * by starting block. */
+	uint64_t max_length;
+	/** The left and right children of the
+	 * node in each tree, indexed by
+	 * @ref BMFS_EXTENT_BY_START and
+	 * @ref BMFS_EXTENT_BY_LENGTH. */
+	uint32_t children[2][2];
+};
+
+/** How free space is chosen for a new file.
+ * @ingroup extent-api
+ */
+
+enum bmfs_extent_fit
+{
+	/** Use the first extent that is large enough.
+	 * This keeps files close to the start of the
+	 * disk. */
+	BMFS_EXTENT_FIRST_FIT,
+	/** Use the smallest extent that is large enough.
+	 * This leaves large extents for large files. */
+	BMFS_EXTENT_BEST_FIT,
+	/** Use the largest extent. This leaves the
+	 * most room for the file to grow. */
+	BMFS_EXTENT_LARGEST_FIT
+};
+
+/** The free space of a disk.
+ *
+ * The free extents are kept in two balanced
+ * trees (treaps). One is ordered by starting
+ * block, and is used when space is reserved or
+ * released, and for first fit. Each of its nodes
+ * also has the largest length in its subtree, for
+ * first and largest fit. The other is ordered by
+ * length, for best fit. Reserving, releasing and
+ * finding space take O(log n) time in the number
+ * of extents, plus one step per extent that a
+ * reserved range covers.
+ *
+ * The trees link their nodes by index, so a map
+ * may be copied with an assignment.
+ * @ingroup extent-api
+ */
+
+struct BMFSExtentMap
+{
+	/** The free extents. Adjacent extents
+	 * are always merged. Only nodes that
+	 * are linked from the roots are used. */
+	struct BMFSExtentNode nodes[BMFS_EXTENT_MAX];
+	/** The root of each tree, indexed by
+	 * @ref BMFS_EXTENT_BY_START and
+	 * @ref BMFS_EXTENT_BY_LENGTH. */
+	uint32_t roots[2];
+	/** The first node that was used and
+	 * freed again, or @ref BMFS_EXTENT_NONE. */
+	uint32_t free_node;
+	/** The number of nodes that were ever used.
+	 * The nodes after these are unused. */
+	uint32_t unused_node;
+	/** The number of free extents. */
+	uint64_t count;
+	/** How free space is chosen by
+	 * @ref bmfs_extent_map_find. */
+	enum bmfs_extent_fit fit;
+	/** The directory generation of the disk
+	 * that the map was last updated for. See
+	 * @ref BMFSDisk::dir_generation. */
+	uint64_t generation;
+};
+
+/** Initializes an extent map with
+ * a single range of free blocks.
+ * @param map An uninitialized extent map.
+ * @param start The first free block.
+ * @param end One past the last free block.
+ * @ingroup extent-api
+ */
+
+void bmfs_extent_map_init(struct BMFSExtentMap *map,
+                          uint64_t start,
+                          uint64_t end);
+
+/** Initializes an extent map from a directory.
+ * Block zero is reserved for the system, so the
+ * free space begins at block one.
+ * @param map An extent map.
+ * @param dir The directory to take the
+ *  reserved extents from.
+ * @param total_blocks The number of blocks
+ *  on the disk.
+ * @returns Zero on success, a negative error
+ *  code on failure.
+ * @ingroup extent-api
+ */
+
+int bmfs_extent_map_build(struct BMFSExtentMap *map,
+                          const struct BMFSDir *dir,
+                          uint64_t total_blocks);
+
+/** Marks a range of blocks as used. Any
+ * part of the range that is already used
+ * is ignored.
+ * @param map An initialized extent map.
+ * @param start The first block of the range.
+ * @param length The number of blocks in the range.
+ *  If this is zero, the map isn't changed.
+ * @returns Zero on success, a negative error
+ *  code on failure.
+ * @ingroup extent-api
+ */
+
+int bmfs_extent_map_reserve(struct BMFSExtentMap *map,
+                            uint64_t start,
+                            uint64_t length);
+
+/** Marks a range of blocks as free. The
+ * range is merged with neighbouring free
+ * extents.
+ * @param map An initialized extent map.
+ * @param start The first block of the range.
+ * @param length The number of blocks in the range.
+ * @returns Zero on success, a negative error
+ *  code on failure. If part of the range is
+ *  already free, -EINVAL is returned.
+ * @ingroup extent-api
+ */
+
+int bmfs_extent_map_release(struct BMFSExtentMap *map,
+                            uint64_t start,
+                            uint64_t length);
+
+/** Checks whether a range of blocks is free.
+ * @param map An initialized extent map.
+ * @param start The first block of the range.
+ * @param length The number of blocks in the range.
+ * @returns One if every block of the range is
+ *  free, zero if not.
+ * @ingroup extent-api
+ */
+
+int bmfs_extent_map_is_free(const struct BMFSExtentMap *map,
+                            uint64_t start,
+                            uint64_t length);
+
+/** Gets the first free extent that
+ * ends after a block. This may be used to
+ * go through the free extents in order.
+ * @param map An initialized extent map.
+ * @param block The block that the extent
+ *  must end after. If the block is free, this
+ *  is the extent that contains it.
+ * @param extent The structure that receives
+ *  the extent.
+ * @returns Zero on success, a negative error
+ *  code on failure. If there is no such extent,
+ *  -ENOENT is returned.
+ * @ingroup extent-api
+ */
+
+int bmfs_extent_map_next(const struct BMFSExtentMap *map,
+                         uint64_t block,
+                         struct BMFSExtent *extent);
+
+/** Finds free space for a number of blocks,
+ * using the fit policy of the map. The space
+ * is not reserved.
+ * @param map An initialized extent map.
+ * @param length The number of blocks needed.
+ *  A length of zero fits in any free extent.
+ * @param start A pointer to the variable that
+ *  will receive the first block of the space.
+ * @returns Zero on success, a negative error
+ *  code on failure. If there is no extent large
+ *  enough, or no free extent at all, -ENOSPC
+ *  is returned.
+ * @ingroup extent-api
+ */
+
+int bmfs_extent_map_find(const struct BMFSExtentMap *map,
+                         uint64_t length,
+                         uint64_t *start);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* BMFS_EXTENT_H */
@@ -0,0 +1,173 @@
+#ifndef BMFS_FILE_H
+#define BMFS_FILE_H
+
+#include "disk.h"
+#include "limits.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup file-api File API
+ * Read and write open files, without
+ * looking them up on every access.
+ */
+
+/** An open file.
+ * The location and size of the file are
+ * taken from the directory when the file
+ * is opened, so reads and writes go straight
+ * to the file data. If the directory is modified
+ * through the same disk structure, the entry is
+ * looked up again on the next access.
+ *
+ * When the file grows, the new size is kept
+ * in the file structure until @ref bmfs_file_sync
+ * or @ref bmfs_file_close is called, so that the
+ * directory isn't written on every write.
+ * @ingroup file-api
+ */
+
+struct BMFSFile
+{
+	/** The disk that the file is on. */
+	struct BMFSDisk *disk;
+	/** The name of the file. */
+	char FileName[BMFS_FILE_NAME_MAX];
+	/** The index of the file's entry in
+	 * the root directory. */
+	int index;
+	/** The byte offset of the file data
+	 * on the disk. */
+	uint64_t offset;
+	/** The number of bytes reserved
+	 * for the file. */
+	uint64_t reserved;
+	/** The number of bytes in the file. */
+	uint64_t size;
+	/** Non-zero if @ref BMFSFile::size was
+	 * changed and not yet written to the
+	 * directory. */
+	int size_dirty;
+	/** The value of the disk's directory
+	 * generation when the entry was last
+	 * looked up. */
+	uint64_t generation;
+};
+
+/** Opens a file.
+ * @param file An uninitialized file structure.
+ * @param disk An initialized disk.
+ * @param filename The name of the file to open.
+ * @returns Zero on success, a negative error code
+ *  on failure. If the file does not exist, -ENOENT
+ *  is returned.
+ * @ingroup file-api
+ */
+
+int bmfs_file_open(struct BMFSFile *file,
+                   struct BMFSDisk *disk,
+                   const char *filename);
+
+/** Closes a file. If the size of the
+ * file was changed, it is written to
+ * the directory.
+ * @param file An open file.
+ * @returns Zero on success, a negative error
+ *  code on failure.
+ * @ingroup file-api
+ */
+
+int bmfs_file_close(struct BMFSFile *file);
+
+/** Writes the size of the file to the
+ * directory, if it was changed.
+ * @param file An open file.
+ * @returns Zero on success, a negative error
+ *  code on failure.
+ * @ingroup file-api
+ */
+
+int bmfs_file_sync(struct BMFSFile *file);
+
+/** Reads data from a file.
+ * @param file An open file.
+ * @param buf Where to put the data.
+ * @param len The number of bytes to read.
+ * @param off The offset within the file to
+ *  begin reading at.
+ * @param read_len A pointer to the variable that
+ *  will receive the number of bytes read. This is
+ *  less than @p len if the end of the file is reached.
+ *  This parameter may be NULL.
+ * @returns Zero on success, a negative error code
+ *  on failure.
+ * @ingroup file-api
+ */
+
+int bmfs_file_pread(struct BMFSFile *file,
+                    void *buf,
+                    uint64_t len,
+                    uint64_t off,
+                    uint64_t *read_len);
+
+/** Reads data from a file, at the location and
+ * with the size that the file had when its entry
+ * was last looked up. Unlike @ref bmfs_file_pread,
+ * this never reads the directory, so it may be
+ * called on a copy of the file structure without
+ * holding anything that protects the directory.
+ * The caller must check that the directory did not
+ * change since, by comparing @ref BMFSFile::generation
+ * with the generation of the disk.
+ * @param file An open file.
+ * @param buf Where to put the data.
+ * @param len The number of bytes to read.
+ * @param off The offset within the file to
+ *  begin reading at.
+ * @param read_len A pointer to the variable that
+ *  will receive the number of bytes read. This
+ *  parameter may be NULL.
+ * @returns Zero on success, a negative error code
+ *  on failure.
+ * @ingroup file-api
+ */
+
+int bmfs_file_pread_cached(const struct BMFSFile *file,
+                           void *buf,
+                           uint64_t len,
+                           uint64_t off,
+                           uint64_t *read_len);
+
+/** Writes data to a file. If the data is written
+ * past the end of the file, the size of the file is
+ * raised to the end of the data. The new size is not
+ * written to the directory until @ref bmfs_file_sync
+ * is called.
+ * @param file An open file.
+ * @param buf The data to write.
+ * @param len The number of bytes to write.
+ * @param off The offset within the file to begin
+ *  writing at.
+ * @param write_len A pointer to the variable that
+ *  will receive the number of bytes written. This is
+ *  less than @p len if the end of the space reserved
+ *  for the file is reached. This parameter may be NULL.
+ * @returns Zero on success, a negative error code
+ *  on failure.
+ * @ingroup file-api
+ */
+
+int bmfs_file_pwrite(struct BMFSFile *file,
+                     const void *buf,
+                     uint64_t len,
+                     uint64_t off,
+                     uint64_t *write_len);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* BMFS_FILE_H */
@@ -0,0 +1,97 @@
+#ifndef BMFS_MMAP_H
+#define BMFS_MMAP_H
+
+#include "disk.h"
+
+#include <stdint.h>
+
+/** @file */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup mmap-api Memory-Mapped Disks
+ * Access a disk image that is mapped into memory.
+ */
+
+/** A disk image that is mapped into memory.
+ * Since BMFS files are contiguous, reads and
+ * writes on a mapped disk are a single memory
+ * copy and do not call into the kernel.
+ * @ingroup mmap-api
+ */
+
+struct BMFSMmap
+{
+	/** The address that the disk image
+	 * is mapped to. */
+	unsigned char *data;
+	/** The number of bytes that are mapped. */
+	uint64_t size;
+	/** The location used by the seek, tell,
+	 * read and write methods. */
+	uint64_t pos;
+	/** Non-zero if the mapping may be written to. */
+	int writable;
+};
+
+/** Maps an entire disk image into memory.
+ * The mapping is shared, so writes are
+ * visible to other processes using the
+ * same disk image.
+ * @param map An uninitialized mapping structure.
+ * @param fd A file descriptor of the disk image
+ *  or device. It may be closed once this function
+ *  returns.
+ * @param writable Non-zero if the disk should be
+ *  mapped for reading and writing. If this is zero,
+ *  the disk is mapped read-only and writes to it
+ *  fail with -EROFS. The file descriptor must have
+ *  been opened with the matching access mode.
+ * @returns Zero on success, a negative error code
+ *  on failure.
+ * @ingroup mmap-api
+ */
+
+int bmfs_mmap_init(struct BMFSMmap *map, int fd, int writable);
+
+/** Writes any modified pages of the mapping
+ * back to the disk image.
+ * @param map An initialized mapping.
+ * @returns Zero on success, a negative error
+ *  code on failure.
+ * @ingroup mmap-api
+ */
+
+int bmfs_mmap_sync(struct BMFSMmap *map);
+
+/** Unmaps the disk image. If the mapping
+ * is writable, it is synchronized first.
+ * @param map An initialized mapping.
+ * @ingroup mmap-api
+ */
+
+void bmfs_mmap_done(struct BMFSMmap *map);
+
+/** Initializes a disk structure with
+ * a memory-mapped disk image. All of the
+ * disk methods, including pread and pwrite,
+ * are implemented with memory copies. The
+ * mapping can't grow, so writes that go past
+ * the end of the image fail with -ENOSPC.
+ * @param disk The disk to initialize.
+ * @param map An initialized mapping. It must
+ *  remain valid for as long as the disk is used.
+ * @returns Zero on success. If @p disk or @p map
+ *  are NULL, this function returns -EFAULT.
+ * @ingroup mmap-api
+ */
+
+int bmfs_disk_init_mmap(struct BMFSDisk *disk, struct BMFSMmap *map);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* BMFS_MMAP_H */
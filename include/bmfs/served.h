@@ -0,0 +1,105 @@
+#ifndef BMFS_SERVED_H
+#define BMFS_SERVED_H
+
+#include <stdint.h>
+
+/** @file */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup served-api Server Protocol
+ * The protocol used by bmfs-served, to give
+ * clients access to a disk image over a UNIX
+ * domain socket.
+ *
+ * A client sends requests without waiting for
+ * the responses, and the server answers them in
+ * the order they were sent. Each request is a
+ * @ref BMFSServedRequest, followed by the name
+ * of the file and, for @ref BMFS_SERVED_WRITE,
+ * the data to write. Each response is a @ref
+ * BMFSServedResponse, followed by its data.
+ * All integers are in the byte order of the host.
+ */
+
+/** The value of @ref BMFSServedRequest::op
+ * for each operation.
+ * @ingroup served-api
+ */
+
+enum BMFSServedOp
+{
+	/** Lists the files on the disk. The name is
+	 * empty. The response data is a @ref BMFSEntry
+	 * for each file. */
+	BMFS_SERVED_LIST = 1,
+	/** Gets the @ref BMFSEntry of a file,
+	 * which is the response data. */
+	BMFS_SERVED_STAT = 2,
+	/** Reads from a file. The response data
+	 * is the bytes that were read, which stops
+	 * at the end of the file. */
+	BMFS_SERVED_READ = 3,
+	/** Writes to a file. The request is followed
+	 * by the data, which must fit in the space
+	 * reserved for the file. The file size grows
+	 * if the data is written past the end of it.
+	 * The response has no data, and its length is
+	 * the number of bytes written. */
+	BMFS_SERVED_WRITE = 4,
+	/** Creates a file. The length of the
+	 * request is the number of mebibytes to
+	 * reserve for it. The response has no data. */
+	BMFS_SERVED_CREATE = 5,
+	/** Deletes a file. The response has no data. */
+	BMFS_SERVED_DELETE = 6
+};
+
+/** The header of a request.
+ * @ingroup served-api
+ */
+
+struct BMFSServedRequest
+{
+	/** Chosen by the client and copied to
+	 * the response, to tell them apart. */
+	uint32_t id;
+	/** The operation, one of @ref BMFSServedOp. */
+	uint16_t op;
+	/** The length of the file name that follows
+	 * the header, not including a terminator. It
+	 * must be less than @ref BMFS_FILE_NAME_MAX. */
+	uint16_t name_len;
+	/** The offset within the file, used
+	 * for reads and writes. */
+	uint64_t offset;
+	/** The number of bytes to read or write,
+	 * or the size of a new file in mebibytes. */
+	uint64_t len;
+};
+
+/** The header of a response.
+ * @ingroup served-api
+ */
+
+struct BMFSServedResponse
+{
+	/** The id of the request. */
+	uint32_t id;
+	/** Zero on success, a negative
+	 * error code on failure. */
+	int32_t status;
+	/** The number of bytes of data that follow
+	 * the header, or the number of bytes written
+	 * for @ref BMFS_SERVED_WRITE. If the request
+	 * failed, no data follows. */
+	uint64_t len;
+};
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* BMFS_SERVED_H */
@@ -2,6 +2,9 @@
 #define BMFS_STDLIB_H
 
 #include "bmfs.h"
+#include "aio.h"
+#include "direct.h"
+#include "mmap.h"
 
 #include <stdio.h>
 
@@ -15,6 +18,10 @@ extern "C" {
  * with a FILE structure and the
  * seek, tell, read and write
  * methods from the standard library.
+ * The pread and pwrite methods are
+ * implemented with the POSIX functions
+ * of the same name, on the file
+ * descriptor of @p file.
  * @param disk The disk to initialize.
  * @param file A file representing the
  *  disk data.
@@ -25,8 +32,66 @@ extern "C" {
 
 int bmfs_disk_init_file(struct BMFSDisk *disk, FILE *file);
 
+/** Initializes a disk structure with
+ * a file descriptor. Unlike a disk made
+ * with @ref bmfs_disk_init_file, the pread
+ * and pwrite methods share no state, so
+ * they may be called from several threads
+ * at once.
+ * @param disk The disk to initialize.
+ * @param fd An open file descriptor of
+ *  the disk data. It is not closed by
+ *  the disk.
+ * @returns On success, this function
+ *  returns zero. If @p disk is NULL, this
+ *  function returns -EFAULT. If @p fd is
+ *  negative, this function returns -EBADF.
+ */
+
+int bmfs_disk_init_fd(struct BMFSDisk *disk, int fd);
+
+/** Copies data from one file descriptor to another.
+ * When possible, the data is copied by the kernel with
+ * copy_file_range or sendfile, so that it never enters
+ * user space. Otherwise, it is copied through a buffer.
+ * @param in_fd The file descriptor to copy from.
+ * @param in_offset The offset to start copying from.
+ *  If this is negative, the file position of @p in_fd
+ *  is used and advanced instead.
+ * @param out_fd The file descriptor to copy to.
+ * @param out_offset The offset to start copying to.
+ *  If this is negative, the file position of @p out_fd
+ *  is used and advanced instead, which is required for
+ *  pipes and sockets.
+ * @param len The number of bytes to copy.
+ * @param buf_size The size of the buffer, if one is
+ *  needed. If this is zero, @ref BMFS_BLOCK_SIZE is
+ *  used.
+ * @param copied_len Receives the number of bytes that
+ *  were copied. This is less than @p len if the end of
+ *  @p in_fd was reached. This parameter may be NULL.
+ * @returns Zero on success, a negative error code on
+ *  failure.
+ */
+
+int bmfs_copy_fd(int in_fd,
+                 int64_t in_offset,
+                 int out_fd,
+                 int64_t out_offset,
+                 uint64_t len,
+                 uint64_t buf_size,
+                 uint64_t *copied_len);
+
+/** Makes @ref bmfs_initialize_flags allocate all
+ * the space of the disk image, instead of creating
+ * a sparse file.
+ */
+
+#define BMFS_INITIALIZE_PREALLOCATE 0x01
+
 /** Initializes a disk with a bootloader, Pure64
- * and a kernel.
+ * and a kernel. The disk image is created as a
+ * sparse file.
  * @param diskname The path to the disk file.
  * @param size The size to truncate the disk
  *  file to. May use one of the suffixes: K,
@@ -39,6 +104,23 @@ int bmfs_disk_init_file(struct BMFSDisk *disk, FILE *file);
 
 int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *kernel);
 
+/** Initializes a disk like @ref bmfs_initialize.
+ * @param diskname The path to the disk file.
+ * @param size The size to truncate the disk
+ *  file to. May use one of the suffixes: K,
+ *  M, G, T or P.
+ * @param mbr Path to bootloader.
+ * @param boot Path to Pure64
+ * @param kernel Path to kernel.
+ * @param flags Zero, or @ref BMFS_INITIALIZE_PREALLOCATE
+ *  to allocate the space of the disk image. If the file
+ *  system can't allocate space, the image is filled
+ *  with zeros instead.
+ * @returns Zero on success.
+ */
+
+int bmfs_initialize_flags(char *diskname, char *size, char *mbr, char *boot, char *kernel, int flags);
+
 /** Reads a file from the disk to a file on
  * the host file system. The file on disk
  * must exist.
@@ -46,9 +128,11 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
  * @param filename The name of the file on the
  *  disk and the name of the file on the host
  *  file system.
+ * @returns Zero on success, a negative error
+ *  code on failure.
  */
 
-void bmfs_readfile(struct BMFSDisk *disk, const char *filename);
+int bmfs_readfile(struct BMFSDisk *disk, const char *filename);
 
 /** Writes a file from the host file system
  * to the disk. The disk and the filename
@@ -57,9 +141,11 @@ void bmfs_readfile(struct BMFSDisk *disk, const char *filename);
  * @param disk The disk to write the file to.
  * @param filename The name of the file on the
  *  host file system.
+ * @returns Zero on success, a negative error
+ *  code on failure.
  */
 
-void bmfs_writefile(struct BMFSDisk *disk, const char *filename);
+int bmfs_writefile(struct BMFSDisk *disk, const char *filename);
 
 #ifdef __cplusplus
 } /* extern "C" { */
@@ -31,6 +31,15 @@ NO_UNIX_UTILS ?= 1
 #   the BMFS fuse program.
 NO_FUSE ?= 1
 
+# NO_SIMD:
+#   If this variable is defined, the
+#   library doesn't use vector instructions
+#   and doesn't depend on the compiler's
+#   CPU feature detection. This may be
+#   needed when building the library for
+#   a kernel.
+NO_SIMD ?=
+
 # VALGRIND:
 #   Path to the valgrind executable.
 #   If valgrind is within the PATH variable,
@@ -46,6 +55,17 @@ VALGRIND ?=
 #   are enabled when compiling the library and programs.
 BMFS_RELEASE ?=
 
+# BENCH_THRESHOLD:
+#   How much slower, in percent, a case of
+#   the micro-bench program may be than the
+#   baseline before 'make bench' fails. The
+#   baseline depends on the machine it was
+#   taken on, so it isn't part of the tree.
+#   It's written to src/micro-bench.baseline
+#   by 'make bench-baseline', and without it
+#   'make bench' only prints the results.
+BENCH_THRESHOLD ?= 20
+
 # ARFLAGS:
 #   These are flags to use when creating and modifying
 #   static libraries.
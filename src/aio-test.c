@@ -0,0 +1,135 @@
+#include <bmfs/aio.h>
+#include <bmfs/stdlib.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#define CHUNK_SIZE 4096
+
+#define CHUNK_COUNT 16
+
+#define DEPTH 8
+
+static char written[CHUNK_COUNT][CHUNK_SIZE];
+
+static char read_back[CHUNK_COUNT][CHUNK_SIZE];
+
+/* Reaps until there's nothing in flight, checking
+ * that each request completes once and in full. */
+
+static void reap_all(struct BMFSAio *aio, int *done, unsigned int in_flight)
+{
+	struct BMFSAioCompletion completions[DEPTH];
+
+	while (in_flight > 0)
+	{
+		int count = bmfs_disk_reap(aio, completions, DEPTH, 1);
+		assert(count > 0);
+		for (int i = 0; i < count; i++)
+		{
+			uintptr_t chunk = (uintptr_t) completions[i].user_data;
+			assert(chunk < CHUNK_COUNT);
+			assert(!done[chunk]);
+			assert(completions[i].err == 0);
+			assert(completions[i].len == CHUNK_SIZE);
+			done[chunk] = 1;
+		}
+		in_flight -= count;
+	}
+}
+
+static void test_queue(struct BMFSDisk *disk, int fd, int uring)
+{
+	struct BMFSAio *aio = NULL;
+	assert(bmfs_aio_create(&aio, disk, fd, DEPTH) == 0);
+	if (uring)
+		assert(bmfs_aio_is_uring(aio));
+	else
+		assert(!bmfs_aio_is_uring(aio));
+
+	for (unsigned int i = 0; i < CHUNK_COUNT; i++)
+		memset(written[i], 'a' + i + uring, CHUNK_SIZE);
+
+	/* write in two batches, since only
+	 * DEPTH requests may be in flight */
+	int done[CHUNK_COUNT];
+	memset(done, 0, sizeof(done));
+	for (uintptr_t i = 0; i < CHUNK_COUNT; i++)
+	{
+		assert(bmfs_disk_submit_write(aio, written[i], CHUNK_SIZE, i * CHUNK_SIZE, (void *) i) == 0);
+		if ((i % DEPTH) == (DEPTH - 1))
+		{
+			assert(bmfs_disk_submit_write(aio, written[i], CHUNK_SIZE, 0, NULL) == -EAGAIN);
+			reap_all(aio, done, DEPTH);
+		}
+	}
+
+	/* read back, starting the requests
+	 * before waiting on any of them */
+	memset(done, 0, sizeof(done));
+	memset(read_back, 0, sizeof(read_back));
+	for (uintptr_t i = 0; i < CHUNK_COUNT; i++)
+	{
+		assert(bmfs_disk_submit_read(aio, read_back[i], CHUNK_SIZE, i * CHUNK_SIZE, (void *) i) == 0);
+		if ((i % DEPTH) == (DEPTH - 1))
+		{
+			assert(bmfs_aio_flush(aio) == 0);
+			reap_all(aio, done, DEPTH);
+		}
+	}
+
+	assert(memcmp(written, read_back, sizeof(written)) == 0);
+
+	/* nothing in flight, so reaping
+	 * returns without blocking */
+	struct BMFSAioCompletion completion;
+	assert(bmfs_disk_reap(aio, &completion, 1, 1) == 0);
+
+	/* requests still in flight are
+	 * waited for when destroyed */
+	assert(bmfs_disk_submit_read(aio, read_back[0], CHUNK_SIZE, 0, NULL) == 0);
+	bmfs_aio_destroy(aio);
+}
+
+static int uring_available(struct BMFSDisk *disk, int fd)
+{
+	struct BMFSAio *aio = NULL;
+	assert(bmfs_aio_create(&aio, disk, fd, DEPTH) == 0);
+	int uring = bmfs_aio_is_uring(aio);
+	bmfs_aio_destroy(aio);
+	return uring;
+}
+
+int main(void)
+{
+	FILE *image = tmpfile();
+	assert(image != NULL);
+	int fd = fileno(image);
+	assert(ftruncate(fd, CHUNK_SIZE * CHUNK_COUNT) == 0);
+
+	struct BMFSDisk disk;
+	assert(bmfs_disk_init_fd(&disk, fd) == 0);
+
+	struct BMFSAio *aio = NULL;
+	assert(bmfs_aio_create(&aio, &disk, -1, 0) == -EINVAL);
+	assert(bmfs_aio_create(&aio, &disk, -1, BMFS_AIO_DEPTH_MAX + 1) == -EINVAL);
+
+	/* test the thread pool */
+	test_queue(&disk, -1, 0);
+
+	/* test io_uring, if the kernel supports it */
+	if (uring_available(&disk, fd))
+		test_queue(&disk, fd, 1);
+	else
+		printf("io_uring is not available, only the thread pool was tested\n");
+
+	fclose(image);
+
+	return EXIT_SUCCESS;
+}
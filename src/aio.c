@@ -0,0 +1,669 @@
+#include <bmfs/aio.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BMFS_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef BMFS_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/** The maximum number of threads
+ * used when io_uring is not available. */
+
+#define BMFS_AIO_THREADS 8
+
+struct BMFSAioRequest
+{
+	int write;
+	void *buf;
+	uint64_t len;
+	uint64_t offset;
+	void *user_data;
+};
+
+#ifdef BMFS_HAVE_IO_URING
+
+struct BMFSAioRing
+{
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+#endif /* BMFS_HAVE_IO_URING */
+
+struct BMFSAioPool
+{
+	pthread_t threads[BMFS_AIO_THREADS];
+	unsigned int thread_count;
+	pthread_mutex_t lock;
+	/** Signaled when a request is queued,
+	 * or when the threads should exit. */
+	pthread_cond_t request_cond;
+	/** Signaled when a request completes. */
+	pthread_cond_t completion_cond;
+	/** Circular queue of pending requests. */
+	struct BMFSAioRequest *requests;
+	unsigned int request_head;
+	unsigned int request_count;
+	/** Circular queue of completions. */
+	struct BMFSAioCompletion *completions;
+	unsigned int completion_head;
+	unsigned int completion_count;
+	int stop;
+};
+
+struct BMFSAio
+{
+	struct BMFSDisk *disk;
+	int fd;
+	unsigned int depth;
+	unsigned int in_flight;
+	int uring;
+#ifdef BMFS_HAVE_IO_URING
+	struct BMFSAioRing ring;
+#endif
+	struct BMFSAioPool pool;
+};
+
+#ifdef BMFS_HAVE_IO_URING
+
+static void ring_done(struct BMFSAioRing *ring);
+
+static int op_supported(const struct io_uring_probe *probe, unsigned int op)
+{
+	return (op <= probe->last_op)
+	    && (op < probe->ops_len)
+	    && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+/* IORING_OP_READ and IORING_OP_WRITE were added in
+ * Linux 5.6, along with the probe. On Linux 5.1 to
+ * 5.5, io_uring_setup succeeds but every read and
+ * write would fail with -EINVAL, so the probe is
+ * used to fall back to the thread pool. */
+
+static int ring_probe(struct BMFSAioRing *ring)
+{
+	unsigned int ops_len = IORING_OP_LAST;
+
+	struct io_uring_probe *probe = calloc(1, sizeof(*probe) + (ops_len * sizeof(probe->ops[0])));
+	if (probe == NULL)
+		return -ENOMEM;
+
+	int err = 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, ops_len) < 0)
+		err = -errno;
+	else if (!op_supported(probe, IORING_OP_READ)
+	      || !op_supported(probe, IORING_OP_WRITE))
+		err = -EOPNOTSUPP;
+
+	free(probe);
+
+	return err;
+}
+
+static int ring_init(struct BMFSAioRing *ring, unsigned int depth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (fd < 0)
+		return -errno;
+
+	ring->fd = fd;
+	ring->sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+	ring->cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size,
+	                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                     fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+	{
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cq_ring = ring->sq_ring;
+	}
+	else
+	{
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+		                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                     fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+		{
+			int err = -errno;
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			close(fd);
+			return err;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size,
+	                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		int err = -errno;
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(fd);
+		return err;
+	}
+
+	unsigned char *sq = (unsigned char *) ring->sq_ring;
+	unsigned char *cq = (unsigned char *) ring->cq_ring;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	int err = ring_probe(ring);
+	if (err != 0)
+	{
+		ring_done(ring);
+		return err;
+	}
+
+	return 0;
+}
+
+static void ring_done(struct BMFSAioRing *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+static int ring_enter(struct BMFSAioRing *ring, unsigned int to_submit, unsigned int min_complete)
+{
+	unsigned int flags = 0;
+	if (min_complete > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	for (;;)
+	{
+		int result = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+		if (result >= 0)
+			return 0;
+		else if (errno != EINTR)
+			return -errno;
+	}
+}
+
+/* The number of requests that are queued
+ * but haven't been passed to the kernel. */
+
+static unsigned int ring_pending(const struct BMFSAioRing *ring)
+{
+	return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Only fills in a submission queue entry. The
+ * entries are passed to the kernel together,
+ * by the next call to io_uring_enter. The ring
+ * has room for every request in flight, so
+ * there is always a free entry. */
+
+static void ring_queue(struct BMFSAioRing *ring, int fd, const struct BMFSAioRequest *request)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)(request->buf);
+	sqe->len = request->len;
+	sqe->off = request->offset;
+	sqe->user_data = (uint64_t)(uintptr_t)(request->user_data);
+
+	ring->sq_array[index] = index;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int ring_reap(struct BMFSAioRing *ring,
+                              struct BMFSAioCompletion *completions,
+                              unsigned int max)
+{
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned int count = 0;
+
+	while ((head != tail) && (count < max))
+	{
+		const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		completions[count].user_data = (void *)(uintptr_t)(cqe->user_data);
+		if (cqe->res < 0)
+		{
+			completions[count].err = cqe->res;
+			completions[count].len = 0;
+		}
+		else
+		{
+			completions[count].err = 0;
+			completions[count].len = cqe->res;
+		}
+		count++;
+		head++;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+#endif /* BMFS_HAVE_IO_URING */
+
+static void *pool_thread(void *aio_ptr)
+{
+	struct BMFSAio *aio = (struct BMFSAio *)(aio_ptr);
+	struct BMFSAioPool *pool = &aio->pool;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;)
+	{
+		while ((pool->request_count == 0) && !pool->stop)
+			pthread_cond_wait(&pool->request_cond, &pool->lock);
+
+		if (pool->request_count == 0)
+			break;
+
+		struct BMFSAioRequest request = pool->requests[pool->request_head];
+		pool->request_head = (pool->request_head + 1) % aio->depth;
+		pool->request_count--;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		uint64_t len = 0;
+		int err;
+		if (request.write)
+			err = bmfs_disk_pwrite(aio->disk, request.buf, request.len, request.offset, &len);
+		else
+			err = bmfs_disk_pread(aio->disk, request.buf, request.len, request.offset, &len);
+
+		pthread_mutex_lock(&pool->lock);
+
+		unsigned int index = (pool->completion_head + pool->completion_count) % aio->depth;
+		pool->completions[index].user_data = request.user_data;
+		pool->completions[index].err = err;
+		pool->completions[index].len = (err == 0) ? len : 0;
+		pool->completion_count++;
+
+		pthread_cond_signal(&pool->completion_cond);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void pool_done(struct BMFSAio *aio)
+{
+	struct BMFSAioPool *pool = &aio->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->request_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned int i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->request_cond);
+	pthread_cond_destroy(&pool->completion_cond);
+
+	free(pool->requests);
+	free(pool->completions);
+}
+
+static int pool_init(struct BMFSAio *aio)
+{
+	struct BMFSAioPool *pool = &aio->pool;
+
+	pool->thread_count = 0;
+	pool->request_head = 0;
+	pool->request_count = 0;
+	pool->completion_head = 0;
+	pool->completion_count = 0;
+	pool->stop = 0;
+
+	pool->requests = calloc(aio->depth, sizeof(pool->requests[0]));
+	pool->completions = calloc(aio->depth, sizeof(pool->completions[0]));
+	if ((pool->requests == NULL)
+	 || (pool->completions == NULL))
+	{
+		free(pool->requests);
+		free(pool->completions);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->request_cond, NULL);
+	pthread_cond_init(&pool->completion_cond, NULL);
+
+	unsigned int thread_count = aio->depth;
+	if (thread_count > BMFS_AIO_THREADS)
+		thread_count = BMFS_AIO_THREADS;
+
+	for (unsigned int i = 0; i < thread_count; i++)
+	{
+		int err = pthread_create(&pool->threads[i], NULL, pool_thread, aio);
+		if (err != 0)
+		{
+			pool_done(aio);
+			return -err;
+		}
+		pool->thread_count++;
+	}
+
+	return 0;
+}
+
+static int pool_submit(struct BMFSAio *aio, const struct BMFSAioRequest *request)
+{
+	struct BMFSAioPool *pool = &aio->pool;
+
+	pthread_mutex_lock(&pool->lock);
+
+	unsigned int index = (pool->request_head + pool->request_count) % aio->depth;
+	pool->requests[index] = *request;
+	pool->request_count++;
+
+	pthread_cond_signal(&pool->request_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+static unsigned int pool_reap(struct BMFSAio *aio,
+                              struct BMFSAioCompletion *completions,
+                              unsigned int max,
+                              unsigned int min)
+{
+	struct BMFSAioPool *pool = &aio->pool;
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->completion_count < min)
+		pthread_cond_wait(&pool->completion_cond, &pool->lock);
+
+	while ((pool->completion_count > 0) && (count < max))
+	{
+		completions[count] = pool->completions[pool->completion_head];
+		pool->completion_head = (pool->completion_head + 1) % aio->depth;
+		pool->completion_count--;
+		count++;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return count;
+}
+
+int bmfs_aio_create(struct BMFSAio **aio_ptr,
+                    struct BMFSDisk *disk,
+                    int fd,
+                    unsigned int depth)
+{
+	if ((aio_ptr == NULL)
+	 || (disk == NULL))
+		return -EFAULT;
+
+	if ((depth == 0)
+	 || (depth > BMFS_AIO_DEPTH_MAX))
+		return -EINVAL;
+
+	struct BMFSAio *aio = malloc(sizeof(*aio));
+	if (aio == NULL)
+		return -ENOMEM;
+
+	aio->disk = disk;
+	aio->fd = fd;
+	aio->depth = depth;
+	aio->in_flight = 0;
+	aio->uring = 0;
+
+#ifdef BMFS_HAVE_IO_URING
+	/* if io_uring is not supported by the
+	 * kernel, or not permitted, the thread
+	 * pool is used instead */
+	if ((fd >= 0)
+	 && (ring_init(&aio->ring, depth) == 0))
+		aio->uring = 1;
+#endif
+
+	if (!aio->uring)
+	{
+		int err = pool_init(aio);
+		if (err != 0)
+		{
+			free(aio);
+			return err;
+		}
+	}
+
+	*aio_ptr = aio;
+
+	return 0;
+}
+
+void bmfs_aio_destroy(struct BMFSAio *aio)
+{
+	if (aio == NULL)
+		return;
+
+	struct BMFSAioCompletion completions[16];
+
+	while (aio->in_flight > 0)
+	{
+		if (bmfs_disk_reap(aio, completions, 16, 1) < 0)
+			break;
+	}
+
+#ifdef BMFS_HAVE_IO_URING
+	if (aio->uring)
+		ring_done(&aio->ring);
+#endif
+
+	if (!aio->uring)
+		pool_done(aio);
+
+	free(aio);
+}
+
+int bmfs_aio_is_uring(const struct BMFSAio *aio)
+{
+	if (aio == NULL)
+		return 0;
+
+	return aio->uring;
+}
+
+static int submit(struct BMFSAio *aio, const struct BMFSAioRequest *request)
+{
+	if (aio->in_flight >= aio->depth)
+		return -EAGAIN;
+
+	int err;
+
+#ifdef BMFS_HAVE_IO_URING
+	if (aio->uring)
+	{
+		/* the length of an io_uring request
+		 * is limited to 32 bits */
+		if (request->len > 0x7ffff000ULL)
+			return -EINVAL;
+		ring_queue(&aio->ring, aio->fd, request);
+		err = 0;
+	}
+	else
+#endif
+	{
+		err = pool_submit(aio, request);
+	}
+
+	if (err != 0)
+		return err;
+
+	aio->in_flight++;
+
+	return 0;
+}
+
+int bmfs_disk_submit_read(struct BMFSAio *aio,
+                          void *buf,
+                          uint64_t len,
+                          uint64_t offset,
+                          void *user_data)
+{
+	if ((aio == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	struct BMFSAioRequest request;
+	request.write = 0;
+	request.buf = buf;
+	request.len = len;
+	request.offset = offset;
+	request.user_data = user_data;
+
+	return submit(aio, &request);
+}
+
+int bmfs_disk_submit_write(struct BMFSAio *aio,
+                           const void *buf,
+                           uint64_t len,
+                           uint64_t offset,
+                           void *user_data)
+{
+	if ((aio == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	struct BMFSAioRequest request;
+	request.write = 1;
+	request.buf = (void *) buf;
+	request.len = len;
+	request.offset = offset;
+	request.user_data = user_data;
+
+	return submit(aio, &request);
+}
+
+int bmfs_aio_flush(struct BMFSAio *aio)
+{
+	if (aio == NULL)
+		return -EFAULT;
+
+#ifdef BMFS_HAVE_IO_URING
+	if (aio->uring)
+	{
+		unsigned int pending = ring_pending(&aio->ring);
+		if (pending > 0)
+			return ring_enter(&aio->ring, pending, 0);
+	}
+#endif
+
+	return 0;
+}
+
+int bmfs_disk_reap(struct BMFSAio *aio,
+                   struct BMFSAioCompletion *completions,
+                   unsigned int max,
+                   unsigned int min)
+{
+	if ((aio == NULL)
+	 || (completions == NULL))
+		return -EFAULT;
+
+	if (min > max)
+		min = max;
+
+	if (min > aio->in_flight)
+		min = aio->in_flight;
+
+	unsigned int count = 0;
+
+#ifdef BMFS_HAVE_IO_URING
+	if (aio->uring)
+	{
+		for (;;)
+		{
+			count += ring_reap(&aio->ring, &completions[count], max - count);
+
+			/* queued requests are submitted with
+			 * the same call that waits, if any */
+			unsigned int pending = ring_pending(&aio->ring);
+			if ((count >= min)
+			 && (pending == 0))
+				break;
+
+			unsigned int wait = (count < min) ? (min - count) : 0;
+
+			int err = ring_enter(&aio->ring, pending, wait);
+			if (err != 0)
+			{
+				aio->in_flight -= count;
+				return (count > 0) ? (int) count : err;
+			}
+		}
+	}
+	else
+#endif
+	{
+		count = pool_reap(aio, completions, max, min);
+	}
+
+	aio->in_flight -= count;
+
+	return count;
+}
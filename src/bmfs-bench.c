@@ -0,0 +1,1132 @@
+#include <bmfs/aio.h>
+#include <bmfs/bmfs.h>
+#include <bmfs/direct.h>
+#include <bmfs/mmap.h>
+#include <bmfs/stdlib.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/** The memory given to the cache backend. */
+
+#define CACHE_MEMORY_SIZE (16ULL * 1024ULL * 1024ULL)
+
+/** The page size of the cache backend. */
+
+#define CACHE_PAGE_SIZE 4096ULL
+
+/** The number of files kept on the
+ * disk by the create and delete churn. */
+
+#define CHURN_WINDOW 16
+
+/** The number of files looked up
+ * by the stat workload. */
+
+#define STAT_FILES 48
+
+/** The options of a run. They are printed
+ * with the results, so that a run can be
+ * repeated. */
+
+struct bench_config
+{
+	/** The path of the disk image to create. */
+	const char *disk_path;
+	/** The size of the disk image. */
+	uint64_t disk_size;
+	/** The size of the file used by the
+	 * sequential and random workloads. */
+	uint64_t file_size;
+	/** The size of each read or write of the
+	 * random workloads, and of the sequential
+	 * workloads. */
+	uint64_t io_size;
+	/** The number of operations of the random,
+	 * churn, stat and fragmentation workloads. */
+	uint64_t ops;
+	/** The seed of the random offsets
+	 * and names. */
+	uint64_t seed;
+	/** The number of reads kept in flight
+	 * by the asynchronous workload. */
+	unsigned int queue_depth;
+	/** Non-zero if the results are
+	 * printed as JSON. */
+	int json;
+};
+
+/** A disk backend that is measured. Only
+ * the parts that the backend uses are set. */
+
+struct backend
+{
+	/** The name, as given on the command line. */
+	const char *name;
+	/** The disk that the workloads use. */
+	struct BMFSDisk disk;
+	/** The file descriptor of the disk image. */
+	int fd;
+	/** Used by the file backend. */
+	FILE *file;
+	/** Used by the mmap backend. */
+	struct BMFSMmap map;
+	/** Used by the direct backend. */
+	struct BMFSDirect direct;
+	/** Used by the cache backend, on
+	 * top of a file descriptor disk. */
+	struct BMFSCache cache;
+	/** The disk under the cache. */
+	struct BMFSDisk base;
+	/** The memory of the cache. */
+	void *cache_memory;
+};
+
+/** The measurements of one workload. */
+
+struct bench_result
+{
+	/** The number of operations. */
+	uint64_t ops;
+	/** The number of bytes read or written,
+	 * or zero if the workload doesn't move data. */
+	uint64_t bytes;
+	/** The total time, in nanoseconds. */
+	uint64_t total_ns;
+	/** The latency of each operation, in
+	 * nanoseconds. Sorted once the workload
+	 * is done. */
+	uint64_t *latencies;
+};
+
+/** A workload. It runs on a freshly
+ * formatted disk, unless it needs the
+ * data of the workload before it. */
+
+struct workload
+{
+	/** The name, as given on the command line. */
+	const char *name;
+	/** Runs the workload. */
+	int (*run)(struct backend *backend,
+	           const struct bench_config *config,
+	           void *buf,
+	           struct bench_result *result);
+	/** Non-zero if the disk is formatted first. */
+	int format;
+};
+
+static void help(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("\n");
+	printf("Runs reproducible workloads against the\n");
+	printf("disk backends and reports their throughput\n");
+	printf("and latency. The disk image is created and\n");
+	printf("removed by the benchmark.\n");
+	printf("\n");
+	printf("options:\n");
+	printf("  --backend,     -b : file, fd, mmap, direct, cache or all (default: all)\n");
+	printf("  --disk,        -d : the disk image to create (default: bmfs-bench.image)\n");
+	printf("  --disk-size,   -s : the size of the disk image (default: 256MiB)\n");
+	printf("  --file-size,   -f : the size of the file for sequential and random I/O (default: 64MiB)\n");
+	printf("  --help,        -h : display this help message\n");
+	printf("  --io-size,     -i : the size of each read and write (default: 4KiB)\n");
+	printf("  --json,        -j : print the results as JSON\n");
+	printf("  --ops,         -n : the number of operations of each workload (default: 10000)\n");
+	printf("  --queue-depth, -q : the number of reads in flight for aio-read (default: 32)\n");
+	printf("  --seed,        -r : the seed of the random numbers (default: 1)\n");
+	printf("  --version,     -v : display version information\n");
+	printf("  --workload,    -w : a workload to run, may be repeated (default: all)\n");
+	printf("\n");
+	printf("workloads:\n");
+	printf("  seq-write  : writes the file from start to end\n");
+	printf("  seq-read   : reads the file from start to end\n");
+	printf("  rand-write : writes at random offsets of the file\n");
+	printf("  rand-read  : reads from random offsets of the file\n");
+	printf("  aio-read   : reads from random offsets, several at a time\n");
+	printf("  churn      : creates and deletes files\n");
+	printf("  stat       : looks up random files in the directory\n");
+	printf("  frag       : allocates files on a fragmented disk\n");
+}
+
+static void version(void)
+{
+	printf("%s\n", BMFS_VERSION_STRING);
+}
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t) ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+/* xorshift64*, so that runs with the same
+ * seed do the same operations everywhere */
+
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int parse_size(const char *str, uint64_t *size)
+{
+	struct bmfs_sspec sspec;
+	int err = bmfs_sspec_parse(&sspec, str);
+	if (err != 0)
+		return err;
+
+	return bmfs_sspec_bytes(&sspec, size);
+}
+
+/* backends */
+
+static int backend_open(struct backend *backend, const char *name, const char *path)
+{
+	memset(backend, 0, sizeof(*backend));
+	backend->name = name;
+	backend->fd = -1;
+
+	int err = 0;
+
+	if (strcmp(name, "direct") == 0)
+	{
+		err = bmfs_direct_init(&backend->direct, path, 1, 0);
+		if (err == 0)
+			err = bmfs_disk_init_direct(&backend->disk, &backend->direct);
+		return err;
+	}
+
+	backend->fd = open(path, O_RDWR);
+	if (backend->fd < 0)
+		return -errno;
+
+	if (strcmp(name, "fd") == 0)
+		err = bmfs_disk_init_fd(&backend->disk, backend->fd);
+	else if (strcmp(name, "file") == 0)
+	{
+		backend->file = fdopen(backend->fd, "r+b");
+		if (backend->file == NULL)
+			err = -errno;
+		else
+			err = bmfs_disk_init_file(&backend->disk, backend->file);
+	}
+	else if (strcmp(name, "mmap") == 0)
+	{
+		err = bmfs_mmap_init(&backend->map, backend->fd, 1);
+		if (err == 0)
+			err = bmfs_disk_init_mmap(&backend->disk, &backend->map);
+	}
+	else if (strcmp(name, "cache") == 0)
+	{
+		backend->cache_memory = malloc(CACHE_MEMORY_SIZE);
+		if (backend->cache_memory == NULL)
+			err = -ENOMEM;
+		else
+			err = bmfs_disk_init_fd(&backend->base, backend->fd);
+
+		if (err == 0)
+			err = bmfs_cache_init(&backend->cache,
+			                      &backend->base,
+			                      backend->cache_memory,
+			                      CACHE_MEMORY_SIZE,
+			                      CACHE_PAGE_SIZE,
+			                      BMFS_CACHE_WRITE_BACK);
+
+		if (err == 0)
+			err = bmfs_disk_init_cache(&backend->disk, &backend->cache);
+	}
+	else
+		err = -EINVAL;
+
+	return err;
+}
+
+/* Writes data buffered by the backend itself,
+ * so that writes are measured until they reach
+ * the disk image. The page cache of the host is
+ * not flushed, as for the file descriptor. */
+
+static int backend_flush(struct backend *backend)
+{
+	if (backend->file != NULL)
+	{
+		if (fflush(backend->file) != 0)
+			return -errno;
+	}
+	else if (backend->cache_memory != NULL)
+		return bmfs_cache_flush(&backend->cache);
+
+	return 0;
+}
+
+static void backend_close(struct backend *backend)
+{
+	if (strcmp(backend->name, "direct") == 0)
+	{
+		bmfs_direct_done(&backend->direct);
+		return;
+	}
+
+	if (strcmp(backend->name, "mmap") == 0)
+		bmfs_mmap_done(&backend->map);
+
+	free(backend->cache_memory);
+
+	if (backend->file != NULL)
+		fclose(backend->file);
+	else if (backend->fd >= 0)
+		close(backend->fd);
+}
+
+/* workloads */
+
+/* Creates the file used by the sequential and random
+ * workloads, if it doesn't exist, and gets its offset. */
+
+static int open_data_file(struct backend *backend, const struct bench_config *config, uint64_t *offset)
+{
+	struct BMFSEntry entry;
+	int err = bmfs_disk_find_file(&backend->disk, "data", &entry, NULL);
+	if (err == -ENOENT)
+	{
+		uint64_t mebibytes = (config->file_size + (1024 * 1024) - 1) / (1024 * 1024);
+		err = bmfs_disk_create_file(&backend->disk, "data", mebibytes);
+		if (err == 0)
+			err = bmfs_disk_find_file(&backend->disk, "data", &entry, NULL);
+	}
+
+	if (err != 0)
+		return err;
+
+	return bmfs_entry_get_offset(&entry, offset);
+}
+
+static int run_sequential(struct backend *backend,
+                          const struct bench_config *config,
+                          void *buf,
+                          struct bench_result *result,
+                          int writing)
+{
+	uint64_t file_offset;
+	int err = open_data_file(backend, config, &file_offset);
+	if (err != 0)
+		return err;
+
+	uint64_t count = config->file_size / config->io_size;
+	if (count > result->ops)
+		count = result->ops;
+
+	uint64_t start = now();
+
+	for (uint64_t i = 0; i < count; i++)
+	{
+		uint64_t offset = file_offset + (i * config->io_size);
+		uint64_t op_start = now();
+
+		if (writing)
+			err = bmfs_disk_pwrite(&backend->disk, buf, config->io_size, offset, NULL);
+		else
+			err = bmfs_disk_pread(&backend->disk, buf, config->io_size, offset, NULL);
+
+		if (err != 0)
+			return err;
+
+		result->latencies[i] = now() - op_start;
+	}
+
+	if (writing)
+	{
+		err = backend_flush(backend);
+		if (err != 0)
+			return err;
+	}
+
+	result->total_ns = now() - start;
+	result->ops = count;
+	result->bytes = count * config->io_size;
+
+	return 0;
+}
+
+static int run_random(struct backend *backend,
+                      const struct bench_config *config,
+                      void *buf,
+                      struct bench_result *result,
+                      int writing)
+{
+	uint64_t file_offset;
+	int err = open_data_file(backend, config, &file_offset);
+	if (err != 0)
+		return err;
+
+	uint64_t slots = config->file_size / config->io_size;
+	if (slots == 0)
+		return -EINVAL;
+
+	uint64_t state = config->seed;
+
+	uint64_t start = now();
+
+	for (uint64_t i = 0; i < result->ops; i++)
+	{
+		uint64_t offset = file_offset + ((next_random(&state) % slots) * config->io_size);
+		uint64_t op_start = now();
+
+		if (writing)
+			err = bmfs_disk_pwrite(&backend->disk, buf, config->io_size, offset, NULL);
+		else
+			err = bmfs_disk_pread(&backend->disk, buf, config->io_size, offset, NULL);
+
+		if (err != 0)
+			return err;
+
+		result->latencies[i] = now() - op_start;
+	}
+
+	if (writing)
+	{
+		err = backend_flush(backend);
+		if (err != 0)
+			return err;
+	}
+
+	result->total_ns = now() - start;
+	result->bytes = result->ops * config->io_size;
+
+	return 0;
+}
+
+static int run_seq_write(struct backend *backend, const struct bench_config *config, void *buf, struct bench_result *result)
+{
+	return run_sequential(backend, config, buf, result, 1);
+}
+
+static int run_seq_read(struct backend *backend, const struct bench_config *config, void *buf, struct bench_result *result)
+{
+	return run_sequential(backend, config, buf, result, 0);
+}
+
+static int run_rand_write(struct backend *backend, const struct bench_config *config, void *buf, struct bench_result *result)
+{
+	return run_random(backend, config, buf, result, 1);
+}
+
+static int run_rand_read(struct backend *backend, const struct bench_config *config, void *buf, struct bench_result *result)
+{
+	return run_random(backend, config, buf, result, 0);
+}
+
+/* The io_uring queue reads straight from the file
+ * descriptor, which only sees all of the data for
+ * backends that don't buffer it. The others use
+ * the thread pool, and the cache, which can't be
+ * used from several threads, only one thread. */
+
+static int aio_open(struct backend *backend, unsigned int *depth, struct BMFSAio **aio)
+{
+	int fd = -1;
+	if (strcmp(backend->name, "fd") == 0)
+		fd = backend->fd;
+	else if (strcmp(backend->name, "direct") == 0)
+		fd = backend->direct.fd;
+	else if (strcmp(backend->name, "cache") == 0)
+		*depth = 1;
+
+	return bmfs_aio_create(aio, &backend->disk, fd, *depth);
+}
+
+/* Random reads, like rand-read, with up to the queue
+ * depth in flight. The latency of a read is from
+ * its submission to its completion. */
+
+static int run_aio_read(struct backend *backend, const struct bench_config *config, void *buf, struct bench_result *result)
+{
+	(void) buf;
+
+	uint64_t file_offset;
+	int err = open_data_file(backend, config, &file_offset);
+	if (err != 0)
+		return err;
+
+	uint64_t slots = config->file_size / config->io_size;
+	if (slots == 0)
+		return -EINVAL;
+
+	unsigned int depth = config->queue_depth;
+	struct BMFSAio *aio = NULL;
+	err = aio_open(backend, &depth, &aio);
+	if (err != 0)
+		return err;
+
+	/* each read in flight has its own buffer,
+	 * aligned for the direct backend, and the
+	 * free ones are kept on a stack */
+	void *bufs = NULL;
+	uint64_t *starts = malloc(depth * sizeof(uint64_t));
+	unsigned int *free_slots = malloc(depth * sizeof(unsigned int));
+	struct BMFSAioCompletion *completions = malloc(depth * sizeof(completions[0]));
+	if ((starts == NULL)
+	 || (free_slots == NULL)
+	 || (completions == NULL)
+	 || (posix_memalign(&bufs, BMFS_DIRECT_ALIGNMENT, depth * config->io_size) != 0))
+	{
+		free(starts);
+		free(free_slots);
+		free(completions);
+		bmfs_aio_destroy(aio);
+		return -ENOMEM;
+	}
+
+	unsigned int free_count = 0;
+	for (unsigned int i = 0; i < depth; i++)
+		free_slots[free_count++] = i;
+
+	uint64_t state = config->seed;
+	uint64_t submitted = 0;
+	uint64_t completed = 0;
+
+	uint64_t start = now();
+
+	while ((err == 0)
+	    && (completed < result->ops))
+	{
+		while ((submitted < result->ops)
+		    && (free_count > 0))
+		{
+			unsigned int slot = free_slots[--free_count];
+			uint64_t offset = file_offset + ((next_random(&state) % slots) * config->io_size);
+			starts[slot] = now();
+			err = bmfs_disk_submit_read(aio,
+			                            ((char *) bufs) + (slot * config->io_size),
+			                            config->io_size,
+			                            offset,
+			                            (void *)(uintptr_t) slot);
+			if (err != 0)
+				break;
+			submitted++;
+		}
+
+		if (err != 0)
+			break;
+
+		int count = bmfs_disk_reap(aio, completions, depth, 1);
+		if (count < 0)
+		{
+			err = count;
+			break;
+		}
+
+		uint64_t end = now();
+
+		for (int i = 0; i < count; i++)
+		{
+			unsigned int slot = (unsigned int)(uintptr_t) completions[i].user_data;
+			if ((err == 0)
+			 && (completions[i].err != 0))
+				err = completions[i].err;
+			else if ((err == 0)
+			      && (completions[i].len != config->io_size))
+				err = -EIO;
+			result->latencies[completed++] = end - starts[slot];
+			free_slots[free_count++] = slot;
+		}
+	}
+
+	result->total_ns = now() - start;
+	result->bytes = result->ops * config->io_size;
+
+	bmfs_aio_destroy(aio);
+
+	free(bufs);
+	free(starts);
+	free(free_slots);
+	free(completions);
+
+	return err;
+}
+
+/* Each operation creates a file and, once
+ * the window is full, deletes the oldest one. */
+
+static int run_churn(struct backend *backend, const struct bench_config *config, void *buf, struct bench_result *result)
+{
+	(void) config;
+	(void) buf;
+
+	uint64_t start = now();
+
+	for (uint64_t i = 0; i < result->ops; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		uint64_t op_start = now();
+
+		if (i >= CHURN_WINDOW)
+		{
+			snprintf(filename, sizeof(filename), "churn-%" PRIu64, i - CHURN_WINDOW);
+			int err = bmfs_disk_delete_file(&backend->disk, filename);
+			if (err != 0)
+				return err;
+		}
+
+		snprintf(filename, sizeof(filename), "churn-%" PRIu64, i);
+		int err = bmfs_disk_create_file(&backend->disk, filename, 2);
+		if (err != 0)
+			return err;
+
+		result->latencies[i] = now() - op_start;
+	}
+
+	result->total_ns = now() - start;
+
+	return 0;
+}
+
+/* Looks up random files in a full directory,
+ * including names that don't exist. The directory
+ * isn't cached, so it's read from the backend. */
+
+static int run_stat(struct backend *backend, const struct bench_config *config, void *buf, struct bench_result *result)
+{
+	(void) buf;
+
+	for (unsigned int i = 0; i < STAT_FILES; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "stat-%u", i);
+		int err = bmfs_disk_create_file(&backend->disk, filename, 0);
+		if (err != 0)
+			return err;
+	}
+
+	uint64_t state = config->seed;
+
+	uint64_t start = now();
+
+	for (uint64_t i = 0; i < result->ops; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		unsigned int n = next_random(&state) % (STAT_FILES + (STAT_FILES / 4));
+		snprintf(filename, sizeof(filename), "stat-%u", n);
+
+		uint64_t op_start = now();
+
+		struct BMFSEntry entry;
+		int err = bmfs_disk_find_file(&backend->disk, filename, &entry, NULL);
+		if ((err != 0)
+		 && ((err != -ENOENT)
+		  || (n < STAT_FILES)))
+			return (err == -ENOENT) ? -EIO : err;
+
+		result->latencies[i] = now() - op_start;
+	}
+
+	result->total_ns = now() - start;
+
+	return 0;
+}
+
+/* Fills the disk with small files, deletes
+ * every other one, and then measures creating
+ * and deleting files that fit the holes, and
+ * files that only fit at the end of the disk. */
+
+static int run_frag(struct backend *backend, const struct bench_config *config, void *buf, struct bench_result *result)
+{
+	(void) buf;
+
+	uint64_t mebibytes;
+	int err = bmfs_disk_mebibytes(&backend->disk, &mebibytes);
+	if (err != 0)
+		return err;
+
+	/* the first block holds the directory, and a
+	 * quarter of the disk is left for large files */
+	uint64_t small_files = ((mebibytes / 2) - 1) * 3 / 4;
+	if (small_files > (BMFS_DIR_PAGE_ENTRIES - 8))
+		small_files = BMFS_DIR_PAGE_ENTRIES - 8;
+
+	for (uint64_t i = 0; i < small_files; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "frag-%" PRIu64, i);
+		err = bmfs_disk_create_file(&backend->disk, filename, 2);
+		if (err != 0)
+			return err;
+	}
+
+	for (uint64_t i = 0; i < small_files; i += 2)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "frag-%" PRIu64, i);
+		err = bmfs_disk_delete_file(&backend->disk, filename);
+		if (err != 0)
+			return err;
+	}
+
+	uint64_t state = config->seed;
+
+	uint64_t start = now();
+
+	for (uint64_t i = 0; i < result->ops; i++)
+	{
+		/* mostly files that fit in a hole */
+		uint64_t size = ((next_random(&state) % 4) == 0) ? 4 : 2;
+
+		uint64_t op_start = now();
+
+		err = bmfs_disk_create_file(&backend->disk, "frag-new", size);
+		if (err == 0)
+			err = bmfs_disk_delete_file(&backend->disk, "frag-new");
+
+		if (err != 0)
+			return err;
+
+		result->latencies[i] = now() - op_start;
+	}
+
+	result->total_ns = now() - start;
+
+	return 0;
+}
+
+static const struct workload workloads[] =
+{
+	{ "seq-write", run_seq_write, 1 },
+	{ "seq-read", run_seq_read, 0 },
+	{ "rand-write", run_rand_write, 0 },
+	{ "rand-read", run_rand_read, 0 },
+	{ "aio-read", run_aio_read, 0 },
+	{ "churn", run_churn, 1 },
+	{ "stat", run_stat, 1 },
+	{ "frag", run_frag, 1 }
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static const char *backend_names[] =
+{
+	"file",
+	"fd",
+	"mmap",
+	"direct",
+	"cache"
+};
+
+#define BACKEND_COUNT (sizeof(backend_names) / sizeof(backend_names[0]))
+
+/* results */
+
+static int compare_latencies(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* nearest rank, from the sorted latencies */
+
+static uint64_t percentile(const struct bench_result *result, double p)
+{
+	if (result->ops == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)((p / 100.0) * result->ops + 0.5);
+	if (rank == 0)
+		rank = 1;
+	else if (rank > result->ops)
+		rank = result->ops;
+
+	return result->latencies[rank - 1];
+}
+
+static double ops_per_second(const struct bench_result *result)
+{
+	if (result->total_ns == 0)
+		return 0;
+
+	return result->ops * 1e9 / result->total_ns;
+}
+
+static double mebibytes_per_second(const struct bench_result *result)
+{
+	if (result->total_ns == 0)
+		return 0;
+
+	return (result->bytes / (1024.0 * 1024.0)) * 1e9 / result->total_ns;
+}
+
+static void print_header(const struct bench_config *config)
+{
+	if (config->json)
+	{
+		printf("{\n");
+		printf("  \"config\": {\n");
+		printf("    \"disk_size\": %" PRIu64 ",\n", config->disk_size);
+		printf("    \"file_size\": %" PRIu64 ",\n", config->file_size);
+		printf("    \"io_size\": %" PRIu64 ",\n", config->io_size);
+		printf("    \"ops\": %" PRIu64 ",\n", config->ops);
+		printf("    \"seed\": %" PRIu64 ",\n", config->seed);
+		printf("    \"queue_depth\": %u\n", config->queue_depth);
+		printf("  },\n");
+		printf("  \"results\": [");
+		return;
+	}
+
+	printf("disk size %" PRIu64 " B, file size %" PRIu64 " B, io size %" PRIu64 " B, %" PRIu64 " ops, seed %" PRIu64 ", queue depth %u\n",
+	       config->disk_size, config->file_size, config->io_size, config->ops, config->seed, config->queue_depth);
+	printf("\n");
+	printf("%-8s %-10s %10s %12s %10s %10s %10s %10s %10s %10s\n",
+	       "backend", "workload", "ops", "ops/s", "MiB/s",
+	       "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+}
+
+static void print_result(const struct bench_config *config,
+                         const char *backend,
+                         const char *workload,
+                         const struct bench_result *result,
+                         int err,
+                         int first)
+{
+	if (config->json)
+	{
+		printf("%s\n    {", first ? "" : ",");
+		printf("\"backend\": \"%s\", \"workload\": \"%s\", ", backend, workload);
+		if (err != 0)
+		{
+			printf("\"error\": \"%s\"}", strerror(-err));
+			return;
+		}
+		printf("\"ops\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"total_ns\": %" PRIu64 ", ",
+		       result->ops, result->bytes, result->total_ns);
+		printf("\"ops_per_sec\": %.1f, \"mib_per_sec\": %.2f, ",
+		       ops_per_second(result), mebibytes_per_second(result));
+		printf("\"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}",
+		       percentile(result, 50), percentile(result, 90), percentile(result, 99),
+		       percentile(result, 99.9), percentile(result, 100));
+		return;
+	}
+
+	if (err != 0)
+	{
+		printf("%-8s %-10s %s\n", backend, workload, strerror(-err));
+		return;
+	}
+
+	printf("%-8s %-10s %10" PRIu64 " %12.0f ", backend, workload, result->ops, ops_per_second(result));
+	if (result->bytes > 0)
+		printf("%10.1f ", mebibytes_per_second(result));
+	else
+		printf("%10s ", "-");
+	printf("%10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+	       percentile(result, 50), percentile(result, 90), percentile(result, 99),
+	       percentile(result, 99.9), percentile(result, 100));
+}
+
+static void print_footer(const struct bench_config *config)
+{
+	if (config->json)
+		printf("\n  ]\n}\n");
+}
+
+/* Creates the disk image, sparse, and
+ * formats it through a file descriptor. */
+
+static int create_disk(const struct bench_config *config)
+{
+	int fd = open(config->disk_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	int err = 0;
+	if (ftruncate(fd, config->disk_size) != 0)
+		err = -errno;
+
+	struct BMFSDisk disk;
+	if (err == 0)
+		err = bmfs_disk_init_fd(&disk, fd);
+
+	if (err == 0)
+		err = bmfs_disk_format(&disk);
+
+	close(fd);
+
+	return err;
+}
+
+static int run_workload(const struct bench_config *config,
+                        const char *backend_name,
+                        const struct workload *workload,
+                        void *buf,
+                        struct bench_result *result)
+{
+	int err = 0;
+	if (workload->format)
+		err = create_disk(config);
+
+	if (err != 0)
+		return err;
+
+	struct backend backend;
+	err = backend_open(&backend, backend_name, config->disk_path);
+	if (err != 0)
+	{
+		/* only the parts that were
+		 * opened are released */
+		if (backend.fd >= 0)
+			close(backend.fd);
+		free(backend.cache_memory);
+		return err;
+	}
+
+	result->ops = config->ops;
+	result->bytes = 0;
+	result->total_ns = 0;
+
+	err = workload->run(&backend, config, buf, result);
+	if (err == 0)
+		err = backend_flush(&backend);
+
+	backend_close(&backend);
+
+	if (err != 0)
+		return err;
+
+	qsort(result->latencies, result->ops, sizeof(uint64_t), compare_latencies);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct option opts[] =
+	{
+		{ "backend", required_argument, NULL, 'b' },
+		{ "disk", required_argument, NULL, 'd' },
+		{ "disk-size", required_argument, NULL, 's' },
+		{ "file-size", required_argument, NULL, 'f' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "io-size", required_argument, NULL, 'i' },
+		{ "json", no_argument, NULL, 'j' },
+		{ "ops", required_argument, NULL, 'n' },
+		{ "queue-depth", required_argument, NULL, 'q' },
+		{ "seed", required_argument, NULL, 'r' },
+		{ "version", no_argument, NULL, 'v' },
+		{ "workload", required_argument, NULL, 'w' },
+		{ 0, 0, 0, 0 }
+	};
+
+	struct bench_config config;
+	config.disk_path = "bmfs-bench.image";
+	config.disk_size = 256ULL * 1024ULL * 1024ULL;
+	config.file_size = 64ULL * 1024ULL * 1024ULL;
+	config.io_size = 4096;
+	config.ops = 10000;
+	config.seed = 1;
+	config.queue_depth = 32;
+	config.json = 0;
+
+	const char *backend_name = "all";
+
+	int selected[WORKLOAD_COUNT];
+	int selected_any = 0;
+	memset(selected, 0, sizeof(selected));
+
+	while (1)
+	{
+		int c = getopt_long(argc, argv, "b:d:s:f:i:n:q:r:w:hjv", opts, NULL);
+		if (c == 'b')
+			backend_name = optarg;
+		else if (c == 'd')
+			config.disk_path = optarg;
+		else if ((c == 's')
+		      || (c == 'f')
+		      || (c == 'i'))
+		{
+			uint64_t size = 0;
+			if ((parse_size(optarg, &size) != 0)
+			 || (size == 0))
+			{
+				fprintf(stderr, "%s: invalid size '%s'\n", argv[0], optarg);
+				return EXIT_FAILURE;
+			}
+
+			if (c == 's')
+				config.disk_size = size;
+			else if (c == 'f')
+				config.file_size = size;
+			else
+				config.io_size = size;
+		}
+		else if (c == 'n')
+			config.ops = strtoull(optarg, NULL, 10);
+		else if (c == 'q')
+		{
+			unsigned long depth = strtoul(optarg, NULL, 10);
+			if ((depth == 0)
+			 || (depth > BMFS_AIO_DEPTH_MAX))
+			{
+				fprintf(stderr, "%s: invalid queue depth '%s'\n", argv[0], optarg);
+				return EXIT_FAILURE;
+			}
+			config.queue_depth = depth;
+		}
+		else if (c == 'r')
+			config.seed = strtoull(optarg, NULL, 10);
+		else if (c == 'j')
+			config.json = 1;
+		else if (c == 'w')
+		{
+			size_t i;
+			for (i = 0; i < WORKLOAD_COUNT; i++)
+			{
+				if (strcmp(optarg, workloads[i].name) == 0)
+					break;
+			}
+
+			if (i == WORKLOAD_COUNT)
+			{
+				fprintf(stderr, "%s: unknown workload '%s'\n", argv[0], optarg);
+				return EXIT_FAILURE;
+			}
+
+			selected[i] = 1;
+			selected_any = 1;
+		}
+		else if (c == 'h')
+		{
+			help(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if (c == 'v')
+		{
+			version();
+			return EXIT_FAILURE;
+		}
+		else if (c == -1)
+			/* end of options */
+			break;
+		else if (c == ':')
+			/* invalid option */
+			return EXIT_FAILURE;
+		else if (c == '?')
+			/* missing option argument */
+			return EXIT_FAILURE;
+	}
+
+	if (!selected_any)
+	{
+		for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+			selected[i] = 1;
+	}
+
+	if (strcmp(backend_name, "all") != 0)
+	{
+		size_t i;
+		for (i = 0; i < BACKEND_COUNT; i++)
+		{
+			if (strcmp(backend_name, backend_names[i]) == 0)
+				break;
+		}
+
+		if (i == BACKEND_COUNT)
+		{
+			fprintf(stderr, "%s: unknown backend '%s'\n", argv[0], backend_name);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* the seed of xorshift must not be zero */
+	if (config.seed == 0)
+		config.seed = 1;
+
+	if ((config.ops == 0)
+	 || (config.file_size < config.io_size)
+	 || ((config.file_size + (4 * 1024 * 1024)) > config.disk_size))
+	{
+		fprintf(stderr, "%s: the file must fit on the disk, and hold at least one read\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* aligned, so that the direct
+	 * backend doesn't need to copy it */
+	void *buf = NULL;
+	if (posix_memalign(&buf, BMFS_DIRECT_ALIGNMENT, config.io_size) != 0)
+	{
+		fprintf(stderr, "%s: failed to allocate buffer\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	memset(buf, 0x5a, config.io_size);
+
+	struct bench_result result;
+	result.latencies = malloc(config.ops * sizeof(uint64_t));
+	if (result.latencies == NULL)
+	{
+		fprintf(stderr, "%s: failed to allocate latency buffer\n", argv[0]);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	int retval = EXIT_SUCCESS;
+	int first = 1;
+
+	print_header(&config);
+
+	for (size_t b = 0; b < BACKEND_COUNT; b++)
+	{
+		if ((strcmp(backend_name, "all") != 0)
+		 && (strcmp(backend_name, backend_names[b]) != 0))
+			continue;
+
+		/* the read and random workloads use
+		 * the disk left by the previous one */
+		int disk_ready = 0;
+
+		for (size_t w = 0; w < WORKLOAD_COUNT; w++)
+		{
+			if (!selected[w])
+				continue;
+
+			struct workload workload = workloads[w];
+			if (!disk_ready)
+				workload.format = 1;
+
+			int err = run_workload(&config, backend_names[b], &workload, buf, &result);
+
+			disk_ready = (err == 0);
+
+			print_result(&config, backend_names[b], workload.name, &result, err, first);
+			first = 0;
+
+			/* direct I/O isn't supported by every file
+			 * system, which doesn't fail the whole run */
+			if ((err != 0)
+			 && !((err == -EINVAL) && (strcmp(backend_names[b], "direct") == 0)))
+				retval = EXIT_FAILURE;
+		}
+	}
+
+	print_footer(&config);
+
+	unlink(config.disk_path);
+
+	free(result.latencies);
+	free(buf);
+
+	return retval;
+}
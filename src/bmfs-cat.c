@@ -6,6 +6,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 static void help(const char *argv0)
 {
 	printf("usage: %s [options]\n", argv0);
@@ -17,6 +20,7 @@ static void help(const char *argv0)
 	printf("option.\n");
 	printf("\n");
 	printf("options:\n");
+	printf("  --buffer-size, -b : the size of the copy buffer, in bytes (default: %llu)\n", BMFS_BLOCK_SIZE);
 	printf("  --disk,        -d : specify disk image to use\n");
 	printf("  --help,        -h : display this help message\n");
 	printf("  --output-file, -o : pipe contents into this file ('-' means stdout)\n");
@@ -31,7 +35,12 @@ static void version(void)
 	printf("%s\n", BMFS_VERSION_STRING);
 }
 
-static int cat_file(struct BMFSDisk *disk, const char *filename, FILE *output_file)
+/* The data is copied straight from the disk
+ * image to the output file, so that it doesn't
+ * have to go through user space when the output
+ * is a file or a pipe. */
+
+static int cat_file(struct BMFSDisk *disk, int disk_fd, const char *filename, int output_fd, uint64_t buffer_size)
 {
 	struct BMFSEntry entry;
 
@@ -44,24 +53,13 @@ static int cat_file(struct BMFSDisk *disk, const char *filename, FILE *output_fi
 	if (err != 0)
 		return err;
 
-	err = bmfs_disk_seek(disk, entry_offset, SEEK_SET);
+	uint64_t copied = 0;
+	err = bmfs_copy_fd(disk_fd, entry_offset, output_fd, -1, entry.FileSize, buffer_size, &copied);
 	if (err != 0)
 		return err;
-
-	char buf[32];
-
-	uint64_t i = 0;
-	while (i < entry.FileSize)
-	{
-		uint64_t read_count = 0;
-		err = bmfs_disk_read(disk, buf, sizeof(buf), &read_count);
-		if (err != 0)
-			return err;
-
-		fwrite(buf, read_count, 1, output_file);
-
-		i += read_count;
-	}
+	else if (copied < entry.FileSize)
+		/* the disk image is truncated */
+		return -EIO;
 
 	return 0;
 }
@@ -72,19 +70,32 @@ int main(int argc, char **argv)
 
 	struct option opts[] =
 	{
+		{ "buffer-size", required_argument, NULL, 'b' },
 		{ "disk", required_argument, NULL, 'd' },
 		{ "help", no_argument, NULL, 'h' },
-		{ "output-file", required_argument, NULL, 'f' },
+		{ "output-file", required_argument, NULL, 'o' },
 		{ "version", no_argument, NULL, 'v' },
 		{ 0, 0, 0, 0 }
 	};
 
 	const char *diskname = NULL;
 
+	uint64_t buffer_size = BMFS_BLOCK_SIZE;
+
 	while (1)
 	{
-		int c = getopt_long(argc, argv, "d:n:r:o:hv", opts, NULL);
-		if (c == 'd')
+		int c = getopt_long(argc, argv, "b:d:n:r:o:hv", opts, NULL);
+		if (c == 'b')
+		{
+			buffer_size = strtoull(optarg, NULL, 10);
+			if ((buffer_size == 0)
+			 || (buffer_size > BMFS_BLOCK_SIZE))
+			{
+				fprintf(stderr, "%s: buffer size must be between 1 and %llu bytes\n", argv[0], BMFS_BLOCK_SIZE);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (c == 'd')
 			diskname = optarg;
 		else if (c == 'h')
 		{
@@ -122,57 +133,56 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	FILE *diskfile;
-	diskfile = fopen(diskname, "r+b");
-	if (diskfile == NULL)
+	int disk_fd = open(diskname, O_RDONLY);
+	if (disk_fd < 0)
 	{
 		fprintf(stderr, "%s: failed to open '%s': %s\n", argv[0], diskname, strerror(errno));
 		return EXIT_FAILURE;
 	}
 
 	struct BMFSDisk disk;
-	int err = bmfs_disk_init_file(&disk, diskfile);
+	int err = bmfs_disk_init_fd(&disk, disk_fd);
 	if (err != 0)
 	{
 		fprintf(stderr, "%s: failed to initialize disk structure: %s\n", argv[0], strerror(-err));
-		fclose(diskfile);
+		close(disk_fd);
 		return EXIT_FAILURE;
 	}
 
 	if (output_filename == NULL)
 		output_filename = "-";
 
-	FILE *output_file = stdout;
+	int output_fd = STDOUT_FILENO;
 
 	if (strcmp(output_filename, "-") != 0)
 	{
-		output_file = fopen(output_filename, "wb");
-		if (output_file == NULL)
+		output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (output_fd < 0)
 		{
 			fprintf(stderr, "%s: failed to open '%s': %s\n", argv[0], output_filename, strerror(errno));
-			fclose(diskfile);
+			close(disk_fd);
 			return EXIT_FAILURE;
 		}
 	}
 
 	while (optind < argc)
 	{
-		err = cat_file(&disk, argv[optind], output_file);
+		err = cat_file(&disk, disk_fd, argv[optind], output_fd, buffer_size);
 		if (err != 0)
 		{
 			fprintf(stderr, "%s: failed to cat '%s': %s\n", argv[0], argv[optind], strerror(-err));
-			if (output_file != stdout)
-				fclose(output_file);
-			fclose(diskfile);
+			if (output_fd != STDOUT_FILENO)
+				close(output_fd);
+			close(disk_fd);
 			return EXIT_FAILURE;
 		}
 		optind++;
 	}
 
-	if (output_file != stdout)
-		fclose(output_file);
+	if (output_fd != STDOUT_FILENO)
+		close(output_fd);
 
-	fclose(diskfile);
+	close(disk_fd);
 
 	return EXIT_SUCCESS;
 }
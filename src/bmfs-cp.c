@@ -7,6 +7,19 @@
 #include <string.h>
 #include <signal.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** The number of buffers between the
+ * reader and the writer thread. */
+#define PIPELINE_DEPTH 2
+
+/** The alignment of the buffers, so that
+ * they may also be used with O_DIRECT. */
+#define PIPELINE_ALIGNMENT 4096
+
 static volatile int keep_reading = 1;
 
 void handle_interrupt(int sig)
@@ -43,7 +56,409 @@ static const char * basename_(const char *src)
 	return &src[src_pos];
 }
 
-static int copy_file(struct BMFSDisk *disk, const char *src, const char *dst, uint64_t reserved_mebibytes)
+/* Serializes changes to the directory, since
+ * files may be resized by several workers. */
+
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the number of mebibytes to reserve
+ * for a number of bytes, at least one block. */
+
+static uint64_t mebibytes_for(uint64_t bytes)
+{
+	uint64_t mebibytes = (bytes + (1024 * 1024) - 1) / (1024 * 1024);
+	if (mebibytes < (BMFS_BLOCK_SIZE / (1024 * 1024)))
+		mebibytes = BMFS_BLOCK_SIZE / (1024 * 1024);
+	return mebibytes;
+}
+
+/* Returns the number of mebibytes to reserve
+ * for a new file. Regular files get as much as
+ * they need. Other sources start with the given
+ * reservation and grow as they are copied. */
+
+static uint64_t reservation_for(const char *src, uint64_t reserved_mebibytes)
+{
+	struct stat src_stat;
+	if ((strcmp(src, "-") == 0)
+	 || (stat(src, &src_stat) != 0)
+	 || !S_ISREG(src_stat.st_mode))
+		return reserved_mebibytes;
+
+	uint64_t mebibytes = mebibytes_for(src_stat.st_size);
+	if (mebibytes < reserved_mebibytes)
+		mebibytes = reserved_mebibytes;
+
+	return mebibytes;
+}
+
+/* Resizes the space reserved for a file and
+ * updates the copy of its entry. The first
+ * data_size bytes are kept if it's moved. */
+
+static int resize_reservation(struct BMFSDisk *disk,
+                              const char *dst,
+                              struct BMFSEntry *entry,
+                              uint64_t mebibytes,
+                              uint64_t data_size)
+{
+	char *buf = NULL;
+	if (data_size > 0)
+	{
+		buf = malloc(BMFS_BLOCK_SIZE);
+		if (buf == NULL)
+			return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	int err = bmfs_disk_resize_file(disk, dst, mebibytes, data_size, buf, BMFS_BLOCK_SIZE);
+	if (err == 0)
+		err = bmfs_disk_find_file(disk, dst, entry, NULL);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	free(buf);
+
+	return err;
+}
+
+/* Grows the reservation of a file that is
+ * being streamed. It grows in place by just
+ * what is needed when the next blocks are free.
+ * Otherwise, the file has to be moved, and the
+ * reservation is doubled so that it's moved as
+ * few times as possible. */
+
+static int grow_reservation(struct BMFSDisk *disk,
+                            const char *dst,
+                            struct BMFSEntry *entry,
+                            uint64_t data_size,
+                            uint64_t needed)
+{
+	uint64_t needed_mebibytes = mebibytes_for(needed);
+	if (needed_mebibytes % 2 != 0)
+		needed_mebibytes++;
+
+	uint64_t doubled_mebibytes = entry->ReservedBlocks * 4;
+
+	pthread_mutex_lock(&dir_lock);
+
+	int in_place = (disk->extents != NULL)
+	            && bmfs_extent_map_is_free(disk->extents,
+	                                       entry->StartingBlock + entry->ReservedBlocks,
+	                                       (needed_mebibytes / 2) - entry->ReservedBlocks);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	if (in_place
+	 || (doubled_mebibytes < needed_mebibytes))
+		return resize_reservation(disk, dst, entry, needed_mebibytes, data_size);
+
+	int err = resize_reservation(disk, dst, entry, doubled_mebibytes, data_size);
+	if (err == -ENOSPC)
+		err = resize_reservation(disk, dst, entry, needed_mebibytes, data_size);
+
+	return err;
+}
+
+/* When the source isn't a regular file, it is
+ * read by one thread while the data read before
+ * is written to the disk by another. The space
+ * reserved for the file grows as needed, and is
+ * trimmed once the size of the file is known. */
+
+struct pipeline_buffer
+{
+	char *data;
+	uint64_t len;
+};
+
+struct pipeline
+{
+	pthread_mutex_t lock;
+	/* signaled when a buffer is filled */
+	pthread_cond_t filled_cond;
+	/* signaled when a buffer is written */
+	pthread_cond_t emptied_cond;
+	struct pipeline_buffer buffers[PIPELINE_DEPTH];
+	uint64_t buffer_size;
+	/* the number of buffers waiting
+	 * to be written */
+	unsigned int filled;
+	int src_fd;
+	/* set by the reader when it's done */
+	int done;
+	/* set by the writer when it fails */
+	int stopped;
+	int err;
+};
+
+/* Reads until the buffer is full or the end
+ * of the source is reached, since pipes often
+ * return less than what was asked for. */
+
+static int fill_buffer(int fd, struct pipeline_buffer *buffer, uint64_t buffer_size, int *eof)
+{
+	buffer->len = 0;
+
+	while (buffer->len < buffer_size)
+	{
+		if (!keep_reading)
+		{
+			*eof = 1;
+			break;
+		}
+
+		ssize_t result = read(fd, buffer->data + buffer->len, buffer_size - buffer->len);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		else if (result == 0)
+		{
+			*eof = 1;
+			break;
+		}
+
+		buffer->len += result;
+	}
+
+	return 0;
+}
+
+static void *reader_main(void *pipeline_ptr)
+{
+	struct pipeline *pipeline = (struct pipeline *)(pipeline_ptr);
+
+	unsigned int index = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pipeline->lock);
+
+		while ((pipeline->filled == PIPELINE_DEPTH)
+		    && !pipeline->stopped)
+			pthread_cond_wait(&pipeline->emptied_cond, &pipeline->lock);
+
+		int stopped = pipeline->stopped;
+
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if (stopped)
+			break;
+
+		struct pipeline_buffer *buffer = &pipeline->buffers[index];
+
+		int eof = 0;
+		int err = fill_buffer(pipeline->src_fd, buffer, pipeline->buffer_size, &eof);
+
+		pthread_mutex_lock(&pipeline->lock);
+
+		if (err != 0)
+			pipeline->err = err;
+		else if (buffer->len > 0)
+			pipeline->filled++;
+
+		if ((err != 0) || eof)
+			pipeline->done = 1;
+
+		pthread_cond_signal(&pipeline->filled_cond);
+
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if ((err != 0) || eof)
+			break;
+
+		index = (index + 1) % PIPELINE_DEPTH;
+	}
+
+	return NULL;
+}
+
+static int copy_pipeline(struct BMFSDisk *disk,
+                         int src_fd,
+                         const char *dst,
+                         struct BMFSEntry *entry,
+                         uint64_t buffer_size,
+                         uint64_t *size)
+{
+	uint64_t offset;
+	int err = bmfs_entry_get_offset(entry, &offset);
+	if (err != 0)
+		return err;
+
+	uint64_t max_size = entry->ReservedBlocks * BMFS_BLOCK_SIZE;
+	int grown = 0;
+
+	struct pipeline pipeline;
+	pipeline.buffer_size = buffer_size;
+	pipeline.filled = 0;
+	pipeline.src_fd = src_fd;
+	pipeline.done = 0;
+	pipeline.stopped = 0;
+	pipeline.err = 0;
+
+	for (unsigned int i = 0; i < PIPELINE_DEPTH; i++)
+	{
+		pipeline.buffers[i].len = 0;
+		if (posix_memalign((void **) &pipeline.buffers[i].data, PIPELINE_ALIGNMENT, buffer_size) != 0)
+		{
+			while (i > 0)
+				free(pipeline.buffers[--i].data);
+			return -ENOMEM;
+		}
+	}
+
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.filled_cond, NULL);
+	pthread_cond_init(&pipeline.emptied_cond, NULL);
+
+	pthread_t reader;
+	int reader_started = 0;
+	if (pthread_create(&reader, NULL, reader_main, &pipeline) != 0)
+		err = -EAGAIN;
+	else
+		reader_started = 1;
+
+	uint64_t total = 0;
+	unsigned int index = 0;
+
+	while (err == 0)
+	{
+		pthread_mutex_lock(&pipeline.lock);
+
+		while ((pipeline.filled == 0)
+		    && !pipeline.done)
+			pthread_cond_wait(&pipeline.filled_cond, &pipeline.lock);
+
+		unsigned int filled = pipeline.filled;
+
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (filled == 0)
+			/* the reader is done */
+			break;
+
+		struct pipeline_buffer *buffer = &pipeline.buffers[index];
+
+		if ((total + buffer->len) > max_size)
+		{
+			err = grow_reservation(disk, dst, entry, total, total + buffer->len);
+			if (err == 0)
+				err = bmfs_entry_get_offset(entry, &offset);
+
+			max_size = entry->ReservedBlocks * BMFS_BLOCK_SIZE;
+			grown = 1;
+		}
+
+		if (err == 0)
+			err = bmfs_disk_pwrite(disk, buffer->data, buffer->len, offset + total, NULL);
+
+		if (err != 0)
+			break;
+
+		total += buffer->len;
+
+		pthread_mutex_lock(&pipeline.lock);
+		pipeline.filled--;
+		pthread_cond_signal(&pipeline.emptied_cond);
+		pthread_mutex_unlock(&pipeline.lock);
+
+		index = (index + 1) % PIPELINE_DEPTH;
+	}
+
+	if (reader_started)
+	{
+		/* let the reader exit, if
+		 * this thread failed */
+		pthread_mutex_lock(&pipeline.lock);
+		pipeline.stopped = 1;
+		pthread_cond_signal(&pipeline.emptied_cond);
+		pthread_mutex_unlock(&pipeline.lock);
+
+		pthread_join(reader, NULL);
+
+		if (err == 0)
+			err = pipeline.err;
+	}
+
+	pthread_cond_destroy(&pipeline.emptied_cond);
+	pthread_cond_destroy(&pipeline.filled_cond);
+	pthread_mutex_destroy(&pipeline.lock);
+
+	for (unsigned int i = 0; i < PIPELINE_DEPTH; i++)
+		free(pipeline.buffers[i].data);
+
+	/* the last growth may have
+	 * reserved more than needed */
+	if ((err == 0)
+	 && grown
+	 && (mebibytes_for(total) < (entry->ReservedBlocks * 2)))
+		err = resize_reservation(disk, dst, entry, mebibytes_for(total), 0);
+
+	*size = total;
+
+	return err;
+}
+
+/* Copies the contents of the source into the
+ * space reserved for the entry. The file size
+ * is not written to the directory. */
+
+static int copy_contents(struct BMFSDisk *disk,
+                         int disk_fd,
+                         const char *src,
+                         const char *dst,
+                         struct BMFSEntry *entry,
+                         uint64_t buffer_size,
+                         uint64_t *size)
+{
+	int err = 0;
+
+	int src_fd = STDIN_FILENO;
+	if (strcmp(src, "-") != 0)
+	{
+		src_fd = open(src, O_RDONLY);
+		if (src_fd < 0)
+			return -errno;
+	}
+
+	struct stat src_stat;
+	if (fstat(src_fd, &src_stat) != 0)
+		err = -errno;
+	else if (S_ISREG(src_stat.st_mode))
+	{
+		/* the size is known up front, so the
+		 * space is reserved before copying and
+		 * the kernel can copy the whole file */
+		if (((uint64_t) src_stat.st_size) > (entry->ReservedBlocks * BMFS_BLOCK_SIZE))
+			err = resize_reservation(disk, dst, entry, mebibytes_for(src_stat.st_size), 0);
+
+		uint64_t entry_offset = 0;
+		if (err == 0)
+			err = bmfs_entry_get_offset(entry, &entry_offset);
+
+		if (err == 0)
+			err = bmfs_copy_fd(src_fd, 0, disk_fd, entry_offset, src_stat.st_size, buffer_size, size);
+	}
+	else
+		err = copy_pipeline(disk, src_fd, dst, entry, buffer_size, size);
+
+	if (src_fd != STDIN_FILENO)
+		close(src_fd);
+
+	return err;
+}
+
+static int copy_file(struct BMFSDisk *disk,
+                     int disk_fd,
+                     const char *src,
+                     const char *dst,
+                     uint64_t reserved_mebibytes,
+                     uint64_t buffer_size)
 {
 	if (src == NULL)
 		src = "-";
@@ -64,114 +479,290 @@ static int copy_file(struct BMFSDisk *disk, const char *src, const char *dst, ui
 			return -EISDIR;
 	}
 
-	struct BMFSDir dir;
-	int err = bmfs_disk_read_dir(disk, &dir);
-	if (err != 0)
-		return err;
-
-	struct BMFSEntry *entry;
-	entry = bmfs_dir_find(&dir, dst);
-	if (entry == NULL)
+	struct BMFSEntry entry;
+	int number;
+	int err = bmfs_disk_find_file(disk, dst, &entry, &number);
+	if (err == -ENOENT)
 	{
-		err = bmfs_disk_create_file(disk, dst, reserved_mebibytes);
-		if (err != 0)
-			return err;
-
-		/* if a file was added to the
-		 * root directory, we'll have
-		 * to read the directory again
-		 * to get the file's starting
-		 * point. */
-
-		err = bmfs_disk_read_dir(disk, &dir);
+		err = bmfs_disk_create_file(disk, dst, reservation_for(src, reserved_mebibytes));
 		if (err != 0)
 			return err;
 
-		entry = bmfs_dir_find(&dir, dst);
-		if (entry == NULL)
-			/* for some reason, the
-			 * file creation failed
-			 * and the entry doesn't
-			 * exist. */
-			return -ENOENT;
+		/* the entry of the new file
+		 * has the starting point */
+		err = bmfs_disk_find_file(disk, dst, &entry, &number);
 	}
 
-	uint64_t entry_offset;
-	err = bmfs_entry_get_offset(entry, &entry_offset);
 	if (err != 0)
 		return err;
 
-	err = bmfs_disk_seek(disk, entry_offset, SEEK_SET);
+	uint64_t size = 0;
+	err = copy_contents(disk, disk_fd, src, dst, &entry, buffer_size, &size);
 	if (err != 0)
 		return err;
 
-	FILE *srcfile = stdin;
-	if (strcmp(src, "-") != 0)
+	/* only the entry of the file
+	 * has to be written */
+	err = bmfs_disk_set_file_size(disk, number, size);
+	if (err != 0)
+		return err;
+
+	return 0;
+}
+
+/* When several files are copied, they are all
+ * created first, with one write of the directory.
+ * Their contents are then copied by a number of
+ * worker threads, each writing to the disjoint
+ * space reserved for its files. */
+
+struct copy_job
+{
+	const char *src;
+	const char *dst;
+	struct BMFSEntry entry;
+	uint64_t size;
+	int err;
+};
+
+struct copy_jobs
+{
+	struct BMFSDisk *disk;
+	int disk_fd;
+	uint64_t buffer_size;
+	struct copy_job *jobs;
+	uint64_t count;
+	/* the next job to take, shared
+	 * by all the worker threads */
+	uint64_t next;
+};
+
+static void *worker_main(void *jobs_ptr)
+{
+	struct copy_jobs *jobs = (struct copy_jobs *)(jobs_ptr);
+
+	for (;;)
 	{
-		srcfile = fopen(src, "rb");
-		if (srcfile == NULL)
-			return -errno;
+		uint64_t i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+		if (i >= jobs->count)
+			break;
+
+		struct copy_job *job = &jobs->jobs[i];
+
+		job->err = copy_contents(jobs->disk,
+		                         jobs->disk_fd,
+		                         job->src,
+		                         job->dst,
+		                         &job->entry,
+		                         jobs->buffer_size,
+		                         &job->size);
 	}
 
-	uint64_t entry_size = entry->ReservedBlocks * BMFS_BLOCK_SIZE;
-	uint64_t i = 0;
+	return NULL;
+}
 
-	char buf[32];
-	size_t buf_size = sizeof(buf);
+static int copy_files(struct BMFSDisk *disk,
+                      int disk_fd,
+                      const char *argv0,
+                      char **srcs,
+                      uint64_t count,
+                      uint64_t reserved_mebibytes,
+                      uint64_t buffer_size,
+                      unsigned int thread_count)
+{
+	struct copy_job *jobs = calloc(count, sizeof(*jobs));
+	const char **new_files = calloc(count, sizeof(*new_files));
+	uint64_t *new_mebibytes = calloc(count, sizeof(*new_mebibytes));
+	if ((jobs == NULL)
+	 || (new_files == NULL)
+	 || (new_mebibytes == NULL))
+	{
+		free(jobs);
+		free(new_files);
+		free(new_mebibytes);
+		return -ENOMEM;
+	}
 
-	if (srcfile == stdin)
-		/* only rely on reading one
-		 * byte at a time if using
-		 * standard input */
-		buf_size = 1;
+	int err = 0;
+	uint64_t new_count = 0;
 
-	while (!feof(srcfile) && keep_reading)
+	/* every source is checked, and opened,
+	 * before anything is created or copied */
+	for (uint64_t i = 0; (i < count) && (err == 0); i++)
 	{
-		size_t read_count = fread(buf, 1, buf_size, srcfile);
-		if ((i + read_count) > entry_size)
+		jobs[i].src = srcs[i];
+		jobs[i].dst = basename_(srcs[i]);
+		if ((jobs[i].dst == NULL)
+		 || (strcmp(srcs[i], "-") == 0))
+			/* a name is needed for
+			 * each destination */
+			err = -EINVAL;
+		else if (jobs[i].dst[0] == 0)
+			err = -EISDIR;
+
+		if (err != 0)
 		{
-			/* not enough blocks reserved for file */
-			if (srcfile != stdin)
-				fclose(srcfile);
-			return -ENOSPC;
+			fprintf(stderr, "%s: invalid source '%s'\n", argv0, srcs[i]);
+			break;
+		}
+
+		/* two sources with the same basename
+		 * would be copied to the same file */
+		for (uint64_t j = 0; j < i; j++)
+		{
+			if (strcmp(jobs[j].dst, jobs[i].dst) == 0)
+			{
+				fprintf(stderr, "%s: '%s' and '%s' have the same destination '%s'\n", argv0, srcs[j], srcs[i], jobs[i].dst);
+				err = -EEXIST;
+				break;
+			}
 		}
 
-		err = bmfs_disk_write(disk, buf, read_count, NULL);
+		if (err != 0)
+			break;
+
+		/* a source that can't be read would
+		 * leave an empty file behind */
+		struct stat src_stat;
+		int src_fd = open(srcs[i], O_RDONLY);
+		if (src_fd < 0)
+			err = -errno;
+		else if (fstat(src_fd, &src_stat) != 0)
+			err = -errno;
+		else if (S_ISDIR(src_stat.st_mode))
+			err = -EISDIR;
+
+		if (src_fd >= 0)
+			close(src_fd);
+
 		if (err != 0)
 		{
-			if (srcfile != stdin)
-				fclose(srcfile);
-			return err;
+			fprintf(stderr, "%s: failed to open '%s': %s\n", argv0, srcs[i], strerror(-err));
+			break;
 		}
 
-		i += read_count;
+		if (bmfs_disk_find_file(disk, jobs[i].dst, NULL, NULL) == -ENOENT)
+		{
+			new_files[new_count] = jobs[i].dst;
+			new_mebibytes[new_count] = reservation_for(srcs[i], reserved_mebibytes);
+			new_count++;
+		}
 	}
 
-	if (srcfile != stdin)
-		fclose(srcfile);
+	if ((err == 0)
+	 && (new_count > 0))
+	{
+		err = bmfs_disk_create_files(disk, new_files, new_mebibytes, new_count);
+		if (err != 0)
+			fprintf(stderr, "%s: failed to create files: %s\n", argv0, strerror(-err));
+	}
 
-	entry->FileSize = i;
+	for (uint64_t i = 0; (i < count) && (err == 0); i++)
+		err = bmfs_disk_find_file(disk, jobs[i].dst, &jobs[i].entry, NULL);
+
+	free(new_files);
+	free(new_mebibytes);
 
-	err = bmfs_disk_write_dir(disk, &dir);
 	if (err != 0)
+	{
+		free(jobs);
 		return err;
+	}
 
-	return 0;
+	struct copy_jobs shared;
+	shared.disk = disk;
+	shared.disk_fd = disk_fd;
+	shared.buffer_size = buffer_size;
+	shared.jobs = jobs;
+	shared.count = count;
+	shared.next = 0;
+
+	if (thread_count > count)
+		thread_count = count;
+
+	pthread_t *threads = calloc(thread_count, sizeof(*threads));
+	if (threads == NULL)
+	{
+		free(jobs);
+		return -ENOMEM;
+	}
+
+	/* this thread does the work of the
+	 * first worker */
+	unsigned int started = 1;
+	while (started < thread_count)
+	{
+		if (pthread_create(&threads[started], NULL, worker_main, &shared) != 0)
+			break;
+		started++;
+	}
+
+	worker_main(&shared);
+
+	for (unsigned int i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	/* the sizes of all the files are also
+	 * written at once, if the directory is
+	 * cached */
+	err = bmfs_disk_defer_dir(disk);
+	if (err == -EINVAL)
+		err = 0;
+
+	for (uint64_t i = 0; (i < count) && (err == 0); i++)
+	{
+		if (jobs[i].err != 0)
+		{
+			fprintf(stderr, "%s: failed to copy '%s': %s\n", argv0, jobs[i].src, strerror(-jobs[i].err));
+			continue;
+		}
+
+		int number;
+		if (bmfs_disk_find_file(disk, jobs[i].dst, NULL, &number) != 0)
+			continue;
+
+		err = bmfs_disk_set_file_size(disk, number, jobs[i].size);
+	}
+
+	int flush_err = bmfs_disk_flush_dir(disk);
+	if (err == 0)
+		err = flush_err;
+
+	for (uint64_t i = 0; (i < count) && (err == 0); i++)
+	{
+		if (jobs[i].err != 0)
+			err = jobs[i].err;
+	}
+
+	free(jobs);
+
+	return err;
 }
 
 static void help(const char *argv0)
 {
 	printf("usage: %s [options] src [dst]\n", argv0);
+	printf("       %s [options] src1 src2 src3...\n", argv0);
+	printf("       %s [options] --multiple src...\n", argv0);
 	printf("\n");
 	printf("Copies a file from the host system to the BMFS\n");
 	printf("formatted file system. If no destination is given,\n");
 	printf("the destination file will be named using the basename\n");
 	printf("of the source argument.\n");
 	printf("\n");
+	printf("When more than two files are given, or the --multiple\n");
+	printf("option is used, every argument is a source. The files\n");
+	printf("are all created at once and copied in parallel.\n");
+	printf("\n");
 	printf("options:\n");
+	printf("  --buffer-size, -b      : the size of the copy buffers, in bytes (default: %llu)\n", BMFS_BLOCK_SIZE);
 	printf("  --disk, -d             : specify disk image to use\n");
 	printf("  --help, -h             : display this help message\n");
-	printf("  --reserved-storage, -r : the number of bytes to reserve for the file\n");
+	printf("  --jobs, -j             : the number of files to copy at once (default: number of CPUs)\n");
+	printf("  --multiple, -m         : treat every argument as a source\n");
+	printf("  --reserved-storage, -r : the minimum number of bytes to reserve for the file (default: 2MiB)\n");
 	printf("  --version, -v          : display version information\n");
 	printf("\n");
 	printf("environment variables:\n");
@@ -189,8 +780,11 @@ int main(int argc, char **argv)
 
 	struct option opts[] =
 	{
+		{ "buffer-size", required_argument, NULL, 'b' },
 		{ "disk", required_argument, NULL, 'd' },
 		{ "help", no_argument, NULL, 'h' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "multiple", no_argument, NULL, 'm' },
 		{ "reserved-storage", required_argument, NULL, 'r' },
 		{ "version", no_argument, NULL, 'v' },
 		{ 0, 0, 0, 0 }
@@ -206,11 +800,40 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	uint64_t buffer_size = BMFS_BLOCK_SIZE;
+
+	long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (thread_count < 1)
+		thread_count = 1;
+
+	int multiple = 0;
+
 	while (1)
 	{
-		int c = getopt_long(argc, argv, "d:n:r:hv", opts, NULL);
-		if (c == 'd')
+		int c = getopt_long(argc, argv, "b:d:j:mn:r:hv", opts, NULL);
+		if (c == 'b')
+		{
+			buffer_size = strtoull(optarg, NULL, 10);
+			if ((buffer_size == 0)
+			 || ((buffer_size % PIPELINE_ALIGNMENT) != 0))
+			{
+				fprintf(stderr, "%s: buffer size must be a multiple of %d bytes\n", argv[0], PIPELINE_ALIGNMENT);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (c == 'd')
 			diskname = optarg;
+		else if (c == 'j')
+		{
+			thread_count = atol(optarg);
+			if (thread_count < 1)
+			{
+				fprintf(stderr, "%s: invalid number of jobs '%s'\n", argv[0], optarg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (c == 'm')
+			multiple = 1;
 		if (c == 'r')
 		{
 			err = bmfs_sspec_parse(&reserved_storage, optarg);
@@ -256,18 +879,16 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if ((optind + 2) < argc)
+		multiple = 1;
+
 	const char *src = argv[optind];
 
 	const char *dst = NULL;
-	if ((optind + 1) < argc)
+	if (!multiple
+	 && ((optind + 1) < argc))
 		dst = argv[optind + 1];
 
-	if ((optind + 2) < argc)
-	{
-		printf("%s: trailing argument '%s'\n", argv[0], argv[optind]);
-		return EXIT_FAILURE;
-	}
-
 	/* make sure that the reserved storage
 	 * is at least one block size */
 	uint64_t reserved_bytes;
@@ -293,32 +914,67 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	FILE *diskfile;
-	diskfile = fopen(diskname, "r+b");
-	if (diskfile == NULL)
+	int disk_fd = open(diskname, O_RDWR);
+	if (disk_fd < 0)
 	{
 		fprintf(stderr, "%s: failed to open '%s': %s\n", argv[0], diskname, strerror(errno));
 		return EXIT_FAILURE;
 	}
 
 	struct BMFSDisk disk;
-	err = bmfs_disk_init_file(&disk, diskfile);
+	err = bmfs_disk_init_fd(&disk, disk_fd);
 	if (err != 0)
 	{
 		fprintf(stderr, "%s: failed to initialize disk structure: %s\n", argv[0], strerror(-err));
-		fclose(diskfile);
+		close(disk_fd);
 		return EXIT_FAILURE;
 	}
 
-	err = copy_file(&disk, src, dst, reserved_mebibytes);
+	/* the directory is looked up once for
+	 * every file, so it's kept in memory and
+	 * indexed, and the free space is kept in
+	 * memory for reservations to grow */
+	struct BMFSDir *dir = malloc(sizeof(*dir));
+	struct BMFSDirIndex *index = malloc(sizeof(*index));
+	struct BMFSExtentMap *extents = malloc(sizeof(*extents));
+	if ((dir == NULL)
+	 || (index == NULL)
+	 || (extents == NULL))
+		err = -ENOMEM;
+	else
+		err = bmfs_disk_cache_dir(&disk, dir);
+
+	if (err == 0)
+	{
+		bmfs_dir_set_index(dir, index);
+		extents->fit = BMFS_EXTENT_FIRST_FIT;
+		err = bmfs_disk_cache_extents(&disk, extents);
+	}
+
+	if (err != 0)
+		fprintf(stderr, "%s: failed to read directory: %s\n", argv[0], strerror(-err));
+	else if (multiple)
+		err = copy_files(&disk, disk_fd, argv[0], &argv[optind], argc - optind, reserved_mebibytes, buffer_size, thread_count);
+	else
+	{
+		err = copy_file(&disk, disk_fd, src, dst, reserved_mebibytes, buffer_size);
+		if (err != 0)
+			fprintf(stderr, "%s: failed to copy '%s': %s\n", argv[0], src, strerror(-err));
+	}
+
+	bmfs_disk_uncache_extents(&disk);
+	bmfs_disk_uncache_dir(&disk);
+	free(extents);
+	free(index);
+	free(dir);
+
 	if (err != 0)
 	{
-		fprintf(stderr, "%s: failed to copy '%s': %s\n", argv[0], src, strerror(-err));
-		fclose(diskfile);
+		close(disk_fd);
 		return EXIT_FAILURE;
 	}
 
-	fclose(diskfile);
+	close(disk_fd);
 
 	return EXIT_SUCCESS;
 }
@@ -7,11 +7,14 @@
 
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -25,6 +28,103 @@
 
 struct BMFSDisk disk;
 
+/** The root directory, which is
+ * cached by the disk so that lookups
+ * don't have to read it every time.
+ */
+
+struct BMFSDir root_dir;
+
+/** The index of the root directory,
+ * so that names are found without
+ * going through every entry.
+ */
+
+struct BMFSDirIndex root_index;
+
+/** The free space of the disk, which
+ * is kept so that creating a file
+ * doesn't have to sort the directory.
+ */
+
+struct BMFSExtentMap free_extents;
+
+/** Protects the root directory. Since fuse
+ * calls the operations from several threads,
+ * operations that modify the directory hold
+ * this lock for writing and operations that
+ * only look at it hold it for reading. Reads
+ * of open files don't take it at all, unless
+ * the directory changed since the file was
+ * last looked up.
+ */
+
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** The file descriptor of the disk
+ * file, used to synchronize it with
+ * the storage device.
+ */
+
+int disk_fd = -1;
+
+/** An open file. Open files are kept
+ * in a list, so that their sizes can be
+ * written to the directory periodically.
+ */
+
+struct bmfs_fuse_file
+{
+	/** The file handle. */
+	struct BMFSFile file;
+	/** Held whenever the file handle is used
+	 * or modified, after @ref dir_lock, except
+	 * for reads that only take a copy of it. */
+	pthread_mutex_t lock;
+	/** The previous file in the list. */
+	struct bmfs_fuse_file *prev;
+	/** The next file in the list. */
+	struct bmfs_fuse_file *next;
+};
+
+/** The list of open files. It may only
+ * be modified with @ref dir_lock held
+ * for writing, and read with it held
+ * for reading.
+ */
+
+struct bmfs_fuse_file *open_files = NULL;
+
+/** The number of seconds between writes
+ * of the file sizes to the directory. If
+ * this is zero, they are only written when
+ * a file is flushed or released.
+ */
+
+int flush_interval = 5;
+
+/** The thread that writes the file sizes
+ * to the directory every @ref flush_interval
+ * seconds. */
+
+pthread_t flush_thread;
+
+/** Set when @ref flush_thread was started. */
+
+int flush_thread_started = 0;
+
+/** Set when @ref flush_thread should exit. */
+
+int flush_thread_stop = 0;
+
+/** Protects @ref flush_thread_stop. */
+
+pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when @ref flush_thread_stop is set. */
+
+pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+
 /** These are options read from
  * the command line. */
 
@@ -32,6 +132,12 @@ struct bmfs_fuse_options
 {
 	/** The path of the disk file */
 	const char *disk;
+	/** A flag set when the disk should
+	 * be mapped into memory */
+	int mmap;
+	/** The number of seconds between
+	 * writes of file sizes */
+	int flush_interval;
 	/** A flag set when help is requested */
 	int show_help;
 };
@@ -40,21 +146,118 @@ struct bmfs_fuse_options
     { t, offsetof(struct bmfs_fuse_options, p), 1 }
 static const struct fuse_opt option_spec[] = {
 	BMFS_FUSE_OPTION("--disk=%s", disk),
+	BMFS_FUSE_OPTION("--mmap", mmap),
+	BMFS_FUSE_OPTION("--flush-interval=%d", flush_interval),
 	BMFS_FUSE_OPTION("-h", show_help),
 	BMFS_FUSE_OPTION("--help", show_help),
 	FUSE_OPT_END
 };
 
+/** Writes the sizes of all open files
+ * to the directory. The caller must hold
+ * @ref dir_lock for writing.
+ * */
+
+static int sync_open_files(void)
+{
+	int result = 0;
+
+	for (struct bmfs_fuse_file *handle = open_files; handle != NULL; handle = handle->next)
+	{
+		pthread_mutex_lock(&handle->lock);
+		int err = bmfs_file_sync(&handle->file);
+		pthread_mutex_unlock(&handle->lock);
+		if ((err != 0) && (result == 0))
+			result = err;
+	}
+
+	return result;
+}
+
+/** Periodically writes the sizes of
+ * open files to the directory, so that
+ * they are not lost if the program is
+ * killed.
+ * */
+
+static void *flush_thread_main(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&flush_mutex);
+
+	while (!flush_thread_stop)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += flush_interval;
+
+		pthread_cond_timedwait(&flush_cond, &flush_mutex, &deadline);
+		if (flush_thread_stop)
+			break;
+
+		pthread_mutex_unlock(&flush_mutex);
+
+		pthread_rwlock_wrlock(&dir_lock);
+		sync_open_files();
+		pthread_rwlock_unlock(&dir_lock);
+
+		pthread_mutex_lock(&flush_mutex);
+	}
+
+	pthread_mutex_unlock(&flush_mutex);
+
+	return NULL;
+}
+
 /** Called when the fuse connection
- * is initialized. Not currently used.
+ * is initialized. This starts the
+ * thread that writes file sizes,
+ * since fuse may fork before this
+ * is called.
  * */
 
 static void *bmfs_fuse_init(struct fuse_conn_info *conn)
 {
 	(void) conn;
+
+	if (flush_interval > 0)
+	{
+		if (pthread_create(&flush_thread, NULL, flush_thread_main, NULL) == 0)
+			flush_thread_started = 1;
+		else
+			fprintf(stderr, "bmfs-fuse: Failed to start flush thread, sizes are written on release only\n");
+	}
+
 	return NULL;
 }
 
+/** Called when the file system is
+ * unmounted. Stops the flush thread
+ * and writes any remaining sizes.
+ * */
+
+static void bmfs_fuse_destroy(void *private_data)
+{
+	(void) private_data;
+
+	if (flush_thread_started)
+	{
+		pthread_mutex_lock(&flush_mutex);
+		flush_thread_stop = 1;
+		pthread_cond_signal(&flush_cond);
+		pthread_mutex_unlock(&flush_mutex);
+
+		pthread_join(flush_thread, NULL);
+
+		flush_thread_started = 0;
+	}
+
+	pthread_rwlock_wrlock(&dir_lock);
+	sync_open_files();
+	pthread_rwlock_unlock(&dir_lock);
+}
+
 static int bmfs_fuse_access(const char *filename, int mode)
 {
 	(void) mode;
@@ -62,11 +265,17 @@ static int bmfs_fuse_access(const char *filename, int mode)
 	if (strcmp(filename, "/") == 0)
 		return 0;
 
-	if (bmfs_disk_find_file(&disk, filename + 1, NULL, NULL) == 0)
-		return 0;
+	pthread_rwlock_rdlock(&dir_lock);
+
+	int err = bmfs_disk_find_file(&disk, filename + 1, NULL, NULL);
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	if (err != 0)
+		/* file not found */
+		return -ENOENT;
 
-	/* file not found */
-	return -ENOENT;
+	return 0;
 }
 
 /** Gets permissions and size of a
@@ -86,8 +295,27 @@ static int bmfs_fuse_getattr(const char *path, struct stat *stbuf)
 		return 0;
 	}
 
+	pthread_rwlock_rdlock(&dir_lock);
+
 	struct BMFSEntry entry;
-	if (bmfs_disk_find_file(&disk, path + 1, &entry, NULL) != 0)
+	int err = bmfs_disk_find_file(&disk, path + 1, &entry, NULL);
+
+	/* open files may have grown without
+	 * the directory being updated yet */
+	for (struct bmfs_fuse_file *handle = open_files; (err == 0) && (handle != NULL); handle = handle->next)
+	{
+		if (strcmp(handle->file.FileName, entry.FileName) != 0)
+			continue;
+
+		pthread_mutex_lock(&handle->lock);
+		if (handle->file.size > entry.FileSize)
+			entry.FileSize = handle->file.size;
+		pthread_mutex_unlock(&handle->lock);
+	}
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	if (err != 0)
 		return -ENOENT;
 
 	stbuf->st_mode = S_IFREG | 0666;
@@ -128,27 +356,91 @@ static int bmfs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler
 	filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
 
-	/* get the current directory entries */
-	struct BMFSDir dir;
-	if (bmfs_disk_read_dir(&disk, &dir) != 0)
-		return -ENOENT;
+	pthread_rwlock_wrlock(&dir_lock);
 
-	/* list the entries */
-	for (int i = 0; i < 64; i++)
+	/* pick up changes made by other programs */
+	int err = bmfs_disk_refresh_dir(&disk);
+
+	/* list the entries of the cached directory,
+	 * instead of copying it, while the lock is
+	 * still held */
+	for (uint64_t i = 0; (err == 0) && (i < root_dir.EntryCount); i++)
 	{
-		if (dir.Entries[i].FileName[0] == 0)
+		const struct BMFSEntry *entry = &root_dir.Entries[i];
+		if (bmfs_entry_is_terminator(entry))
 			/* end of entries */
 			break;
-		else if (dir.Entries[i].FileName[0] == 1)
+		else if (bmfs_entry_is_empty(entry))
 			/* empty entry */
 			continue;
 		/* found an entry */
-		filler(buf, dir.Entries[i].FileName, NULL, 0);
+		filler(buf, entry->FileName, NULL, 0);
 	}
 
+	pthread_rwlock_unlock(&dir_lock);
+
+	if (err != 0)
+		return -EIO;
+
 	return 0;
 }
 
+/** Allocates a file handle for an
+ * open file and stores it in the fuse
+ * file info, so that reads and writes
+ * don't have to look up the file. The
+ * caller must hold @ref dir_lock for
+ * writing.
+ * */
+
+static int open_handle(const char *path, struct fuse_file_info *fi)
+{
+	struct bmfs_fuse_file *handle = malloc(sizeof(*handle));
+	if (handle == NULL)
+		return -ENOMEM;
+
+	int err = bmfs_file_open(&handle->file, &disk, path + 1);
+	if (err != 0)
+	{
+		free(handle);
+		return err;
+	}
+
+	pthread_mutex_init(&handle->lock, NULL);
+
+	handle->prev = NULL;
+	handle->next = open_files;
+	if (open_files != NULL)
+		open_files->prev = handle;
+	open_files = handle;
+
+	fi->fh = (uint64_t)(uintptr_t) handle;
+
+	return 0;
+}
+
+/** Gets the file handle made
+ * by @ref open_handle.
+ * */
+
+static struct bmfs_fuse_file *get_handle(struct fuse_file_info *fi)
+{
+	return (struct bmfs_fuse_file *)(uintptr_t) fi->fh;
+}
+
+/** Checks whether the directory has changed
+ * since the file handle was last updated. The
+ * directory generation is only modified while
+ * @ref dir_lock is held for writing, so if it
+ * matches, a copy of the handle can be used
+ * without the lock.
+ * */
+
+static int handle_is_current(const struct BMFSFile *file)
+{
+	return file->generation == __atomic_load_n(&disk.dir_generation, __ATOMIC_ACQUIRE);
+}
+
 /** Creates a file, defaulting to the
  * size of 2 MiB.
  * */
@@ -156,9 +448,16 @@ static int bmfs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler
 static int bmfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	(void) mode;
-	(void) fi;
 
-	return bmfs_disk_create_file(&disk, path + 1, 1);
+	pthread_rwlock_wrlock(&dir_lock);
+
+	int err = bmfs_disk_create_file(&disk, path + 1, 1);
+	if (err == 0)
+		err = open_handle(path, fi);
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	return err;
 }
 
 /** Deletes a file.
@@ -166,19 +465,112 @@ static int bmfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info
 
 static int bmfs_fuse_unlink(const char *path)
 {
-	return bmfs_disk_delete_file(&disk, path + 1);
+	pthread_rwlock_wrlock(&dir_lock);
+
+	int err = bmfs_disk_delete_file(&disk, path + 1);
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	return err;
 }
 
-/** This function opens a file.
- * Except, the way fuse is implemented,
- * it really just checks that it exists.
+/** Opens a file. The location and
+ * size of the file are kept in a
+ * file handle until it is released.
  * */
 
 static int bmfs_fuse_open(const char *path, struct fuse_file_info *fi)
 {
-	(void) fi;
+	pthread_rwlock_wrlock(&dir_lock);
 
-	return bmfs_disk_find_file(&disk, path + 1, NULL, NULL);
+	/* pick up changes made by other programs */
+	int err = bmfs_disk_refresh_dir(&disk);
+	if (err == 0)
+		err = open_handle(path, fi);
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	return err;
+}
+
+/** Writes the size of a file to the
+ * directory, if it changed. This is called
+ * each time a file descriptor is closed.
+ * */
+
+static int bmfs_fuse_flush(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	struct bmfs_fuse_file *handle = get_handle(fi);
+
+	pthread_rwlock_wrlock(&dir_lock);
+	pthread_mutex_lock(&handle->lock);
+
+	int err = bmfs_file_sync(&handle->file);
+
+	pthread_mutex_unlock(&handle->lock);
+	pthread_rwlock_unlock(&dir_lock);
+
+	return err;
+}
+
+/** Writes the size of a file to the
+ * directory and synchronizes the disk
+ * file with the storage device.
+ * */
+
+static int bmfs_fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int err = bmfs_fuse_flush(path, fi);
+	if (err != 0)
+		return err;
+
+	if (datasync)
+		err = fdatasync(disk_fd);
+	else
+		err = fsync(disk_fd);
+
+	if (err != 0)
+		return -errno;
+
+	return 0;
+}
+
+/** Releases the file handle
+ * of an open file, writing the
+ * size of the file if it changed.
+ * */
+
+static int bmfs_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	struct bmfs_fuse_file *handle = get_handle(fi);
+
+	pthread_rwlock_wrlock(&dir_lock);
+
+	pthread_mutex_lock(&handle->lock);
+	int err = bmfs_file_close(&handle->file);
+	pthread_mutex_unlock(&handle->lock);
+
+	if (handle->prev != NULL)
+		handle->prev->next = handle->next;
+	else
+		open_files = handle->next;
+
+	if (handle->next != NULL)
+		handle->next->prev = handle->prev;
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	pthread_mutex_destroy(&handle->lock);
+
+	free(handle);
+
+	fi->fh = 0;
+
+	return err;
 }
 
 /** Reads data from a file.
@@ -191,9 +583,9 @@ static int bmfs_fuse_open(const char *path, struct fuse_file_info *fi)
 static int bmfs_fuse_read(const char *path, char *buf, size_t size, off_t offset,
                           struct fuse_file_info *fi)
 {
+	(void) path;
+
 	int err;
-	struct BMFSEntry entry;
-	uint64_t entry_offset;
 	uint64_t read_count;
 
 	/* make sure return code
@@ -203,25 +595,41 @@ static int bmfs_fuse_read(const char *path, char *buf, size_t size, off_t offset
 	if (size > INT_MAX)
 		size = INT_MAX;
 
-	err = bmfs_disk_find_file(&disk, path + 1, &entry, NULL);
-	if (err != 0)
-		return err;
+	struct bmfs_fuse_file *handle = get_handle(fi);
 
-	err = bmfs_entry_get_offset(&entry, &entry_offset);
-	if (err != 0)
-		return err;
+	/* the location and size are copied, since
+	 * writes to the file change the size */
+	pthread_mutex_lock(&handle->lock);
+	struct BMFSFile snapshot = handle->file;
+	pthread_mutex_unlock(&handle->lock);
 
-	if (offset > entry.FileSize)
-		offset = entry.FileSize;
+	int locked = 1;
 
-	err = bmfs_disk_seek(&disk, entry_offset + offset, SEEK_SET);
-	if (err != 0)
-		return err;
+	if (handle_is_current(&snapshot))
+	{
+		/* the common case, the file is read with
+		 * positional I/O and without dir_lock. The
+		 * directory is never read here. */
+		err = bmfs_file_pread_cached(&snapshot, buf, size, offset, &read_count);
+
+		/* like a seqlock, the generation is checked
+		 * again after the read. If the file was
+		 * deleted in the meantime, its blocks may
+		 * now have another file's data. */
+		locked = !handle_is_current(&snapshot);
+	}
 
-	if ((size + offset) > entry.FileSize)
-		size = entry.FileSize - offset;
+	if (locked)
+	{
+		/* the entry has to be looked up
+		 * again, which changes the handle */
+		pthread_rwlock_rdlock(&dir_lock);
+		pthread_mutex_lock(&handle->lock);
+		err = bmfs_file_pread(&handle->file, buf, size, offset, &read_count);
+		pthread_mutex_unlock(&handle->lock);
+		pthread_rwlock_unlock(&dir_lock);
+	}
 
-	err = bmfs_disk_read(&disk, buf, size, &read_count);
 	if (err != 0)
 		return err;
 
@@ -240,12 +648,10 @@ static int bmfs_fuse_read(const char *path, char *buf, size_t size, off_t offset
 static int bmfs_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
                            struct fuse_file_info *fi)
 {
+	(void) path;
+
 	int err;
-	struct BMFSDir dir;
-	struct BMFSEntry *entry;
-	uint64_t entry_offset;
 	uint64_t write_count;
-	uint64_t reserved_bytes;
 
 	/* make sure return code
 	 * can differentiate between
@@ -254,37 +660,19 @@ static int bmfs_fuse_write(const char *path, const char *buf, size_t size, off_t
 	if (size > INT_MAX)
 		size = INT_MAX;
 
-	err = bmfs_disk_read_dir(&disk, &dir);
-	if (err != 0)
-		return err;
-
-	entry = bmfs_dir_find(&dir, path + 1);
-	if (entry == NULL)
-		return -ENOENT;
-
-	reserved_bytes = entry->ReservedBlocks * BMFS_BLOCK_SIZE;
+	/* the new size of the file is kept in the
+	 * handle and written to the directory later,
+	 * so the directory is only read here */
+	struct bmfs_fuse_file *handle = get_handle(fi);
 
-	err = bmfs_entry_get_offset(entry, &entry_offset);
-	if (err != 0)
-		return err;
-
-	if (offset > reserved_bytes)
-		offset = reserved_bytes;
-
-	err = bmfs_disk_seek(&disk, entry_offset + offset, SEEK_SET);
-	if (err != 0)
-		return err;
-
-	if ((size + offset) > reserved_bytes)
-		size = reserved_bytes - offset;
+	pthread_rwlock_rdlock(&dir_lock);
+	pthread_mutex_lock(&handle->lock);
 
-	err = bmfs_disk_write(&disk, buf, size, &write_count);
-	if (err != 0)
-		return err;
+	err = bmfs_file_pwrite(&handle->file, buf, size, offset, &write_count);
 
-	entry->FileSize += write_count;
+	pthread_mutex_unlock(&handle->lock);
+	pthread_rwlock_unlock(&dir_lock);
 
-	err = bmfs_disk_write_dir(&disk, &dir);
 	if (err != 0)
 		return err;
 
@@ -293,6 +681,7 @@ static int bmfs_fuse_write(const char *path, const char *buf, size_t size, off_t
 
 static struct fuse_operations bmfs_fuse_operations = {
 	.init = bmfs_fuse_init,
+	.destroy = bmfs_fuse_destroy,
 	.access = bmfs_fuse_access,
 	.getattr = bmfs_fuse_getattr,
 	.utimens = bmfs_fuse_utimens,
@@ -300,6 +689,9 @@ static struct fuse_operations bmfs_fuse_operations = {
 	.create = bmfs_fuse_create,
 	.unlink = bmfs_fuse_unlink,
 	.open = bmfs_fuse_open,
+	.flush = bmfs_fuse_flush,
+	.fsync = bmfs_fuse_fsync,
+	.release = bmfs_fuse_release,
 	.read = bmfs_fuse_read,
 	.write = bmfs_fuse_write
 };
@@ -310,6 +702,8 @@ static void show_help(const char *argv0)
 	fprintf(stderr, "\n");
 	fprintf(stderr, "BMFS Options:\n");
 	fprintf(stderr, "    --disk=<s>             The disk file to mount (defaults to 'disk.image')\n");
+	fprintf(stderr, "    --mmap                 Map the disk file into memory\n");
+	fprintf(stderr, "    --flush-interval=<n>   Seconds between writes of file sizes (defaults to 5, 0 to disable)\n");
 	fprintf(stderr, "\n");
 }
 
@@ -321,6 +715,8 @@ int main(int argc, char *argv[])
 		/* .disk may be reallocated, can't
 		 * use string literal */
 		.disk = strdup("disk.image"),
+		.mmap = 0,
+		.flush_interval = 5,
 		.show_help = 0
 	};
 
@@ -348,10 +744,53 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	bmfs_disk_init_file(&disk, diskfile);
+	disk_fd = fileno(diskfile);
+
+	flush_interval = options.flush_interval;
+
+	struct BMFSMmap map;
+
+	if (options.mmap)
+	{
+		int err = bmfs_mmap_init(&map, disk_fd, 1);
+		if (err != 0)
+		{
+			fprintf(stderr, "%s: Failed to map '%s': %s\n", argv[0], options.disk, strerror(-err));
+			fclose(diskfile);
+			return EXIT_FAILURE;
+		}
+		bmfs_disk_init_mmap(&disk, &map);
+	}
+	else
+	{
+		/* the file descriptor disk has no shared
+		 * position, so it can be read from several
+		 * threads at once */
+		bmfs_disk_init_fd(&disk, disk_fd);
+	}
+
+	int err = bmfs_disk_cache_dir(&disk, &root_dir);
+	if (err == 0)
+	{
+		bmfs_dir_set_index(&root_dir, &root_index);
+		free_extents.fit = BMFS_EXTENT_FIRST_FIT;
+		err = bmfs_disk_cache_extents(&disk, &free_extents);
+	}
+
+	if (err != 0)
+	{
+		fprintf(stderr, "%s: Failed to read directory of '%s': %s\n", argv[0], options.disk, strerror(-err));
+		if (options.mmap)
+			bmfs_mmap_done(&map);
+		fclose(diskfile);
+		return EXIT_FAILURE;
+	}
 
 	int retval = fuse_main(args.argc, args.argv, &bmfs_fuse_operations, NULL);
 
+	if (options.mmap)
+		bmfs_mmap_done(&map);
+
 	if (diskfile != NULL)
 		fclose(diskfile);
 
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+
 static int exists(const char * filename)
 {
 	FILE *file = fopen(filename, "r");
@@ -26,6 +28,7 @@ static void help(const char *argv0)
 	printf("  --disk-size, -s : specify storage to allocate for disk\n");
 	printf("  --force, -f     : format file, even if it already exists\n");
 	printf("  --help, -h      : display this help message\n");
+	printf("  --preallocate, -p : allocate all the space of the disk, instead of creating a sparse file\n");
 	printf("  --version, -v   : display version information\n");
 	printf("\n");
 	printf("environment variables:\n");
@@ -40,6 +43,7 @@ static void version(void)
 int main(int argc, char **argv)
 {
 	int force_flag = 0;
+	int preallocate_flag = 0;
 
 	struct option opts[] =
 	{
@@ -47,6 +51,7 @@ int main(int argc, char **argv)
 		{ "disk-size", required_argument, NULL, 's' },
 		{ "force", no_argument, NULL, 'f' },
 		{ "help", no_argument, NULL, 'h' },
+		{ "preallocate", no_argument, NULL, 'p' },
 		{ "version", no_argument, NULL, 'v' },
 		{ 0, 0, 0, 0 }
 	};
@@ -63,11 +68,13 @@ int main(int argc, char **argv)
 
 	while (1)
 	{
-		int c = getopt_long(argc, argv, "d:n:r:hfv", opts, NULL);
+		int c = getopt_long(argc, argv, "d:n:r:s:hfpv", opts, NULL);
 		if (c == 'd')
 			diskname = optarg;
 		else if (c == 'f')
 			force_flag = 1;
+		else if (c == 'p')
+			preallocate_flag = 1;
 		else if (c == 's')
 		{
 			err = bmfs_sspec_parse(&disk_storage, optarg);
@@ -129,7 +136,7 @@ int main(int argc, char **argv)
 	}
 
 	FILE *diskfile;
-	diskfile = fopen(diskname, "wb");
+	diskfile = fopen(diskname, "w+b");
 	if (diskfile == NULL)
 	{
 		fprintf(stderr, "%s: failed to open '%s': %s\n", argv[0], diskname, strerror(errno));
@@ -151,6 +158,17 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (preallocate_flag)
+	{
+		err = posix_fallocate(fileno(diskfile), 0, disk_size);
+		if (err != 0)
+		{
+			fprintf(stderr, "%s: failed to allocate space for '%s': %s\n", argv[0], diskname, strerror(err));
+			fclose(diskfile);
+			return EXIT_FAILURE;
+		}
+	}
+
 	struct BMFSDisk disk;
 	err = bmfs_disk_init_file(&disk, diskfile);
 	if (err != 0)
@@ -140,19 +140,25 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	struct BMFSDir dir;
-	err = bmfs_disk_read_dir(&disk, &dir);
+	/* too large for the stack */
+	struct BMFSDir *dir = malloc(sizeof(*dir));
+	if (dir == NULL)
+		err = -ENOMEM;
+	else
+		err = bmfs_disk_read_dir(&disk, dir);
+
 	if (err != 0)
 	{
 		fprintf(stderr, "%s: failed to read root directory: %s\n", argv[0], strerror(-err));
+		free(dir);
 		fclose(diskfile);
 		return EXIT_FAILURE;
 	}
 
-	for (uint64_t i = 0ULL; i < 64ULL; i++)
+	for (uint64_t i = 0ULL; i < dir->EntryCount; i++)
 	{
 		const struct BMFSEntry *entry;
-		entry = &dir.Entries[i];
+		entry = &dir->Entries[i];
 		if (bmfs_entry_is_empty(entry))
 			continue;
 		else if (bmfs_entry_is_terminator(entry))
@@ -181,6 +187,8 @@ int main(int argc, char **argv)
 		printf("%s\n", entry->FileName);
 	}
 
+	free(dir);
+
 	fclose(diskfile);
 
 	return EXIT_SUCCESS;
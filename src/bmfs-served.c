@@ -0,0 +1,866 @@
+/* for accept4 */
+#define _GNU_SOURCE
+
+#include <bmfs/bmfs.h>
+#include <bmfs/served.h>
+#include <bmfs/stdlib.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* the headers are sent as they are in memory */
+_Static_assert(sizeof(struct BMFSServedRequest) == 24, "unexpected request header size");
+_Static_assert(sizeof(struct BMFSServedResponse) == 16, "unexpected response header size");
+
+/** The size of the buffers of a connection.
+ * Requests are read and responses are written
+ * through them, so that a client sending many
+ * requests at once is served with few calls. */
+
+#define CONNECTION_BUFFER_SIZE (64 * 1024)
+
+/** Reads up to this size are copied into the
+ * response buffer. Larger reads are sent from
+ * the disk image to the socket by the kernel. */
+
+#define COPY_READ_MAX (16 * 1024)
+
+/** The disk image that is served. */
+
+static struct BMFSDisk disk;
+
+/** The file descriptor of the disk image. */
+
+static int disk_fd = -1;
+
+/** The cached root directory of the disk. */
+
+static struct BMFSDir root_dir;
+
+/** The index of the root directory. */
+
+static struct BMFSDirIndex root_index;
+
+/** The free space of the disk. */
+
+static struct BMFSExtentMap free_extents;
+
+/** Protects the cached directory and extent
+ * map. It is held for reading while entries are
+ * looked up and for writing while they change. */
+
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Set by the signal handler, when
+ * the server should stop. */
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/** A client connection, served by its own thread. */
+
+struct connection
+{
+	/** The socket of the client. */
+	int fd;
+	/** Requests that were received, but
+	 * not handled yet, start here. */
+	size_t in_start;
+	/** The end of the received data. */
+	size_t in_end;
+	/** The length of the responses
+	 * that weren't sent yet. */
+	size_t out_len;
+	/** A copy of the directory for listing,
+	 * allocated the first time it's needed. */
+	struct BMFSDir *list_dir;
+	/** Received data. */
+	char in[CONNECTION_BUFFER_SIZE];
+	/** Responses that weren't sent yet. */
+	char out[CONNECTION_BUFFER_SIZE];
+	/** Holds data that is written to a file. */
+	char data[CONNECTION_BUFFER_SIZE];
+};
+
+static void help(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("\n");
+	printf("Serves the files of a BMFS formatted disk\n");
+	printf("image over a UNIX domain socket, so that\n");
+	printf("clients don't have to open the image and\n");
+	printf("read its directory themselves.\n");
+	printf("\n");
+	printf("options:\n");
+	printf("  --disk,    -d : specify disk image to use\n");
+	printf("  --help,    -h : display this help message\n");
+	printf("  --socket,  -s : the path of the socket (default: bmfs.sock)\n");
+	printf("  --version, -v : display version information\n");
+	printf("\n");
+	printf("environment variables:\n");
+	printf("    BMFS_DISK : the disk image to use\n");
+}
+
+static void version(void)
+{
+	printf("%s\n", BMFS_VERSION_STRING);
+}
+
+static void handle_stop(int signum)
+{
+	(void) signum;
+
+	stop_requested = 1;
+}
+
+/* Sends all of the buffered responses. */
+
+static int flush_output(struct connection *conn)
+{
+	size_t sent = 0;
+
+	while (sent < conn->out_len)
+	{
+		ssize_t result = send(conn->fd, conn->out + sent, conn->out_len - sent, MSG_NOSIGNAL);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		sent += result;
+	}
+
+	conn->out_len = 0;
+
+	return 0;
+}
+
+/* Adds data to the responses. If it doesn't
+ * fit in the buffer, the buffer is sent first. */
+
+static int write_output(struct connection *conn, const void *buf, size_t len)
+{
+	if ((conn->out_len + len) > sizeof(conn->out))
+	{
+		int err = flush_output(conn);
+		if (err != 0)
+			return err;
+	}
+
+	while (len > sizeof(conn->out))
+	{
+		/* too large for the buffer, so
+		 * it is sent a buffer at a time */
+		memcpy(conn->out, buf, sizeof(conn->out));
+		conn->out_len = sizeof(conn->out);
+
+		int err = flush_output(conn);
+		if (err != 0)
+			return err;
+
+		buf = ((const char *) buf) + sizeof(conn->out);
+		len -= sizeof(conn->out);
+	}
+
+	memcpy(conn->out + conn->out_len, buf, len);
+	conn->out_len += len;
+
+	return 0;
+}
+
+/* Reads exactly the given number of bytes of
+ * requests. The responses are only sent before
+ * waiting for more data, so the responses to
+ * pipelined requests are sent together. */
+
+static int read_input(struct connection *conn, void *buf, size_t len)
+{
+	char *dst = (char *) buf;
+
+	while (len > 0)
+	{
+		size_t avail = conn->in_end - conn->in_start;
+		if (avail > 0)
+		{
+			if (avail > len)
+				avail = len;
+
+			memcpy(dst, conn->in + conn->in_start, avail);
+			conn->in_start += avail;
+			dst += avail;
+			len -= avail;
+			continue;
+		}
+
+		int err = flush_output(conn);
+		if (err != 0)
+			return err;
+
+		/* large data skips the buffer */
+		char *target = conn->in;
+		size_t target_size = sizeof(conn->in);
+		if (len >= sizeof(conn->in))
+		{
+			target = dst;
+			target_size = len;
+		}
+
+		ssize_t result = read(conn->fd, target, target_size);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		else if (result == 0)
+			/* the client disconnected */
+			return -ECONNRESET;
+
+		if (target == dst)
+		{
+			dst += result;
+			len -= result;
+		}
+		else
+		{
+			conn->in_start = 0;
+			conn->in_end = result;
+		}
+	}
+
+	return 0;
+}
+
+/* Reads data of a request that
+ * can't be used, so that the next
+ * request can be read. */
+
+static int skip_input(struct connection *conn, uint64_t len)
+{
+	while (len > 0)
+	{
+		size_t chunk = sizeof(conn->data);
+		if (chunk > len)
+			chunk = len;
+
+		int err = read_input(conn, conn->data, chunk);
+		if (err != 0)
+			return err;
+
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static int write_response(struct connection *conn, uint32_t id, int status, uint64_t len)
+{
+	struct BMFSServedResponse response;
+	response.id = id;
+	response.status = status;
+	response.len = len;
+
+	return write_output(conn, &response, sizeof(response));
+}
+
+/* Looks up a file. If it isn't found, the
+ * directory is refreshed, in case the file
+ * was created by another program. */
+
+static int find_entry(const char *filename, struct BMFSEntry *entry)
+{
+	pthread_rwlock_rdlock(&dir_lock);
+
+	int err = bmfs_disk_find_file(&disk, filename, entry, NULL);
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	if (err == -ENOENT)
+	{
+		pthread_rwlock_wrlock(&dir_lock);
+
+		err = bmfs_disk_refresh_dir(&disk);
+		if (err == 0)
+			err = bmfs_disk_find_file(&disk, filename, entry, NULL);
+
+		pthread_rwlock_unlock(&dir_lock);
+	}
+
+	return err;
+}
+
+static int serve_list(struct connection *conn, const struct BMFSServedRequest *request)
+{
+	if (conn->list_dir == NULL)
+	{
+		conn->list_dir = malloc(sizeof(*conn->list_dir));
+		if (conn->list_dir == NULL)
+			return write_response(conn, request->id, -ENOMEM, 0);
+	}
+
+	/* the lock isn't held while the
+	 * entries are sent, since that may
+	 * wait for the client */
+	pthread_rwlock_wrlock(&dir_lock);
+
+	int err = bmfs_disk_refresh_dir(&disk);
+	if (err == 0)
+		err = bmfs_disk_read_dir(&disk, conn->list_dir);
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	if (err != 0)
+		return write_response(conn, request->id, err, 0);
+
+	const struct BMFSDir *dir = conn->list_dir;
+
+	uint64_t count = 0;
+	for (uint64_t i = 0; i < dir->EntryCount; i++)
+	{
+		if (bmfs_entry_is_terminator(&dir->Entries[i]))
+			break;
+		else if (!bmfs_entry_is_empty(&dir->Entries[i]))
+			count++;
+	}
+
+	err = write_response(conn, request->id, 0, count * sizeof(struct BMFSEntry));
+	if (err != 0)
+		return err;
+
+	for (uint64_t i = 0; i < dir->EntryCount; i++)
+	{
+		if (bmfs_entry_is_terminator(&dir->Entries[i]))
+			break;
+		else if (bmfs_entry_is_empty(&dir->Entries[i]))
+			continue;
+
+		err = write_output(conn, &dir->Entries[i], sizeof(struct BMFSEntry));
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int serve_stat(struct connection *conn, const struct BMFSServedRequest *request, const char *filename)
+{
+	struct BMFSEntry entry;
+	int err = find_entry(filename, &entry);
+	if (err != 0)
+		return write_response(conn, request->id, err, 0);
+
+	err = write_response(conn, request->id, 0, sizeof(entry));
+	if (err != 0)
+		return err;
+
+	return write_output(conn, &entry, sizeof(entry));
+}
+
+/* Checks that a file still has the data that is
+ * being sent, after the directory changed. If the
+ * file was moved, deleted or truncated, the blocks
+ * that were sent may have had another file's data. */
+
+static int check_read(const char *filename,
+                      uint64_t starting_block,
+                      uint64_t end,
+                      uint64_t *generation)
+{
+	struct BMFSEntry entry;
+
+	pthread_rwlock_rdlock(&dir_lock);
+
+	*generation = __atomic_load_n(&disk.dir_generation, __ATOMIC_ACQUIRE);
+
+	int err = bmfs_disk_find_file(&disk, filename, &entry, NULL);
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	if ((err == 0)
+	 && ((entry.StartingBlock != starting_block)
+	  || (entry.FileSize < end)))
+		err = -EIO;
+
+	return err;
+}
+
+static int serve_read(struct connection *conn, const struct BMFSServedRequest *request, const char *filename)
+{
+	/* taken before the lookup, so that any
+	 * change after it is noticed */
+	uint64_t generation = __atomic_load_n(&disk.dir_generation, __ATOMIC_ACQUIRE);
+
+	struct BMFSEntry entry;
+	int err = find_entry(filename, &entry);
+	if (err != 0)
+		return write_response(conn, request->id, err, 0);
+
+	uint64_t len = 0;
+	if (request->offset < entry.FileSize)
+	{
+		len = entry.FileSize - request->offset;
+		if (len > request->len)
+			len = request->len;
+	}
+
+	if (len <= COPY_READ_MAX)
+	{
+		/* small reads are answered from the
+		 * buffer, together with other responses */
+		if ((conn->out_len + sizeof(struct BMFSServedResponse) + len) > sizeof(conn->out))
+		{
+			err = flush_output(conn);
+			if (err != 0)
+				return err;
+		}
+
+		struct BMFSServedResponse response;
+		char *data = conn->out + conn->out_len + sizeof(response);
+
+		/* the entry is looked up again, and the
+		 * lock is held until the data is read, so
+		 * that the file isn't moved or deleted in
+		 * the meantime. The file may only have
+		 * become smaller since the buffer space
+		 * was made. */
+		pthread_rwlock_rdlock(&dir_lock);
+
+		err = bmfs_disk_find_file(&disk, filename, &entry, NULL);
+		if ((err == 0)
+		 && ((request->offset + len) > entry.FileSize))
+			len = (request->offset < entry.FileSize) ? (entry.FileSize - request->offset) : 0;
+
+		if (err == 0)
+			err = bmfs_disk_pread(&disk, data, len, (entry.StartingBlock * BMFS_BLOCK_SIZE) + request->offset, NULL);
+
+		pthread_rwlock_unlock(&dir_lock);
+
+		response.id = request->id;
+		response.status = err;
+		response.len = (err == 0) ? len : 0;
+
+		memcpy(conn->out + conn->out_len, &response, sizeof(response));
+
+		conn->out_len += sizeof(response) + response.len;
+
+		return 0;
+	}
+
+	err = write_response(conn, request->id, 0, len);
+	if (err == 0)
+		err = flush_output(conn);
+
+	if (err != 0)
+		return err;
+
+	/* the lock isn't held while the data is
+	 * sent, since that may wait for the client.
+	 * Instead, like a seqlock, the generation is
+	 * checked after each chunk. Once the data is
+	 * sent, the client can't be told that it was
+	 * wrong, so the connection is closed. */
+	uint64_t offset = (entry.StartingBlock * BMFS_BLOCK_SIZE) + request->offset;
+	uint64_t end = request->offset + len;
+
+	for (uint64_t sent = 0; sent < len; )
+	{
+		uint64_t chunk = sizeof(conn->data);
+		if (chunk > (len - sent))
+			chunk = len - sent;
+
+		uint64_t copied = 0;
+		err = bmfs_copy_fd(disk_fd, offset + sent, conn->fd, -1, chunk, sizeof(conn->data), &copied);
+		if (err != 0)
+			return err;
+		else if (copied < chunk)
+			/* the disk image was truncated, and
+			 * the client can't be told anymore */
+			return -EIO;
+
+		if ((__atomic_load_n(&disk.dir_generation, __ATOMIC_ACQUIRE) != generation)
+		 && (check_read(filename, entry.StartingBlock, end, &generation) != 0))
+			return -EIO;
+
+		sent += chunk;
+	}
+
+	return 0;
+}
+
+static int serve_write(struct connection *conn, const struct BMFSServedRequest *request, const char *filename)
+{
+	struct BMFSEntry entry;
+	int err = find_entry(filename, &entry);
+	if ((err == 0)
+	 && ((request->offset > (entry.ReservedBlocks * BMFS_BLOCK_SIZE))
+	  || (request->len > ((entry.ReservedBlocks * BMFS_BLOCK_SIZE) - request->offset))))
+		err = -ENOSPC;
+
+	if (err != 0)
+	{
+		int skip_err = skip_input(conn, request->len);
+		if (skip_err != 0)
+			return skip_err;
+
+		return write_response(conn, request->id, err, 0);
+	}
+
+	uint64_t end = request->offset + request->len;
+
+	for (uint64_t written = 0; written < request->len; )
+	{
+		size_t chunk = sizeof(conn->data);
+		if (chunk > (request->len - written))
+			chunk = request->len - written;
+
+		/* the data is read from the client
+		 * before the lock is taken */
+		int read_err = read_input(conn, conn->data, chunk);
+		if (read_err != 0)
+			return read_err;
+
+		/* the rest of the data is still
+		 * read after a failed write */
+		if (err == 0)
+		{
+			/* the entry is looked up again for each
+			 * chunk, and the lock is held until the
+			 * chunk is written, so that the file isn't
+			 * moved or deleted in the meantime */
+			pthread_rwlock_rdlock(&dir_lock);
+
+			err = bmfs_disk_find_file(&disk, filename, &entry, NULL);
+			if ((err == 0)
+			 && (end > (entry.ReservedBlocks * BMFS_BLOCK_SIZE)))
+				err = -ENOSPC;
+
+			if (err == 0)
+			{
+				uint64_t offset = (entry.StartingBlock * BMFS_BLOCK_SIZE) + request->offset + written;
+				err = bmfs_disk_pwrite(&disk, conn->data, chunk, offset, NULL);
+			}
+
+			pthread_rwlock_unlock(&dir_lock);
+		}
+
+		written += chunk;
+	}
+
+	if ((err == 0)
+	 && (end > entry.FileSize))
+	{
+		/* the entry is looked up again, since
+		 * it may have moved in the meantime */
+		pthread_rwlock_wrlock(&dir_lock);
+
+		int number = 0;
+		err = bmfs_disk_find_file(&disk, filename, &entry, &number);
+		if ((err == 0)
+		 && (end > entry.FileSize))
+			err = bmfs_disk_set_file_size(&disk, number, end);
+
+		pthread_rwlock_unlock(&dir_lock);
+	}
+
+	return write_response(conn, request->id, err, (err == 0) ? request->len : 0);
+}
+
+static int serve_create(struct connection *conn, const struct BMFSServedRequest *request, const char *filename)
+{
+	int err = -EINVAL;
+
+	if (request->len > 0)
+	{
+		pthread_rwlock_wrlock(&dir_lock);
+
+		err = bmfs_disk_refresh_dir(&disk);
+		if (err == 0)
+			err = bmfs_disk_create_file(&disk, filename, request->len);
+
+		pthread_rwlock_unlock(&dir_lock);
+	}
+
+	return write_response(conn, request->id, err, 0);
+}
+
+static int serve_delete(struct connection *conn, const struct BMFSServedRequest *request, const char *filename)
+{
+	pthread_rwlock_wrlock(&dir_lock);
+
+	int err = bmfs_disk_refresh_dir(&disk);
+	if (err == 0)
+		err = bmfs_disk_delete_file(&disk, filename);
+
+	pthread_rwlock_unlock(&dir_lock);
+
+	return write_response(conn, request->id, err, 0);
+}
+
+/* Handles one request. A negative return
+ * value means that the connection can't be
+ * used anymore, while errors of the request
+ * itself are sent to the client. */
+
+static int serve_request(struct connection *conn)
+{
+	struct BMFSServedRequest request;
+	int err = read_input(conn, &request, sizeof(request));
+	if (err != 0)
+		return err;
+
+	char filename[BMFS_FILE_NAME_MAX];
+	if (request.name_len >= sizeof(filename))
+	{
+		err = skip_input(conn, request.name_len);
+		if ((err == 0)
+		 && (request.op == BMFS_SERVED_WRITE))
+			err = skip_input(conn, request.len);
+
+		if (err != 0)
+			return err;
+
+		return write_response(conn, request.id, -ENAMETOOLONG, 0);
+	}
+
+	err = read_input(conn, filename, request.name_len);
+	if (err != 0)
+		return err;
+
+	filename[request.name_len] = 0;
+
+	switch (request.op)
+	{
+	case BMFS_SERVED_LIST:
+		return serve_list(conn, &request);
+	case BMFS_SERVED_STAT:
+		return serve_stat(conn, &request, filename);
+	case BMFS_SERVED_READ:
+		return serve_read(conn, &request, filename);
+	case BMFS_SERVED_WRITE:
+		return serve_write(conn, &request, filename);
+	case BMFS_SERVED_CREATE:
+		return serve_create(conn, &request, filename);
+	case BMFS_SERVED_DELETE:
+		return serve_delete(conn, &request, filename);
+	default:
+		break;
+	}
+
+	return write_response(conn, request.id, -ENOSYS, 0);
+}
+
+static void *connection_main(void *arg)
+{
+	struct connection *conn = (struct connection *) arg;
+
+	while (serve_request(conn) == 0)
+		;
+
+	close(conn->fd);
+	free(conn->list_dir);
+	free(conn);
+
+	return NULL;
+}
+
+/* Binds the socket, replacing a socket
+ * left behind by a previous server. */
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	strcpy(addr.sun_path, path);
+
+	struct stat path_stat;
+	if ((stat(path, &path_stat) == 0)
+	 && S_ISSOCK(path_stat.st_mode))
+		unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if ((bind(fd, (const struct sockaddr *) &addr, sizeof(addr)) != 0)
+	 || (listen(fd, SOMAXCONN) != 0))
+	{
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	struct option opts[] =
+	{
+		{ "disk", required_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "socket", required_argument, NULL, 's' },
+		{ "version", no_argument, NULL, 'v' },
+		{ 0, 0, 0, 0 }
+	};
+
+	const char *diskname = NULL;
+
+	const char *socket_path = "bmfs.sock";
+
+	while (1)
+	{
+		int c = getopt_long(argc, argv, "d:s:hv", opts, NULL);
+		if (c == 'd')
+			diskname = optarg;
+		else if (c == 'h')
+		{
+			help(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if (c == 's')
+			socket_path = optarg;
+		else if (c == 'v')
+		{
+			version();
+			return EXIT_FAILURE;
+		}
+		else if (c == -1)
+			/* end of options */
+			break;
+		else if (c == ':')
+			/* invalid option */
+			return EXIT_FAILURE;
+		else if (c == '?')
+			/* missing option argument */
+			return EXIT_FAILURE;
+	}
+
+	if (diskname == NULL)
+	{
+		diskname = getenv("BMFS_DISK");
+		if (diskname == NULL)
+			diskname = "disk.image";
+	}
+
+	disk_fd = open(diskname, O_RDWR | O_CLOEXEC);
+	if (disk_fd < 0)
+	{
+		fprintf(stderr, "%s: failed to open '%s': %s\n", argv[0], diskname, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* the file descriptor disk has no shared
+	 * position, so it can be used by all the
+	 * connections at once */
+	int err = bmfs_disk_init_fd(&disk, disk_fd);
+	if (err == 0)
+		err = bmfs_disk_check_tag(&disk);
+
+	if (err == 0)
+		err = bmfs_disk_cache_dir(&disk, &root_dir);
+
+	if (err == 0)
+	{
+		bmfs_dir_set_index(&root_dir, &root_index);
+		free_extents.fit = BMFS_EXTENT_FIRST_FIT;
+		err = bmfs_disk_cache_extents(&disk, &free_extents);
+	}
+
+	if (err != 0)
+	{
+		fprintf(stderr, "%s: failed to read directory of '%s': %s\n", argv[0], diskname, strerror(-err));
+		close(disk_fd);
+		return EXIT_FAILURE;
+	}
+
+	int listen_fd = listen_on(socket_path);
+	if (listen_fd < 0)
+	{
+		fprintf(stderr, "%s: failed to listen on '%s': %s\n", argv[0], socket_path, strerror(-listen_fd));
+		close(disk_fd);
+		return EXIT_FAILURE;
+	}
+
+	/* no SA_RESTART, so that accept
+	 * returns when a signal arrives */
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	/* sendfile raises it when
+	 * a client disconnects */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	int retval = EXIT_SUCCESS;
+
+	while (!stop_requested)
+	{
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if ((errno == EINTR)
+			 || (errno == ECONNABORTED))
+				continue;
+
+			fprintf(stderr, "%s: failed to accept connection: %s\n", argv[0], strerror(errno));
+			retval = EXIT_FAILURE;
+			break;
+		}
+
+		struct connection *conn = malloc(sizeof(*conn));
+		if (conn == NULL)
+		{
+			close(fd);
+			continue;
+		}
+
+		conn->fd = fd;
+		conn->in_start = 0;
+		conn->in_end = 0;
+		conn->out_len = 0;
+		conn->list_dir = NULL;
+
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, connection_main, conn) != 0)
+		{
+			close(fd);
+			free(conn);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+
+	close(listen_fd);
+	unlink(socket_path);
+
+	/* sizes are written as files grow, so
+	 * the directory is already up to date */
+	pthread_rwlock_wrlock(&dir_lock);
+	close(disk_fd);
+
+	return retval;
+}
@@ -21,10 +21,22 @@ char s_create[] = "create";
 char s_read[] = "read";
 char s_write[] = "write";
 char s_delete[] = "delete";
+char s_extend[] = "extend";
+char s_compact[] = "compact";
+char s_batch[] = "batch";
 char s_version[] = "version";
 
+/* The longest line, and the most
+ * arguments on a line, of a batch script */
+#define BATCH_LINE_MAX 1024
+#define BATCH_ARGS_MAX 8
+
 static int format_file(struct BMFSDisk *disk, long bytes);
 
+static int run_command(struct BMFSDisk *disk, const char *argv0, int argc, char **argv, int interactive);
+
+static int run_batch(struct BMFSDisk *disk, const char *argv0, const char *scriptname);
+
 static void list_entries(struct BMFSDisk *disk);
 
 static void print_usage(const char *argv0);
@@ -39,8 +51,6 @@ int main(int argc, char *argv[])
 	char *diskname;
 	char *command;
 	char *filename;
-	char tempstring[32];
-	unsigned int filesize;
 
 	/* Parse arguments */
 	if (argc < 3)
@@ -66,13 +76,20 @@ int main(int argc, char *argv[])
 
 	if (strcasecmp(s_initialize, command) == 0)
 	{
+		int flags = 0;
+		if (strcmp(argv[argc - 1], "--preallocate") == 0)
+		{
+			flags |= BMFS_INITIALIZE_PREALLOCATE;
+			argc--;
+		}
+
 		if (argc >= 4)
 		{
 			char *size = argv[3];				// Required
 			char *mbr = (argc > 4 ? argv[4] : NULL);    	// Opt.
 			char *boot = (argc > 5 ? argv[5] : NULL);   	// Opt.
 			char *kernel = (argc > 6 ? argv[6] : NULL); 	// Opt.
-			int ret = bmfs_initialize(diskname, size, mbr, boot, kernel);
+			int ret = bmfs_initialize_flags(diskname, size, mbr, boot, kernel, flags);
 			if (ret != 0)
 				return EXIT_FAILURE;
 			else
@@ -82,7 +99,7 @@ int main(int argc, char *argv[])
 		{
 			printf("Usage: %s disk %s ", argv[0], command);
 			printf("size [mbr_file] ");
-			printf("[bootloader_file] [kernel_file]\n");
+			printf("[bootloader_file] [kernel_file] [--preallocate]\n");
 			return EXIT_FAILURE;
 		}
 	}
@@ -109,11 +126,9 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (strcasecmp(s_list, command) == 0)
-	{
-		list_entries(&disk);
-	}
-	else if (strcasecmp(s_format, command) == 0)
+	int ret = EXIT_SUCCESS;
+
+	if (strcasecmp(s_format, command) == 0)
 	{
 		if (argc > 3)
 		{
@@ -131,76 +146,293 @@ int main(int argc, char *argv[])
 			printf("Format aborted!\n");
 		}
 	}
+	else if (strcasecmp(s_batch, command) == 0)
+	{
+		ret = run_batch(&disk, argv[0], filename);
+	}
+	else
+	{
+		ret = run_command(&disk, argv[0], argc - 2, &argv[2], 1);
+	}
+
+	if (diskfile != NULL)
+	{
+		fclose(diskfile);
+	}
+	return ret;
+}
+
+/* Runs one of the commands that work on an
+ * open disk. The first argument is the name
+ * of the command. If interactive is zero, the
+ * user is never prompted for missing arguments. */
+
+static int run_command(struct BMFSDisk *disk, const char *argv0, int argc, char **argv, int interactive)
+{
+	char *command = argv[0];
+	char *filename = (argc > 1 ? argv[1] : NULL);
+	char tempstring[32];
+	unsigned int filesize;
+
+	if (strcasecmp(s_list, command) == 0)
+	{
+		list_entries(disk);
+	}
 	else if (strcasecmp(s_create, command) == 0)
 	{
 		if (filename == NULL)
 		{
 			printf("Error: File name not specified.\n");
+			return EXIT_FAILURE;
 		}
-		else
+
+		if (argc > 2)
 		{
-			if (argc > 4)
+			int filesize = atoi(argv[2]);
+			if (filesize < 1)
 			{
-				int filesize = atoi(argv[4]);
-				if (filesize < 1)
-				{
-					printf("Error: Invalid file size.\n");
-					return EXIT_FAILURE;
-				}
-
-				int err = bmfs_disk_create_file(&disk, filename, filesize);
-				if (err != 0)
-				{
-					fprintf(stderr, "%s: Failed to create '%s'\n", argv[0], filename);
-					fprintf(stderr, "  %s\n", strerror(-err));
-					return EXIT_FAILURE;
-				}
+				printf("Error: Invalid file size.\n");
+				return EXIT_FAILURE;
 			}
+
+			int err = bmfs_disk_create_file(disk, filename, filesize);
+			if (err != 0)
+			{
+				fprintf(stderr, "%s: Failed to create '%s'\n", argv0, filename);
+				fprintf(stderr, "  %s\n", strerror(-err));
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!interactive)
+		{
+			printf("Error: File size not specified.\n");
+			return EXIT_FAILURE;
+		}
+		else
+		{
+			printf("Maximum file size in MiB: ");
+			if (fgets(tempstring, sizeof(tempstring), stdin) != NULL)	// Get up to 32 chars from the keyboard
+				filesize = atoi(tempstring);
 			else
+				return EXIT_FAILURE;
+
+			if (filesize < 1)
 			{
-				printf("Maximum file size in MiB: ");
-				if (fgets(tempstring, sizeof(tempstring), stdin) != NULL)	// Get up to 32 chars from the keyboard
-					filesize = atoi(tempstring);
-				else
-					return EXIT_FAILURE;
-
-				if (filesize < 1)
-				{
-					printf("Error: Invalid file size.\n");
-					return EXIT_FAILURE;
-				}
-
-				int err = bmfs_disk_create_file(&disk, filename, filesize);
-				if (err != 0)
-				{
-					fprintf(stderr, "%s: Failed to create '%s'\n", argv[0], filename);
-					fprintf(stderr, "  %s\n", strerror(-err));
-					return EXIT_FAILURE;
-				}
+				printf("Error: Invalid file size.\n");
+				return EXIT_FAILURE;
+			}
+
+			int err = bmfs_disk_create_file(disk, filename, filesize);
+			if (err != 0)
+			{
+				fprintf(stderr, "%s: Failed to create '%s'\n", argv0, filename);
+				fprintf(stderr, "  %s\n", strerror(-err));
+				return EXIT_FAILURE;
 			}
 		}
 	}
-	else if (strcasecmp(s_read, command) == 0)
+	else if (strcasecmp(s_compact, command) == 0)
 	{
-		bmfs_readfile(&disk, filename);
+		int removed = bmfs_disk_compact_dir(disk);
+		if (removed < 0)
+		{
+			fprintf(stderr, "%s: Failed to compact directory\n", argv0);
+			fprintf(stderr, "  %s\n", strerror(-removed));
+			return EXIT_FAILURE;
+		}
+		printf("Removed %d deleted entries.\n", removed);
 	}
-	else if (strcasecmp(s_write, command) == 0)
+	else if (strcasecmp(s_extend, command) == 0)
 	{
-		bmfs_writefile(&disk, filename);
+		if (argc < 2)
+		{
+			printf("Usage: %s disk %s entries\n", argv0, command);
+			return EXIT_FAILURE;
+		}
+
+		int err = bmfs_disk_extend_dir(disk, strtoull(argv[1], NULL, 10));
+		if (err != 0)
+		{
+			fprintf(stderr, "%s: Failed to extend directory\n", argv0);
+			fprintf(stderr, "  %s\n", strerror(-err));
+			return EXIT_FAILURE;
+		}
 	}
-	else if (strcasecmp(s_delete, command) == 0)
+	else if ((strcasecmp(s_read, command) == 0)
+	      || (strcasecmp(s_write, command) == 0)
+	      || (strcasecmp(s_delete, command) == 0))
 	{
-		bmfs_disk_delete_file(&disk, filename);
+		if (filename == NULL)
+		{
+			printf("Error: File name not specified.\n");
+			return EXIT_FAILURE;
+		}
+
+		int err;
+		if (strcasecmp(s_read, command) == 0)
+			err = bmfs_readfile(disk, filename);
+		else if (strcasecmp(s_write, command) == 0)
+			err = bmfs_writefile(disk, filename);
+		else
+		{
+			err = bmfs_disk_delete_file(disk, filename);
+			if (err != 0)
+			{
+				fprintf(stderr, "%s: Failed to delete '%s'\n", argv0, filename);
+				fprintf(stderr, "  %s\n", strerror(-err));
+			}
+		}
+
+		if (err != 0)
+			return EXIT_FAILURE;
 	}
 	else
 	{
 		printf("Error: Unknown command\n");
+		return EXIT_FAILURE;
 	}
-	if (diskfile != NULL)
+
+	return EXIT_SUCCESS;
+}
+
+/* Runs the commands of a script, one per line,
+ * against the open disk. The directory is cached
+ * and written once, after the last command, so
+ * that each command only changes memory. Blank
+ * lines and anything after a '#' are ignored.
+ * The script stops at the first failing command. */
+
+static int run_batch(struct BMFSDisk *disk, const char *argv0, const char *scriptname)
+{
+	FILE *script = stdin;
+	if ((scriptname != NULL)
+	 && (strcmp(scriptname, "-") != 0))
 	{
-		fclose(diskfile);
+		script = fopen(scriptname, "r");
+		if (script == NULL)
+		{
+			fprintf(stderr, "%s: Failed to open '%s': %s\n", argv0, scriptname, strerror(errno));
+			return EXIT_FAILURE;
+		}
 	}
-	return EXIT_SUCCESS;
+	else
+	{
+		scriptname = "stdin";
+	}
+
+	/* these are too large for the stack */
+	struct BMFSDir *dir = malloc(sizeof(*dir));
+	struct BMFSDirIndex *index = malloc(sizeof(*index));
+	struct BMFSExtentMap *extents = malloc(sizeof(*extents));
+
+	int err = 0;
+	if ((dir == NULL)
+	 || (index == NULL)
+	 || (extents == NULL))
+		err = -ENOMEM;
+	else
+		err = bmfs_disk_cache_dir(disk, dir);
+
+	if (err == 0)
+	{
+		bmfs_dir_set_index(dir, index);
+		extents->fit = BMFS_EXTENT_FIRST_FIT;
+		err = bmfs_disk_cache_extents(disk, extents);
+	}
+
+	if (err == 0)
+		err = bmfs_disk_defer_dir(disk);
+
+	if (err != 0)
+	{
+		fprintf(stderr, "%s: Failed to read directory: %s\n", argv0, strerror(-err));
+		bmfs_disk_uncache_extents(disk);
+		bmfs_disk_uncache_dir(disk);
+		free(extents);
+		free(index);
+		free(dir);
+		if (script != stdin)
+			fclose(script);
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+	unsigned long int line_number = 0;
+	char line[BATCH_LINE_MAX];
+
+	while (fgets(line, sizeof(line), script) != NULL)
+	{
+		line_number++;
+
+		if ((strchr(line, '\n') == NULL)
+		 && !feof(script))
+		{
+			fprintf(stderr, "%s: %s:%lu: Line is too long\n", argv0, scriptname, line_number);
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		char *comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = 0;
+
+		char *args[BATCH_ARGS_MAX + 1];
+		int argc = 0;
+		for (char *arg = strtok(line, " \t\r\n"); arg != NULL; arg = strtok(NULL, " \t\r\n"))
+		{
+			if (argc == BATCH_ARGS_MAX)
+				break;
+			args[argc++] = arg;
+		}
+		args[argc] = NULL;
+
+		if (argc == 0)
+			continue;
+
+		if ((strcasecmp(s_format, args[0]) == 0)
+		 || (strcasecmp(s_initialize, args[0]) == 0)
+		 || (strcasecmp(s_batch, args[0]) == 0))
+		{
+			fprintf(stderr, "%s: %s:%lu: '%s' can't be used in a batch\n", argv0, scriptname, line_number, args[0]);
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		if (run_command(disk, argv0, argc, args, 0) != EXIT_SUCCESS)
+		{
+			fprintf(stderr, "%s: %s:%lu: '%s' failed\n", argv0, scriptname, line_number, args[0]);
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	if ((ret == EXIT_SUCCESS)
+	 && ferror(script))
+	{
+		fprintf(stderr, "%s: Failed to read '%s'\n", argv0, scriptname);
+		ret = EXIT_FAILURE;
+	}
+
+	/* the commands that ran before a
+	 * failure are kept, as if they were
+	 * run one at a time */
+	err = bmfs_disk_flush_dir(disk);
+	if (err != 0)
+	{
+		fprintf(stderr, "%s: Failed to write directory: %s\n", argv0, strerror(-err));
+		ret = EXIT_FAILURE;
+	}
+
+	bmfs_disk_uncache_extents(disk);
+	bmfs_disk_uncache_dir(disk);
+	free(extents);
+	free(index);
+	free(dir);
+
+	if (script != stdin)
+		fclose(script);
+
+	return ret;
 }
 
 
@@ -222,17 +454,24 @@ int format_file(struct BMFSDisk *disk, long bytes)
 
 static void list_entries(struct BMFSDisk *disk)
 {
-	struct BMFSDir dir;
-	int err = bmfs_disk_read_dir(disk, &dir);
+	/* too large for the stack */
+	struct BMFSDir *dir = malloc(sizeof(*dir));
+	if (dir == NULL)
+		return;
+
+	int err = bmfs_disk_read_dir(disk, dir);
 	if (err != 0)
+	{
+		free(dir);
 		return;
+	}
 
 	printf("| Name                             |             Size (B) |       Reserved (MiB) |\n");
 	printf("|----------------------------------|----------------------|----------------------|\n");
-	for (size_t i = 0; i < 64; i++)
+	for (uint64_t i = 0; i < dir->EntryCount; i++)
 	{
 		const struct BMFSEntry *entry;
-		entry = &dir.Entries[i];
+		entry = &dir->Entries[i];
 		if (bmfs_entry_is_empty(entry))
 			continue;
 		else if (bmfs_entry_is_terminator(entry))
@@ -243,6 +482,8 @@ static void list_entries(struct BMFSDisk *disk)
 			       (unsigned long long)(entry->FileSize),
 			       (unsigned long long)(entry->ReservedBlocks * 2));
 	}
+
+	free(dir);
 }
 
 static void print_usage(const char *argv0)
@@ -258,9 +499,16 @@ static void print_usage(const char *argv0)
 	printf("\tcreate : creates a file within a BMFS file system\n");
 	printf("\tdelete : deletes a file within a BMFS file system\n");
 	printf("\tformat : formats an existing file with BMFS\n");
+	printf("\tcompact : removes the entries of deleted files from the directory\n");
+	printf("\textend : makes room for more entries in the root directory (up to %d)\n", BMFS_DIR_ENTRIES_MAX);
+	printf("\tbatch : runs the commands in a file, or stdin, one per line\n");
+	printf("\t        the directory is written once, after the last command\n");
 	printf("\tinitialize : creates an image for the BareMetal operating system\n");
+	printf("\t             the image is sparse, unless --preallocate is given last\n");
 	printf("\n");
 	printf("File: may be used in a read, write, create or delete operation\n");
+	printf("      or is the new number of entries, for extend\n");
+	printf("      or is the script to run, for batch\n");
 }
 
 static void print_version(void)
@@ -0,0 +1,187 @@
+#include <assert.h>
+#include <bmfs/cache.h>
+#include <bmfs/limits.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct DiskData
+{
+	char *buf;
+	uint64_t len;
+	uint64_t pos;
+	uint64_t reads;
+	uint64_t writes;
+};
+
+static int data_seek(void *disk_ptr, int64_t offset, int whence)
+{
+	struct DiskData *disk = (struct DiskData *)(disk_ptr);
+	if (whence == SEEK_SET)
+		disk->pos = offset;
+	else if (whence == SEEK_CUR)
+		disk->pos += offset;
+	else if (whence == SEEK_END)
+		disk->pos = disk->len + offset;
+	return 0;
+}
+
+static int data_tell(void *disk_ptr, int64_t *offset)
+{
+	struct DiskData *disk = (struct DiskData *)(disk_ptr);
+
+	*offset = disk->pos;
+
+	return 0;
+}
+
+static int data_pread(void *disk_ptr, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len)
+{
+	struct DiskData *disk = (struct DiskData *)(disk_ptr);
+
+	if (offset > disk->len)
+		offset = disk->len;
+
+	if ((offset + len) > disk->len)
+		len = disk->len - offset;
+
+	memcpy(buf, &disk->buf[offset], len);
+
+	if (read_len != NULL)
+		*read_len = len;
+
+	disk->reads++;
+
+	return 0;
+}
+
+static int data_pwrite(void *disk_ptr, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len)
+{
+	struct DiskData *disk = (struct DiskData *)(disk_ptr);
+
+	if (offset > disk->len)
+		offset = disk->len;
+
+	if ((offset + len) > disk->len)
+		len = disk->len - offset;
+
+	memcpy(&disk->buf[offset], buf, len);
+
+	if (write_len != NULL)
+		*write_len = len;
+
+	disk->writes++;
+
+	return 0;
+}
+
+int main(void)
+{
+	struct DiskData data;
+
+	data.buf = calloc(1, BMFS_MINIMUM_DISK_SIZE);
+	if (data.buf == NULL)
+		return EXIT_FAILURE;
+	data.len = BMFS_MINIMUM_DISK_SIZE;
+	data.pos = 0;
+	data.reads = 0;
+	data.writes = 0;
+
+	struct BMFSDisk base;
+	bmfs_disk_init(&base);
+	base.disk = &data;
+	base.seek = data_seek;
+	base.tell = data_tell;
+	base.pread = data_pread;
+	base.pwrite = data_pwrite;
+
+	uint64_t memory_size = bmfs_cache_memory_size(4096, 2);
+	void *memory = malloc(memory_size);
+	if (memory == NULL)
+		return EXIT_FAILURE;
+
+	struct BMFSCache cache;
+	struct BMFSDisk disk;
+
+	/* test parameter checking */
+	assert(bmfs_cache_init(&cache, &base, memory, memory_size, 1000, BMFS_CACHE_WRITE_THROUGH) == -EINVAL);
+	assert(bmfs_cache_init(&cache, &base, memory, 16, 4096, BMFS_CACHE_WRITE_THROUGH) == -ENOMEM);
+
+	/* test write-through mode */
+	assert(bmfs_cache_init(&cache, &base, memory, memory_size, 4096, BMFS_CACHE_WRITE_THROUGH) == 0);
+	assert(cache.page_count == 2);
+	assert(bmfs_disk_init_cache(&disk, &cache) == 0);
+
+	assert(bmfs_disk_format(&disk) == 0);
+	assert(memcmp(&data.buf[1024], "BMFS", 4) == 0);
+	/* formatting only writes, so the
+	 * first read loads the page */
+	assert(bmfs_disk_check_tag(&disk) == 0);
+	uint64_t hits = cache.hits;
+	uint64_t misses = cache.misses;
+	uint64_t reads = data.reads;
+	assert(bmfs_disk_check_tag(&disk) == 0);
+	assert(bmfs_disk_check_tag(&disk) == 0);
+	assert(cache.hits == hits + 2);
+	assert(cache.misses == misses);
+	assert(data.reads == reads);
+
+	assert(bmfs_disk_create_file(&disk, "a.txt", 2) == 0);
+	assert(memcmp(&data.buf[4096], "a.txt", 5) == 0);
+	struct BMFSEntry entry;
+	assert(bmfs_disk_find_file(&disk, "a.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 1);
+
+	/* reading a third page evicts the least recently used one */
+	char buf[8];
+	reads = data.reads;
+	assert(bmfs_disk_pread(&disk, buf, sizeof(buf), 8192, NULL) == 0);
+	assert(data.reads == reads + 1);
+	assert(bmfs_disk_pread(&disk, buf, sizeof(buf), 4096, NULL) == 0);
+	assert(data.reads == reads + 1);
+	assert(bmfs_disk_pread(&disk, buf, sizeof(buf), 0, NULL) == 0);
+	assert(data.reads == reads + 2);
+
+	/* test reads that cross a page boundary */
+	assert(bmfs_disk_pwrite(&disk, "abcdefgh", 8, 4092, NULL) == 0);
+	assert(memcmp(&data.buf[4092], "abcdefgh", 8) == 0);
+	assert(bmfs_disk_pread(&disk, buf, 8, 4092, NULL) == 0);
+	assert(memcmp(buf, "abcdefgh", 8) == 0);
+
+	/* test reads at the end of the disk */
+	uint64_t read_len = 0;
+	assert(bmfs_disk_pread(&disk, buf, 8, BMFS_MINIMUM_DISK_SIZE - 4, &read_len) == 0);
+	assert(read_len == 4);
+
+	/* test write-back mode */
+	assert(bmfs_cache_init(&cache, &base, memory, memory_size, 4096, BMFS_CACHE_WRITE_BACK) == 0);
+	assert(bmfs_disk_init_cache(&disk, &cache) == 0);
+
+	assert(bmfs_disk_create_file(&disk, "b.txt", 2) == 0);
+	assert(memcmp(&data.buf[4096 + 64], "b.txt", 5) != 0);
+	assert(bmfs_disk_find_file(&disk, "b.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 2);
+	assert(bmfs_cache_flush(&cache) == 0);
+	assert(memcmp(&data.buf[4096 + 64], "b.txt", 5) == 0);
+	/* the directory and the disk info section */
+	assert(cache.writebacks == 2);
+
+	/* evicting a modified page writes it back */
+	assert(bmfs_disk_pwrite(&disk, "12345678", 8, 0, NULL) == 0);
+	assert(memcmp(&data.buf[0], "12345678", 8) != 0);
+	assert(bmfs_disk_pread(&disk, buf, sizeof(buf), 8192, NULL) == 0);
+	assert(bmfs_disk_pread(&disk, buf, sizeof(buf), 12288, NULL) == 0);
+	assert(memcmp(&data.buf[0], "12345678", 8) == 0);
+
+	/* test invalidation */
+	assert(bmfs_disk_find_file(&disk, "b.txt", NULL, NULL) == 0);
+	memcpy(&data.buf[4096], "c.txt", 6);
+	assert(bmfs_disk_find_file(&disk, "c.txt", NULL, NULL) == -ENOENT);
+	assert(bmfs_cache_invalidate(&cache) == 0);
+	assert(bmfs_disk_find_file(&disk, "c.txt", NULL, NULL) == 0);
+
+	free(memory);
+	free(data.buf);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,471 @@
+#include <bmfs/cache.h>
+
+#include <errno.h>
+#include <string.h>
+
+#define NIL 0xffffffffU
+
+static uint32_t hash_index(const struct BMFSCache *cache, uint64_t index)
+{
+	uint64_t hash = index * 0x9e3779b97f4a7c15ULL;
+	return (uint32_t)((hash >> 32) % cache->page_count);
+}
+
+static unsigned char *page_data(struct BMFSCache *cache, uint32_t i)
+{
+	return &cache->data[i * cache->page_size];
+}
+
+static void lru_unlink(struct BMFSCache *cache, uint32_t i)
+{
+	struct BMFSCachePage *page = &cache->pages[i];
+
+	if (page->lru_prev != NIL)
+		cache->pages[page->lru_prev].lru_next = page->lru_next;
+	else
+		cache->lru_head = page->lru_next;
+
+	if (page->lru_next != NIL)
+		cache->pages[page->lru_next].lru_prev = page->lru_prev;
+	else
+		cache->lru_tail = page->lru_prev;
+
+	page->lru_prev = NIL;
+	page->lru_next = NIL;
+}
+
+static void lru_push_front(struct BMFSCache *cache, uint32_t i)
+{
+	struct BMFSCachePage *page = &cache->pages[i];
+
+	page->lru_prev = NIL;
+	page->lru_next = cache->lru_head;
+
+	if (cache->lru_head != NIL)
+		cache->pages[cache->lru_head].lru_prev = i;
+	else
+		cache->lru_tail = i;
+
+	cache->lru_head = i;
+}
+
+static uint32_t hash_find(const struct BMFSCache *cache, uint64_t index)
+{
+	uint32_t i = cache->buckets[hash_index(cache, index)];
+	while (i != NIL)
+	{
+		if (cache->pages[i].index == index)
+			return i;
+		i = cache->pages[i].hash_next;
+	}
+	return NIL;
+}
+
+static void hash_insert(struct BMFSCache *cache, uint32_t i)
+{
+	uint32_t bucket = hash_index(cache, cache->pages[i].index);
+	cache->pages[i].hash_next = cache->buckets[bucket];
+	cache->buckets[bucket] = i;
+}
+
+static void hash_remove(struct BMFSCache *cache, uint32_t i)
+{
+	uint32_t *link = &cache->buckets[hash_index(cache, cache->pages[i].index)];
+	while (*link != NIL)
+	{
+		if (*link == i)
+		{
+			*link = cache->pages[i].hash_next;
+			break;
+		}
+		link = &cache->pages[*link].hash_next;
+	}
+	cache->pages[i].hash_next = NIL;
+}
+
+static int write_back(struct BMFSCache *cache, uint32_t i)
+{
+	struct BMFSCachePage *page = &cache->pages[i];
+
+	int err = bmfs_disk_pwrite(cache->base,
+	                           page_data(cache, i),
+	                           page->len,
+	                           page->index * cache->page_size,
+	                           NULL);
+	if (err != 0)
+		return err;
+
+	page->dirty = 0;
+	cache->writebacks++;
+
+	return 0;
+}
+
+/* Finds the page at a particular page index,
+ * reading it from the underlying disk if it
+ * is not cached. If the page is going to be
+ * completely overwritten, it doesn't need to
+ * be read. */
+
+static int get_page(struct BMFSCache *cache, uint64_t index, int fill, uint32_t *i_ptr)
+{
+	uint32_t i = hash_find(cache, index);
+	if (i != NIL)
+	{
+		cache->hits++;
+		lru_unlink(cache, i);
+		lru_push_front(cache, i);
+		*i_ptr = i;
+		return 0;
+	}
+
+	cache->misses++;
+
+	/* evict the least recently used page */
+	i = cache->lru_tail;
+
+	struct BMFSCachePage *page = &cache->pages[i];
+	if (page->valid)
+	{
+		if (page->dirty)
+		{
+			int err = write_back(cache, i);
+			if (err != 0)
+				return err;
+		}
+		hash_remove(cache, i);
+		page->valid = 0;
+	}
+
+	page->index = index;
+	page->len = 0;
+
+	if (fill)
+	{
+		uint64_t read_len = 0;
+		int err = bmfs_disk_pread(cache->base,
+		                          page_data(cache, i),
+		                          cache->page_size,
+		                          index * cache->page_size,
+		                          &read_len);
+		if (err != 0)
+			return err;
+		page->len = read_len;
+	}
+
+	page->valid = 1;
+	page->dirty = 0;
+
+	hash_insert(cache, i);
+	lru_unlink(cache, i);
+	lru_push_front(cache, i);
+
+	*i_ptr = i;
+
+	return 0;
+}
+
+static int bmfs_cache_pread(void *cache_ptr, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len)
+{
+	struct BMFSCache *cache = (struct BMFSCache *)(cache_ptr);
+	if ((cache == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	uint64_t total = 0;
+	while (total < len)
+	{
+		uint64_t index = (offset + total) / cache->page_size;
+		uint64_t page_offset = (offset + total) % cache->page_size;
+
+		uint32_t i;
+		int err = get_page(cache, index, 1, &i);
+		if (err != 0)
+			return err;
+
+		const struct BMFSCachePage *page = &cache->pages[i];
+		if (page->len <= page_offset)
+			/* end of disk */
+			break;
+
+		uint64_t count = page->len - page_offset;
+		if (count > (len - total))
+			count = len - total;
+
+		memcpy(((unsigned char *) buf) + total, page_data(cache, i) + page_offset, count);
+
+		total += count;
+
+		if (page->len < cache->page_size)
+			/* end of disk */
+			break;
+	}
+
+	if (read_len != NULL)
+		*read_len = total;
+
+	return 0;
+}
+
+static int bmfs_cache_pwrite(void *cache_ptr, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len)
+{
+	struct BMFSCache *cache = (struct BMFSCache *)(cache_ptr);
+	if ((cache == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	if (cache->mode == BMFS_CACHE_WRITE_THROUGH)
+	{
+		int err = bmfs_disk_pwrite(cache->base, buf, len, offset, &len);
+		if (err != 0)
+			return err;
+	}
+
+	uint64_t total = 0;
+	while (total < len)
+	{
+		uint64_t index = (offset + total) / cache->page_size;
+		uint64_t page_offset = (offset + total) % cache->page_size;
+
+		uint64_t count = cache->page_size - page_offset;
+		if (count > (len - total))
+			count = len - total;
+
+		uint32_t i;
+		if (cache->mode == BMFS_CACHE_WRITE_THROUGH)
+		{
+			/* only update pages that are
+			 * already in the cache */
+			i = hash_find(cache, index);
+		}
+		else
+		{
+			int fill = (page_offset != 0) || (count != cache->page_size);
+			int err = get_page(cache, index, fill, &i);
+			if (err != 0)
+				return err;
+			cache->pages[i].dirty = 1;
+		}
+
+		if (i != NIL)
+		{
+			struct BMFSCachePage *page = &cache->pages[i];
+			if (page->len < page_offset)
+				memset(page_data(cache, i) + page->len, 0, page_offset - page->len);
+			memcpy(page_data(cache, i) + page_offset, ((const unsigned char *) buf) + total, count);
+			if (page->len < (page_offset + count))
+				page->len = page_offset + count;
+		}
+
+		total += count;
+	}
+
+	if (write_len != NULL)
+		*write_len = total;
+
+	return 0;
+}
+
+static int bmfs_cache_seek(void *cache_ptr, int64_t offset, int whence)
+{
+	struct BMFSCache *cache = (struct BMFSCache *)(cache_ptr);
+	if (cache == NULL)
+		return -EFAULT;
+
+	int64_t pos;
+	if (whence == SEEK_SET)
+	{
+		pos = offset;
+	}
+	else if (whence == SEEK_CUR)
+	{
+		pos = ((int64_t)(cache->pos)) + offset;
+	}
+	else if (whence == SEEK_END)
+	{
+		uint64_t size;
+		int err = bmfs_disk_bytes(cache->base, &size);
+		if (err != 0)
+			return err;
+		pos = ((int64_t)(size)) + offset;
+	}
+	else
+	{
+		return -EINVAL;
+	}
+
+	if (pos < 0)
+		return -EINVAL;
+
+	cache->pos = pos;
+
+	return 0;
+}
+
+static int bmfs_cache_tell(void *cache_ptr, int64_t *offset)
+{
+	struct BMFSCache *cache = (struct BMFSCache *)(cache_ptr);
+	if (cache == NULL)
+		return -EFAULT;
+
+	if (offset != NULL)
+		*offset = cache->pos;
+
+	return 0;
+}
+
+static int bmfs_cache_read(void *cache_ptr, void *buf, uint64_t len, uint64_t *read_len)
+{
+	struct BMFSCache *cache = (struct BMFSCache *)(cache_ptr);
+	if (cache == NULL)
+		return -EFAULT;
+
+	uint64_t read_len2 = 0;
+	int err = bmfs_cache_pread(cache, buf, len, cache->pos, &read_len2);
+	if (err != 0)
+		return err;
+
+	cache->pos += read_len2;
+
+	if (read_len != NULL)
+		*read_len = read_len2;
+
+	return 0;
+}
+
+static int bmfs_cache_write(void *cache_ptr, const void *buf, uint64_t len, uint64_t *write_len)
+{
+	struct BMFSCache *cache = (struct BMFSCache *)(cache_ptr);
+	if (cache == NULL)
+		return -EFAULT;
+
+	uint64_t write_len2 = 0;
+	int err = bmfs_cache_pwrite(cache, buf, len, cache->pos, &write_len2);
+	if (err != 0)
+		return err;
+
+	cache->pos += write_len2;
+
+	if (write_len != NULL)
+		*write_len = write_len2;
+
+	return 0;
+}
+
+uint64_t bmfs_cache_memory_size(uint64_t page_size, uint32_t page_count)
+{
+	uint64_t page_cost = page_size;
+	page_cost += sizeof(struct BMFSCachePage);
+	page_cost += sizeof(uint32_t);
+	return page_cost * page_count;
+}
+
+int bmfs_cache_init(struct BMFSCache *cache,
+                    struct BMFSDisk *base,
+                    void *memory,
+                    uint64_t memory_size,
+                    uint64_t page_size,
+                    enum bmfs_cache_mode mode)
+{
+	if ((cache == NULL)
+	 || (base == NULL)
+	 || (memory == NULL))
+		return -EFAULT;
+
+	/* must be a power of two */
+	if ((page_size < 512)
+	 || ((page_size & (page_size - 1)) != 0))
+		return -EINVAL;
+
+	uint64_t page_count = memory_size / bmfs_cache_memory_size(page_size, 1);
+	if (page_count == 0)
+		return -ENOMEM;
+	else if (page_count >= NIL)
+		page_count = NIL - 1;
+
+	cache->base = base;
+	cache->mode = mode;
+	cache->page_size = page_size;
+	cache->page_count = (uint32_t) page_count;
+	cache->data = (unsigned char *) memory;
+	cache->pages = (struct BMFSCachePage *)(cache->data + (page_size * page_count));
+	cache->buckets = (uint32_t *)(&cache->pages[page_count]);
+	cache->lru_head = NIL;
+	cache->lru_tail = NIL;
+	cache->pos = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->writebacks = 0;
+
+	for (uint32_t i = 0; i < cache->page_count; i++)
+	{
+		cache->pages[i].index = 0;
+		cache->pages[i].len = 0;
+		cache->pages[i].hash_next = NIL;
+		cache->pages[i].valid = 0;
+		cache->pages[i].dirty = 0;
+		cache->buckets[i] = NIL;
+		lru_push_front(cache, i);
+	}
+
+	return 0;
+}
+
+int bmfs_cache_flush(struct BMFSCache *cache)
+{
+	if (cache == NULL)
+		return -EFAULT;
+
+	for (uint32_t i = 0; i < cache->page_count; i++)
+	{
+		if (cache->pages[i].valid
+		 && cache->pages[i].dirty)
+		{
+			int err = write_back(cache, i);
+			if (err != 0)
+				return err;
+		}
+	}
+
+	return 0;
+}
+
+int bmfs_cache_invalidate(struct BMFSCache *cache)
+{
+	int err = bmfs_cache_flush(cache);
+	if (err != 0)
+		return err;
+
+	cache->lru_head = NIL;
+	cache->lru_tail = NIL;
+
+	for (uint32_t i = 0; i < cache->page_count; i++)
+	{
+		if (cache->pages[i].valid)
+		{
+			hash_remove(cache, i);
+			cache->pages[i].valid = 0;
+		}
+		lru_push_front(cache, i);
+	}
+
+	return 0;
+}
+
+int bmfs_disk_init_cache(struct BMFSDisk *disk, struct BMFSCache *cache)
+{
+	if ((disk == NULL)
+	 || (cache == NULL))
+		return -EFAULT;
+
+	bmfs_disk_init(disk);
+	disk->disk = cache;
+	disk->seek = bmfs_cache_seek;
+	disk->tell = bmfs_cache_tell;
+	disk->read = bmfs_cache_read;
+	disk->write = bmfs_cache_write;
+	disk->pread = bmfs_cache_pread;
+	disk->pwrite = bmfs_cache_pwrite;
+
+	return 0;
+}
@@ -1,7 +1,9 @@
 #include <bmfs/dir.h>
+#include <bmfs/limits.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -42,6 +44,49 @@ int main(void)
 
 	assert(bmfs_dir_add_file(&dir, "a.txt") == -EEXIST);
 
+	/* test that bytes after the terminator
+	 * of a stored name are ignored */
+	memcpy(dir.Entries[0].FileName, "a.txt\0garbage", 14);
+	assert(bmfs_dir_find(&dir, "a.txt") == &dir.Entries[0]);
+	assert(bmfs_dir_find(&dir, "a.tx") == NULL);
+	assert(bmfs_dir_find(&dir, "a.txt\0other") == &dir.Entries[0]);
+	assert(bmfs_dir_find(&dir, "a.txtgarbage") == NULL);
+
+	/* test names at and past the length limit */
+	assert(bmfs_dir_add_file(&dir, "0123456789012345678901234567890") == 0);
+	assert(bmfs_dir_find(&dir, "0123456789012345678901234567890") == &dir.Entries[1]);
+	assert(bmfs_dir_find(&dir, "01234567890123456789012345678901") == NULL);
+	assert(bmfs_dir_find(&dir, "012345678901234567890123456789") == NULL);
+
+	/* test each lookup, not only the one
+	 * chosen for this processor */
+	const enum bmfs_dir_lookup lookups[] = {
+		BMFS_DIR_LOOKUP_SCALAR,
+		BMFS_DIR_LOOKUP_SSE2,
+		BMFS_DIR_LOOKUP_AVX2
+	};
+	assert(bmfs_dir_lookup_supported(BMFS_DIR_LOOKUP_SCALAR));
+	for (size_t i = 0; i < sizeof(lookups) / sizeof(lookups[0]); i++)
+	{
+		enum bmfs_dir_lookup lookup = lookups[i];
+		if (!bmfs_dir_lookup_supported(lookup))
+		{
+			assert(bmfs_dir_find_with(&dir, "a.txt", lookup) == NULL);
+			continue;
+		}
+		assert(bmfs_dir_find_with(&dir, "a.txt", lookup) == &dir.Entries[0]);
+		assert(bmfs_dir_find_with(&dir, "a.tx", lookup) == NULL);
+		assert(bmfs_dir_find_with(&dir, "a.txtgarbage", lookup) == NULL);
+		assert(bmfs_dir_find_with(&dir, "c.txt", lookup) == &dir.Entries[2]);
+		assert(bmfs_dir_find_with(&dir, "b.txt", lookup) == NULL);
+		assert(bmfs_dir_find_with(&dir, "0123456789012345678901234567890", lookup) == &dir.Entries[1]);
+		assert(bmfs_dir_find_with(&dir, "01234567890123456789012345678901", lookup) == NULL);
+		assert(bmfs_dir_find_with(&dir, "012345678901234567890123456789", lookup) == NULL);
+		assert(bmfs_dir_find_with(&dir, "", lookup) == NULL);
+	}
+	assert(bmfs_dir_delete_file(&dir, "0123456789012345678901234567890") == 0);
+	assert(bmfs_dir_find(&dir, "0123456789012345678901234567890") == NULL);
+
 	/* a.txt */
 	dir.Entries[0].StartingBlock = 42;
 	/* c.txt */
@@ -57,6 +102,94 @@ int main(void)
 	assert(strcmp(dir.Entries[1].FileName, "a.txt.gz") == 0);
 	assert(strcmp(dir.Entries[2].FileName, "c.txt") == 0);
 
+	/* test the index */
+	struct BMFSDirIndex index;
+	bmfs_dir_init(&dir);
+	bmfs_dir_set_index(&dir, &index);
+	for (int i = 0; i < 64; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "file%d", i);
+		assert(bmfs_dir_add_file(&dir, filename) == 0);
+	}
+	assert(bmfs_dir_add_file(&dir, "file7") == -EEXIST);
+	assert(bmfs_dir_add_file(&dir, "more") == -ENOSPC);
+	assert(bmfs_dir_find(&dir, "file7") == &dir.Entries[7]);
+	assert(bmfs_dir_find(&dir, "file64") == NULL);
+	/* deleting must leave the other entries reachable */
+	for (int i = 0; i < 64; i += 2)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "file%d", i);
+		assert(bmfs_dir_delete_file(&dir, filename) == 0);
+		assert(bmfs_dir_find(&dir, filename) == NULL);
+	}
+	for (int i = 1; i < 64; i += 2)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "file%d", i);
+		assert(bmfs_dir_find(&dir, filename) == &dir.Entries[i]);
+	}
+	assert(bmfs_dir_add_file(&dir, "new") == 0);
+	assert(bmfs_dir_find(&dir, "new") == &dir.Entries[0]);
+	assert(bmfs_dir_sort(&dir, NULL) == 0);
+	assert(bmfs_dir_find(&dir, "new") == &dir.Entries[32]);
+	assert(bmfs_dir_find(&dir, "file1") == &dir.Entries[0]);
+	bmfs_dir_set_index(&dir, NULL);
+	assert(bmfs_dir_find(&dir, "new") == &dir.Entries[32]);
+
+	/* test that the stable sort keeps the
+	 * order of entries that compare equal */
+	bmfs_dir_init(&dir);
+	for (int i = 0; i < 64; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "%02d.txt", i);
+		assert(bmfs_dir_add_file(&dir, filename) == 0);
+		dir.Entries[i].StartingBlock = 64 - (i / 2);
+	}
+	assert(bmfs_dir_sort_stable(&dir, bmfs_entry_cmp_by_starting_block) == 0);
+	for (int i = 0; i < 64; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "%02d.txt", 62 - ((i / 2) * 2) + (i % 2));
+		assert(strcmp(dir.Entries[i].FileName, filename) == 0);
+		assert(dir.Entries[i].StartingBlock == (uint64_t)(33 + (i / 2)));
+	}
+	assert(bmfs_dir_sort(&dir, NULL) == 0);
+	assert(strcmp(dir.Entries[0].FileName, "00.txt") == 0);
+	assert(strcmp(dir.Entries[63].FileName, "63.txt") == 0);
+
+	/* test compaction */
+	bmfs_dir_init(&dir);
+	bmfs_dir_set_index(&dir, &index);
+	for (int i = 0; i < 32; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "file%d", i);
+		assert(bmfs_dir_add_file(&dir, filename) == 0);
+	}
+	for (int i = 0; i < 8; i++)
+	{
+		char filename[BMFS_FILE_NAME_MAX];
+		snprintf(filename, sizeof(filename), "file%d", i * 3);
+		assert(!bmfs_dir_should_compact(&dir));
+		assert(bmfs_dir_delete_file(&dir, filename) == 0);
+	}
+	assert(bmfs_dir_should_compact(&dir));
+	assert(bmfs_dir_compact(&dir) == 8);
+	assert(!bmfs_dir_should_compact(&dir));
+	assert(strcmp(dir.Entries[0].FileName, "file1") == 0);
+	assert(strcmp(dir.Entries[1].FileName, "file2") == 0);
+	assert(strcmp(dir.Entries[2].FileName, "file4") == 0);
+	assert(strcmp(dir.Entries[23].FileName, "file31") == 0);
+	assert(bmfs_entry_is_terminator(&dir.Entries[24]));
+	assert(bmfs_dir_find(&dir, "file31") == &dir.Entries[23]);
+	assert(bmfs_dir_find(&dir, "file3") == NULL);
+	assert(bmfs_dir_compact(&dir) == 0);
+	assert(bmfs_dir_add_file(&dir, "new") == 0);
+	assert(bmfs_dir_find(&dir, "new") == &dir.Entries[24]);
+
 	return EXIT_SUCCESS;
 }
 
@@ -3,19 +3,69 @@
 /* v1.2.3 (2017 04 07) */
 
 #include <bmfs/dir.h>
+#include <bmfs/limits.h>
 #include <errno.h>
+#include <string.h>
 
-static int sort_entries(struct BMFSEntry *a,
-                        struct BMFSEntry *b,
-                        int (*entry_cmp)(const struct BMFSEntry *a,
-                                         const struct BMFSEntry *b));
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(BMFS_NO_SIMD)
+#define BMFS_DIR_SIMD
+#include <immintrin.h>
+#endif
+
+typedef int (*entry_cmp_f)(const struct BMFSEntry *a, const struct BMFSEntry *b);
+
+static void sort_indices(const struct BMFSEntry *entries,
+                         uint16_t *indices,
+                         uint16_t *scratch,
+                         size_t count,
+                         entry_cmp_f entry_cmp);
+
+static void permute_entries(struct BMFSEntry *entries,
+                            uint16_t *indices,
+                            size_t count);
+
+static void index_insert(struct BMFSDir *dir, size_t position);
+
+static void index_remove(struct BMFSDir *dir, size_t position);
 
 void bmfs_dir_init(struct BMFSDir *dir)
 {
-	for (uint64_t i = 0; i < 64; i++)
+	bmfs_dir_init_extended(dir, BMFS_DIR_PAGE_ENTRIES);
+}
+
+int bmfs_dir_init_extended(struct BMFSDir *dir, uint64_t entry_count)
+{
+	if (dir == NULL)
+		return -EFAULT;
+	else if ((entry_count == 0)
+	      || (entry_count > BMFS_DIR_ENTRIES_MAX)
+	      || ((entry_count % BMFS_DIR_PAGE_ENTRIES) != 0))
+		return -EINVAL;
+
+	for (uint64_t i = 0; i < entry_count; i++)
 	{
 		bmfs_entry_init(&dir->Entries[i]);
 	}
+
+	/* so that lookups stop at the
+	 * end of the first page, until
+	 * the other pages are used */
+	if (entry_count > BMFS_DIR_PAGE_ENTRIES)
+		dir->Entries[BMFS_DIR_PAGE_ENTRIES].FileName[0] = 0;
+
+	dir->EntryCount = entry_count;
+	/* every page has to be written */
+	dir->DirtyPages = (entry_count == BMFS_DIR_ENTRIES_MAX)
+	                ? ~0ULL
+	                : ((1ULL << (entry_count / BMFS_DIR_PAGE_ENTRIES)) - 1);
+	dir->Index = NULL;
+
+	return 0;
+}
+
+void bmfs_dir_mark_dirty(struct BMFSDir *dir, const struct BMFSEntry *entry)
+{
+	dir->DirtyPages |= 1ULL << ((entry - &dir->Entries[0]) / BMFS_DIR_PAGE_ENTRIES);
 }
 
 int bmfs_dir_add(struct BMFSDir *dir, const struct BMFSEntry *entry)
@@ -23,22 +73,29 @@ int bmfs_dir_add(struct BMFSDir *dir, const struct BMFSEntry *entry)
 	if (bmfs_dir_find(dir, entry->FileName) != NULL)
 		return -EEXIST;
 
-	for (size_t i = 0; i < 64; i++)
+	for (size_t i = 0; i < dir->EntryCount; i++)
 	{
 		struct BMFSEntry *dst;
 		dst = &dir->Entries[i];
 		if (bmfs_entry_is_empty(dst))
 		{
 			*dst = *entry;
+			bmfs_dir_mark_dirty(dir, dst);
+			index_insert(dir, i);
 			return 0;
 		}
 		else if (bmfs_entry_is_terminator(dst))
 		{
 			*dst = *entry;
-			if ((i + 1) < 64)
+			bmfs_dir_mark_dirty(dir, dst);
+			if ((i + 1) < dir->EntryCount)
+			{
 				/* make sure next entry
 				 * indicates end of directory */
 				dir->Entries[i + 1].FileName[0] = 0;
+				bmfs_dir_mark_dirty(dir, &dir->Entries[i + 1]);
+			}
+			index_insert(dir, i);
 			return 0;
 		}
 	}
@@ -67,46 +124,281 @@ int bmfs_dir_delete_file(struct BMFSDir *dir, const char *filename)
 	if (entry == NULL)
 		return -ENOENT;
 
+	/* the name is still needed
+	 * to find it in the index */
+	index_remove(dir, entry - &dir->Entries[0]);
+
 	entry->FileName[0] = 1;
 
+	bmfs_dir_mark_dirty(dir, entry);
+
 	return 0;
 }
 
+int bmfs_dir_compact(struct BMFSDir *dir)
+{
+	if (dir == NULL)
+		return -EFAULT;
+
+	uint64_t dst = 0;
+	uint64_t src = 0;
+	/* one past the last file */
+	uint64_t end = 0;
+
+	for (; src < dir->EntryCount; src++)
+	{
+		struct BMFSEntry *entry = &dir->Entries[src];
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			continue;
+
+		if (dst != src)
+		{
+			dir->Entries[dst] = *entry;
+			bmfs_dir_mark_dirty(dir, &dir->Entries[dst]);
+		}
+
+		dst++;
+		end = src + 1;
+	}
+
+	/* empty entries after the last
+	 * file aren't counted, but the
+	 * terminator is still moved in
+	 * front of them */
+	uint64_t removed = end - dst;
+
+	/* the entries that were moved are
+	 * cleared, so that no stale names
+	 * remain past the terminator */
+	for (uint64_t i = dst; i < end; i++)
+	{
+		memset(&dir->Entries[i], 0, sizeof(dir->Entries[i]));
+		bmfs_entry_init(&dir->Entries[i]);
+		bmfs_dir_mark_dirty(dir, &dir->Entries[i]);
+	}
+
+	if ((dst < dir->EntryCount)
+	 && !bmfs_entry_is_terminator(&dir->Entries[dst]))
+	{
+		dir->Entries[dst].FileName[0] = 0;
+		bmfs_dir_mark_dirty(dir, &dir->Entries[dst]);
+	}
+
+	if (removed > 0)
+		bmfs_dir_rebuild_index(dir);
+
+	return (int) removed;
+}
+
+int bmfs_dir_should_compact(const struct BMFSDir *dir)
+{
+	if (dir == NULL)
+		return 0;
+
+	/* entries after the last file are
+	 * not counted, since compacting the
+	 * directory wouldn't make lookups
+	 * any faster for them */
+	uint64_t deleted = 0;
+	uint64_t trailing = 0;
+	uint64_t count = 0;
+
+	for (; count < dir->EntryCount; count++)
+	{
+		const struct BMFSEntry *entry = &dir->Entries[count];
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			trailing++;
+		else
+		{
+			deleted += trailing;
+			trailing = 0;
+		}
+	}
+
+	count -= trailing;
+
+	return (deleted >= BMFS_DIR_COMPACT_MIN)
+	    && ((deleted * 4) >= count);
+}
+
 int bmfs_dir_sort(struct BMFSDir *dir, int (*entry_cmp)(const struct BMFSEntry *a, const struct BMFSEntry *b))
 {
+	return bmfs_dir_sort_stable(dir, entry_cmp);
+}
+
+int bmfs_dir_sort_stable(struct BMFSDir *dir, int (*entry_cmp)(const struct BMFSEntry *a, const struct BMFSEntry *b))
+{
+	if (dir == NULL)
+		return -EFAULT;
+
 	if (entry_cmp == NULL)
 		entry_cmp = bmfs_entry_cmp_by_filename;
 
-	size_t i;
-	struct BMFSEntry *a;
-	struct BMFSEntry *b;
-	int mod_flag = 0;
+	/* only the entries before the
+	 * terminator are sorted */
+	size_t count = 0;
+	while ((count < dir->EntryCount)
+	    && !bmfs_entry_is_terminator(&dir->Entries[count]))
+		count++;
 
-	do {
-		mod_flag = 0;
-		for (i = 0; i < 64 - 1; i++)
-		{
-			a = &dir->Entries[i];
-			if (bmfs_entry_is_terminator(a))
-				break;
+	/* the entries are 64 bytes each, so
+	 * their indices are sorted instead and
+	 * each entry is moved only once */
+	uint16_t indices[BMFS_DIR_ENTRIES_MAX];
+	uint16_t scratch[BMFS_DIR_ENTRIES_MAX];
 
-			b = &dir->Entries[i + 1];
-			if (bmfs_entry_is_terminator(b))
-				break;
+	for (size_t i = 0; i < count; i++)
+		indices[i] = i;
 
-			mod_flag |= sort_entries(a, b, entry_cmp);
-		}
-	} while (mod_flag);
+	sort_indices(dir->Entries, indices, scratch, count, entry_cmp);
+
+	permute_entries(dir->Entries, indices, count);
+
+	for (size_t i = 0; i < count; i += BMFS_DIR_PAGE_ENTRIES)
+		bmfs_dir_mark_dirty(dir, &dir->Entries[i]);
+
+	bmfs_dir_rebuild_index(dir);
 
 	return 0;
 }
 
-struct BMFSEntry * bmfs_dir_find(struct BMFSDir *dir, const char *filename)
+/* FNV-1a, over the bytes of the
+ * name before the terminator. */
+
+static uint32_t hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (uint64_t i = 0; (i < BMFS_FILE_NAME_MAX) && (name[i] != 0); i++)
+	{
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static size_t index_home(const struct BMFSEntry *entry)
+{
+	return hash_name(entry->FileName) & (BMFS_DIR_INDEX_SIZE - 1);
+}
+
+static void index_insert(struct BMFSDir *dir, size_t position)
+{
+	struct BMFSDirIndex *index = dir->Index;
+	if (index == NULL)
+		return;
+
+	/* linear probing, there are always
+	 * more slots than entries */
+	size_t slot = index_home(&dir->Entries[position]);
+	while (index->Slots[slot] != 0)
+		slot = (slot + 1) & (BMFS_DIR_INDEX_SIZE - 1);
+
+	index->Slots[slot] = position + 1;
+}
+
+static void index_remove(struct BMFSDir *dir, size_t position)
+{
+	struct BMFSDirIndex *index = dir->Index;
+	if (index == NULL)
+		return;
+
+	size_t slot = index_home(&dir->Entries[position]);
+	while (index->Slots[slot] != (position + 1))
+	{
+		if (index->Slots[slot] == 0)
+			/* not indexed */
+			return;
+		slot = (slot + 1) & (BMFS_DIR_INDEX_SIZE - 1);
+	}
+
+	/* move later entries of the probe sequence
+	 * back, so that lookups don't stop at the
+	 * empty slot before reaching them */
+	size_t next = slot;
+	while (1)
+	{
+		next = (next + 1) & (BMFS_DIR_INDEX_SIZE - 1);
+		if (index->Slots[next] == 0)
+			break;
+
+		size_t home = index_home(&dir->Entries[index->Slots[next] - 1]);
+
+		/* the entry can only move back if its home
+		 * slot is not between the empty slot and
+		 * where it is now, wrapping around */
+		int stays;
+		if (slot <= next)
+			stays = (slot < home) && (home <= next);
+		else
+			stays = (slot < home) || (home <= next);
+
+		if (stays)
+			continue;
+
+		index->Slots[slot] = index->Slots[next];
+		slot = next;
+	}
+
+	index->Slots[slot] = 0;
+}
+
+void bmfs_dir_set_index(struct BMFSDir *dir, struct BMFSDirIndex *index)
+{
+	dir->Index = index;
+
+	bmfs_dir_rebuild_index(dir);
+}
+
+void bmfs_dir_rebuild_index(struct BMFSDir *dir)
+{
+	if (dir->Index == NULL)
+		return;
+
+	for (size_t i = 0; i < BMFS_DIR_INDEX_SIZE; i++)
+		dir->Index->Slots[i] = 0;
+
+	for (size_t i = 0; i < dir->EntryCount; i++)
+	{
+		const struct BMFSEntry *entry = &dir->Entries[i];
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			continue;
+
+		index_insert(dir, i);
+	}
+}
+
+static struct BMFSEntry *find_indexed(struct BMFSDir *dir, const char *filename)
+{
+	const struct BMFSDirIndex *index = dir->Index;
+
+	size_t slot = hash_name(filename) & (BMFS_DIR_INDEX_SIZE - 1);
+
+	while (index->Slots[slot] != 0)
+	{
+		struct BMFSEntry *entry = &dir->Entries[index->Slots[slot] - 1];
+		if (bmfs_entry_cmp_filename(entry, filename) == 0)
+			return entry;
+
+		slot = (slot + 1) & (BMFS_DIR_INDEX_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+static struct BMFSEntry *find_scalar(struct BMFSDir *dir, const char *filename)
 {
 	int tint;
 	struct BMFSEntry *entry;
 
-	for (tint = 0; tint < 64; tint++)
+	for (tint = 0; tint < (int) dir->EntryCount; tint++)
 	{
 		entry = &dir->Entries[tint];
 		if (bmfs_entry_is_terminator(entry))
@@ -127,21 +419,252 @@ struct BMFSEntry * bmfs_dir_find(struct BMFSDir *dir, const char *filename)
 	return NULL;
 }
 
-static int sort_entries(struct BMFSEntry *a,
-                        struct BMFSEntry *b,
-                        int (*entry_cmp)(const struct BMFSEntry *a,
-                                         const struct BMFSEntry *b))
+#ifdef BMFS_DIR_SIMD
+
+/* The vector lookups compare the whole name
+ * field of an entry at once, against a copy of
+ * the query padded with zeros. Bytes after the
+ * null terminator of a stored name may be left
+ * over from an older name, so only the bytes up
+ * to and including the query's terminator have
+ * to match. Those are selected by the bit mask,
+ * one bit per byte. */
+
+static struct BMFSEntry *find_sse2(struct BMFSDir *dir, const char *query, uint32_t mask)
+{
+	__m128i query_lo = _mm_loadu_si128((const __m128i *) &query[0]);
+	__m128i query_hi = _mm_loadu_si128((const __m128i *) &query[16]);
+
+	for (uint64_t i = 0; i < dir->EntryCount; i++)
+	{
+		struct BMFSEntry *entry = &dir->Entries[i];
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			continue;
+
+		__m128i name_lo = _mm_loadu_si128((const __m128i *) &entry->FileName[0]);
+		__m128i name_hi = _mm_loadu_si128((const __m128i *) &entry->FileName[16]);
+
+		uint32_t equal = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(name_lo, query_lo));
+		equal |= ((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(name_hi, query_hi))) << 16;
+
+		if ((equal & mask) == mask)
+			return entry;
+	}
+
+	return NULL;
+}
+
+__attribute__((target("avx2")))
+static struct BMFSEntry *find_avx2(struct BMFSDir *dir, const char *query, uint32_t mask)
+{
+	__m256i query_vec = _mm256_loadu_si256((const __m256i *) query);
+
+	for (uint64_t i = 0; i < dir->EntryCount; i++)
+	{
+		struct BMFSEntry *entry = &dir->Entries[i];
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			continue;
+
+		__m256i name = _mm256_loadu_si256((const __m256i *) entry->FileName);
+
+		uint32_t equal = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(name, query_vec));
+
+		if ((equal & mask) == mask)
+			return entry;
+	}
+
+	return NULL;
+}
+
+#endif /* BMFS_DIR_SIMD */
+
+#ifdef BMFS_DIR_SIMD
+
+/* Copies the query into a buffer the size of the
+ * name field, padded with zeros, and computes the
+ * mask of bytes to compare. Returns zero if the name
+ * fills the whole field, which only the scalar
+ * comparison handles. */
+
+static int make_query(const char *filename, char *query, uint32_t *mask)
 {
-	int res;
-	struct BMFSEntry tmp;
-	res = entry_cmp(a, b);
-	if (res > 0)
+	uint64_t len = 0;
+
+	while ((len < BMFS_FILE_NAME_MAX) && (filename[len] != 0))
 	{
-		tmp = *a;
-		*a = *b;
-		*b = tmp;
+		query[len] = filename[len];
+		len++;
+	}
+
+	if (len >= BMFS_FILE_NAME_MAX)
+		return 0;
+
+	for (uint64_t i = len; i < BMFS_FILE_NAME_MAX; i++)
+		query[i] = 0;
+
+	/* compare up to and including the terminator */
+	*mask = (uint32_t)((2ULL << len) - 1);
+
+	return 1;
+}
+
+#endif /* BMFS_DIR_SIMD */
+
+int bmfs_dir_lookup_supported(enum bmfs_dir_lookup lookup)
+{
+	switch (lookup)
+	{
+	case BMFS_DIR_LOOKUP_SCALAR:
 		return 1;
+#ifdef BMFS_DIR_SIMD
+	case BMFS_DIR_LOOKUP_SSE2:
+		/* part of x86-64 */
+		return 1;
+	case BMFS_DIR_LOOKUP_AVX2:
+		return __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif /* BMFS_DIR_SIMD */
+	default:
+		break;
 	}
+
 	return 0;
 }
 
+struct BMFSEntry * bmfs_dir_find_with(struct BMFSDir *dir,
+                                      const char *filename,
+                                      enum bmfs_dir_lookup lookup)
+{
+	if (!bmfs_dir_lookup_supported(lookup))
+		return NULL;
+	else if (lookup == BMFS_DIR_LOOKUP_SCALAR)
+		return find_scalar(dir, filename);
+
+#ifdef BMFS_DIR_SIMD
+
+	char query[BMFS_FILE_NAME_MAX];
+	uint32_t mask;
+
+	if (!make_query(filename, query, &mask))
+		return find_scalar(dir, filename);
+	else if (lookup == BMFS_DIR_LOOKUP_AVX2)
+		return find_avx2(dir, query, mask);
+	else
+		return find_sse2(dir, query, mask);
+
+#else /* BMFS_DIR_SIMD */
+
+	return NULL;
+
+#endif /* BMFS_DIR_SIMD */
+}
+
+struct BMFSEntry * bmfs_dir_find(struct BMFSDir *dir, const char *filename)
+{
+	if (dir->Index != NULL)
+		return find_indexed(dir, filename);
+
+#ifdef BMFS_DIR_SIMD
+
+	char query[BMFS_FILE_NAME_MAX];
+	uint32_t mask;
+
+	if (!make_query(filename, query, &mask))
+		/* the stored name would have to fill the
+		 * whole field without a terminator, which
+		 * only the scalar comparison handles */
+		return find_scalar(dir, filename);
+
+	if (__builtin_cpu_supports("avx2"))
+		return find_avx2(dir, query, mask);
+	else
+		return find_sse2(dir, query, mask);
+
+#else /* BMFS_DIR_SIMD */
+
+	return find_scalar(dir, filename);
+
+#endif /* BMFS_DIR_SIMD */
+}
+
+/* A bottom-up merge sort. Runs that are
+ * already in order aren't merged, so a
+ * sorted directory takes one comparison
+ * per pair of runs. */
+
+static void sort_indices(const struct BMFSEntry *entries,
+                         uint16_t *indices,
+                         uint16_t *scratch,
+                         size_t count,
+                         entry_cmp_f entry_cmp)
+{
+	for (size_t width = 1; width < count; width *= 2)
+	{
+		for (size_t lo = 0; lo < (count - width); lo += width * 2)
+		{
+			size_t mid = lo + width;
+			size_t hi = mid + width;
+			if (hi > count)
+				hi = count;
+
+			if (entry_cmp(&entries[indices[mid - 1]], &entries[indices[mid]]) <= 0)
+				continue;
+
+			size_t a = lo;
+			size_t b = mid;
+			size_t out = lo;
+
+			while ((a < mid) && (b < hi))
+			{
+				/* taking from the left run on ties
+				 * is what makes the sort stable */
+				if (entry_cmp(&entries[indices[b]], &entries[indices[a]]) < 0)
+					scratch[out++] = indices[b++];
+				else
+					scratch[out++] = indices[a++];
+			}
+
+			while (a < mid)
+				scratch[out++] = indices[a++];
+
+			while (b < hi)
+				scratch[out++] = indices[b++];
+
+			for (size_t i = lo; i < hi; i++)
+				indices[i] = scratch[i];
+		}
+	}
+}
+
+/* Moves the entries into sorted order by
+ * following the cycles of the permutation,
+ * so only one entry needs to be copied to
+ * temporary storage per cycle. */
+
+static void permute_entries(struct BMFSEntry *entries,
+                            uint16_t *indices,
+                            size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (indices[i] == i)
+			continue;
+
+		struct BMFSEntry tmp = entries[i];
+		size_t j = i;
+
+		while (indices[j] != i)
+		{
+			size_t k = indices[j];
+			entries[j] = entries[k];
+			indices[j] = j;
+			j = k;
+		}
+
+		entries[j] = tmp;
+		indices[j] = j;
+	}
+}
@@ -0,0 +1,467 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <bmfs/direct.h>
+#include <bmfs/limits.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define ALIGN_DOWN(x) ((x) & ~(BMFS_DIRECT_ALIGNMENT - 1))
+
+#define ALIGN_UP(x) ALIGN_DOWN((x) + (BMFS_DIRECT_ALIGNMENT - 1))
+
+static int is_aligned(const void *buf, uint64_t len, uint64_t offset)
+{
+	return ((((uintptr_t) buf) % BMFS_DIRECT_ALIGNMENT) == 0)
+	    && ((len % BMFS_DIRECT_ALIGNMENT) == 0)
+	    && ((offset % BMFS_DIRECT_ALIGNMENT) == 0);
+}
+
+/* Reads until either the length is
+ * satisfied or the end of the disk
+ * is reached. */
+
+static int read_fully(int fd, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len)
+{
+	uint64_t total = 0;
+	while (total < len)
+	{
+		ssize_t result = pread(fd, ((char *) buf) + total, len - total, offset + total);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		else if (result == 0)
+			break;
+		total += result;
+	}
+
+	*read_len = total;
+
+	return 0;
+}
+
+static int write_fully(int fd, const void *buf, uint64_t len, uint64_t offset)
+{
+	uint64_t total = 0;
+	while (total < len)
+	{
+		ssize_t result = pwrite(fd, ((const char *) buf) + total, len - total, offset + total);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		else if (result == 0)
+			return -EIO;
+		total += result;
+	}
+
+	return 0;
+}
+
+static unsigned int get_buffer(struct BMFSDirect *direct)
+{
+	pthread_mutex_lock(&direct->lock);
+
+	for (;;)
+	{
+		for (unsigned int i = 0; i < direct->buffer_count; i++)
+		{
+			if (!(direct->buffers_used & (1U << i)))
+			{
+				direct->buffers_used |= 1U << i;
+				pthread_mutex_unlock(&direct->lock);
+				return i;
+			}
+		}
+		pthread_cond_wait(&direct->cond, &direct->lock);
+	}
+}
+
+static void put_buffer(struct BMFSDirect *direct, unsigned int i)
+{
+	pthread_mutex_lock(&direct->lock);
+	direct->buffers_used &= ~(1U << i);
+	pthread_cond_signal(&direct->cond);
+	pthread_mutex_unlock(&direct->lock);
+}
+
+/* Locks the sectors at the given offsets. Either
+ * offset may be UINT64_MAX, if that sector isn't
+ * partially written. The locks are taken in order,
+ * so that two writers can't deadlock. */
+
+static void lock_sectors(struct BMFSDirect *direct, uint64_t a, uint64_t b, unsigned int *locks)
+{
+	locks[0] = BMFS_DIRECT_SECTOR_LOCKS;
+	locks[1] = BMFS_DIRECT_SECTOR_LOCKS;
+
+	if (a != UINT64_MAX)
+		locks[0] = (a / BMFS_DIRECT_ALIGNMENT) % BMFS_DIRECT_SECTOR_LOCKS;
+
+	if (b != UINT64_MAX)
+		locks[1] = (b / BMFS_DIRECT_ALIGNMENT) % BMFS_DIRECT_SECTOR_LOCKS;
+
+	if (locks[0] == locks[1])
+		locks[1] = BMFS_DIRECT_SECTOR_LOCKS;
+	else if (locks[0] > locks[1])
+	{
+		unsigned int tmp = locks[0];
+		locks[0] = locks[1];
+		locks[1] = tmp;
+	}
+
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		if (locks[i] < BMFS_DIRECT_SECTOR_LOCKS)
+			pthread_mutex_lock(&direct->sector_locks[locks[i]]);
+	}
+}
+
+static void unlock_sectors(struct BMFSDirect *direct, const unsigned int *locks)
+{
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		if (locks[i] < BMFS_DIRECT_SECTOR_LOCKS)
+			pthread_mutex_unlock(&direct->sector_locks[locks[i]]);
+	}
+}
+
+static int bmfs_direct_seek(void *direct_ptr, int64_t offset, int whence)
+{
+	struct BMFSDirect *direct = (struct BMFSDirect *)(direct_ptr);
+	if (direct == NULL)
+		return -EFAULT;
+
+	int64_t pos;
+	if (whence == SEEK_SET)
+		pos = offset;
+	else if (whence == SEEK_CUR)
+		pos = ((int64_t)(direct->pos)) + offset;
+	else if (whence == SEEK_END)
+		pos = ((int64_t)(direct->size)) + offset;
+	else
+		return -EINVAL;
+
+	if (pos < 0)
+		return -EINVAL;
+
+	direct->pos = pos;
+
+	return 0;
+}
+
+static int bmfs_direct_tell(void *direct_ptr, int64_t *offset)
+{
+	struct BMFSDirect *direct = (struct BMFSDirect *)(direct_ptr);
+	if (direct == NULL)
+		return -EFAULT;
+
+	if (offset != NULL)
+		*offset = direct->pos;
+
+	return 0;
+}
+
+static int bmfs_direct_pread(void *direct_ptr, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len)
+{
+	struct BMFSDirect *direct = (struct BMFSDirect *)(direct_ptr);
+	if ((direct == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	if (offset > direct->size)
+		offset = direct->size;
+
+	if (len > (direct->size - offset))
+		len = direct->size - offset;
+
+	if (is_aligned(buf, len, offset))
+	{
+		uint64_t total = 0;
+		int err = read_fully(direct->fd, buf, len, offset, &total);
+		if (err != 0)
+			return err;
+		if (read_len != NULL)
+			*read_len = total;
+		return 0;
+	}
+
+	unsigned int i = get_buffer(direct);
+	unsigned char *block = direct->buffers[i];
+
+	uint64_t total = 0;
+	while (total < len)
+	{
+		uint64_t start = ALIGN_DOWN(offset + total);
+		uint64_t head = (offset + total) - start;
+		uint64_t span = ALIGN_UP(head + (len - total));
+		if (span > BMFS_BLOCK_SIZE)
+			span = BMFS_BLOCK_SIZE;
+
+		uint64_t span_read = 0;
+		int err = read_fully(direct->fd, block, span, start, &span_read);
+		if (err != 0)
+		{
+			put_buffer(direct, i);
+			return err;
+		}
+		else if (span_read <= head)
+			/* end of disk */
+			break;
+
+		uint64_t count = span_read - head;
+		if (count > (len - total))
+			count = len - total;
+
+		memcpy(((unsigned char *) buf) + total, &block[head], count);
+
+		total += count;
+	}
+
+	put_buffer(direct, i);
+
+	if (read_len != NULL)
+		*read_len = total;
+
+	return 0;
+}
+
+static int bmfs_direct_pwrite(void *direct_ptr, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len)
+{
+	struct BMFSDirect *direct = (struct BMFSDirect *)(direct_ptr);
+	if ((direct == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	/* the size of the disk is fixed when
+	 * it's opened, so a write past its end
+	 * is rejected instead of being cut short */
+	if ((offset > direct->size)
+	 || (len > (direct->size - offset)))
+		return -ENOSPC;
+
+	if (is_aligned(buf, len, offset))
+	{
+		int err = write_fully(direct->fd, buf, len, offset);
+		if (err != 0)
+			return err;
+		if (write_len != NULL)
+			*write_len = len;
+		return 0;
+	}
+
+	unsigned int i = get_buffer(direct);
+	unsigned char *block = direct->buffers[i];
+
+	uint64_t total = 0;
+	while (total < len)
+	{
+		uint64_t start = ALIGN_DOWN(offset + total);
+		uint64_t head = (offset + total) - start;
+		uint64_t span = ALIGN_UP(head + (len - total));
+		if (span > BMFS_BLOCK_SIZE)
+			span = BMFS_BLOCK_SIZE;
+
+		uint64_t count = span - head;
+		if (count > (len - total))
+			count = len - total;
+
+		uint64_t tail = head + count;
+
+		uint64_t first = UINT64_MAX;
+		if (head != 0)
+			first = start;
+
+		uint64_t last = UINT64_MAX;
+		if (((tail % BMFS_DIRECT_ALIGNMENT) != 0)
+		 && ((head == 0) || (span > BMFS_DIRECT_ALIGNMENT)))
+			last = span - BMFS_DIRECT_ALIGNMENT;
+
+		/* read the sectors that are only
+		 * partially overwritten */
+		unsigned int locks[2];
+		lock_sectors(direct, first, (last == UINT64_MAX) ? last : start + last, locks);
+
+		int err = 0;
+		uint64_t unused;
+		if (first != UINT64_MAX)
+		{
+			memset(block, 0, BMFS_DIRECT_ALIGNMENT);
+			err = read_fully(direct->fd, block, BMFS_DIRECT_ALIGNMENT, start, &unused);
+		}
+		if ((err == 0)
+		 && (last != UINT64_MAX))
+		{
+			memset(&block[last], 0, BMFS_DIRECT_ALIGNMENT);
+			err = read_fully(direct->fd, &block[last], BMFS_DIRECT_ALIGNMENT, start + last, &unused);
+		}
+
+		if (err == 0)
+		{
+			memcpy(&block[head], ((const unsigned char *) buf) + total, count);
+			err = write_fully(direct->fd, block, span, start);
+		}
+
+		unlock_sectors(direct, locks);
+
+		if (err != 0)
+		{
+			put_buffer(direct, i);
+			return err;
+		}
+
+		total += count;
+	}
+
+	put_buffer(direct, i);
+
+	if (write_len != NULL)
+		*write_len = total;
+
+	return 0;
+}
+
+static int bmfs_direct_read(void *direct_ptr, void *buf, uint64_t len, uint64_t *read_len)
+{
+	struct BMFSDirect *direct = (struct BMFSDirect *)(direct_ptr);
+	if (direct == NULL)
+		return -EFAULT;
+
+	uint64_t read_len2 = 0;
+	int err = bmfs_direct_pread(direct, buf, len, direct->pos, &read_len2);
+	if (err != 0)
+		return err;
+
+	direct->pos += read_len2;
+
+	if (read_len != NULL)
+		*read_len = read_len2;
+
+	return 0;
+}
+
+static int bmfs_direct_write(void *direct_ptr, const void *buf, uint64_t len, uint64_t *write_len)
+{
+	struct BMFSDirect *direct = (struct BMFSDirect *)(direct_ptr);
+	if (direct == NULL)
+		return -EFAULT;
+
+	uint64_t write_len2 = 0;
+	int err = bmfs_direct_pwrite(direct, buf, len, direct->pos, &write_len2);
+	if (err != 0)
+		return err;
+
+	direct->pos += write_len2;
+
+	if (write_len != NULL)
+		*write_len = write_len2;
+
+	return 0;
+}
+
+int bmfs_direct_init(struct BMFSDirect *direct,
+                     const char *path,
+                     int writable,
+                     unsigned int buffer_count)
+{
+	if ((direct == NULL)
+	 || (path == NULL))
+		return -EFAULT;
+
+	if (buffer_count == 0)
+		buffer_count = 2;
+	else if (buffer_count > BMFS_DIRECT_BUFFERS_MAX)
+		return -EINVAL;
+
+	int fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0)
+		return -errno;
+
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < 0)
+	{
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	direct->fd = fd;
+	direct->size = size;
+	direct->pos = 0;
+	direct->buffer_count = 0;
+	direct->buffers_used = 0;
+
+	pthread_mutex_init(&direct->lock, NULL);
+	pthread_cond_init(&direct->cond, NULL);
+
+	for (unsigned int i = 0; i < BMFS_DIRECT_SECTOR_LOCKS; i++)
+		pthread_mutex_init(&direct->sector_locks[i], NULL);
+
+	for (unsigned int i = 0; i < buffer_count; i++)
+	{
+		/* the buffers are aligned to a block,
+		 * so that they may be backed by huge
+		 * pages */
+		int err = posix_memalign(&direct->buffers[i], BMFS_BLOCK_SIZE, BMFS_BLOCK_SIZE);
+		if (err != 0)
+		{
+			bmfs_direct_done(direct);
+			return -err;
+		}
+		direct->buffer_count++;
+	}
+
+	return 0;
+}
+
+void bmfs_direct_done(struct BMFSDirect *direct)
+{
+	if (direct == NULL)
+		return;
+
+	for (unsigned int i = 0; i < direct->buffer_count; i++)
+		free(direct->buffers[i]);
+
+	direct->buffer_count = 0;
+
+	if (direct->fd >= 0)
+	{
+		close(direct->fd);
+		direct->fd = -1;
+	}
+
+	pthread_mutex_destroy(&direct->lock);
+	pthread_cond_destroy(&direct->cond);
+
+	for (unsigned int i = 0; i < BMFS_DIRECT_SECTOR_LOCKS; i++)
+		pthread_mutex_destroy(&direct->sector_locks[i]);
+}
+
+int bmfs_disk_init_direct(struct BMFSDisk *disk, struct BMFSDirect *direct)
+{
+	if ((disk == NULL)
+	 || (direct == NULL))
+		return -EFAULT;
+
+	bmfs_disk_init(disk);
+	disk->disk = direct;
+	disk->seek = bmfs_direct_seek;
+	disk->tell = bmfs_direct_tell;
+	disk->read = bmfs_direct_read;
+	disk->write = bmfs_direct_write;
+	disk->pread = bmfs_direct_pread;
+	disk->pwrite = bmfs_direct_pwrite;
+
+	return 0;
+}
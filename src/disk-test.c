@@ -1,14 +1,23 @@
 #include <assert.h>
+#include <bmfs/direct.h>
 #include <bmfs/disk.h>
 #include <bmfs/limits.h>
+#include <bmfs/mmap.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 struct DiskData
 {
 	char *buf;
 	uint64_t len;
 	uint64_t pos;
+	/* makes every read fail */
+	int fail_reads;
+	/* makes every write fail */
+	int fail_writes;
 };
 
 static int data_seek(void *disk_ptr, int64_t offset, int whence)
@@ -56,6 +65,9 @@ static int data_read(void *disk_ptr, void *buf, uint64_t len, uint64_t *read_len
 {
 	struct DiskData *disk = (struct DiskData *)(disk_ptr);
 
+	if (disk->fail_reads)
+		return -EBADF;
+
 	if ((disk->pos + len) > disk->len)
 		len = disk->len - disk->pos;
 
@@ -71,6 +83,9 @@ static int data_write(void *disk_ptr, const void *buf, uint64_t len, uint64_t *w
 {
 	struct DiskData *disk = (struct DiskData *)(disk_ptr);
 
+	if (disk->fail_writes)
+		return -EIO;
+
 	if ((disk->pos + len) > disk->len)
 		len = disk->len - disk->pos;
 
@@ -82,6 +97,102 @@ static int data_write(void *disk_ptr, const void *buf, uint64_t len, uint64_t *w
 	return 0;
 }
 
+#define DIRECT_SIZE 16384
+
+#define DIRECT_THREADS 4
+
+#define DIRECT_ITERATIONS 500
+
+struct DirectWriter
+{
+	struct BMFSDisk *disk;
+	uint64_t offset;
+};
+
+/* Writes the iteration count to a few bytes
+ * that share a sector with other writers. */
+
+static void *direct_writer(void *writer_ptr)
+{
+	struct DirectWriter *writer = (struct DirectWriter *)(writer_ptr);
+
+	for (unsigned int i = 0; i < DIRECT_ITERATIONS; i++)
+	{
+		unsigned char value[3];
+		memset(value, i & 0xff, sizeof(value));
+		assert(bmfs_disk_pwrite(writer->disk, value, sizeof(value), writer->offset, NULL) == 0);
+	}
+
+	return NULL;
+}
+
+static void test_direct(struct BMFSDisk *disk)
+{
+	static unsigned char expected[DIRECT_SIZE];
+	static unsigned char actual[DIRECT_SIZE];
+	unsigned char pattern[8200];
+
+	memset(expected, 0, sizeof(expected));
+
+	/* writes that start and end within
+	 * sectors, across sector boundaries */
+	const uint64_t writes[5][2] = {
+		{ 4090, 20 },
+		{ 100, 8200 },
+		{ 8191, 1 },
+		{ 12000, DIRECT_SIZE - 12000 },
+		{ 1, 4096 }
+	};
+
+	for (unsigned int i = 0; i < 5; i++)
+	{
+		uint64_t offset = writes[i][0];
+		uint64_t len = writes[i][1];
+		for (uint64_t j = 0; j < len; j++)
+			pattern[j] = (unsigned char)(i + j + 1);
+		memcpy(&expected[offset], pattern, len);
+
+		uint64_t write_len = 0;
+		assert(bmfs_disk_pwrite(disk, pattern, len, offset, &write_len) == 0);
+		assert(write_len == len);
+	}
+
+	uint64_t read_len = 0;
+	assert(bmfs_disk_pread(disk, &actual[1], DIRECT_SIZE - 1, 1, &read_len) == 0);
+	assert(read_len == DIRECT_SIZE - 1);
+	assert(memcmp(&actual[1], &expected[1], DIRECT_SIZE - 1) == 0);
+	assert(bmfs_disk_pread(disk, actual, 20, 4090, &read_len) == 0);
+	assert(read_len == 20);
+	assert(memcmp(actual, &expected[4090], 20) == 0);
+
+	/* concurrent writes to different bytes
+	 * of the same sectors are all kept */
+	pthread_t threads[DIRECT_THREADS];
+	struct DirectWriter writers[DIRECT_THREADS];
+	for (unsigned int i = 0; i < DIRECT_THREADS; i++)
+	{
+		writers[i].disk = disk;
+		writers[i].offset = 8186 + (i * 3);
+		assert(pthread_create(&threads[i], NULL, direct_writer, &writers[i]) == 0);
+	}
+	for (unsigned int i = 0; i < DIRECT_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	assert(bmfs_disk_pread(disk, actual, DIRECT_THREADS * 3, 8186, &read_len) == 0);
+	for (unsigned int i = 0; i < DIRECT_THREADS * 3; i++)
+		assert(actual[i] == ((DIRECT_ITERATIONS - 1) & 0xff));
+
+	/* writes past the end of the disk fail
+	 * without writing anything */
+	uint64_t write_len = 0;
+	assert(bmfs_disk_pwrite(disk, "abcd", 4, DIRECT_SIZE - 4, &write_len) == 0);
+	assert(write_len == 4);
+	assert(bmfs_disk_pwrite(disk, "efgh", 4, DIRECT_SIZE - 2, &write_len) == -ENOSPC);
+	assert(bmfs_disk_pwrite(disk, pattern, BMFS_DIRECT_ALIGNMENT, DIRECT_SIZE, NULL) == -ENOSPC);
+	assert(bmfs_disk_pread(disk, actual, 4, DIRECT_SIZE - 4, &read_len) == 0);
+	assert(memcmp(actual, "abcd", 4) == 0);
+}
+
 int main(void)
 {
 	struct DiskData data;
@@ -91,18 +202,34 @@ int main(void)
 		return EXIT_FAILURE;
 	data.pos = 0;
 	data.len = BMFS_MINIMUM_DISK_SIZE;
+	data.fail_reads = 0;
+	data.fail_writes = 0;
 
 	struct BMFSDisk disk;
+	bmfs_disk_init(&disk);
 	disk.disk = &data;
 	disk.tell = data_tell;
 	disk.seek = data_seek;
 	disk.read = data_read;
 	disk.write = data_write;
 
-	/* test format function */
+	/* test format function, which only writes,
+	 * so that write-only images can be formatted */
+	data.fail_reads = 1;
 	assert(bmfs_disk_format(&disk) == 0);
+	data.fail_reads = 0;
 	assert(memcmp(&data.buf[1024], "BMFS", 4) == 0);
 
+	/* test positional reads and writes */
+	char tag[4];
+	uint64_t tag_len = 0;
+	assert(bmfs_disk_seek(&disk, 0, SEEK_SET) == 0);
+	assert(bmfs_disk_pread(&disk, tag, sizeof(tag), 1024, &tag_len) == 0);
+	assert(tag_len == sizeof(tag));
+	assert(memcmp(tag, "BMFS", 4) == 0);
+	assert(bmfs_disk_pwrite(&disk, "SFMB", 4, 2048, NULL) == 0);
+	assert(memcmp(&data.buf[2048], "SFMB", 4) == 0);
+
 	/* test allocation */
 	uint64_t starting_block = 0;
 	assert(bmfs_disk_allocate_bytes(&disk, 1024, &starting_block) == 0);
@@ -155,12 +282,277 @@ int main(void)
 	assert(memcmp(&data.buf[4096], "c.txt", 5) == 0);
 	assert(memcmp(&data.buf[4096 + 64], "b.txt", 5) == 0);
 
+	/* test the entry number of found files */
+	int number = -1;
+	assert(bmfs_disk_find_file(&disk, "b.txt", NULL, &number) == 0);
+	assert(number == 1);
+
+	/* test the cached directory */
+	struct BMFSDir cached_dir;
+	assert(bmfs_disk_cache_dir(&disk, &cached_dir) == 0);
+	assert(disk.dir == &cached_dir);
+	struct BMFSDirIndex cached_index;
+	bmfs_dir_set_index(&cached_dir, &cached_index);
+	uint64_t generation = disk.dir_generation;
+	/* modifications by someone else are only seen
+	 * once the generation counter changes */
+	memcpy(&data.buf[4096], "d.txt", 6);
+	assert(bmfs_disk_find_file(&disk, "c.txt", NULL, NULL) == 0);
+	assert(bmfs_disk_refresh_dir(&disk) == 0);
+	assert(bmfs_disk_find_file(&disk, "c.txt", NULL, NULL) == 0);
+	assert(disk.dir_generation == generation);
+	data.buf[1032]++;
+	assert(bmfs_disk_refresh_dir(&disk) == 0);
+	assert(bmfs_disk_find_file(&disk, "c.txt", NULL, NULL) == -ENOENT);
+	assert(bmfs_disk_find_file(&disk, "d.txt", NULL, NULL) == 0);
+	assert(disk.dir_generation == generation + 1);
+	assert(cached_dir.Index == &cached_index);
+	memcpy(&data.buf[4096], "c.txt", 6);
+	data.buf[1032]++;
+	assert(bmfs_disk_refresh_dir(&disk) == 0);
+
 	/* test to make sure the same file can't be created */
 	assert(bmfs_disk_delete_file(&disk, "b.txt") == 0);
+	assert(data.buf[4096 + 64] == 1);
 	assert(bmfs_disk_create_file(&disk, "c.txt", 2) == -EEXIST);
 
+	/* test the cached extent map */
+	struct BMFSEntry entry;
+	struct BMFSExtentMap extents;
+	extents.fit = BMFS_EXTENT_FIRST_FIT;
+	assert(bmfs_disk_cache_extents(&disk, &extents) == 0);
+	assert(extents.count == 1);
+	struct BMFSExtent extent;
+	assert(bmfs_extent_map_next(&extents, 0, &extent) == 0);
+	assert(extent.start == 2);
+	assert(bmfs_disk_create_file(&disk, "e.txt", 2) == 0);
+	assert(extents.count == 0);
+	assert(extents.generation == disk.dir_generation);
+	assert(bmfs_disk_create_file(&disk, "f.txt", 2) == -ENOSPC);
+	/* a file without blocks fits on a full disk */
+	assert(bmfs_disk_create_file(&disk, "f.txt", 0) == 0);
+	assert(bmfs_disk_find_file(&disk, "f.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 1);
+	assert(bmfs_disk_delete_file(&disk, "f.txt") == 0);
+	assert(bmfs_disk_delete_file(&disk, "e.txt") == 0);
+	assert(extents.count == 1);
+	assert(extents.generation == disk.dir_generation);
+
+	/* test deferred writes of the directory */
+	uint64_t disk_generation;
+	memcpy(&disk_generation, &data.buf[1032], sizeof(disk_generation));
+	assert(bmfs_disk_defer_dir(&disk) == 0);
+	assert(bmfs_disk_create_file(&disk, "e.txt", 2) == 0);
+	assert(bmfs_disk_find_file(&disk, "e.txt", NULL, &number) == 0);
+	assert(bmfs_disk_set_file_size(&disk, number, 3) == 0);
+	assert(extents.generation == disk.dir_generation);
+	assert(data.buf[4096 + (number * 64)] == 1);
+	assert(memcmp(&data.buf[1032], &disk_generation, sizeof(disk_generation)) == 0);
+	assert(bmfs_disk_flush_dir(&disk) == 0);
+	assert(memcmp(&data.buf[4096 + (number * 64)], "e.txt", 6) == 0);
+	assert(data.buf[4096 + (number * 64) + 48] == 3);
+	disk_generation++;
+	assert(memcmp(&data.buf[1032], &disk_generation, sizeof(disk_generation)) == 0);
+	assert(extents.generation == disk.dir_generation);
+	assert(cached_dir.DirtyPages == 0);
+	assert(bmfs_disk_delete_file(&disk, "e.txt") == 0);
+	assert(data.buf[4096 + (number * 64)] == 1);
+
+	/* a change that can't be written is dropped
+	 * from the cache, so that its blocks can't
+	 * be given to another file */
+	data.fail_writes = 1;
+	assert(bmfs_disk_create_file(&disk, "e.txt", 2) == -EIO);
+	data.fail_writes = 0;
+	assert(bmfs_disk_find_file(&disk, "e.txt", NULL, NULL) == -ENOENT);
+	assert(cached_dir.DirtyPages == 0);
+	assert(cached_dir.Index == &cached_index);
+	assert(extents.generation != disk.dir_generation);
+	assert(bmfs_disk_create_file(&disk, "f.txt", 2) == 0);
+	assert(bmfs_disk_find_file(&disk, "f.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 2);
+	assert(extents.count == 0);
+	data.fail_writes = 1;
+	assert(bmfs_disk_delete_file(&disk, "f.txt") == -EIO);
+	data.fail_writes = 0;
+	assert(bmfs_disk_find_file(&disk, "f.txt", NULL, NULL) == 0);
+	assert(bmfs_disk_create_file(&disk, "e.txt", 2) == -ENOSPC);
+	assert(bmfs_disk_delete_file(&disk, "f.txt") == 0);
+
+	bmfs_disk_uncache_extents(&disk);
+	bmfs_disk_uncache_dir(&disk);
+
+	/* test extending a version 1 directory */
+	uint64_t layout[2];
+	memcpy(layout, &data.buf[1040], sizeof(layout));
+	assert((layout[0] == 0) && (layout[1] == 0));
+	assert(bmfs_disk_extend_dir(&disk, 100) == -EINVAL);
+	/* a kernel that reaches 1 MiB isn't overwritten */
+	memset(&data.buf[1024 * 1024], 0, 4096);
+	data.buf[(1024 * 1024) + 4095] = 1;
+	assert(bmfs_disk_extend_dir(&disk, 128) == -ENOSPC);
+	assert(bmfs_disk_format_extended(&disk, 128) == -ENOSPC);
+	assert(data.buf[(1024 * 1024) + 4095] == 1);
+	memcpy(layout, &data.buf[1040], sizeof(layout));
+	assert((layout[0] == 0) && (layout[1] == 0));
+	data.buf[(1024 * 1024) + 4095] = 0;
+	assert(bmfs_disk_extend_dir(&disk, 128) == 0);
+	memcpy(layout, &data.buf[1040], sizeof(layout));
+	assert((layout[0] == 2) && (layout[1] == 128));
+	assert(bmfs_disk_read_dir(&disk, &dir) == 0);
+	assert(dir.EntryCount == 128);
+	assert(bmfs_disk_find_file(&disk, "c.txt", NULL, NULL) == 0);
+	assert(bmfs_disk_extend_dir(&disk, 64) == -EINVAL);
+
+	/* test an extended directory */
+	assert(bmfs_disk_format_extended(&disk, 128) == 0);
+	assert(bmfs_disk_read_dir(&disk, &dir) == 0);
+	assert(dir.EntryCount == 128);
+	assert(dir.DirtyPages == 0);
+	for (int i = 0; i < 70; i++)
+	{
+		struct BMFSEntry entry;
+		bmfs_entry_init(&entry);
+		snprintf(entry.FileName, sizeof(entry.FileName), "file%d", i);
+		assert(bmfs_dir_add(&dir, &entry) == 0);
+	}
+	assert(dir.DirtyPages == 3);
+	assert(bmfs_disk_sync_dir(&disk, &dir) == 0);
+	assert(dir.DirtyPages == 0);
+	assert(memcmp(&data.buf[4096], "file0", 6) == 0);
+	assert(memcmp(&data.buf[1024 * 1024], "file64", 7) == 0);
+	assert(bmfs_disk_find_file(&disk, "file69", NULL, &number) == 0);
+	assert(number == 69);
+	assert(bmfs_disk_set_file_size(&disk, number, 1) == -ENOSPC);
+	assert(bmfs_disk_set_file_size(&disk, number, 0) == 0);
+	assert(bmfs_disk_set_file_size(&disk, 128, 0) == -EINVAL);
+
+	/* only modified pages are written */
+	data.buf[4096] = 'x';
+	assert(bmfs_dir_delete_file(&dir, "file65") == 0);
+	assert(dir.DirtyPages == 2);
+	assert(bmfs_disk_sync_dir(&disk, &dir) == 0);
+	assert(data.buf[4096] == 'x');
+	assert(data.buf[(1024 * 1024) + 64] == 1);
+
+	/* test compaction of the directory on disk */
+	for (int i = 30; i < 50; i++)
+	{
+		char filename[16];
+		snprintf(filename, sizeof(filename), "file%d", i);
+		assert(bmfs_disk_delete_file(&disk, filename) == 0);
+	}
+	/* compacted automatically once file46 was deleted */
+	assert(bmfs_disk_find_file(&disk, "file69", NULL, &number) == 0);
+	assert(number == 51);
+	assert(data.buf[4096 + (52 * 64)] == 0);
+	assert(data.buf[4096 + (30 * 64)] == 1);
+	assert(bmfs_disk_compact_dir(&disk) == 3);
+	assert(bmfs_disk_compact_dir(&disk) == 0);
+	assert(bmfs_disk_find_file(&disk, "file69", NULL, &number) == 0);
+	assert(number == 48);
+	assert(memcmp(&data.buf[4096 + (30 * 64)], "file50", 7) == 0);
+
+	/* test creating several files at once */
+	const char *filenames[3] = { "g1.txt", "g2.txt", "g3.txt" };
+	uint64_t mebibytes[3] = { 2, 2, 2 };
+	assert(bmfs_disk_create_files(&disk, filenames, mebibytes, 3) == -ENOSPC);
+	assert(bmfs_disk_find_file(&disk, "g1.txt", NULL, NULL) == -ENOENT);
+	assert(bmfs_disk_create_files(&disk, filenames, mebibytes, 2) == 0);
+	assert(bmfs_disk_find_file(&disk, "g1.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 1);
+	assert(bmfs_disk_find_file(&disk, "g2.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 2);
+
+	/* test resizing files */
+	assert(bmfs_disk_delete_file(&disk, "g2.txt") == 0);
+	assert(bmfs_disk_resize_file(&disk, "g1.txt", 4, 0, NULL, 0) == 0);
+	assert(bmfs_disk_find_file(&disk, "g1.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 1);
+	assert(entry.ReservedBlocks == 2);
+	assert(bmfs_disk_resize_file(&disk, "g1.txt", 2, 0, NULL, 0) == 0);
+	assert(bmfs_disk_create_file(&disk, "g2.txt", 2) == 0);
+	/* make room for the file to be moved */
+	data.len = BMFS_BLOCK_SIZE * 5;
+	data.buf = realloc(data.buf, data.len);
+	assert(data.buf != NULL);
+	memset(&data.buf[BMFS_MINIMUM_DISK_SIZE], 0, data.len - BMFS_MINIMUM_DISK_SIZE);
+	memcpy(&data.buf[BMFS_BLOCK_SIZE], "hello", 5);
+	char move_buf[4];
+	assert(bmfs_disk_resize_file(&disk, "g1.txt", 4, 5, move_buf, sizeof(move_buf)) == 0);
+	assert(bmfs_disk_find_file(&disk, "g1.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 3);
+	assert(entry.ReservedBlocks == 2);
+	assert(memcmp(&data.buf[BMFS_BLOCK_SIZE * 3], "hello", 5) == 0);
+	assert(bmfs_disk_resize_file(&disk, "g1.txt", 8, 5, move_buf, sizeof(move_buf)) == -ENOSPC);
+	assert(bmfs_disk_find_file(&disk, "g1.txt", &entry, NULL) == 0);
+	assert(entry.StartingBlock == 3);
+
+	/* test the same with a cached directory
+	 * and extent map, which are changed in
+	 * place */
+	assert(bmfs_disk_cache_dir(&disk, &cached_dir) == 0);
+	assert(bmfs_disk_cache_extents(&disk, &extents) == 0);
+	assert(extents.count == 1);
+	const char *more_filenames[2] = { "h1.txt", "h2.txt" };
+	assert(bmfs_disk_create_files(&disk, more_filenames, mebibytes, 2) == -ENOSPC);
+	assert(bmfs_disk_find_file(&disk, "h1.txt", NULL, NULL) == -ENOENT);
+	assert(extents.count == 1);
+	assert(bmfs_extent_map_next(&extents, 0, &extent) == 0);
+	assert((extent.start == 1) && (extent.length == 1));
+	assert(!disk.dir_deferred);
+	assert(bmfs_disk_resize_file(&disk, "g2.txt", 4, 0, NULL, 0) == -ENOSPC);
+	assert(bmfs_disk_delete_file(&disk, "g1.txt") == 0);
+	assert(bmfs_disk_resize_file(&disk, "g2.txt", 4, 0, NULL, 0) == 0);
+	assert(bmfs_disk_find_file(&disk, "g2.txt", &entry, NULL) == 0);
+	assert((entry.StartingBlock == 2) && (entry.ReservedBlocks == 2));
+	assert(extents.count == 2);
+	assert(extents.generation == disk.dir_generation);
+	bmfs_disk_uncache_extents(&disk);
+	bmfs_disk_uncache_dir(&disk);
+	assert(bmfs_disk_find_file(&disk, "h1.txt", NULL, NULL) == -ENOENT);
+	assert(bmfs_disk_find_file(&disk, "g2.txt", &entry, NULL) == 0);
+	assert(entry.ReservedBlocks == 2);
+
 	free(data.buf);
 
+	/* test the bounds of a mapped disk */
+	FILE *image = tmpfile();
+	assert(image != NULL);
+	assert(ftruncate(fileno(image), 8192) == 0);
+	struct BMFSMmap map;
+	assert(bmfs_mmap_init(&map, fileno(image), 1) == 0);
+	assert(bmfs_disk_init_mmap(&disk, &map) == 0);
+	uint64_t write_len = 0;
+	assert(bmfs_disk_pwrite(&disk, "abcd", 4, 8188, &write_len) == 0);
+	assert(write_len == 4);
+	assert(bmfs_disk_pwrite(&disk, "efgh", 4, 8190, &write_len) == -ENOSPC);
+	assert(bmfs_disk_pwrite(&disk, "efgh", 4, 8200, NULL) == -ENOSPC);
+	assert(memcmp(&map.data[8188], "abcd", 4) == 0);
+	bmfs_mmap_done(&map);
+	fclose(image);
+
+	/* test unaligned transfers on a direct disk,
+	 * unless the file system doesn't support it */
+	char direct_path[] = "disk-test-XXXXXX";
+	int direct_fd = mkstemp(direct_path);
+	assert(direct_fd >= 0);
+	assert(ftruncate(direct_fd, DIRECT_SIZE) == 0);
+	close(direct_fd);
+	struct BMFSDirect direct;
+	int err = bmfs_direct_init(&direct, direct_path, 1, 0);
+	unlink(direct_path);
+	if (err == 0)
+	{
+		assert(bmfs_disk_init_direct(&disk, &direct) == 0);
+		test_direct(&disk);
+		bmfs_direct_done(&direct);
+	}
+	else
+	{
+		assert(err == -EINVAL);
+	}
+
 	return EXIT_SUCCESS;
 }
 
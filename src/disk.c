@@ -13,6 +13,22 @@
 
 /* disk wrapper functions */
 
+void bmfs_disk_init(struct BMFSDisk *disk)
+{
+	disk->disk = NULL;
+	disk->seek = NULL;
+	disk->tell = NULL;
+	disk->read = NULL;
+	disk->write = NULL;
+	disk->pread = NULL;
+	disk->pwrite = NULL;
+	disk->dir = NULL;
+	disk->extents = NULL;
+	disk->dir_generation = 0;
+	disk->dir_disk_generation = 0;
+	disk->dir_deferred = 0;
+}
+
 int bmfs_disk_seek(struct BMFSDisk *disk, int64_t offset, int whence)
 {
 	if ((disk == NULL)
@@ -37,97 +53,1244 @@ int bmfs_disk_read(struct BMFSDisk *disk, void *buf, uint64_t len, uint64_t *rea
 	 || (disk->read == NULL))
 		return -EFAULT;
 
-	return disk->read(disk->disk, buf, len, read_len);
+	return disk->read(disk->disk, buf, len, read_len);
+}
+
+int bmfs_disk_write(struct BMFSDisk *disk, const void *buf, uint64_t len, uint64_t *write_len)
+{
+	if ((disk == NULL)
+	 || (disk->write == NULL))
+		return -EFAULT;
+
+	return disk->write(disk->disk, buf, len, write_len);
+}
+
+int bmfs_disk_pread(struct BMFSDisk *disk, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len)
+{
+	if (disk == NULL)
+		return -EFAULT;
+
+	if (disk->pread != NULL)
+		return disk->pread(disk->disk, buf, len, offset, read_len);
+
+	int err = bmfs_disk_seek(disk, offset, SEEK_SET);
+	if (err != 0)
+		return err;
+
+	return bmfs_disk_read(disk, buf, len, read_len);
+}
+
+int bmfs_disk_pwrite(struct BMFSDisk *disk, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len)
+{
+	if (disk == NULL)
+		return -EFAULT;
+
+	if (disk->pwrite != NULL)
+		return disk->pwrite(disk->disk, buf, len, offset, write_len);
+
+	int err = bmfs_disk_seek(disk, offset, SEEK_SET);
+	if (err != 0)
+		return err;
+
+	return bmfs_disk_write(disk, buf, len, write_len);
+}
+
+/* directory functions */
+
+/* The generation counter is stored in the
+ * disk info section, after the BMFS tag. */
+
+static int read_generation(struct BMFSDisk *disk, uint64_t *generation)
+{
+	return bmfs_disk_pread(disk, generation, sizeof(*generation), 1032, NULL);
+}
+
+static int write_generation(struct BMFSDisk *disk, uint64_t generation)
+{
+	return bmfs_disk_pwrite(disk, &generation, sizeof(generation), 1032, NULL);
+}
+
+/* A version 1 directory is a single page
+ * at 4 KiB. An extended directory keeps its
+ * first page there, so that it can still be
+ * read as a version 1 directory, and the rest
+ * of its pages at 1 MiB. The version and the
+ * number of entries are stored after the
+ * generation counter. For version 1 disks,
+ * both are zero. */
+
+#define DIR_OFFSET 4096ULL
+
+#define DIR_EXTENDED_OFFSET (1024ULL * 1024ULL)
+
+#define DIR_PAGE_SIZE (BMFS_DIR_PAGE_ENTRIES * sizeof(struct BMFSEntry))
+
+#define DIR_LAYOUT_OFFSET 1040
+
+#define DIR_VERSION_EXTENDED 2
+
+static uint64_t page_offset(uint64_t page)
+{
+	if (page == 0)
+		return DIR_OFFSET;
+	else
+		return DIR_EXTENDED_OFFSET + ((page - 1) * DIR_PAGE_SIZE);
+}
+
+static int read_entry_count(struct BMFSDisk *disk, uint64_t *entry_count)
+{
+	uint64_t layout[2];
+	int err = bmfs_disk_pread(disk, layout, sizeof(layout), DIR_LAYOUT_OFFSET, NULL);
+	if (err != 0)
+		return err;
+
+	if ((layout[0] == 0)
+	 || (layout[0] == 1))
+	{
+		*entry_count = BMFS_DIR_PAGE_ENTRIES;
+		return 0;
+	}
+	else if (layout[0] != DIR_VERSION_EXTENDED)
+		return -ENOTSUP;
+	else if ((layout[1] == 0)
+	      || (layout[1] > BMFS_DIR_ENTRIES_MAX)
+	      || ((layout[1] % BMFS_DIR_PAGE_ENTRIES) != 0))
+		return -EINVAL;
+
+	*entry_count = layout[1];
+
+	return 0;
+}
+
+static int write_entry_count(struct BMFSDisk *disk, uint64_t entry_count)
+{
+	uint64_t layout[2] = { 0, 0 };
+
+	if (entry_count != BMFS_DIR_PAGE_ENTRIES)
+	{
+		layout[0] = DIR_VERSION_EXTENDED;
+		layout[1] = entry_count;
+	}
+
+	return bmfs_disk_pwrite(disk, layout, sizeof(layout), DIR_LAYOUT_OFFSET, NULL);
+}
+
+/* Reads all the pages of the directory. The
+ * pages after the first one are contiguous,
+ * so this takes at most two reads. */
+
+static int read_pages(struct BMFSDisk *disk, struct BMFSDir *dir, uint64_t entry_count)
+{
+	int err = bmfs_disk_pread(disk, dir->Entries, DIR_PAGE_SIZE, DIR_OFFSET, NULL);
+	if (err != 0)
+		return err;
+
+	if (entry_count > BMFS_DIR_PAGE_ENTRIES)
+	{
+		uint64_t len = (entry_count - BMFS_DIR_PAGE_ENTRIES) * sizeof(struct BMFSEntry);
+		err = bmfs_disk_pread(disk, &dir->Entries[BMFS_DIR_PAGE_ENTRIES], len, DIR_EXTENDED_OFFSET, NULL);
+		if (err != 0)
+			return err;
+	}
+
+	dir->EntryCount = entry_count;
+	dir->DirtyPages = 0;
+	dir->Index = NULL;
+
+	return 0;
+}
+
+static int write_page(struct BMFSDisk *disk, const struct BMFSDir *dir, uint64_t page)
+{
+	return bmfs_disk_pwrite(disk,
+	                        &dir->Entries[page * BMFS_DIR_PAGE_ENTRIES],
+	                        DIR_PAGE_SIZE,
+	                        page_offset(page),
+	                        NULL);
+}
+
+/* Copies directory entries into the cached
+ * directory, after they are written. */
+
+static void update_cache(struct BMFSDisk *disk, const struct BMFSDir *dir, uint64_t first, uint64_t count)
+{
+	if ((disk->dir == NULL)
+	 || (disk->dir == dir))
+		return;
+
+	memcpy(&disk->dir->Entries[first], &dir->Entries[first], count * sizeof(struct BMFSEntry));
+}
+
+/* Without a cached directory, the entries are
+ * read and written one page at a time, so that
+ * no copy of the whole directory is needed. */
+
+struct DirPage
+{
+	/* the page in the buffer,
+	 * or UINT64_MAX if there
+	 * isn't one yet */
+	uint64_t page;
+	/* non-zero if the buffer was
+	 * modified since it was read */
+	int dirty;
+	struct BMFSEntry entries[BMFS_DIR_PAGE_ENTRIES];
+};
+
+static void page_init(struct DirPage *page)
+{
+	page->page = UINT64_MAX;
+	page->dirty = 0;
+}
+
+static int page_flush(struct BMFSDisk *disk, struct DirPage *page)
+{
+	if (!page->dirty)
+		return 0;
+
+	int err = bmfs_disk_pwrite(disk, page->entries, DIR_PAGE_SIZE, page_offset(page->page), NULL);
+	if (err != 0)
+		return err;
+
+	page->dirty = 0;
+
+	return 0;
+}
+
+/* Gets an entry of the directory on disk,
+ * reading its page if it isn't the one in
+ * the buffer. The previous page is written
+ * first, if it was modified. */
+
+static int page_entry(struct BMFSDisk *disk, struct DirPage *page, uint64_t i, struct BMFSEntry **entry)
+{
+	uint64_t index = i / BMFS_DIR_PAGE_ENTRIES;
+
+	if (page->page != index)
+	{
+		int err = page_flush(disk, page);
+		if (err != 0)
+			return err;
+
+		page->page = UINT64_MAX;
+
+		err = bmfs_disk_pread(disk, page->entries, DIR_PAGE_SIZE, page_offset(index), NULL);
+		if (err != 0)
+			return err;
+
+		page->page = index;
+	}
+
+	*entry = &page->entries[i % BMFS_DIR_PAGE_ENTRIES];
+
+	return 0;
+}
+
+/* Gets the number of entries in the root
+ * directory, from the cached directory if
+ * there is one. */
+
+static int dir_entry_count(struct BMFSDisk *disk, uint64_t *entry_count)
+{
+	if (disk->dir != NULL)
+	{
+		*entry_count = disk->dir->EntryCount;
+		return 0;
+	}
+
+	return read_entry_count(disk, entry_count);
+}
+
+/* Gets an entry of the root directory, from
+ * the cached directory if there is one. This
+ * is for functions that go through every entry
+ * without modifying them. */
+
+static int dir_entry(struct BMFSDisk *disk, struct DirPage *page, uint64_t i, struct BMFSEntry **entry)
+{
+	if (disk->dir != NULL)
+	{
+		*entry = &disk->dir->Entries[i];
+		return 0;
+	}
+
+	return page_entry(disk, page, i, entry);
+}
+
+/* Writes pages of unused entries, from page
+ * first up to page end. Unless it is the first
+ * page of the directory, the first entry of page
+ * first is a terminator, so that lookups stop
+ * there until the new pages are used. */
+
+static int write_unused_pages(struct BMFSDisk *disk, uint64_t first, uint64_t end)
+{
+	struct BMFSEntry entries[BMFS_DIR_PAGE_ENTRIES];
+
+	memset(entries, 0, sizeof(entries));
+
+	for (uint64_t i = 0; i < BMFS_DIR_PAGE_ENTRIES; i++)
+		bmfs_entry_init(&entries[i]);
+
+	for (uint64_t page = first; page < end; page++)
+	{
+		entries[0].FileName[0] = ((page == first) && (page != 0)) ? 0 : 1;
+
+		int err = bmfs_disk_pwrite(disk, entries, DIR_PAGE_SIZE, page_offset(page), NULL);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/* Checks that the pages from page first up to
+ * page end are all zeros. The extended pages are
+ * in block zero after the boot loader and the
+ * kernel, which may be large enough to reach
+ * them, so they're only used if they're empty. */
+
+static int check_unused_pages(struct BMFSDisk *disk, uint64_t first, uint64_t end)
+{
+	uint64_t buf[DIR_PAGE_SIZE / sizeof(uint64_t)];
+
+	for (uint64_t page = first; page < end; page++)
+	{
+		uint64_t read_len = 0;
+		int err = bmfs_disk_pread(disk, buf, sizeof(buf), page_offset(page), &read_len);
+		if (err != 0)
+			return err;
+		else if (read_len != sizeof(buf))
+			return -ENOSPC;
+
+		for (uint64_t i = 0; i < (sizeof(buf) / sizeof(buf[0])); i++)
+		{
+			if (buf[i] != 0)
+				return -ENOSPC;
+		}
+	}
+
+	return 0;
+}
+
+int bmfs_disk_read_dir(struct BMFSDisk *disk, struct BMFSDir *dir)
+{
+	if ((disk == NULL)
+	 || (dir == NULL))
+		return -EFAULT;
+
+	if (disk->dir != NULL)
+	{
+		/* the index would not match
+		 * the new entries */
+		dir->Index = NULL;
+		dir->EntryCount = disk->dir->EntryCount;
+		dir->DirtyPages = 0;
+		memcpy(dir->Entries, disk->dir->Entries, dir->EntryCount * sizeof(struct BMFSEntry));
+		return 0;
+	}
+
+	uint64_t entry_count;
+	int err = read_entry_count(disk, &entry_count);
+	if (err != 0)
+		return err;
+
+	return read_pages(disk, dir, entry_count);
+}
+
+/* Stores a new generation counter on disk. */
+
+static int set_generation(struct BMFSDisk *disk, uint64_t generation)
+{
+	int err = write_generation(disk, generation);
+	if (err != 0)
+		return err;
+
+	disk->dir_disk_generation = generation;
+
+	/* atomic, so that it may be checked
+	 * by threads that don't hold the lock
+	 * that the caller uses for the directory */
+	__atomic_add_fetch(&disk->dir_generation, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Called after the directory is written,
+ * so that other users of the disk know
+ * that it was modified. */
+
+static int bump_generation(struct BMFSDisk *disk)
+{
+	uint64_t generation;
+	int err = read_generation(disk, &generation);
+	if (err != 0)
+		return err;
+
+	return set_generation(disk, generation + 1);
+}
+
+int bmfs_disk_write_dir(struct BMFSDisk *disk, const struct BMFSDir *dir)
+{
+	if ((disk == NULL)
+	 || (dir == NULL))
+		return -EFAULT;
+
+	int err = write_entry_count(disk, dir->EntryCount);
+	if (err != 0)
+		return err;
+
+	for (uint64_t page = 0; page < (dir->EntryCount / BMFS_DIR_PAGE_ENTRIES); page++)
+	{
+		err = write_page(disk, dir, page);
+		if (err != 0)
+			return err;
+	}
+
+	if ((disk->dir != NULL)
+	 && (disk->dir != dir))
+	{
+		disk->dir->EntryCount = dir->EntryCount;
+		update_cache(disk, dir, 0, dir->EntryCount);
+		bmfs_dir_rebuild_index(disk->dir);
+	}
+
+	/* every page was written */
+	if (disk->dir != NULL)
+		disk->dir->DirtyPages = 0;
+
+	return bump_generation(disk);
+}
+
+int bmfs_disk_sync_dir(struct BMFSDisk *disk, struct BMFSDir *dir)
+{
+	if ((disk == NULL)
+	 || (dir == NULL))
+		return -EFAULT;
+
+	if (dir->DirtyPages == 0)
+		return 0;
+
+	if (disk->dir_deferred)
+	{
+		/* the pages stay dirty in the cached
+		 * directory, until they are flushed */
+		if (disk->dir != dir)
+		{
+			for (uint64_t page = 0; page < (dir->EntryCount / BMFS_DIR_PAGE_ENTRIES); page++)
+			{
+				if ((dir->DirtyPages & (1ULL << page)) != 0)
+					update_cache(disk, dir, page * BMFS_DIR_PAGE_ENTRIES, BMFS_DIR_PAGE_ENTRIES);
+			}
+
+			disk->dir->DirtyPages |= dir->DirtyPages;
+			dir->DirtyPages = 0;
+			bmfs_dir_rebuild_index(disk->dir);
+		}
+
+		__atomic_add_fetch(&disk->dir_generation, 1, __ATOMIC_RELEASE);
+
+		return 0;
+	}
+
+	for (uint64_t page = 0; page < (dir->EntryCount / BMFS_DIR_PAGE_ENTRIES); page++)
+	{
+		if ((dir->DirtyPages & (1ULL << page)) == 0)
+			continue;
+
+		int err = write_page(disk, dir, page);
+		if (err != 0)
+			return err;
+
+		update_cache(disk, dir, page * BMFS_DIR_PAGE_ENTRIES, BMFS_DIR_PAGE_ENTRIES);
+
+		dir->DirtyPages &= ~(1ULL << page);
+	}
+
+	if ((disk->dir != NULL)
+	 && (disk->dir != dir))
+		bmfs_dir_rebuild_index(disk->dir);
+
+	return bump_generation(disk);
+}
+
+int bmfs_disk_cache_dir(struct BMFSDisk *disk, struct BMFSDir *dir)
+{
+	if ((disk == NULL)
+	 || (dir == NULL))
+		return -EFAULT;
+
+	disk->dir = NULL;
+
+	int err = read_generation(disk, &disk->dir_disk_generation);
+	if (err != 0)
+		return err;
+
+	err = bmfs_disk_read_dir(disk, dir);
+	if (err != 0)
+		return err;
+
+	disk->dir = dir;
+	__atomic_add_fetch(&disk->dir_generation, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Returns non-zero if the cached extent
+ * map matches the directory. */
+
+static int extents_current(const struct BMFSDisk *disk)
+{
+	return (disk->extents != NULL)
+	    && (disk->extents->generation == disk->dir_generation);
+}
+
+/* Builds the extent map from the directory
+ * on disk, like bmfs_extent_map_build. */
+
+static int build_extents(struct BMFSDisk *disk, struct BMFSExtentMap *map, uint64_t total_blocks)
+{
+	uint64_t entry_count;
+	int err = read_entry_count(disk, &entry_count);
+	if (err != 0)
+		return err;
+
+	enum bmfs_extent_fit fit = map->fit;
+
+	bmfs_extent_map_init(map, 1, total_blocks);
+
+	map->fit = fit;
+
+	struct DirPage page;
+	page_init(&page);
+
+	for (uint64_t i = 0; i < entry_count; i++)
+	{
+		struct BMFSEntry *entry;
+		err = page_entry(disk, &page, i, &entry);
+		if (err != 0)
+			return err;
+
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			continue;
+
+		err = bmfs_extent_map_reserve(map, entry->StartingBlock, entry->ReservedBlocks);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/* Goes through the directory for files that
+ * overlap the given blocks. If there are any,
+ * next is set to the end of the one that ends
+ * last. Otherwise, it is left as it is. */
+
+static int scan_overlap(struct BMFSDisk *disk, uint64_t start, uint64_t length, uint64_t *next)
+{
+	uint64_t entry_count;
+	int err = dir_entry_count(disk, &entry_count);
+	if (err != 0)
+		return err;
+
+	struct DirPage page;
+	page_init(&page);
+
+	for (uint64_t i = 0; i < entry_count; i++)
+	{
+		struct BMFSEntry *entry;
+		err = dir_entry(disk, &page, i, &entry);
+		if (err != 0)
+			return err;
+
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry)
+		      || (entry->ReservedBlocks == 0))
+			continue;
+
+		uint64_t end = entry->StartingBlock + entry->ReservedBlocks;
+
+		if ((entry->StartingBlock < (start + length))
+		 && (end > start)
+		 && (end > *next))
+			*next = end;
+	}
+
+	return 0;
+}
+
+/* Gets the cached extent map, rebuilding
+ * it from the directory if it isn't current. */
+
+static int load_extents(struct BMFSDisk *disk, struct BMFSExtentMap **map)
+{
+	*map = disk->extents;
+
+	if (extents_current(disk))
+		return 0;
+
+	uint64_t total_blocks;
+	int err = bmfs_disk_blocks(disk, &total_blocks);
+	if (err != 0)
+		return err;
+
+	if (disk->dir != NULL)
+		err = bmfs_extent_map_build(*map, disk->dir, total_blocks);
+	else
+		err = build_extents(disk, *map, total_blocks);
+
+	if (err != 0)
+		return err;
+
+	(*map)->generation = disk->dir_generation;
+
+	return 0;
+}
+
+int bmfs_disk_cache_extents(struct BMFSDisk *disk, struct BMFSExtentMap *map)
+{
+	if ((disk == NULL)
+	 || (map == NULL))
+		return -EFAULT;
+
+	disk->extents = map;
+
+	struct BMFSExtentMap *unused;
+
+	int err = load_extents(disk, &unused);
+	if (err != 0)
+	{
+		disk->extents = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+/* Checks whether or not blocks are free, in
+ * the cached extent map if there is one. */
+
+static int blocks_are_free(struct BMFSDisk *disk, uint64_t start, uint64_t length, int *is_free)
+{
+	int err;
+
+	if (disk->extents != NULL)
+	{
+		struct BMFSExtentMap *map;
+		err = load_extents(disk, &map);
+		if (err != 0)
+			return err;
+
+		*is_free = bmfs_extent_map_is_free(map, start, length);
+		return 0;
+	}
+
+	uint64_t total_blocks;
+	err = bmfs_disk_blocks(disk, &total_blocks);
+	if (err != 0)
+		return err;
+
+	if ((start == 0)
+	 || (start > total_blocks)
+	 || (length > (total_blocks - start)))
+	{
+		*is_free = 0;
+		return 0;
+	}
+
+	uint64_t next = start;
+
+	err = scan_overlap(disk, start, length, &next);
+	if (err != 0)
+		return err;
+
+	*is_free = (next == start);
+
+	return 0;
+}
+
+/* Finds free blocks, in the cached extent map
+ * if there is one. Without it, the first blocks
+ * that are large enough are found by going
+ * through the directory, as often as it takes
+ * for no file to overlap them. When the files
+ * were allocated this way, that's usually once. */
+
+static int find_blocks(struct BMFSDisk *disk, uint64_t length, uint64_t *start)
+{
+	int err;
+
+	if (disk->extents != NULL)
+	{
+		/* like the scan below, a file
+		 * without blocks is put at the
+		 * first block, even on a full disk */
+		if (length == 0)
+		{
+			*start = 1;
+			return 0;
+		}
+
+		struct BMFSExtentMap *map;
+		err = load_extents(disk, &map);
+		if (err != 0)
+			return err;
+
+		return bmfs_extent_map_find(map, length, start);
+	}
+
+	uint64_t total_blocks;
+	err = bmfs_disk_blocks(disk, &total_blocks);
+	if (err != 0)
+		return err;
+
+	uint64_t block = 1;
+
+	for (;;)
+	{
+		if ((block > total_blocks)
+		 || (length > (total_blocks - block)))
+			return -ENOSPC;
+
+		uint64_t next = block;
+
+		err = scan_overlap(disk, block, length, &next);
+		if (err != 0)
+			return err;
+		else if (next == block)
+			break;
+
+		block = next;
+	}
+
+	*start = block;
+
+	return 0;
+}
+
+void bmfs_disk_uncache_extents(struct BMFSDisk *disk)
+{
+	if (disk == NULL)
+		return;
+
+	disk->extents = NULL;
+}
+
+void bmfs_disk_uncache_dir(struct BMFSDisk *disk)
+{
+	if (disk == NULL)
+		return;
+
+	disk->dir = NULL;
+	disk->dir_deferred = 0;
+}
+
+int bmfs_disk_defer_dir(struct BMFSDisk *disk)
+{
+	if (disk == NULL)
+		return -EFAULT;
+	else if (disk->dir == NULL)
+		return -EINVAL;
+
+	disk->dir_deferred = 1;
+
+	return 0;
+}
+
+int bmfs_disk_flush_dir(struct BMFSDisk *disk)
+{
+	if (disk == NULL)
+		return -EFAULT;
+
+	if (!disk->dir_deferred)
+		return 0;
+
+	disk->dir_deferred = 0;
+
+	/* flushing doesn't change the free space */
+	int update_extents = extents_current(disk);
+
+	int err = bmfs_disk_sync_dir(disk, disk->dir);
+	if (err != 0)
+	{
+		disk->dir_deferred = 1;
+		return err;
+	}
+
+	if (update_extents)
+		disk->extents->generation = disk->dir_generation;
+
+	return 0;
+}
+
+int bmfs_disk_refresh_dir(struct BMFSDisk *disk)
+{
+	if (disk == NULL)
+		return -EFAULT;
+
+	/* deferred changes would be lost */
+	if ((disk->dir == NULL)
+	 || (disk->dir_deferred))
+		return 0;
+
+	uint64_t generation;
+	int err = read_generation(disk, &generation);
+	if (err != 0)
+		return err;
+
+	if (generation == disk->dir_disk_generation)
+		return 0;
+
+	struct BMFSDirIndex *index = disk->dir->Index;
+
+	err = bmfs_disk_cache_dir(disk, disk->dir);
+	if (err != 0)
+		return err;
+
+	if (index != NULL)
+		bmfs_dir_set_index(disk->dir, index);
+
+	return 0;
+}
+
+/* Called when a change to the root directory
+ * couldn't be written. The cached directory is
+ * read again, so that it doesn't keep entries
+ * that aren't on disk, and the extent map is
+ * made stale, so that it's built again from
+ * the blocks the disk actually has reserved.
+ * If the directory can't be read, it's no
+ * longer cached. */
+
+static void discard_dir_changes(struct BMFSDisk *disk)
+{
+	if ((disk->dir != NULL)
+	 && !disk->dir_deferred)
+	{
+		struct BMFSDir *dir = disk->dir;
+		struct BMFSDirIndex *index = dir->Index;
+
+		if ((bmfs_disk_cache_dir(disk, dir) == 0)
+		 && (index != NULL))
+			bmfs_dir_set_index(dir, index);
+	}
+
+	__atomic_add_fetch(&disk->dir_generation, 1, __ATOMIC_RELEASE);
+}
+
+/* Called after the root directory is modified,
+ * in the cached directory or on disk. */
+
+static int commit_dir(struct BMFSDisk *disk)
+{
+	int err;
+	if (disk->dir != NULL)
+		err = bmfs_disk_sync_dir(disk, disk->dir);
+	else
+		/* the pages were written already */
+		err = bump_generation(disk);
+
+	if (err != 0)
+		discard_dir_changes(disk);
+
+	return err;
+}
+
+/* Finds a file in the root directory, in the
+ * cached directory if there is one. Otherwise,
+ * the entry is left in the page buffer. */
+
+static int lookup_file(struct BMFSDisk *disk,
+                       struct DirPage *page,
+                       const char *filename,
+                       uint64_t *position,
+                       struct BMFSEntry **entry)
+{
+	if (disk->dir != NULL)
+	{
+		*entry = bmfs_dir_find(disk->dir, filename);
+		if (*entry == NULL)
+			return -ENOENT;
+
+		*position = *entry - &disk->dir->Entries[0];
+		return 0;
+	}
+
+	uint64_t entry_count;
+	int err = read_entry_count(disk, &entry_count);
+	if (err != 0)
+		return err;
+
+	for (uint64_t i = 0; i < entry_count; i++)
+	{
+		err = page_entry(disk, page, i, entry);
+		if (err != 0)
+			return err;
+
+		if (bmfs_entry_is_terminator(*entry))
+			break;
+		else if (bmfs_entry_is_empty(*entry))
+			continue;
+		else if (bmfs_entry_cmp_filename(*entry, filename) != 0)
+			continue;
+
+		*position = i;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/* Adds an entry to the directory on
+ * disk, like bmfs_dir_add does. */
+
+static int add_uncached(struct BMFSDisk *disk, const struct BMFSEntry *entry)
+{
+	uint64_t entry_count;
+	int err = read_entry_count(disk, &entry_count);
+	if (err != 0)
+		return err;
+
+	struct DirPage page;
+	page_init(&page);
+
+	/* the first empty entry */
+	uint64_t position = entry_count;
+	uint64_t i = 0;
+
+	for (; i < entry_count; i++)
+	{
+		struct BMFSEntry *dst;
+		err = page_entry(disk, &page, i, &dst);
+		if (err != 0)
+			return err;
+
+		if (bmfs_entry_is_terminator(dst))
+			break;
+		else if (bmfs_entry_is_empty(dst))
+		{
+			if (position == entry_count)
+				position = i;
+		}
+		else if (bmfs_entry_cmp_filename(dst, entry->FileName) == 0)
+			return -EEXIST;
+	}
+
+	if (position == entry_count)
+	{
+		/* ran out of entries */
+		if (i == entry_count)
+			return -ENOSPC;
+
+		position = i;
+
+		if ((position + 1) < entry_count)
+		{
+			/* make sure next entry
+			 * indicates end of directory */
+			struct BMFSEntry *next;
+			err = page_entry(disk, &page, position + 1, &next);
+			if (err != 0)
+				return err;
+
+			next->FileName[0] = 0;
+			page.dirty = 1;
+		}
+	}
+
+	struct BMFSEntry *dst;
+	err = page_entry(disk, &page, position, &dst);
+	if (err != 0)
+		return err;
+
+	*dst = *entry;
+	page.dirty = 1;
+
+	return page_flush(disk, &page);
+}
+
+/* Checks the directory on disk, like
+ * bmfs_dir_should_compact does. */
+
+static int should_compact_uncached(struct BMFSDisk *disk, int *should_compact)
+{
+	uint64_t entry_count;
+	int err = read_entry_count(disk, &entry_count);
+	if (err != 0)
+		return err;
+
+	struct DirPage page;
+	page_init(&page);
+
+	uint64_t deleted = 0;
+	uint64_t trailing = 0;
+	uint64_t count = 0;
+
+	for (; count < entry_count; count++)
+	{
+		struct BMFSEntry *entry;
+		err = page_entry(disk, &page, count, &entry);
+		if (err != 0)
+			return err;
+
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			trailing++;
+		else
+		{
+			deleted += trailing;
+			trailing = 0;
+		}
+	}
+
+	count -= trailing;
+
+	*should_compact = (deleted >= BMFS_DIR_COMPACT_MIN)
+	               && ((deleted * 4) >= count);
+
+	return 0;
+}
+
+/* Compacts the directory on disk, like
+ * bmfs_dir_compact does. Entries are read
+ * through one page buffer and moved into
+ * another, which is written once it's full.
+ * Since entries only move towards the start,
+ * a page is never written before it is read. */
+
+static int compact_uncached(struct BMFSDisk *disk)
+{
+	uint64_t entry_count;
+	int err = read_entry_count(disk, &entry_count);
+	if (err != 0)
+		return err;
+
+	struct DirPage src_page;
+	struct DirPage dst_page;
+	page_init(&src_page);
+	page_init(&dst_page);
+
+	uint64_t dst = 0;
+	uint64_t src = 0;
+	/* one past the last file */
+	uint64_t end = 0;
+
+	for (; src < entry_count; src++)
+	{
+		struct BMFSEntry *entry;
+		err = page_entry(disk, &src_page, src, &entry);
+		if (err != 0)
+			return err;
+
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			continue;
+
+		if (dst != src)
+		{
+			struct BMFSEntry *moved;
+			err = page_entry(disk, &dst_page, dst, &moved);
+			if (err != 0)
+				return err;
+
+			*moved = *entry;
+			dst_page.dirty = 1;
+		}
+
+		dst++;
+		end = src + 1;
+	}
+
+	uint64_t removed = end - dst;
+	if (removed == 0)
+		return 0;
+
+	/* the entries that were moved are
+	 * cleared, and the terminator is
+	 * put after the last file */
+	for (uint64_t i = dst; i < end; i++)
+	{
+		struct BMFSEntry *entry;
+		err = page_entry(disk, &dst_page, i, &entry);
+		if (err != 0)
+			return err;
+
+		memset(entry, 0, sizeof(*entry));
+		bmfs_entry_init(entry);
+		if (i == dst)
+			entry->FileName[0] = 0;
+
+		dst_page.dirty = 1;
+	}
+
+	err = page_flush(disk, &dst_page);
+	if (err != 0)
+		return err;
+
+	return (int) removed;
 }
 
-int bmfs_disk_write(struct BMFSDisk *disk, const void *buf, uint64_t len, uint64_t *write_len)
+/* Adds the entry of a file whose blocks were
+ * just allocated, and reserves the blocks in
+ * the cached extent map. */
+
+static int add_file(struct BMFSDisk *disk, const struct BMFSEntry *entry)
 {
-	if ((disk == NULL)
-	 || (disk->write == NULL))
-		return -EFAULT;
+	int err;
 
-	return disk->write(disk->disk, buf, len, write_len);
-}
+	/* the extent map was made current
+	 * when the space was allocated */
+	int update_extents = extents_current(disk);
 
-/* public functions */
+	if (disk->dir != NULL)
+	{
+		err = bmfs_dir_add(disk->dir, entry);
+		if (err != 0)
+			return err;
+	}
+	else
+	{
+		err = add_uncached(disk, entry);
+		if (err != 0)
+		{
+			/* some of the pages may
+			 * have been written */
+			discard_dir_changes(disk);
+			return err;
+		}
+	}
 
-int bmfs_disk_read_dir(struct BMFSDisk *disk, struct BMFSDir *dir)
-{
-	int err = bmfs_disk_seek(disk, 4096, SEEK_SET);
+	err = commit_dir(disk);
 	if (err != 0)
 		return err;
 
-	err = bmfs_disk_read(disk, dir->Entries, sizeof(dir->Entries), NULL);
-	if (err != 0)
-		return err;
+	if (update_extents
+	 && (bmfs_extent_map_reserve(disk->extents, entry->StartingBlock, entry->ReservedBlocks) == 0))
+		disk->extents->generation = disk->dir_generation;
 
 	return 0;
 }
 
-int bmfs_disk_write_dir(struct BMFSDisk *disk, const struct BMFSDir *dir)
+/* Deletes a file from the root directory, and
+ * releases its blocks in the cached extent map.
+ * If undo is non-zero, the file was just added
+ * and is removed again. Then the directory is
+ * not compacted, and if the file is the last
+ * one, its entry becomes the terminator again. */
+
+static int remove_file(struct BMFSDisk *disk, const char *filename, int undo)
 {
-	int err = bmfs_disk_seek(disk, 4096, SEEK_SET);
+	uint64_t entry_count;
+	int err = dir_entry_count(disk, &entry_count);
 	if (err != 0)
 		return err;
 
-	err = bmfs_disk_write(disk, dir->Entries, sizeof(dir->Entries), NULL);
+	struct DirPage page;
+	page_init(&page);
+
+	uint64_t position;
+	struct BMFSEntry *entry;
+	err = lookup_file(disk, &page, filename, &position, &entry);
 	if (err != 0)
 		return err;
 
-	return 0;
-}
+	/* needed after the entry is moved */
+	uint64_t starting_block = entry->StartingBlock;
+	uint64_t reserved_blocks = entry->ReservedBlocks;
 
-int bmfs_disk_allocate_bytes(struct BMFSDisk *disk, uint64_t bytes, uint64_t *starting_block)
-{
-	if ((disk == NULL)
-	 || (starting_block == NULL))
-		return -EFAULT;
+	int last = 0;
 
-	/* make bytes % BMFS_BLOCK_SIZE == 0
-	 * by rounding up */
-	if ((bytes % BMFS_BLOCK_SIZE) != 0)
-		bytes += BMFS_BLOCK_SIZE - (bytes % BMFS_BLOCK_SIZE);
+	if (undo
+	 && ((position + 1) >= entry_count))
+		last = 1;
+	else if (undo)
+	{
+		struct BMFSEntry *next;
+		err = dir_entry(disk, &page, position + 1, &next);
+		if (err != 0)
+			return err;
 
-	struct BMFSDir dir;
+		last = bmfs_entry_is_terminator(next);
 
-	int err = bmfs_disk_read_dir(disk, &dir);
-	if (err != 0)
-		return err;
+		/* the next entry may be in another page */
+		err = dir_entry(disk, &page, position, &entry);
+		if (err != 0)
+			return err;
+	}
 
-	err = bmfs_dir_sort(&dir, bmfs_entry_cmp_by_starting_block);
-	if (err != 0)
-		return err;
+	if (disk->dir != NULL)
+	{
+		err = bmfs_dir_delete_file(disk->dir, filename);
+		if (err != 0)
+			return err;
+
+		if (last)
+			entry->FileName[0] = 0;
+		else if (!undo
+		      && bmfs_dir_should_compact(disk->dir))
+			bmfs_dir_compact(disk->dir);
+	}
+	else
+	{
+		entry->FileName[0] = last ? 0 : 1;
+		page.dirty = 1;
 
-	uint64_t total_blocks;
-	err = bmfs_disk_blocks(disk, &total_blocks);
-	if (err != 0)
-		return err;
-	else if (total_blocks == 0)
-		return -ENOSPC;
+		err = page_flush(disk, &page);
 
-	uint64_t prev_block = 1;
-	uint64_t next_block = total_blocks;
+		int should_compact = 0;
 
-	for (uint64_t i = 0; i < 64; i++)
-	{
-		struct BMFSEntry *entry = &dir.Entries[i];
-		if (!(bmfs_entry_is_empty(entry))
-		 && !(bmfs_entry_is_terminator(entry)))
-			next_block = entry->StartingBlock;
+		if ((err == 0)
+		 && !undo)
+			err = should_compact_uncached(disk, &should_compact);
 
-		size_t blocks_between = next_block - prev_block;
-		if ((blocks_between * BMFS_BLOCK_SIZE) >= bytes)
+		if ((err == 0)
+		 && should_compact)
 		{
-			/* found a spot between entries */
-			*starting_block = prev_block;
-			return 0;
+			int removed = compact_uncached(disk);
+			if (removed < 0)
+				err = removed;
 		}
 
-		prev_block = next_block + entry->ReservedBlocks;
-		next_block = total_blocks;
+		if (err != 0)
+		{
+			discard_dir_changes(disk);
+			return err;
+		}
 	}
 
-	return -ENOSPC;
+	int update_extents = extents_current(disk);
+
+	err = commit_dir(disk);
+	if (err != 0)
+		return err;
+
+	if (update_extents
+	 && (bmfs_extent_map_release(disk->extents, starting_block, reserved_blocks) == 0))
+		disk->extents->generation = disk->dir_generation;
+
+	return 0;
+}
+
+/* public functions */
+
+int bmfs_disk_allocate_bytes(struct BMFSDisk *disk, uint64_t bytes, uint64_t *starting_block)
+{
+	if ((disk == NULL)
+	 || (starting_block == NULL))
+		return -EFAULT;
+
+	/* make bytes % BMFS_BLOCK_SIZE == 0
+	 * by rounding up */
+	if ((bytes % BMFS_BLOCK_SIZE) != 0)
+		bytes += BMFS_BLOCK_SIZE - (bytes % BMFS_BLOCK_SIZE);
+
+	return find_blocks(disk, bytes / BMFS_BLOCK_SIZE, starting_block);
 }
 
 int bmfs_disk_allocate_mebibytes(struct BMFSDisk *disk, uint64_t mebibytes, uint64_t *starting_block)
@@ -205,75 +1368,335 @@ int bmfs_disk_create_file(struct BMFSDisk *disk, const char *filename, uint64_t
 	bmfs_entry_set_starting_block(&entry, starting_block);
 	bmfs_entry_set_reserved_blocks(&entry, mebibytes / 2);
 
-	struct BMFSDir dir;
+	return add_file(disk, &entry);
+}
+
+int bmfs_disk_create_files(struct BMFSDisk *disk,
+                           const char *const *filenames,
+                           const uint64_t *mebibytes,
+                           uint64_t count)
+{
+	if ((disk == NULL)
+	 || (filenames == NULL)
+	 || (mebibytes == NULL))
+		return -EFAULT;
+
+	/* with a cached directory, the entries
+	 * are written once all of them are added */
+	int defer = (disk->dir != NULL)
+	         && !disk->dir_deferred;
+	if (defer)
+		disk->dir_deferred = 1;
 
-	err = bmfs_disk_read_dir(disk, &dir);
+	int err = 0;
+	uint64_t i = 0;
+
+	for (; i < count; i++)
+	{
+		err = bmfs_disk_create_file(disk, filenames[i], mebibytes[i]);
+		if (err != 0)
+			break;
+	}
+
+	/* the files that were created are removed
+	 * again, so that nothing changes if one of
+	 * the files can't be created */
 	if (err != 0)
-		return err;
+	{
+		while (i > 0)
+			remove_file(disk, filenames[--i], 1);
+	}
+
+	if (defer)
+	{
+		int flush_err = bmfs_disk_flush_dir(disk);
+		if (flush_err != 0)
+		{
+			/* the files that aren't on disk
+			 * are dropped from the cache */
+			disk->dir_deferred = 0;
+			discard_dir_changes(disk);
+		}
+
+		if (err == 0)
+			err = flush_err;
+	}
+
+	return err;
+}
+
+/* Moves the data of a file to blocks that
+ * don't overlap the ones it is in now. */
 
-	err = bmfs_dir_add(&dir, &entry);
+static int move_data(struct BMFSDisk *disk,
+                     uint64_t from_block,
+                     uint64_t to_block,
+                     uint64_t size,
+                     void *buf,
+                     uint64_t buf_size)
+{
+	if ((size > 0)
+	 && ((buf == NULL)
+	  || (buf_size == 0)))
+		return -EFAULT;
+
+	uint64_t from = from_block * BMFS_BLOCK_SIZE;
+	uint64_t to = to_block * BMFS_BLOCK_SIZE;
+
+	for (uint64_t offset = 0; offset < size; offset += buf_size)
+	{
+		uint64_t len = size - offset;
+		if (len > buf_size)
+			len = buf_size;
+
+		int err = bmfs_disk_pread(disk, buf, len, from + offset, NULL);
+		if (err != 0)
+			return err;
+
+		err = bmfs_disk_pwrite(disk, buf, len, to + offset, NULL);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+int bmfs_disk_resize_file(struct BMFSDisk *disk,
+                          const char *filename,
+                          uint64_t mebibytes,
+                          uint64_t data_size,
+                          void *buf,
+                          uint64_t buf_size)
+{
+	if ((disk == NULL)
+	 || (filename == NULL))
+		return -EFAULT;
+
+	if (mebibytes % 2 != 0)
+		mebibytes++;
+
+	uint64_t blocks = mebibytes / 2;
+	if (data_size > (blocks * BMFS_BLOCK_SIZE))
+		return -EINVAL;
+
+	struct DirPage page;
+	page_init(&page);
+
+	uint64_t position;
+	struct BMFSEntry *entry;
+	int err = lookup_file(disk, &page, filename, &position, &entry);
 	if (err != 0)
 		return err;
+	else if (entry->FileSize > (blocks * BMFS_BLOCK_SIZE))
+		return -EINVAL;
+
+	uint64_t start = entry->StartingBlock;
+	uint64_t reserved = entry->ReservedBlocks;
+	uint64_t new_start = start;
+
+	if (blocks == reserved)
+		return 0;
+	else if (blocks > reserved)
+	{
+		/* shrinking is always done in place */
+		int in_place;
+		err = blocks_are_free(disk, start + reserved, blocks - reserved, &in_place);
+		if (err != 0)
+			return err;
+
+		if (!in_place)
+		{
+			/* the current blocks are still reserved,
+			 * so the new space doesn't overlap them
+			 * and the data can be moved in one pass */
+			err = find_blocks(disk, blocks, &new_start);
+			if (err != 0)
+				return err;
+
+			err = move_data(disk, start, new_start, data_size, buf, buf_size);
+			if (err != 0)
+				return err;
+		}
+	}
 
-	err = bmfs_disk_write_dir(disk, &dir);
+	entry->StartingBlock = new_start;
+	entry->ReservedBlocks = blocks;
+
+	if (disk->dir != NULL)
+		bmfs_dir_mark_dirty(disk->dir, entry);
+	else
+	{
+		page.dirty = 1;
+
+		err = page_flush(disk, &page);
+		if (err != 0)
+		{
+			discard_dir_changes(disk);
+			return err;
+		}
+	}
+
+	/* the extent map is only changed once
+	 * the directory is written */
+	int update_extents = extents_current(disk);
+
+	err = commit_dir(disk);
 	if (err != 0)
 		return err;
 
+	if (!update_extents)
+		return 0;
+
+	struct BMFSExtentMap *map = disk->extents;
+
+	if (blocks < reserved)
+		err = bmfs_extent_map_release(map, start + blocks, reserved - blocks);
+	else if (new_start == start)
+		err = bmfs_extent_map_reserve(map, start + reserved, blocks - reserved);
+	else
+	{
+		err = bmfs_extent_map_release(map, start, reserved);
+		if (err == 0)
+			err = bmfs_extent_map_reserve(map, new_start, blocks);
+	}
+
+	if (err == 0)
+		map->generation = disk->dir_generation;
+
 	return 0;
 }
 
 int bmfs_disk_delete_file(struct BMFSDisk *disk, const char *filename)
 {
-	struct BMFSDir dir;
-	int err = bmfs_disk_read_dir(disk, &dir);
+	if ((disk == NULL)
+	 || (filename == NULL))
+		return -EFAULT;
+
+	return remove_file(disk, filename, 0);
+}
+
+int bmfs_disk_compact_dir(struct BMFSDisk *disk)
+{
+	if (disk == NULL)
+		return -EFAULT;
+
+	int removed;
+	if (disk->dir != NULL)
+		removed = bmfs_dir_compact(disk->dir);
+	else
+		removed = compact_uncached(disk);
+
+	if (removed <= 0)
+		return removed;
+
+	/* compacting the directory
+	 * doesn't change the free space */
+	int update_extents = extents_current(disk);
+
+	int err = commit_dir(disk);
 	if (err != 0)
 		return err;
 
-	struct BMFSEntry *entry;
-	entry = bmfs_dir_find(&dir, filename);
-	if (entry == NULL)
-		return -ENOENT;
-
-	entry->FileName[0] = 1;
+	if (update_extents)
+		disk->extents->generation = disk->dir_generation;
 
-	return bmfs_disk_write_dir(disk, &dir);
+	return removed;
 }
 
 int bmfs_disk_find_file(struct BMFSDisk *disk, const char *filename, struct BMFSEntry *fileentry, int *entrynumber)
 {
-	int err;
-	struct BMFSDir dir;
-	struct BMFSEntry *result;
+	if (disk == NULL)
+		return -EFAULT;
 
-	err = bmfs_disk_read_dir(disk, &dir);
+	struct DirPage page;
+	page_init(&page);
+
+	uint64_t position;
+	struct BMFSEntry *result;
+	int err = lookup_file(disk, &page, filename, &position, &result);
 	if (err != 0)
 		return err;
 
-	result = bmfs_dir_find(&dir, filename);
-	if (result == NULL)
-		/* not found */
-		return -ENOENT;
-
 	if (fileentry)
 		*fileentry = *result;
 
 	if (entrynumber)
-		*entrynumber = (result - &dir.Entries[0]) / sizeof(dir.Entries[0]);
+		*entrynumber = (int) position;
 
 	return 0;
 }
 
-int bmfs_disk_check_tag(struct BMFSDisk *disk)
+int bmfs_disk_set_file_size(struct BMFSDisk *disk, int entrynumber, uint64_t size)
 {
 	if (disk == NULL)
 		return -EFAULT;
 
-	int err = bmfs_disk_seek(disk, 1024, SEEK_SET);
+	uint64_t entry_count;
+	int err = dir_entry_count(disk, &entry_count);
+	if (err != 0)
+		return err;
+
+	if ((entrynumber < 0)
+	 || (((uint64_t) entrynumber) >= entry_count))
+		return -EINVAL;
+
+	struct DirPage page;
+	page_init(&page);
+
+	struct BMFSEntry *entry;
+	err = dir_entry(disk, &page, entrynumber, &entry);
+	if (err != 0)
+		return err;
+
+	if (bmfs_entry_is_empty(entry)
+	 || bmfs_entry_is_terminator(entry))
+		return -ENOENT;
+	else if (size > (entry->ReservedBlocks * BMFS_BLOCK_SIZE))
+		return -ENOSPC;
+
+	entry->FileSize = size;
+
+	/* the size of a file
+	 * doesn't change the
+	 * free space */
+	int update_extents = extents_current(disk);
+
+	if (disk->dir_deferred)
+	{
+		bmfs_dir_mark_dirty(disk->dir, entry);
+		err = bmfs_disk_sync_dir(disk, disk->dir);
+	}
+	else
+	{
+		/* only the one entry is written,
+		 * instead of the whole directory */
+		uint64_t offset = page_offset(entrynumber / BMFS_DIR_PAGE_ENTRIES);
+		offset += (entrynumber % BMFS_DIR_PAGE_ENTRIES) * sizeof(*entry);
+
+		err = bmfs_disk_pwrite(disk, entry, sizeof(*entry), offset, NULL);
+		if (err == 0)
+			err = bump_generation(disk);
+	}
+
 	if (err != 0)
+	{
+		discard_dir_changes(disk);
 		return err;
+	}
+
+	if (update_extents)
+		disk->extents->generation = disk->dir_generation;
+
+	return 0;
+}
+
+int bmfs_disk_check_tag(struct BMFSDisk *disk)
+{
+	if (disk == NULL)
+		return -EFAULT;
 
 	char tag[4];
-	err = bmfs_disk_read(disk, tag, 4, NULL);
+	int err = bmfs_disk_pread(disk, tag, 4, 1024, NULL);
 	if (err != 0)
 		return err;
 	else if ((tag[0] != 'B')
@@ -290,31 +1713,133 @@ int bmfs_disk_write_tag(struct BMFSDisk *disk)
 	if (disk == NULL)
 		return -EFAULT;
 
-	int err = bmfs_disk_seek(disk, 1024, SEEK_SET);
+	int err = bmfs_disk_pwrite(disk, "BMFS", 4, 1024, NULL);
+	if (err != 0)
+		return err;
+
+	return 0;
+}
+
+int bmfs_disk_format(struct BMFSDisk *disk)
+{
+	return bmfs_disk_format_extended(disk, BMFS_DIR_PAGE_ENTRIES);
+}
+
+int bmfs_disk_format_extended(struct BMFSDisk *disk, uint64_t entry_count)
+{
+	if (disk == NULL)
+		return -EFAULT;
+	else if ((entry_count == 0)
+	      || (entry_count > BMFS_DIR_ENTRIES_MAX)
+	      || ((entry_count % BMFS_DIR_PAGE_ENTRIES) != 0))
+		return -EINVAL;
+
+	int err;
+
+	if (entry_count > BMFS_DIR_PAGE_ENTRIES)
+	{
+		/* pages of a directory that was
+		 * already extended may be reused */
+		uint64_t old_count;
+		if (read_entry_count(disk, &old_count) != 0)
+			old_count = BMFS_DIR_PAGE_ENTRIES;
+
+		if (old_count < entry_count)
+		{
+			err = check_unused_pages(disk,
+			                         old_count / BMFS_DIR_PAGE_ENTRIES,
+			                         entry_count / BMFS_DIR_PAGE_ENTRIES);
+			if (err != 0)
+				return err;
+		}
+	}
+
+	err = bmfs_disk_write_tag(disk);
 	if (err != 0)
 		return err;
 
-	err = bmfs_disk_write(disk, "BMFS", 4, NULL);
+	err = write_entry_count(disk, entry_count);
 	if (err != 0)
 		return err;
 
-	return 0;
+	/* the pages are written one at a time,
+	 * so that no directory has to be made
+	 * in memory */
+	err = write_unused_pages(disk, 0, 1);
+	if (err != 0)
+		return err;
+
+	err = write_unused_pages(disk, 1, entry_count / BMFS_DIR_PAGE_ENTRIES);
+	if (err != 0)
+		return err;
+
+	if (disk->dir != NULL)
+	{
+		struct BMFSDirIndex *index = disk->dir->Index;
+
+		bmfs_dir_init_extended(disk->dir, entry_count);
+
+		/* every page was written */
+		disk->dir->DirtyPages = 0;
+
+		if (index != NULL)
+			bmfs_dir_set_index(disk->dir, index);
+	}
+
+	/* the old counter isn't read, since the
+	 * disk may not be readable or may not have
+	 * been formatted before. It only has to be
+	 * different from what users of the disk
+	 * last saw. */
+	return set_generation(disk, disk->dir_disk_generation + 1);
 }
 
-int bmfs_disk_format(struct BMFSDisk *disk)
+int bmfs_disk_extend_dir(struct BMFSDisk *disk, uint64_t entry_count)
 {
-	int err = bmfs_disk_write_tag(disk);
+	if (disk == NULL)
+		return -EFAULT;
+
+	uint64_t old_count;
+	int err = dir_entry_count(disk, &old_count);
 	if (err != 0)
 		return err;
 
-	struct BMFSDir dir;
-	bmfs_dir_init(&dir);
+	if ((entry_count < old_count)
+	 || (entry_count > BMFS_DIR_ENTRIES_MAX)
+	 || ((entry_count % BMFS_DIR_PAGE_ENTRIES) != 0))
+		return -EINVAL;
+	else if (entry_count == old_count)
+		return 0;
 
-	err = bmfs_disk_write_dir(disk, &dir);
+	err = check_unused_pages(disk,
+	                         old_count / BMFS_DIR_PAGE_ENTRIES,
+	                         entry_count / BMFS_DIR_PAGE_ENTRIES);
 	if (err != 0)
 		return err;
 
-	return 0;
+	/* lookups stop at the first new entry
+	 * until the new pages are used, so only
+	 * the new pages have to be written */
+	err = write_unused_pages(disk,
+	                         old_count / BMFS_DIR_PAGE_ENTRIES,
+	                         entry_count / BMFS_DIR_PAGE_ENTRIES);
+	if (err != 0)
+		return err;
+
+	err = write_entry_count(disk, entry_count);
+	if (err != 0)
+		return err;
+
+	if (disk->dir != NULL)
+	{
+		for (uint64_t i = old_count; i < entry_count; i++)
+			bmfs_entry_init(&disk->dir->Entries[i]);
+
+		disk->dir->Entries[old_count].FileName[0] = 0;
+		disk->dir->EntryCount = entry_count;
+	}
+
+	return bump_generation(disk);
 }
 
 int bmfs_read(struct BMFSDisk *disk,
@@ -335,11 +1860,7 @@ int bmfs_read(struct BMFSDisk *disk,
 	if (err != 0)
 		return err;
 
-	err = bmfs_disk_seek(disk, file_offset + off, SEEK_SET);
-	if (err != 0)
-		return err;
-
-	err = bmfs_disk_read(disk, buf, len, NULL);
+	err = bmfs_disk_pread(disk, buf, len, file_offset + off, NULL);
 	if (err != 0)
 		return err;
 
@@ -364,11 +1885,7 @@ int bmfs_write(struct BMFSDisk *disk,
 	if (err != 0)
 		return err;
 
-	err = bmfs_disk_seek(disk, file_offset + off, SEEK_SET);
-	if (err != 0)
-		return err;
-
-	err = bmfs_disk_write(disk, buf, len, NULL);
+	err = bmfs_disk_pwrite(disk, buf, len, file_offset + off, NULL);
 	if (err != 0)
 		return err;
 
@@ -0,0 +1,43 @@
+#include <bmfs/entry.h>
+#include <bmfs/limits.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int is_cleared(const char *str, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (str[i] != 0)
+			return 0;
+	}
+	return 1;
+}
+
+int main(void)
+{
+	struct BMFSEntry entry;
+
+	/* test that the bytes after the
+	 * name are cleared */
+	memset(&entry, 0xff, sizeof(entry));
+	bmfs_entry_set_file_name(&entry, "a.txt");
+	assert(strcmp(entry.FileName, "a.txt") == 0);
+	assert(is_cleared(&entry.FileName[5], BMFS_FILE_NAME_MAX - 5));
+
+	/* test that a shorter name clears
+	 * what is left of the longer one */
+	bmfs_entry_set_file_name(&entry, "0123456789");
+	bmfs_entry_set_file_name(&entry, "b");
+	assert(strcmp(entry.FileName, "b") == 0);
+	assert(is_cleared(&entry.FileName[1], BMFS_FILE_NAME_MAX - 1));
+
+	/* test that names past the length
+	 * limit are truncated and terminated */
+	bmfs_entry_set_file_name(&entry, "0123456789012345678901234567890123456789");
+	assert(strlen(entry.FileName) == (BMFS_FILE_NAME_MAX - 1));
+	assert(memcmp(entry.FileName, "0123456789012345678901234567890", BMFS_FILE_NAME_MAX) == 0);
+
+	return EXIT_SUCCESS;
+}
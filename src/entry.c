@@ -95,7 +95,10 @@ void bmfs_entry_set_file_name(struct BMFSEntry *entry, const char *filename)
 			break;
 		entry->FileName[i] = filename[i];
 	}
-	entry->FileName[i] = 0;
+	/* the rest is cleared, so that nothing
+	 * from memory ends up on the disk */
+	for (; i < BMFS_FILE_NAME_MAX; i++)
+		entry->FileName[i] = 0;
 }
 
 void bmfs_entry_set_starting_block(struct BMFSEntry *entry, size_t starting_block)
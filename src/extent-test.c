@@ -0,0 +1,290 @@
+#include <assert.h>
+#include <bmfs/extent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Gets the extent at a position in the
+ * order of starting blocks. */
+
+static struct BMFSExtent extent_at(const struct BMFSExtentMap *map, unsigned int n)
+{
+	struct BMFSExtent extent;
+	extent.start = 0;
+	extent.length = 0;
+
+	uint64_t block = 0;
+	for (unsigned int i = 0; i <= n; i++)
+	{
+		assert(bmfs_extent_map_next(map, block, &extent) == 0);
+		block = extent.start + extent.length;
+	}
+
+	return extent;
+}
+
+static void test_reserve(void)
+{
+	struct BMFSExtentMap map;
+	bmfs_extent_map_init(&map, 1, 100);
+	assert(map.count == 1);
+
+	/* split an extent */
+	assert(bmfs_extent_map_reserve(&map, 10, 10) == 0);
+	assert(map.count == 2);
+	assert(extent_at(&map, 0).start == 1);
+	assert(extent_at(&map, 0).length == 9);
+	assert(extent_at(&map, 1).start == 20);
+	assert(extent_at(&map, 1).length == 80);
+
+	/* trim the start of an extent */
+	assert(bmfs_extent_map_reserve(&map, 20, 5) == 0);
+	assert(map.count == 2);
+	assert(extent_at(&map, 1).start == 25);
+
+	/* remove an extent and trim another */
+	assert(bmfs_extent_map_reserve(&map, 1, 30) == 0);
+	assert(map.count == 1);
+	assert(extent_at(&map, 0).start == 31);
+	assert(extent_at(&map, 0).length == 69);
+
+	/* an empty range doesn't split an extent */
+	assert(bmfs_extent_map_reserve(&map, 50, 0) == 0);
+	assert(map.count == 1);
+	assert(extent_at(&map, 0).start == 31);
+	assert(extent_at(&map, 0).length == 69);
+}
+
+static void test_release(void)
+{
+	struct BMFSExtentMap map;
+	bmfs_extent_map_init(&map, 1, 100);
+	assert(bmfs_extent_map_reserve(&map, 1, 99) == 0);
+	assert(map.count == 0);
+
+	assert(bmfs_extent_map_release(&map, 10, 10) == 0);
+	assert(bmfs_extent_map_release(&map, 40, 10) == 0);
+	assert(map.count == 2);
+
+	/* releasing free space fails */
+	assert(bmfs_extent_map_release(&map, 15, 10) == -EINVAL);
+
+	/* merge with both neighbours */
+	assert(bmfs_extent_map_release(&map, 20, 20) == 0);
+	assert(map.count == 1);
+	assert(extent_at(&map, 0).start == 10);
+	assert(extent_at(&map, 0).length == 40);
+}
+
+static void test_find(void)
+{
+	struct BMFSExtentMap map;
+	bmfs_extent_map_init(&map, 1, 100);
+	/* free: [1, 5) [10, 13) [20, 100) */
+	assert(bmfs_extent_map_reserve(&map, 5, 5) == 0);
+	assert(bmfs_extent_map_reserve(&map, 13, 7) == 0);
+
+	uint64_t start = 0;
+	map.fit = BMFS_EXTENT_FIRST_FIT;
+	assert(bmfs_extent_map_find(&map, 3, &start) == 0);
+	assert(start == 1);
+
+	map.fit = BMFS_EXTENT_BEST_FIT;
+	assert(bmfs_extent_map_find(&map, 3, &start) == 0);
+	assert(start == 10);
+
+	map.fit = BMFS_EXTENT_LARGEST_FIT;
+	assert(bmfs_extent_map_find(&map, 3, &start) == 0);
+	assert(start == 20);
+
+	assert(bmfs_extent_map_find(&map, 81, &start) == -ENOSPC);
+
+	/* any free extent fits a length of zero */
+	map.fit = BMFS_EXTENT_FIRST_FIT;
+	assert(bmfs_extent_map_find(&map, 0, &start) == 0);
+	assert(start == 1);
+	map.fit = BMFS_EXTENT_BEST_FIT;
+	assert(bmfs_extent_map_find(&map, 0, &start) == 0);
+	assert(start == 10);
+	map.fit = BMFS_EXTENT_LARGEST_FIT;
+	assert(bmfs_extent_map_find(&map, 0, &start) == 0);
+	assert(start == 20);
+
+	assert(bmfs_extent_map_is_free(&map, 10, 3));
+	assert(bmfs_extent_map_is_free(&map, 50, 50));
+	assert(!bmfs_extent_map_is_free(&map, 10, 4));
+	assert(!bmfs_extent_map_is_free(&map, 4, 2));
+	assert(!bmfs_extent_map_is_free(&map, 99, 2));
+}
+
+static void test_build(void)
+{
+	struct BMFSDir dir;
+	bmfs_dir_init(&dir);
+
+	struct BMFSEntry entry;
+	bmfs_entry_init(&entry);
+	bmfs_entry_set_file_name(&entry, "a.txt");
+	bmfs_entry_set_starting_block(&entry, 3);
+	bmfs_entry_set_reserved_blocks(&entry, 2);
+	assert(bmfs_dir_add(&dir, &entry) == 0);
+
+	bmfs_entry_set_file_name(&entry, "b.txt");
+	bmfs_entry_set_starting_block(&entry, 1);
+	bmfs_entry_set_reserved_blocks(&entry, 1);
+	assert(bmfs_dir_add(&dir, &entry) == 0);
+
+	/* deleted files don't use space */
+	bmfs_entry_set_file_name(&entry, "c.txt");
+	bmfs_entry_set_starting_block(&entry, 6);
+	bmfs_entry_set_reserved_blocks(&entry, 1);
+	assert(bmfs_dir_add(&dir, &entry) == 0);
+	assert(bmfs_dir_delete_file(&dir, "c.txt") == 0);
+
+	struct BMFSExtentMap map;
+	map.fit = BMFS_EXTENT_FIRST_FIT;
+	assert(bmfs_extent_map_build(&map, &dir, 10) == 0);
+	assert(map.count == 2);
+	assert(extent_at(&map, 0).start == 2);
+	assert(extent_at(&map, 0).length == 1);
+	assert(extent_at(&map, 1).start == 5);
+	assert(extent_at(&map, 1).length == 5);
+
+	/* an empty file in the middle of free
+	 * space doesn't split it */
+	bmfs_entry_set_file_name(&entry, "d.txt");
+	bmfs_entry_set_starting_block(&entry, 7);
+	bmfs_entry_set_reserved_blocks(&entry, 0);
+	assert(bmfs_dir_add(&dir, &entry) == 0);
+	assert(bmfs_extent_map_build(&map, &dir, 10) == 0);
+	assert(map.count == 2);
+	assert(extent_at(&map, 1).start == 5);
+	assert(extent_at(&map, 1).length == 5);
+
+	struct BMFSExtent extent;
+	assert(bmfs_extent_map_next(&map, 2, &extent) == 0);
+	assert(extent.start == 2);
+	assert(bmfs_extent_map_next(&map, 3, &extent) == 0);
+	assert(extent.start == 5);
+	assert(bmfs_extent_map_next(&map, 10, &extent) == -ENOENT);
+}
+
+#define MODEL_BLOCKS 600
+
+/* Finds space the way the map should,
+ * from a plain array of free blocks. */
+
+static int model_find(const unsigned char *free_blocks, enum bmfs_extent_fit fit, uint64_t length, uint64_t *start)
+{
+	int found = 0;
+	uint64_t found_length = 0;
+
+	for (uint64_t i = 1; i < MODEL_BLOCKS; )
+	{
+		if (!free_blocks[i])
+		{
+			i++;
+			continue;
+		}
+
+		uint64_t j = i;
+		while ((j < MODEL_BLOCKS) && free_blocks[j])
+			j++;
+
+		uint64_t run = j - i;
+		if ((run >= length)
+		 && (!found
+		  || ((fit == BMFS_EXTENT_BEST_FIT) && (run < found_length))
+		  || ((fit == BMFS_EXTENT_LARGEST_FIT) && (run > found_length))))
+		{
+			found = 1;
+			found_length = run;
+			*start = i;
+			if (fit == BMFS_EXTENT_FIRST_FIT)
+				break;
+		}
+
+		i = j;
+	}
+
+	return found ? 0 : -ENOSPC;
+}
+
+/* Compares the map with a plain array of free
+ * blocks, over many random reservations and
+ * releases, so that the trees are rebalanced
+ * in many different ways. */
+
+static void test_random(void)
+{
+	static struct BMFSExtentMap map;
+	static unsigned char free_blocks[MODEL_BLOCKS];
+
+	bmfs_extent_map_init(&map, 1, MODEL_BLOCKS);
+	memset(free_blocks, 1, sizeof(free_blocks));
+	free_blocks[0] = 0;
+
+	uint64_t state = 1;
+
+	for (unsigned int n = 0; n < 20000; n++)
+	{
+		state = (state * 6364136223846793005ULL) + 1442695040888963407ULL;
+		uint64_t r = state >> 33;
+
+		uint64_t start = 1 + (r % (MODEL_BLOCKS - 1));
+		uint64_t length = 1 + ((r >> 10) % 8);
+		if ((start + length) > MODEL_BLOCKS)
+			length = MODEL_BLOCKS - start;
+
+		int used = 1;
+		for (uint64_t i = start; i < (start + length); i++)
+			used = used && !free_blocks[i];
+
+		if (used && ((r >> 20) & 1))
+		{
+			assert(bmfs_extent_map_release(&map, start, length) == 0);
+			memset(&free_blocks[start], 1, length);
+		}
+		else
+		{
+			assert(bmfs_extent_map_reserve(&map, start, length) == 0);
+			memset(&free_blocks[start], 0, length);
+		}
+
+		map.fit = (enum bmfs_extent_fit)((r >> 21) % 3);
+
+		uint64_t expected = 0;
+		uint64_t actual = 0;
+		int expected_err = model_find(free_blocks, map.fit, length * 2, &expected);
+		assert(bmfs_extent_map_find(&map, length * 2, &actual) == expected_err);
+		assert((expected_err != 0) || (actual == expected));
+
+		assert(bmfs_extent_map_is_free(&map, start, length) == free_blocks[start]);
+	}
+
+	/* the extents match the free blocks */
+	uint64_t block = 0;
+	uint64_t count = 0;
+	struct BMFSExtent extent;
+	while (bmfs_extent_map_next(&map, block, &extent) == 0)
+	{
+		assert(!free_blocks[extent.start - 1]);
+		for (uint64_t i = extent.start; i < (extent.start + extent.length); i++)
+			assert(free_blocks[i]);
+		assert(((extent.start + extent.length) == MODEL_BLOCKS)
+		    || !free_blocks[extent.start + extent.length]);
+		block = extent.start + extent.length;
+		count++;
+	}
+	assert(count == map.count);
+}
+
+int main(void)
+{
+	test_reserve();
+	test_release();
+	test_find();
+	test_build();
+	test_random();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,543 @@
+#include <bmfs/extent.h>
+
+#include <errno.h>
+
+/* The free extents are nodes of two treaps.
+ * The first is ordered by starting block, and
+ * each node keeps the largest length in its
+ * subtree, for first and largest fit. The second
+ * is ordered by length, then starting block, for
+ * best fit. The priority of a node only depends
+ * on its index, so both trees are balanced the
+ * same way and the map can be copied. */
+
+#define NONE BMFS_EXTENT_NONE
+
+#define BY_START BMFS_EXTENT_BY_START
+
+#define BY_LENGTH BMFS_EXTENT_BY_LENGTH
+
+static uint64_t extent_end(const struct BMFSExtent *extent)
+{
+	return extent->start + extent->length;
+}
+
+static struct BMFSExtentNode *node_at(struct BMFSExtentMap *map, uint32_t i)
+{
+	return &map->nodes[i];
+}
+
+static const struct BMFSExtentNode *const_node_at(const struct BMFSExtentMap *map, uint32_t i)
+{
+	return &map->nodes[i];
+}
+
+static uint32_t priority(uint32_t i)
+{
+	uint32_t x = i * 0x9e3779b1U;
+	x ^= x >> 16;
+	x *= 0x85ebca6bU;
+	x ^= x >> 13;
+	return x;
+}
+
+static int higher_priority(uint32_t a, uint32_t b)
+{
+	uint32_t pa = priority(a);
+	uint32_t pb = priority(b);
+	return (pa > pb) || ((pa == pb) && (a < b));
+}
+
+static int less_than(const struct BMFSExtentMap *map, int tree, uint32_t a, uint32_t b)
+{
+	const struct BMFSExtent *x = &const_node_at(map, a)->extent;
+	const struct BMFSExtent *y = &const_node_at(map, b)->extent;
+
+	if ((tree == BY_LENGTH)
+	 && (x->length != y->length))
+		return x->length < y->length;
+
+	return x->start < y->start;
+}
+
+static uint64_t max_length(const struct BMFSExtentMap *map, uint32_t i)
+{
+	if (i == NONE)
+		return 0;
+
+	return const_node_at(map, i)->max_length;
+}
+
+/* Updates the largest length of a subtree,
+ * after the children of its root changed. */
+
+static void update(struct BMFSExtentMap *map, int tree, uint32_t i)
+{
+	if (tree != BY_START)
+		return;
+
+	struct BMFSExtentNode *node = node_at(map, i);
+
+	uint64_t length = node->extent.length;
+	uint64_t left = max_length(map, node->children[BY_START][0]);
+	uint64_t right = max_length(map, node->children[BY_START][1]);
+
+	if (left > length)
+		length = left;
+
+	if (right > length)
+		length = right;
+
+	node->max_length = length;
+}
+
+static uint32_t tree_insert(struct BMFSExtentMap *map, int tree, uint32_t root, uint32_t i)
+{
+	if (root == NONE)
+	{
+		update(map, tree, i);
+		return i;
+	}
+
+	int side = less_than(map, tree, i, root) ? 0 : 1;
+
+	uint32_t *children = node_at(map, root)->children[tree];
+
+	uint32_t child = tree_insert(map, tree, children[side], i);
+	children[side] = child;
+
+	if (higher_priority(child, root))
+	{
+		/* rotate the child above the root */
+		uint32_t *child_children = node_at(map, child)->children[tree];
+		children[side] = child_children[!side];
+		child_children[!side] = root;
+		update(map, tree, root);
+		update(map, tree, child);
+		return child;
+	}
+
+	update(map, tree, root);
+
+	return root;
+}
+
+static uint32_t tree_merge(struct BMFSExtentMap *map, int tree, uint32_t a, uint32_t b)
+{
+	if (a == NONE)
+		return b;
+	else if (b == NONE)
+		return a;
+
+	if (higher_priority(a, b))
+	{
+		uint32_t *children = node_at(map, a)->children[tree];
+		children[1] = tree_merge(map, tree, children[1], b);
+		update(map, tree, a);
+		return a;
+	}
+	else
+	{
+		uint32_t *children = node_at(map, b)->children[tree];
+		children[0] = tree_merge(map, tree, a, children[0]);
+		update(map, tree, b);
+		return b;
+	}
+}
+
+static uint32_t tree_remove(struct BMFSExtentMap *map, int tree, uint32_t root, uint32_t i)
+{
+	if (root == i)
+	{
+		uint32_t *children = node_at(map, i)->children[tree];
+		return tree_merge(map, tree, children[0], children[1]);
+	}
+
+	int side = less_than(map, tree, i, root) ? 0 : 1;
+
+	uint32_t *children = node_at(map, root)->children[tree];
+	children[side] = tree_remove(map, tree, children[side], i);
+
+	update(map, tree, root);
+
+	return root;
+}
+
+static void link_node(struct BMFSExtentMap *map, uint32_t i)
+{
+	struct BMFSExtentNode *node = node_at(map, i);
+	node->children[BY_START][0] = NONE;
+	node->children[BY_START][1] = NONE;
+	node->children[BY_LENGTH][0] = NONE;
+	node->children[BY_LENGTH][1] = NONE;
+
+	map->roots[BY_START] = tree_insert(map, BY_START, map->roots[BY_START], i);
+	map->roots[BY_LENGTH] = tree_insert(map, BY_LENGTH, map->roots[BY_LENGTH], i);
+}
+
+static void unlink_node(struct BMFSExtentMap *map, uint32_t i)
+{
+	map->roots[BY_START] = tree_remove(map, BY_START, map->roots[BY_START], i);
+	map->roots[BY_LENGTH] = tree_remove(map, BY_LENGTH, map->roots[BY_LENGTH], i);
+}
+
+static int insert_extent(struct BMFSExtentMap *map, uint64_t start, uint64_t length)
+{
+	uint32_t i;
+	if (map->free_node != NONE)
+	{
+		/* unused nodes are linked
+		 * through their first child */
+		i = map->free_node;
+		map->free_node = node_at(map, i)->children[BY_START][0];
+	}
+	else if (map->unused_node < BMFS_EXTENT_MAX)
+		i = map->unused_node++;
+	else
+		return -ENOMEM;
+
+	struct BMFSExtentNode *node = node_at(map, i);
+	node->extent.start = start;
+	node->extent.length = length;
+
+	link_node(map, i);
+
+	map->count++;
+
+	return 0;
+}
+
+static void remove_extent(struct BMFSExtentMap *map, uint32_t i)
+{
+	unlink_node(map, i);
+
+	node_at(map, i)->children[BY_START][0] = map->free_node;
+	map->free_node = i;
+
+	map->count--;
+}
+
+/* Changes the range of an extent. It is taken
+ * out of both trees, since its length is a key
+ * of one and its subtree lengths of the other. */
+
+static void set_extent(struct BMFSExtentMap *map, uint32_t i, uint64_t start, uint64_t length)
+{
+	unlink_node(map, i);
+
+	struct BMFSExtentNode *node = node_at(map, i);
+	node->extent.start = start;
+	node->extent.length = length;
+
+	link_node(map, i);
+}
+
+/* Finds the first extent that ends after
+ * the given block. Since the extents don't
+ * overlap, they are ordered by their ends
+ * as well as their starts. */
+
+static uint32_t find_end_after(const struct BMFSExtentMap *map, uint64_t block)
+{
+	uint32_t found = NONE;
+	uint32_t i = map->roots[BY_START];
+
+	while (i != NONE)
+	{
+		const struct BMFSExtentNode *node = const_node_at(map, i);
+		if (extent_end(&node->extent) > block)
+		{
+			found = i;
+			i = node->children[BY_START][0];
+		}
+		else
+			i = node->children[BY_START][1];
+	}
+
+	return found;
+}
+
+/* Finds the last extent that starts
+ * before the given block. */
+
+static uint32_t find_start_before(const struct BMFSExtentMap *map, uint64_t block)
+{
+	uint32_t found = NONE;
+	uint32_t i = map->roots[BY_START];
+
+	while (i != NONE)
+	{
+		const struct BMFSExtentNode *node = const_node_at(map, i);
+		if (node->extent.start < block)
+		{
+			found = i;
+			i = node->children[BY_START][1];
+		}
+		else
+			i = node->children[BY_START][0];
+	}
+
+	return found;
+}
+
+/* Finds the extent with the lowest starting
+ * block that has at least the given length,
+ * by skipping subtrees with no such extent. */
+
+static uint32_t find_first_fit(const struct BMFSExtentMap *map, uint64_t length)
+{
+	uint32_t i = map->roots[BY_START];
+
+	while ((i != NONE)
+	    && (max_length(map, i) >= length))
+	{
+		const struct BMFSExtentNode *node = const_node_at(map, i);
+		uint32_t left = node->children[BY_START][0];
+		/* an empty subtree has a maximum length of
+		 * zero, which a length of zero would fit */
+		if ((left != NONE)
+		 && (max_length(map, left) >= length))
+			i = left;
+		else if (node->extent.length >= length)
+			return i;
+		else
+			i = node->children[BY_START][1];
+	}
+
+	return NONE;
+}
+
+/* Finds the shortest extent that has at least
+ * the given length. Of extents with the same
+ * length, the one that starts first is used. */
+
+static uint32_t find_best_fit(const struct BMFSExtentMap *map, uint64_t length)
+{
+	uint32_t found = NONE;
+	uint32_t i = map->roots[BY_LENGTH];
+
+	while (i != NONE)
+	{
+		const struct BMFSExtentNode *node = const_node_at(map, i);
+		if (node->extent.length >= length)
+		{
+			found = i;
+			i = node->children[BY_LENGTH][0];
+		}
+		else
+			i = node->children[BY_LENGTH][1];
+	}
+
+	return found;
+}
+
+void bmfs_extent_map_init(struct BMFSExtentMap *map,
+                          uint64_t start,
+                          uint64_t end)
+{
+	map->count = 0;
+	map->roots[BY_START] = NONE;
+	map->roots[BY_LENGTH] = NONE;
+	map->free_node = NONE;
+	map->unused_node = 0;
+	map->fit = BMFS_EXTENT_FIRST_FIT;
+	map->generation = 0;
+
+	if (end > start)
+		insert_extent(map, start, end - start);
+}
+
+int bmfs_extent_map_build(struct BMFSExtentMap *map,
+                          const struct BMFSDir *dir,
+                          uint64_t total_blocks)
+{
+	if ((map == NULL)
+	 || (dir == NULL))
+		return -EFAULT;
+
+	enum bmfs_extent_fit fit = map->fit;
+
+	bmfs_extent_map_init(map, 1, total_blocks);
+
+	map->fit = fit;
+
+	for (uint64_t i = 0; i < dir->EntryCount; i++)
+	{
+		const struct BMFSEntry *entry = &dir->Entries[i];
+		if (bmfs_entry_is_terminator(entry))
+			break;
+		else if (bmfs_entry_is_empty(entry))
+			continue;
+
+		int err = bmfs_extent_map_reserve(map, entry->StartingBlock, entry->ReservedBlocks);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+int bmfs_extent_map_reserve(struct BMFSExtentMap *map,
+                            uint64_t start,
+                            uint64_t length)
+{
+	if (map == NULL)
+		return -EFAULT;
+	else if (length == 0)
+		return 0;
+
+	uint64_t end = start + length;
+	uint32_t i = find_end_after(map, start);
+
+	while ((i != NONE)
+	    && (node_at(map, i)->extent.start < end))
+	{
+		struct BMFSExtent *extent = &node_at(map, i)->extent;
+		uint64_t extent_start = extent->start;
+		uint64_t extent_stop = extent_end(extent);
+
+		if ((extent_start < start)
+		 && (extent_stop > end))
+		{
+			/* the range is in the middle
+			 * of the extent, split it */
+			set_extent(map, i, extent_start, start - extent_start);
+			return insert_extent(map, end, extent_stop - end);
+		}
+		else if (extent_start < start)
+		{
+			/* keep the beginning */
+			set_extent(map, i, extent_start, start - extent_start);
+		}
+		else if (extent_stop > end)
+		{
+			/* keep the end */
+			set_extent(map, i, end, extent_stop - end);
+			break;
+		}
+		else
+		{
+			/* the whole extent is used */
+			remove_extent(map, i);
+		}
+
+		i = find_end_after(map, extent_stop);
+	}
+
+	return 0;
+}
+
+int bmfs_extent_map_release(struct BMFSExtentMap *map,
+                            uint64_t start,
+                            uint64_t length)
+{
+	if (map == NULL)
+		return -EFAULT;
+	else if (length == 0)
+		return 0;
+
+	uint64_t end = start + length;
+	uint32_t next = find_end_after(map, start);
+
+	if ((next != NONE)
+	 && (node_at(map, next)->extent.start < end))
+		/* already free */
+		return -EINVAL;
+
+	uint32_t prev = find_start_before(map, start);
+
+	int merge_prev = (prev != NONE) && (extent_end(&node_at(map, prev)->extent) == start);
+	int merge_next = (next != NONE) && (node_at(map, next)->extent.start == end);
+
+	if (merge_prev && merge_next)
+	{
+		uint64_t prev_start = node_at(map, prev)->extent.start;
+		uint64_t next_stop = extent_end(&node_at(map, next)->extent);
+		remove_extent(map, next);
+		set_extent(map, prev, prev_start, next_stop - prev_start);
+	}
+	else if (merge_prev)
+	{
+		const struct BMFSExtent *extent = &node_at(map, prev)->extent;
+		set_extent(map, prev, extent->start, extent->length + length);
+	}
+	else if (merge_next)
+	{
+		const struct BMFSExtent *extent = &node_at(map, next)->extent;
+		set_extent(map, next, start, extent->length + length);
+	}
+	else
+	{
+		return insert_extent(map, start, length);
+	}
+
+	return 0;
+}
+
+int bmfs_extent_map_is_free(const struct BMFSExtentMap *map,
+                            uint64_t start,
+                            uint64_t length)
+{
+	if (map == NULL)
+		return 0;
+	else if (length == 0)
+		return 1;
+
+	/* adjacent extents are merged, so the
+	 * range has to be in a single extent */
+	uint32_t i = find_end_after(map, start);
+	if (i == NONE)
+		return 0;
+
+	const struct BMFSExtent *extent = &const_node_at(map, i)->extent;
+
+	return (extent->start <= start)
+	    && (extent_end(extent) >= (start + length));
+}
+
+int bmfs_extent_map_next(const struct BMFSExtentMap *map,
+                         uint64_t block,
+                         struct BMFSExtent *extent)
+{
+	if ((map == NULL)
+	 || (extent == NULL))
+		return -EFAULT;
+
+	uint32_t i = find_end_after(map, block);
+	if (i == NONE)
+		return -ENOENT;
+
+	*extent = const_node_at(map, i)->extent;
+
+	return 0;
+}
+
+int bmfs_extent_map_find(const struct BMFSExtentMap *map,
+                         uint64_t length,
+                         uint64_t *start)
+{
+	if ((map == NULL)
+	 || (start == NULL))
+		return -EFAULT;
+
+	uint32_t found = NONE;
+
+	if (map->fit == BMFS_EXTENT_BEST_FIT)
+		found = find_best_fit(map, length);
+	else if (map->fit == BMFS_EXTENT_LARGEST_FIT)
+	{
+		/* the first of the largest extents */
+		uint64_t largest = max_length(map, map->roots[BY_START]);
+		if (largest >= length)
+			found = find_first_fit(map, largest);
+	}
+	else
+		found = find_first_fit(map, length);
+
+	if (found == NONE)
+		return -ENOSPC;
+
+	*start = const_node_at(map, found)->extent.start;
+
+	return 0;
+}
@@ -0,0 +1,166 @@
+#include <assert.h>
+#include <bmfs/file.h>
+#include <bmfs/limits.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct DiskData
+{
+	char *buf;
+	uint64_t len;
+	uint64_t pos;
+};
+
+static int data_seek(void *disk_ptr, int64_t offset, int whence)
+{
+	struct DiskData *disk = (struct DiskData *)(disk_ptr);
+	if (whence == SEEK_SET)
+		disk->pos = offset;
+	else if (whence == SEEK_CUR)
+		disk->pos += offset;
+	else if (whence == SEEK_END)
+		disk->pos = disk->len + offset;
+	return 0;
+}
+
+static int data_tell(void *disk_ptr, int64_t *offset)
+{
+	struct DiskData *disk = (struct DiskData *)(disk_ptr);
+
+	*offset = disk->pos;
+
+	return 0;
+}
+
+static int data_pread(void *disk_ptr, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len)
+{
+	struct DiskData *disk = (struct DiskData *)(disk_ptr);
+
+	if (offset > disk->len)
+		offset = disk->len;
+
+	if ((offset + len) > disk->len)
+		len = disk->len - offset;
+
+	memcpy(buf, &disk->buf[offset], len);
+
+	if (read_len != NULL)
+		*read_len = len;
+
+	return 0;
+}
+
+static int data_pwrite(void *disk_ptr, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len)
+{
+	struct DiskData *disk = (struct DiskData *)(disk_ptr);
+
+	if (offset > disk->len)
+		offset = disk->len;
+
+	if ((offset + len) > disk->len)
+		len = disk->len - offset;
+
+	memcpy(&disk->buf[offset], buf, len);
+
+	if (write_len != NULL)
+		*write_len = len;
+
+	return 0;
+}
+
+int main(void)
+{
+	struct DiskData data;
+
+	data.buf = calloc(1, BMFS_MINIMUM_DISK_SIZE);
+	if (data.buf == NULL)
+		return EXIT_FAILURE;
+	data.len = BMFS_MINIMUM_DISK_SIZE;
+	data.pos = 0;
+
+	struct BMFSDisk disk;
+	bmfs_disk_init(&disk);
+	disk.disk = &data;
+	disk.seek = data_seek;
+	disk.tell = data_tell;
+	disk.pread = data_pread;
+	disk.pwrite = data_pwrite;
+
+	assert(bmfs_disk_format(&disk) == 0);
+	assert(bmfs_disk_create_file(&disk, "a.txt", 2) == 0);
+
+	struct BMFSFile file;
+	assert(bmfs_file_open(&file, &disk, "b.txt") == -ENOENT);
+	assert(bmfs_file_open(&file, &disk, "a.txt") == 0);
+	assert(file.index == 0);
+	assert(file.offset == BMFS_BLOCK_SIZE);
+	assert(file.reserved == BMFS_BLOCK_SIZE);
+	assert(file.size == 0);
+
+	/* test that writing past the end updates the size */
+	uint64_t len = 0;
+	assert(bmfs_file_pwrite(&file, "hello", 5, 0, &len) == 0);
+	assert(len == 5);
+	assert(file.size == 5);
+	assert(memcmp(&data.buf[BMFS_BLOCK_SIZE], "hello", 5) == 0);
+
+	/* test that the size is written on sync */
+	struct BMFSEntry entry;
+	assert(bmfs_disk_find_file(&disk, "a.txt", &entry, NULL) == 0);
+	assert(entry.FileSize == 0);
+	assert(bmfs_file_sync(&file) == 0);
+	assert(file.size_dirty == 0);
+	assert(bmfs_disk_find_file(&disk, "a.txt", &entry, NULL) == 0);
+	assert(entry.FileSize == 5);
+
+	/* test that overwriting does not change the size */
+	assert(bmfs_file_pwrite(&file, "j", 1, 0, NULL) == 0);
+	assert(file.size == 5);
+
+	/* test that reads stop at the end of the file */
+	char buf[16];
+	assert(bmfs_file_pread(&file, buf, sizeof(buf), 0, &len) == 0);
+	assert(len == 5);
+	assert(memcmp(buf, "jello", 5) == 0);
+	assert(bmfs_file_pread(&file, buf, sizeof(buf), 8, &len) == 0);
+	assert(len == 0);
+
+	/* test that writes stop at the end of the reserved space */
+	assert(bmfs_file_pwrite(&file, "abcd", 4, BMFS_BLOCK_SIZE - 2, &len) == 0);
+	assert(len == 2);
+	assert(file.size == BMFS_BLOCK_SIZE);
+
+	/* test that an unwritten size is kept
+	 * when the entry is looked up again */
+	assert(bmfs_disk_create_file(&disk, "b.txt", 2) == 0);
+	assert(bmfs_file_pread(&file, buf, sizeof(buf), 0, &len) == 0);
+	assert(file.size == BMFS_BLOCK_SIZE);
+	assert(file.size_dirty == 1);
+
+	/* test that the size is written on close */
+	assert(bmfs_file_close(&file) == 0);
+	assert(bmfs_disk_find_file(&disk, "a.txt", &entry, NULL) == 0);
+	assert(entry.FileSize == BMFS_BLOCK_SIZE);
+	assert(bmfs_file_open(&file, &disk, "a.txt") == 0);
+
+	/* test that a copy of the file is read at its
+	 * old location, without reading the directory */
+	struct BMFSFile snapshot = file;
+	assert(bmfs_file_pread_cached(&snapshot, buf, 4, 0, &len) == 0);
+	assert(len == 4);
+	assert(memcmp(buf, "jell", 4) == 0);
+
+	/* test that the entry is looked up again
+	 * after the directory is modified */
+	assert(bmfs_disk_delete_file(&disk, "a.txt") == 0);
+	assert(snapshot.generation != disk.dir_generation);
+	assert(bmfs_file_pread_cached(&snapshot, buf, 4, 0, &len) == 0);
+	assert(bmfs_file_pread(&file, buf, sizeof(buf), 0, &len) == -ENOENT);
+
+	assert(bmfs_file_close(&file) == 0);
+
+	free(data.buf);
+
+	return EXIT_SUCCESS;
+}
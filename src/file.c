@@ -0,0 +1,179 @@
+#include <bmfs/file.h>
+
+#include <errno.h>
+
+static int resolve(struct BMFSFile *file)
+{
+	struct BMFSEntry entry;
+	int index = 0;
+
+	int err = bmfs_disk_find_file(file->disk, file->FileName, &entry, &index);
+	if (err != 0)
+		return err;
+
+	file->index = index;
+	file->offset = entry.StartingBlock * BMFS_BLOCK_SIZE;
+	file->reserved = entry.ReservedBlocks * BMFS_BLOCK_SIZE;
+	file->generation = file->disk->dir_generation;
+
+	/* a size that was not written yet
+	 * is kept, unless the file grew
+	 * in the meantime */
+	if (!file->size_dirty
+	 || (entry.FileSize >= file->size))
+	{
+		file->size = entry.FileSize;
+		file->size_dirty = 0;
+	}
+
+	return 0;
+}
+
+/* Looks up the entry again, if the
+ * directory was modified since the
+ * last time it was looked up. This
+ * walks the directory, so anything
+ * that protects the directory must
+ * be held by the caller. */
+
+static int revalidate(struct BMFSFile *file)
+{
+	if (file->generation == file->disk->dir_generation)
+		return 0;
+
+	return resolve(file);
+}
+
+int bmfs_file_open(struct BMFSFile *file,
+                   struct BMFSDisk *disk,
+                   const char *filename)
+{
+	if ((file == NULL)
+	 || (disk == NULL)
+	 || (filename == NULL))
+		return -EFAULT;
+
+	file->disk = disk;
+	file->size = 0;
+	file->size_dirty = 0;
+
+	struct BMFSEntry entry;
+	bmfs_entry_set_file_name(&entry, filename);
+	for (uint64_t i = 0; i < BMFS_FILE_NAME_MAX; i++)
+		file->FileName[i] = entry.FileName[i];
+
+	return resolve(file);
+}
+
+int bmfs_file_close(struct BMFSFile *file)
+{
+	int err = bmfs_file_sync(file);
+	if (err != 0)
+		return err;
+
+	file->disk = NULL;
+
+	return 0;
+}
+
+int bmfs_file_sync(struct BMFSFile *file)
+{
+	if ((file == NULL)
+	 || (file->disk == NULL))
+		return -EFAULT;
+
+	if (!file->size_dirty)
+		return 0;
+
+	int err = revalidate(file);
+	if (err != 0)
+		return err;
+	else if (!file->size_dirty)
+		/* the directory already has it */
+		return 0;
+
+	err = bmfs_disk_set_file_size(file->disk, file->index, file->size);
+	if (err != 0)
+		return err;
+
+	file->size_dirty = 0;
+	file->generation = file->disk->dir_generation;
+
+	return 0;
+}
+
+int bmfs_file_pread(struct BMFSFile *file,
+                    void *buf,
+                    uint64_t len,
+                    uint64_t off,
+                    uint64_t *read_len)
+{
+	if ((file == NULL)
+	 || (file->disk == NULL))
+		return -EFAULT;
+
+	int err = revalidate(file);
+	if (err != 0)
+		return err;
+
+	return bmfs_file_pread_cached(file, buf, len, off, read_len);
+}
+
+int bmfs_file_pread_cached(const struct BMFSFile *file,
+                           void *buf,
+                           uint64_t len,
+                           uint64_t off,
+                           uint64_t *read_len)
+{
+	if ((file == NULL)
+	 || (file->disk == NULL))
+		return -EFAULT;
+
+	if (off > file->size)
+		off = file->size;
+
+	if (len > (file->size - off))
+		len = file->size - off;
+
+	return bmfs_disk_pread(file->disk, buf, len, file->offset + off, read_len);
+}
+
+int bmfs_file_pwrite(struct BMFSFile *file,
+                     const void *buf,
+                     uint64_t len,
+                     uint64_t off,
+                     uint64_t *write_len)
+{
+	if ((file == NULL)
+	 || (file->disk == NULL))
+		return -EFAULT;
+
+	int err = revalidate(file);
+	if (err != 0)
+		return err;
+
+	if (off > file->reserved)
+		off = file->reserved;
+
+	if (len > (file->reserved - off))
+		len = file->reserved - off;
+
+	uint64_t write_len2 = 0;
+	err = bmfs_disk_pwrite(file->disk, buf, len, file->offset + off, &write_len2);
+	if (err != 0)
+		return err;
+
+	if (write_len != NULL)
+		*write_len = write_len2;
+
+	/* the file size is the highest
+	 * offset written to, overwriting
+	 * data does not change it */
+	if ((off + write_len2) > file->size)
+	{
+		file->size = off + write_len2;
+		file->size_dirty = 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,955 @@
+#include <bmfs/disk.h>
+#include <bmfs/limits.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_RDTSC
+#endif
+
+/** The unit of the reported costs. The time
+ * stamp counter is used where there is one, and
+ * the monotonic clock everywhere else, so the
+ * baseline records the unit it was taken in. */
+
+#ifdef BENCH_RDTSC
+#define TICK_UNIT "cycles"
+#else
+#define TICK_UNIT "ns"
+#endif
+
+/** The number of timed rounds of each case.
+ * The fastest round is reported, since noise
+ * from the rest of the system only adds time. */
+
+#define ROUNDS 31
+
+/** The least number of ticks in a round, about
+ * a millisecond. The iteration count of a case
+ * is doubled until a round takes at least this
+ * long, so that the overhead of reading the
+ * clock is lost in the noise. This also warms
+ * up the caches and branch predictors. */
+
+#define ROUND_TICKS (1ULL << 22)
+
+/** The most cases that are run. */
+
+#define CASES_MAX 64
+
+/** The size of the in-memory disk that
+ * holds the block zero of the allocation
+ * cases. The rest of the disk reads as
+ * zeros and drops whatever is written. */
+
+#define MEMORY_DISK_SIZE BMFS_BLOCK_SIZE
+
+/** The default number of times that all
+ * the cases are run. Other programs on the
+ * machine slow down whole runs at a time, so
+ * the best run of each case is reported. */
+
+#define RUNS_DEFAULT 3
+
+/** The default regression threshold, as a
+ * percentage of the baseline. */
+
+#define THRESHOLD_DEFAULT 20.0
+
+/** The least slowdown of a case, in ticks per
+ * operation, that is a regression. The fastest
+ * cases take only a few ticks, so that a jitter
+ * of one or two ticks is a large percentage. */
+
+#define NOISE_TICKS 4.0
+
+/** The most times that the cases which are
+ * slower than the baseline are run again,
+ * before they're reported as regressions. */
+
+#define RETRIES_MAX 3
+
+static uint64_t ticks(void)
+{
+#ifdef BENCH_RDTSC
+	/* keep the loads and stores of the
+	 * timed code on the right side */
+	_mm_lfence();
+	uint64_t t = __rdtsc();
+	_mm_lfence();
+	return t;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t) ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+#endif
+}
+
+/* xorshift64*, so that every run
+ * builds the same directories */
+
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/** A benchmark body. It runs the operation
+ * the given number of times and returns the
+ * ticks that were spent on it, so that setup
+ * between operations can be left out. */
+
+typedef uint64_t (*bench_fn)(void *ctx, uint64_t iterations);
+
+struct bench_result
+{
+	char name[48];
+	double ticks;
+	/* whether the case is slower than
+	 * the baseline */
+	int regressed;
+};
+
+static struct bench_result results[CASES_MAX];
+
+static size_t result_count = 0;
+
+/* when set, only the cases that
+ * regressed are measured */
+static int retrying = 0;
+
+static volatile uintptr_t sink;
+
+static struct bench_result *find_result(struct bench_result *list,
+                                        size_t count,
+                                        const char *name)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (strcmp(list[i].name, name) == 0)
+			return &list[i];
+	}
+
+	return NULL;
+}
+
+static void measure(const char *name, bench_fn fn, void *ctx)
+{
+	struct bench_result *result = find_result(results, result_count, name);
+	if (retrying
+	 && ((result == NULL) || !result->regressed))
+		return;
+
+	uint64_t iterations = 1;
+	while ((fn(ctx, iterations) < ROUND_TICKS)
+	    && (iterations < (1ULL << 30)))
+		iterations *= 2;
+
+	double best = 0;
+	for (unsigned int round = 0; round < ROUNDS; round++)
+	{
+		double per_op = ((double) fn(ctx, iterations)) / iterations;
+		if ((round == 0) || (per_op < best))
+			best = per_op;
+	}
+
+	/* a case that ran before keeps its best run */
+	if (result != NULL)
+	{
+		if (best < result->ticks)
+			result->ticks = best;
+	}
+	else if (result_count < CASES_MAX)
+	{
+		result = &results[result_count++];
+		snprintf(result->name, sizeof(result->name), "%s", name);
+		result->ticks = best;
+		result->regressed = 0;
+	}
+}
+
+/* directories */
+
+enum name_kind
+{
+	/* "f0", "f1", ... */
+	NAMES_SHORT,
+	/* a long common prefix, the worst
+	 * case for byte-wise comparisons */
+	NAMES_PREFIX,
+	/* random lengths and characters */
+	NAMES_RANDOM
+};
+
+static const char *name_kind_names[] = { "short", "prefix", "random" };
+
+struct bench_dir
+{
+	struct BMFSDir dir;
+	struct BMFSDirIndex index;
+	/* the names of the files that weren't
+	 * deleted, in a random order */
+	const char *queries[BMFS_DIR_ENTRIES_MAX];
+	uint64_t query_count;
+	/* names that aren't in the directory */
+	char misses[16][BMFS_FILE_NAME_MAX];
+};
+
+static char names[BMFS_DIR_ENTRIES_MAX][BMFS_FILE_NAME_MAX];
+
+static void make_name(char *name, enum name_kind kind, uint64_t i, uint64_t *state)
+{
+	if (kind == NAMES_SHORT)
+	{
+		snprintf(name, BMFS_FILE_NAME_MAX, "f%llu", (unsigned long long) i);
+	}
+	else if (kind == NAMES_PREFIX)
+	{
+		/* there are never more than 10000 entries */
+		snprintf(name, BMFS_FILE_NAME_MAX, "kernel-module-%04u.bin", (unsigned int) (i % 10000));
+	}
+	else
+	{
+		static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+		uint64_t len = 8 + (next_random(state) % (BMFS_FILE_NAME_MAX - 9));
+		for (uint64_t j = 0; j < len; j++)
+			name[j] = chars[next_random(state) % (sizeof(chars) - 1)];
+		name[len] = 0;
+	}
+}
+
+/* Whether the entry at a position is deleted, so
+ * that the deleted entries are spread evenly. */
+
+static int is_tombstone(uint64_t i, unsigned int tombstones)
+{
+	return (((i + 1) * tombstones) / 100) > ((i * tombstones) / 100);
+}
+
+/* Fills an extended directory with the given
+ * number of entries, a percentage of which are
+ * deleted again. All directories have room for
+ * the maximum number of entries, so that an add
+ * never runs out of space. */
+
+static int fill_dir(struct bench_dir *bdir,
+                    uint64_t fill,
+                    unsigned int tombstones,
+                    enum name_kind kind)
+{
+	uint64_t state = 0x9E3779B97F4A7C15ULL ^ (fill * 131) ^ (tombstones * 7) ^ kind;
+
+	int err = bmfs_dir_init_extended(&bdir->dir, BMFS_DIR_ENTRIES_MAX);
+	if (err != 0)
+		return err;
+
+	for (uint64_t i = 0; i < fill; i++)
+	{
+		do
+		{
+			make_name(names[i], kind, i, &state);
+			err = bmfs_dir_add_file(&bdir->dir, names[i]);
+		} while (err == -EEXIST);
+
+		if (err != 0)
+			return err;
+	}
+
+	bdir->query_count = 0;
+
+	for (uint64_t i = 0; i < fill; i++)
+	{
+		if (is_tombstone(i, tombstones))
+		{
+			err = bmfs_dir_delete_file(&bdir->dir, names[i]);
+			if (err != 0)
+				return err;
+		}
+		else
+		{
+			bdir->queries[bdir->query_count++] = names[i];
+		}
+	}
+
+	/* shuffle the lookups, so that they don't
+	 * walk the directory in order */
+	for (uint64_t i = bdir->query_count; i > 1; i--)
+	{
+		uint64_t j = next_random(&state) % i;
+		const char *tmp = bdir->queries[i - 1];
+		bdir->queries[i - 1] = bdir->queries[j];
+		bdir->queries[j] = tmp;
+	}
+
+	for (uint64_t i = 0; i < 16; i++)
+		snprintf(bdir->misses[i], BMFS_FILE_NAME_MAX, "missing-file-%02llu.bin", (unsigned long long) i);
+
+	return 0;
+}
+
+static struct bench_dir bench_dir;
+
+static uint64_t bench_find(void *ctx, uint64_t iterations)
+{
+	struct bench_dir *bdir = (struct bench_dir *) ctx;
+	uint64_t q = 0;
+
+	uint64_t start = ticks();
+
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		sink += (uintptr_t) bmfs_dir_find(&bdir->dir, bdir->queries[q]);
+		if (++q == bdir->query_count)
+			q = 0;
+	}
+
+	return ticks() - start;
+}
+
+static uint64_t bench_find_miss(void *ctx, uint64_t iterations)
+{
+	struct bench_dir *bdir = (struct bench_dir *) ctx;
+
+	uint64_t start = ticks();
+
+	for (uint64_t i = 0; i < iterations; i++)
+		sink += (uintptr_t) bmfs_dir_find(&bdir->dir, bdir->misses[i % 16]);
+
+	return ticks() - start;
+}
+
+/* Adds a file and deletes it again, so that
+ * the directory is the same for every round.
+ * The add reuses the first free slot, and the
+ * delete leaves it as a tombstone. */
+
+static uint64_t bench_add_delete(void *ctx, uint64_t iterations)
+{
+	struct bench_dir *bdir = (struct bench_dir *) ctx;
+
+	uint64_t start = ticks();
+
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		sink += bmfs_dir_add_file(&bdir->dir, bdir->misses[i % 16]);
+		sink += bmfs_dir_delete_file(&bdir->dir, bdir->misses[i % 16]);
+	}
+
+	return ticks() - start;
+}
+
+struct sort_ctx
+{
+	const struct BMFSDir *unsorted;
+	struct BMFSDir *dir;
+	uint64_t fill;
+};
+
+static struct BMFSDir scratch_dir;
+
+/* Only the sort is timed, the directory
+ * is copied back before each one. */
+
+static uint64_t bench_sort(void *ctx, uint64_t iterations)
+{
+	struct sort_ctx *sort = (struct sort_ctx *) ctx;
+	uint64_t total = 0;
+
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		sort->dir->EntryCount = sort->unsorted->EntryCount;
+		sort->dir->Index = NULL;
+		memcpy(sort->dir->Entries, sort->unsorted->Entries, (sort->fill + 1) * sizeof(struct BMFSEntry));
+
+		uint64_t start = ticks();
+		sink += bmfs_dir_sort(sort->dir, bmfs_entry_cmp_by_filename);
+		total += ticks() - start;
+	}
+
+	return total;
+}
+
+struct cmp_ctx
+{
+	struct BMFSEntry entry;
+	const char *filename;
+};
+
+static uint64_t bench_cmp(void *ctx, uint64_t iterations)
+{
+	struct cmp_ctx *cmp = (struct cmp_ctx *) ctx;
+
+	uint64_t start = ticks();
+
+	for (uint64_t i = 0; i < iterations; i++)
+		sink += bmfs_entry_cmp_filename(&cmp->entry, cmp->filename);
+
+	return ticks() - start;
+}
+
+/* allocation */
+
+/* A disk that only keeps its first block
+ * in memory, which is where the directory
+ * is. The files are never read or written,
+ * so the disk may be much larger. */
+
+struct memory_disk
+{
+	char *buf;
+	uint64_t len;
+	uint64_t pos;
+};
+
+static int memory_seek(void *disk_ptr, int64_t offset, int whence)
+{
+	struct memory_disk *disk = (struct memory_disk *)(disk_ptr);
+	if (whence == SEEK_SET)
+		disk->pos = offset;
+	else if (whence == SEEK_CUR)
+		disk->pos += offset;
+	else if (whence == SEEK_END)
+		disk->pos = disk->len + offset;
+	else
+		return -EINVAL;
+
+	if (disk->pos > disk->len)
+		disk->pos = disk->len;
+
+	return 0;
+}
+
+static int memory_tell(void *disk_ptr, int64_t *offset)
+{
+	struct memory_disk *disk = (struct memory_disk *)(disk_ptr);
+
+	*offset = disk->pos;
+
+	return 0;
+}
+
+static int memory_read(void *disk_ptr, void *buf, uint64_t len, uint64_t *read_len)
+{
+	struct memory_disk *disk = (struct memory_disk *)(disk_ptr);
+
+	if ((disk->pos + len) > disk->len)
+		len = disk->len - disk->pos;
+
+	uint64_t kept = 0;
+	if (disk->pos < MEMORY_DISK_SIZE)
+	{
+		kept = MEMORY_DISK_SIZE - disk->pos;
+		if (kept > len)
+			kept = len;
+		memcpy(buf, &disk->buf[disk->pos], kept);
+	}
+
+	memset(((char *) buf) + kept, 0, len - kept);
+
+	disk->pos += len;
+
+	if (read_len != NULL)
+		*read_len = len;
+
+	return 0;
+}
+
+static int memory_write(void *disk_ptr, const void *buf, uint64_t len, uint64_t *write_len)
+{
+	struct memory_disk *disk = (struct memory_disk *)(disk_ptr);
+
+	if ((disk->pos + len) > disk->len)
+		len = disk->len - disk->pos;
+
+	if (disk->pos < MEMORY_DISK_SIZE)
+	{
+		uint64_t kept = MEMORY_DISK_SIZE - disk->pos;
+		if (kept > len)
+			kept = len;
+		memcpy(&disk->buf[disk->pos], buf, kept);
+	}
+
+	disk->pos += len;
+
+	if (write_len != NULL)
+		*write_len = len;
+
+	return 0;
+}
+
+struct alloc_ctx
+{
+	struct BMFSDisk disk;
+	struct memory_disk data;
+	struct BMFSDir dir;
+	struct BMFSExtentMap extents;
+};
+
+static struct alloc_ctx alloc_ctx;
+
+/* Puts a one block file after another, then
+ * deletes some of them, which leaves holes that
+ * are too small for the two blocks allocated by
+ * the benchmark. The directory is cached, so
+ * the disk isn't read while the map is built. */
+
+static int setup_alloc(struct alloc_ctx *alloc, uint64_t fill, unsigned int tombstones, int cache_extents)
+{
+	bmfs_disk_init(&alloc->disk);
+	alloc->disk.disk = &alloc->data;
+	alloc->disk.seek = memory_seek;
+	alloc->disk.tell = memory_tell;
+	alloc->disk.read = memory_read;
+	alloc->disk.write = memory_write;
+
+	memset(alloc->data.buf, 0, MEMORY_DISK_SIZE);
+	alloc->data.pos = 0;
+	alloc->data.len = (fill + 16) * BMFS_BLOCK_SIZE;
+
+	int err = bmfs_disk_format_extended(&alloc->disk, BMFS_DIR_ENTRIES_MAX);
+	if (err != 0)
+		return err;
+
+	struct BMFSDir *dir = &scratch_dir;
+	err = bmfs_dir_init_extended(dir, BMFS_DIR_ENTRIES_MAX);
+	if (err != 0)
+		return err;
+
+	for (uint64_t i = 0; i < fill; i++)
+	{
+		struct BMFSEntry entry;
+		bmfs_entry_init(&entry);
+		snprintf(entry.FileName, sizeof(entry.FileName), "file-%04llu", (unsigned long long) i);
+		entry.StartingBlock = 1 + i;
+		entry.ReservedBlocks = 1;
+		err = bmfs_dir_add(dir, &entry);
+		if (err != 0)
+			return err;
+		if (is_tombstone(i, tombstones))
+			dir->Entries[i].FileName[0] = 1;
+	}
+
+	err = bmfs_disk_write_dir(&alloc->disk, dir);
+	if (err != 0)
+		return err;
+
+	err = bmfs_disk_cache_dir(&alloc->disk, &alloc->dir);
+	if (err != 0)
+		return err;
+
+	if (cache_extents)
+	{
+		alloc->extents.fit = BMFS_EXTENT_FIRST_FIT;
+		err = bmfs_disk_cache_extents(&alloc->disk, &alloc->extents);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static uint64_t bench_allocate(void *ctx, uint64_t iterations)
+{
+	struct alloc_ctx *alloc = (struct alloc_ctx *) ctx;
+
+	uint64_t start = ticks();
+
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		uint64_t starting_block = 0;
+		sink += bmfs_disk_allocate_bytes(&alloc->disk, BMFS_BLOCK_SIZE * 2, &starting_block);
+		sink += starting_block;
+	}
+
+	return ticks() - start;
+}
+
+/* cases */
+
+static const uint64_t fills[] = { 64, 1024, 4032 };
+
+static const unsigned int tombstone_ratios[] = { 0, 25, 50 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static int run_dir_case(const char *op, bench_fn fn, uint64_t fill, unsigned int tombstones, enum name_kind kind, int indexed)
+{
+	int err = fill_dir(&bench_dir, fill, tombstones, kind);
+	if (err != 0)
+		return err;
+
+	if (indexed)
+		bmfs_dir_set_index(&bench_dir.dir, &bench_dir.index);
+
+	char name[48];
+	snprintf(name, sizeof(name), "%s%s/%llu/%u%%/%s",
+	         op, indexed ? "-indexed" : "",
+	         (unsigned long long) fill, tombstones,
+	         name_kind_names[kind]);
+
+	measure(name, fn, &bench_dir);
+
+	return 0;
+}
+
+static int run_cases(void)
+{
+	int err = 0;
+
+	for (size_t i = 0; (err == 0) && (i < ARRAY_SIZE(fills)); i++)
+		for (size_t j = 0; (err == 0) && (j < ARRAY_SIZE(tombstone_ratios)); j++)
+			err = run_dir_case("find", bench_find, fills[i], tombstone_ratios[j], NAMES_PREFIX, 0);
+
+	if (err == 0)
+		err = run_dir_case("find", bench_find, 1024, 0, NAMES_SHORT, 0);
+	if (err == 0)
+		err = run_dir_case("find", bench_find, 1024, 0, NAMES_RANDOM, 0);
+	if (err == 0)
+		err = run_dir_case("find-miss", bench_find_miss, 64, 0, NAMES_PREFIX, 0);
+	if (err == 0)
+		err = run_dir_case("find-miss", bench_find_miss, 4032, 0, NAMES_PREFIX, 0);
+	if (err == 0)
+		err = run_dir_case("find", bench_find, 4032, 0, NAMES_PREFIX, 1);
+	if (err == 0)
+		err = run_dir_case("find", bench_find, 4032, 50, NAMES_PREFIX, 1);
+
+	for (size_t i = 0; (err == 0) && (i < ARRAY_SIZE(fills)); i++)
+		err = run_dir_case("add-delete", bench_add_delete, fills[i], 0, NAMES_PREFIX, 0);
+	if (err == 0)
+		err = run_dir_case("add-delete", bench_add_delete, 4032, 50, NAMES_PREFIX, 0);
+	if (err == 0)
+		err = run_dir_case("add-delete", bench_add_delete, 4032, 0, NAMES_PREFIX, 1);
+
+	for (size_t i = 0; (err == 0) && (i < ARRAY_SIZE(fills)); i++)
+	{
+		err = fill_dir(&bench_dir, fills[i], 0, NAMES_RANDOM);
+		if (err != 0)
+			break;
+
+		struct sort_ctx sort;
+		sort.unsorted = &bench_dir.dir;
+		sort.dir = &scratch_dir;
+		sort.fill = fills[i];
+
+		char name[48];
+		snprintf(name, sizeof(name), "sort/%llu/0%%/random", (unsigned long long) fills[i]);
+		measure(name, bench_sort, &sort);
+
+		/* a sorted directory is the best case */
+		if (i == (ARRAY_SIZE(fills) - 1))
+		{
+			memcpy(&scratch_dir, &bench_dir.dir, sizeof(scratch_dir));
+			err = bmfs_dir_sort(&scratch_dir, bmfs_entry_cmp_by_filename);
+			if (err != 0)
+				break;
+			memcpy(&bench_dir.dir, &scratch_dir, sizeof(scratch_dir));
+			snprintf(name, sizeof(name), "sort/%llu/0%%/sorted", (unsigned long long) fills[i]);
+			measure(name, bench_sort, &sort);
+		}
+	}
+
+	struct cmp_ctx cmp;
+	bmfs_entry_init(&cmp.entry);
+	bmfs_entry_set_file_name(&cmp.entry, "kernel-module-0042.bin");
+
+	if (err == 0)
+	{
+		cmp.filename = "kernel-module-0042.bin";
+		measure("cmp/equal", bench_cmp, &cmp);
+		cmp.filename = "kernel-module-0043.bin";
+		measure("cmp/differ-late", bench_cmp, &cmp);
+		cmp.filename = "boot.sys";
+		measure("cmp/differ-first", bench_cmp, &cmp);
+	}
+
+	alloc_ctx.data.buf = malloc(MEMORY_DISK_SIZE);
+	if (alloc_ctx.data.buf == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; (err == 0) && (i < ARRAY_SIZE(fills)); i++)
+	{
+		for (size_t j = 0; (err == 0) && (j < ARRAY_SIZE(tombstone_ratios)); j++)
+		{
+			for (int cached = 0; (err == 0) && (cached < 2); cached++)
+			{
+				err = setup_alloc(&alloc_ctx, fills[i], tombstone_ratios[j], cached);
+				if (err != 0)
+					break;
+
+				char name[48];
+				snprintf(name, sizeof(name), "allocate%s/%llu/%u%%",
+				         cached ? "-cached" : "",
+				         (unsigned long long) fills[i],
+				         tombstone_ratios[j]);
+				measure(name, bench_allocate, &alloc_ctx);
+			}
+		}
+	}
+
+	free(alloc_ctx.data.buf);
+
+	return err;
+}
+
+/* baselines */
+
+static int save_baseline(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+		return -errno;
+
+	fprintf(file, "# micro-bench baseline, the %s of one operation\n", TICK_UNIT);
+	fprintf(file, "# regenerate with 'make bench-baseline'\n");
+	fprintf(file, "unit %s\n", TICK_UNIT);
+
+	for (size_t i = 0; i < result_count; i++)
+		fprintf(file, "%s %.1f\n", results[i].name, results[i].ticks);
+
+	if (fclose(file) != 0)
+		return -errno;
+
+	return 0;
+}
+
+static struct bench_result baseline[CASES_MAX];
+
+static size_t baseline_count = 0;
+
+static int load_baseline(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return -errno;
+
+	int same_unit = 0;
+
+	char line[128];
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char name[48];
+		char unit[16];
+		double value;
+
+		if (line[0] == '#')
+			continue;
+		else if (sscanf(line, "unit %15s", unit) == 1)
+			same_unit = (strcmp(unit, TICK_UNIT) == 0);
+		else if ((sscanf(line, "%47s %lf", name, &value) == 2)
+		      && (value > 0)
+		      && (baseline_count < CASES_MAX))
+		{
+			snprintf(baseline[baseline_count].name, sizeof(baseline[0].name), "%s", name);
+			baseline[baseline_count].ticks = value;
+			baseline_count++;
+		}
+	}
+
+	fclose(file);
+
+	if (!same_unit)
+	{
+		fprintf(stderr, "micro-bench: the baseline '%s' wasn't taken in %s\n", path, TICK_UNIT);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Marks the cases that are slower than the
+ * baseline by more than the threshold and by
+ * more than the noise floor. Cases that are
+ * missing from the baseline never regress.
+ * Returns the number of regressions. */
+
+static int find_regressions(double threshold)
+{
+	int regressions = 0;
+
+	for (size_t i = 0; i < result_count; i++)
+	{
+		struct bench_result *result = &results[i];
+		const struct bench_result *old = find_result(baseline, baseline_count, result->name);
+		if (old == NULL)
+		{
+			result->regressed = 0;
+			continue;
+		}
+
+		double slowdown = result->ticks - old->ticks;
+		result->regressed = (slowdown > NOISE_TICKS)
+		                 && (((slowdown * 100.0) / old->ticks) > threshold);
+
+		regressions += result->regressed;
+	}
+
+	return regressions;
+}
+
+static void print_comparison(void)
+{
+	printf("%-36s %12s %12s %9s\n", "case", TICK_UNIT, "baseline", "change");
+
+	for (size_t i = 0; i < result_count; i++)
+	{
+		const struct bench_result *result = &results[i];
+		const struct bench_result *old = find_result(baseline, baseline_count, result->name);
+		if (old == NULL)
+		{
+			printf("%-36s %12.1f %12s %9s\n", result->name, result->ticks, "-", "new");
+			continue;
+		}
+
+		double change = ((result->ticks - old->ticks) * 100.0) / old->ticks;
+
+		printf("%-36s %12.1f %12.1f %+8.1f%%%s\n",
+		       result->name, result->ticks, old->ticks, change,
+		       result->regressed ? "  REGRESSION" : "");
+	}
+}
+
+static void help(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("\n");
+	printf("Measures the directory and entry functions\n");
+	printf("on in-memory directories, in %s per call.\n", TICK_UNIT);
+	printf("\n");
+	printf("options:\n");
+	printf("  --baseline,  -b : compare with a baseline, and fail on regressions\n");
+	printf("                    (cases that are slower are run up to %d more times)\n", RETRIES_MAX);
+	printf("  --help,      -h : display this help message\n");
+	printf("  --runs,      -r : the number of times to run the cases (default: %d)\n", RUNS_DEFAULT);
+	printf("  --save,      -s : write the results as a new baseline\n");
+	printf("  --threshold, -t : the slowdown that is a regression, in percent (default: %.0f)\n", THRESHOLD_DEFAULT);
+}
+
+int main(int argc, char **argv)
+{
+	struct option opts[] =
+	{
+		{ "baseline", required_argument, NULL, 'b' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "runs", required_argument, NULL, 'r' },
+		{ "save", required_argument, NULL, 's' },
+		{ "threshold", required_argument, NULL, 't' },
+		{ 0, 0, 0, 0 }
+	};
+
+	const char *baseline_path = NULL;
+	const char *save_path = NULL;
+	double threshold = THRESHOLD_DEFAULT;
+	unsigned long int runs = RUNS_DEFAULT;
+
+	while (1)
+	{
+		int c = getopt_long(argc, argv, "b:hr:s:t:", opts, NULL);
+		if (c == 'b')
+			baseline_path = optarg;
+		else if (c == 'h')
+		{
+			help(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if (c == 'r')
+		{
+			char *end = NULL;
+			runs = strtoul(optarg, &end, 10);
+			if ((end == optarg)
+			 || (*end != 0)
+			 || (runs == 0))
+			{
+				fprintf(stderr, "%s: invalid number of runs '%s'\n", argv[0], optarg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (c == 's')
+			save_path = optarg;
+		else if (c == 't')
+		{
+			char *end = NULL;
+			threshold = strtod(optarg, &end);
+			if ((end == optarg)
+			 || (*end != 0)
+			 || (threshold < 0))
+			{
+				fprintf(stderr, "%s: invalid threshold '%s'\n", argv[0], optarg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (c == -1)
+			break;
+		else
+			return EXIT_FAILURE;
+	}
+
+	int err = 0;
+	if (baseline_path != NULL)
+	{
+		err = load_baseline(baseline_path);
+		if (err != 0)
+		{
+			if (err != -EINVAL)
+				fprintf(stderr, "%s: failed to read '%s': %s\n", argv[0], baseline_path, strerror(-err));
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (unsigned long int run = 0; (err == 0) && (run < runs); run++)
+		err = run_cases();
+
+	/* a slow case may have been unlucky, so it
+	 * has to be slow again to be a regression */
+	int regressions = find_regressions(threshold);
+	for (unsigned int retry = 0; (err == 0) && (regressions > 0) && (retry < RETRIES_MAX); retry++)
+	{
+		retrying = 1;
+		err = run_cases();
+		retrying = 0;
+		regressions = find_regressions(threshold);
+	}
+
+	if (err != 0)
+	{
+		fprintf(stderr, "%s: failed to set up a case: %s\n", argv[0], strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	if (save_path != NULL)
+	{
+		err = save_baseline(save_path);
+		if (err != 0)
+		{
+			fprintf(stderr, "%s: failed to write '%s': %s\n", argv[0], save_path, strerror(-err));
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (baseline_path == NULL)
+	{
+		printf("%-36s %12s\n", "case", TICK_UNIT);
+		for (size_t i = 0; i < result_count; i++)
+			printf("%-36s %12.1f\n", results[i].name, results[i].ticks);
+		return EXIT_SUCCESS;
+	}
+
+	print_comparison();
+
+	if (regressions > 0)
+	{
+		fprintf(stderr, "%s: %d of %zu cases are more than %.0f%% slower than the baseline\n", argv[0], regressions, result_count, threshold);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+#include <bmfs/mmap.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static int bmfs_mmap_seek(void *map_ptr, int64_t offset, int whence)
+{
+	struct BMFSMmap *map = (struct BMFSMmap *)(map_ptr);
+	if (map == NULL)
+		return -EFAULT;
+
+	int64_t pos;
+	if (whence == SEEK_SET)
+		pos = offset;
+	else if (whence == SEEK_CUR)
+		pos = ((int64_t)(map->pos)) + offset;
+	else if (whence == SEEK_END)
+		pos = ((int64_t)(map->size)) + offset;
+	else
+		return -EINVAL;
+
+	if (pos < 0)
+		return -EINVAL;
+
+	map->pos = pos;
+
+	return 0;
+}
+
+static int bmfs_mmap_tell(void *map_ptr, int64_t *offset)
+{
+	struct BMFSMmap *map = (struct BMFSMmap *)(map_ptr);
+	if (map == NULL)
+		return -EFAULT;
+
+	if (offset != NULL)
+		*offset = map->pos;
+
+	return 0;
+}
+
+static int bmfs_mmap_pread(void *map_ptr, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len)
+{
+	struct BMFSMmap *map = (struct BMFSMmap *)(map_ptr);
+	if ((map == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	if (offset > map->size)
+		offset = map->size;
+
+	if (len > (map->size - offset))
+		len = map->size - offset;
+
+	memcpy(buf, &map->data[offset], len);
+
+	if (read_len != NULL)
+		*read_len = len;
+
+	return 0;
+}
+
+static int bmfs_mmap_pwrite(void *map_ptr, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len)
+{
+	struct BMFSMmap *map = (struct BMFSMmap *)(map_ptr);
+	if ((map == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	if (!map->writable)
+		return -EROFS;
+
+	/* the mapping can't grow, so a write
+	 * past its end is rejected instead of
+	 * being cut short */
+	if ((offset > map->size)
+	 || (len > (map->size - offset)))
+		return -ENOSPC;
+
+	memcpy(&map->data[offset], buf, len);
+
+	if (write_len != NULL)
+		*write_len = len;
+
+	return 0;
+}
+
+static int bmfs_mmap_read(void *map_ptr, void *buf, uint64_t len, uint64_t *read_len)
+{
+	struct BMFSMmap *map = (struct BMFSMmap *)(map_ptr);
+	if (map == NULL)
+		return -EFAULT;
+
+	uint64_t read_len2 = 0;
+	int err = bmfs_mmap_pread(map, buf, len, map->pos, &read_len2);
+	if (err != 0)
+		return err;
+
+	map->pos += read_len2;
+
+	if (read_len != NULL)
+		*read_len = read_len2;
+
+	return 0;
+}
+
+static int bmfs_mmap_write(void *map_ptr, const void *buf, uint64_t len, uint64_t *write_len)
+{
+	struct BMFSMmap *map = (struct BMFSMmap *)(map_ptr);
+	if (map == NULL)
+		return -EFAULT;
+
+	uint64_t write_len2 = 0;
+	int err = bmfs_mmap_pwrite(map, buf, len, map->pos, &write_len2);
+	if (err != 0)
+		return err;
+
+	map->pos += write_len2;
+
+	if (write_len != NULL)
+		*write_len = write_len2;
+
+	return 0;
+}
+
+int bmfs_mmap_init(struct BMFSMmap *map, int fd, int writable)
+{
+	if (map == NULL)
+		return -EFAULT;
+
+	/* lseek is used instead of fstat, so
+	 * that the size of block devices is
+	 * found as well */
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < 0)
+		return -errno;
+	else if (size == 0)
+		return -EINVAL;
+
+	int prot = PROT_READ;
+	if (writable)
+		prot |= PROT_WRITE;
+
+	void *data = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		return -errno;
+
+	map->data = (unsigned char *) data;
+	map->size = size;
+	map->pos = 0;
+	map->writable = writable;
+
+	return 0;
+}
+
+int bmfs_mmap_sync(struct BMFSMmap *map)
+{
+	if (map == NULL)
+		return -EFAULT;
+
+	if (!map->writable)
+		return 0;
+
+	if (msync(map->data, map->size, MS_SYNC) != 0)
+		return -errno;
+
+	return 0;
+}
+
+void bmfs_mmap_done(struct BMFSMmap *map)
+{
+	if ((map == NULL)
+	 || (map->data == NULL))
+		return;
+
+	bmfs_mmap_sync(map);
+
+	munmap(map->data, map->size);
+
+	map->data = NULL;
+	map->size = 0;
+	map->pos = 0;
+}
+
+int bmfs_disk_init_mmap(struct BMFSDisk *disk, struct BMFSMmap *map)
+{
+	if ((disk == NULL)
+	 || (map == NULL))
+		return -EFAULT;
+
+	bmfs_disk_init(disk);
+	disk->disk = map;
+	disk->seek = bmfs_mmap_seek;
+	disk->tell = bmfs_mmap_tell;
+	disk->read = bmfs_mmap_read;
+	disk->write = bmfs_mmap_write;
+	disk->pread = bmfs_mmap_pread;
+	disk->pwrite = bmfs_mmap_pwrite;
+
+	return 0;
+}
@@ -22,6 +22,9 @@ int main(void)
 	test("1",  1ULL);
 	test("0B", 0ULL);
 	test("0",  0ULL);
+	test("16MiB", 16ULL * 1024ULL * 1024ULL);
+	test("4096", 4096ULL);
+	test("120KB", 120ULL * 1000ULL);
 	return EXIT_SUCCESS;
 }
 
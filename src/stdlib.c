@@ -1,9 +1,25 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <bmfs/stdlib.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/* The most that the kernel transfers
+ * in one call, on Linux. */
+#define COPY_CALL_MAX 0x7ffff000ULL
+
 static int bmfs_disk_file_seek(void *file_ptr, int64_t offset, int whence)
 {
 	if (file_ptr == NULL)
@@ -56,27 +72,493 @@ static int bmfs_disk_file_write(void *file_ptr, const void *buf, uint64_t len, u
 	return 0;
 }
 
+/* These loop until all the data is transferred,
+ * since pread and pwrite may return early. They
+ * are shared by the FILE and file descriptor
+ * disks. */
+
+static int fd_pread(int fd, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len_ptr)
+{
+	uint64_t read_len = 0;
+	while (read_len < len)
+	{
+		ssize_t result = pread(fd, ((char *) buf) + read_len, len - read_len, offset + read_len);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		else if (result == 0)
+			/* end of file */
+			break;
+		read_len += result;
+	}
+
+	if (read_len_ptr != NULL)
+		*read_len_ptr = read_len;
+
+	return 0;
+}
+
+static int fd_pwrite(int fd, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len_ptr)
+{
+	uint64_t write_len = 0;
+	while (write_len < len)
+	{
+		ssize_t result = pwrite(fd, ((const char *) buf) + write_len, len - write_len, offset + write_len);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		else if (result == 0)
+			/* nothing was written, and
+			 * trying again would not
+			 * make progress */
+			return -EIO;
+		write_len += result;
+	}
+
+	if (write_len_ptr != NULL)
+		*write_len_ptr = write_len;
+
+	return 0;
+}
+
+/* The positional methods bypass the stdio buffer
+ * and go straight to the file descriptor. Any data
+ * buffered by a previous fread or fwrite is flushed
+ * first, so that both paths see the same data. When
+ * nothing is buffered, fflush does not call into the
+ * kernel. */
+
+static int bmfs_disk_file_pread(void *file_ptr, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len_ptr)
+{
+	if ((file_ptr == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	if (fflush((FILE *)(file_ptr)) != 0)
+		return -errno;
+
+	int fd = fileno((FILE *)(file_ptr));
+	if (fd < 0)
+		return -errno;
+
+	return fd_pread(fd, buf, len, offset, read_len_ptr);
+}
+
+static int bmfs_disk_file_pwrite(void *file_ptr, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len_ptr)
+{
+	if ((file_ptr == NULL)
+	 || (buf == NULL))
+		return -EFAULT;
+
+	if (fflush((FILE *)(file_ptr)) != 0)
+		return -errno;
+
+	int fd = fileno((FILE *)(file_ptr));
+	if (fd < 0)
+		return -errno;
+
+	return fd_pwrite(fd, buf, len, offset, write_len_ptr);
+}
+
 int bmfs_disk_init_file(struct BMFSDisk *disk, FILE *file)
 {
 	if ((disk == NULL)
 	 || (file == NULL))
 		return -EFAULT;
 
+	bmfs_disk_init(disk);
 	disk->disk = file;
 	disk->seek = bmfs_disk_file_seek;
 	disk->tell = bmfs_disk_file_tell;
 	disk->read = bmfs_disk_file_read;
 	disk->write = bmfs_disk_file_write;
+	disk->pread = bmfs_disk_file_pread;
+	disk->pwrite = bmfs_disk_file_pwrite;
+
+	return 0;
+}
+
+/* The file descriptor is stored in the
+ * disk pointer, so that no other memory
+ * is needed for the disk. */
+
+static int get_fd(void *fd_ptr)
+{
+	return (int)(intptr_t)(fd_ptr);
+}
+
+static int bmfs_disk_fd_seek(void *fd_ptr, int64_t offset, int whence)
+{
+	if (lseek(get_fd(fd_ptr), offset, whence) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int bmfs_disk_fd_tell(void *fd_ptr, int64_t *offset_ptr)
+{
+	off_t offset = lseek(get_fd(fd_ptr), 0, SEEK_CUR);
+	if (offset < 0)
+		return -errno;
+
+	if (offset_ptr != NULL)
+		*offset_ptr = offset;
+
+	return 0;
+}
+
+static int bmfs_disk_fd_read(void *fd_ptr, void *buf, uint64_t len, uint64_t *read_len_ptr)
+{
+	if (buf == NULL)
+		return -EFAULT;
+
+	int fd = get_fd(fd_ptr);
+
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0)
+		return -errno;
+
+	uint64_t read_len = 0;
+	int err = fd_pread(fd, buf, len, offset, &read_len);
+	if (err != 0)
+		return err;
+
+	if (lseek(fd, offset + read_len, SEEK_SET) < 0)
+		return -errno;
+
+	if (read_len_ptr != NULL)
+		*read_len_ptr = read_len;
+
+	return 0;
+}
+
+static int bmfs_disk_fd_write(void *fd_ptr, const void *buf, uint64_t len, uint64_t *write_len_ptr)
+{
+	if (buf == NULL)
+		return -EFAULT;
+
+	int fd = get_fd(fd_ptr);
+
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0)
+		return -errno;
+
+	uint64_t write_len = 0;
+	int err = fd_pwrite(fd, buf, len, offset, &write_len);
+	if (err != 0)
+		return err;
+
+	if (lseek(fd, offset + write_len, SEEK_SET) < 0)
+		return -errno;
+
+	if (write_len_ptr != NULL)
+		*write_len_ptr = write_len;
+
+	return 0;
+}
+
+static int bmfs_disk_fd_pread(void *fd_ptr, void *buf, uint64_t len, uint64_t offset, uint64_t *read_len_ptr)
+{
+	if (buf == NULL)
+		return -EFAULT;
+
+	return fd_pread(get_fd(fd_ptr), buf, len, offset, read_len_ptr);
+}
+
+static int bmfs_disk_fd_pwrite(void *fd_ptr, const void *buf, uint64_t len, uint64_t offset, uint64_t *write_len_ptr)
+{
+	if (buf == NULL)
+		return -EFAULT;
+
+	return fd_pwrite(get_fd(fd_ptr), buf, len, offset, write_len_ptr);
+}
+
+int bmfs_disk_init_fd(struct BMFSDisk *disk, int fd)
+{
+	if (disk == NULL)
+		return -EFAULT;
+	else if (fd < 0)
+		return -EBADF;
+
+	bmfs_disk_init(disk);
+	disk->disk = (void *)(intptr_t)(fd);
+	disk->seek = bmfs_disk_fd_seek;
+	disk->tell = bmfs_disk_fd_tell;
+	disk->read = bmfs_disk_fd_read;
+	disk->write = bmfs_disk_fd_write;
+	disk->pread = bmfs_disk_fd_pread;
+	disk->pwrite = bmfs_disk_fd_pwrite;
+
+	return 0;
+}
+
+/* Copies data without it going through user
+ * space, if the kernel supports it for these
+ * files. Stops early, without an error, if the
+ * data has to be copied through a buffer. */
+
+static int copy_in_kernel(int in_fd, int64_t in_offset, int out_fd, int64_t out_offset, uint64_t len, uint64_t *copied_ptr)
+{
+	uint64_t copied = 0;
+
+#ifdef __linux__
+	/* copy_file_range only works between
+	 * regular files, sendfile also works when
+	 * the output is a pipe or a socket */
+	int use_copy_range = 1;
+
+	while (copied < len)
+	{
+		size_t chunk = len - copied;
+		if (chunk > COPY_CALL_MAX)
+			chunk = COPY_CALL_MAX;
+
+		loff_t in_pos = in_offset + copied;
+		loff_t out_pos = out_offset + copied;
+
+		ssize_t result;
+		if (use_copy_range)
+			result = copy_file_range(in_fd, (in_offset < 0) ? NULL : &in_pos,
+			                         out_fd, (out_offset < 0) ? NULL : &out_pos,
+			                         chunk, 0);
+		else if (out_offset < 0)
+			result = sendfile(out_fd, in_fd, (in_offset < 0) ? NULL : &in_pos, chunk);
+		else
+			/* sendfile can't write at an offset */
+			break;
+
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			else if (use_copy_range
+			      && ((errno == EXDEV)
+			       || (errno == EINVAL)
+			       || (errno == ENOSYS)
+			       || (errno == EBADF)
+			       || (errno == EOPNOTSUPP)))
+			{
+				use_copy_range = 0;
+				continue;
+			}
+			else if ((errno == EINVAL)
+			      || (errno == ENOSYS))
+				break;
+
+			return -errno;
+		}
+		else if (result == 0)
+			/* end of file */
+			break;
+
+		copied += result;
+	}
+#else
+	(void) in_fd;
+	(void) in_offset;
+	(void) out_fd;
+	(void) out_offset;
+	(void) len;
+#endif
+
+	*copied_ptr = copied;
+
+	return 0;
+}
+
+/* These are used when the data is copied
+ * through a buffer. A negative offset means
+ * that the file position is used instead. */
+
+static int read_some(int fd, void *buf, uint64_t len, int64_t offset, uint64_t *read_len)
+{
+	for (;;)
+	{
+		ssize_t result;
+		if (offset < 0)
+			result = read(fd, buf, len);
+		else
+			result = pread(fd, buf, len, offset);
+
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		*read_len = result;
+
+		return 0;
+	}
+}
+
+static int write_all(int fd, const void *buf, uint64_t len, int64_t offset)
+{
+	if (offset >= 0)
+		return fd_pwrite(fd, buf, len, offset, NULL);
+
+	uint64_t write_len = 0;
+	while (write_len < len)
+	{
+		ssize_t result = write(fd, ((const char *) buf) + write_len, len - write_len);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		write_len += result;
+	}
 
 	return 0;
 }
 
+int bmfs_copy_fd(int in_fd,
+                 int64_t in_offset,
+                 int out_fd,
+                 int64_t out_offset,
+                 uint64_t len,
+                 uint64_t buf_size,
+                 uint64_t *copied_len)
+{
+	if ((in_fd < 0)
+	 || (out_fd < 0))
+		return -EBADF;
+
+	uint64_t copied = 0;
+
+	int err = copy_in_kernel(in_fd, in_offset, out_fd, out_offset, len, &copied);
+	if (err != 0)
+		return err;
+
+	if (copied < len)
+	{
+		if (buf_size == 0)
+			buf_size = BMFS_BLOCK_SIZE;
+
+		if (buf_size > (len - copied))
+			buf_size = len - copied;
+
+		char *buf = malloc(buf_size);
+		if (buf == NULL)
+			return -ENOMEM;
+
+		while (copied < len)
+		{
+			uint64_t chunk = len - copied;
+			if (chunk > buf_size)
+				chunk = buf_size;
+
+			uint64_t read_len = 0;
+			err = read_some(in_fd, buf, chunk, (in_offset < 0) ? -1 : (int64_t)(in_offset + copied), &read_len);
+			if ((err != 0)
+			 || (read_len == 0))
+				break;
+
+			err = write_all(out_fd, buf, read_len, (out_offset < 0) ? -1 : (int64_t)(out_offset + copied));
+			if (err != 0)
+				break;
+
+			copied += read_len;
+		}
+
+		free(buf);
+
+		if (err != 0)
+			return err;
+	}
+
+	if (copied_len != NULL)
+		*copied_len = copied;
+
+	return 0;
+}
+
+/* Writes zeros over the whole disk image, for
+ * file systems that can't allocate space any
+ * other way. Progress is only printed when the
+ * percentage changes. */
+
+static int zero_fill(FILE *disk, unsigned long long diskSize, char *buffer, size_t bufferSize)
+{
+	unsigned long long writeSize = 0;
+	int lastPercent = -1;
+
+	memset(buffer, 0, bufferSize);
+
+	while (writeSize < diskSize)
+	{
+		int percent = (int)((writeSize * 100) / diskSize);
+		if (percent != lastPercent)
+		{
+			printf("Formatting disk: %llu of %llu bytes (%d%%)...\r", writeSize, diskSize, percent);
+			fflush(stdout);
+			lastPercent = percent;
+		}
+
+		size_t chunkSize = bufferSize;
+		if (chunkSize > diskSize - writeSize)
+		{
+			chunkSize = diskSize - writeSize;
+		}
+		if (fwrite(buffer, chunkSize, 1, disk) != 1)
+		{
+			return -EIO;
+		}
+		writeSize += chunkSize;
+	}
+
+	printf("Formatting disk: %llu of %llu bytes (100%%)%9s\n", writeSize, diskSize, "");
+
+	return 0;
+}
+
+/* Sets the size of the disk image. A new image
+ * is all zeros, so it's made sparse by default and
+ * only the regions that are written afterwards take
+ * up space. */
+
+static int size_disk(FILE *disk, unsigned long long diskSize, int flags, char *buffer, size_t bufferSize)
+{
+	int fd = fileno(disk);
+	if (fd < 0)
+		return -errno;
+
+	if ((flags & BMFS_INITIALIZE_PREALLOCATE) == 0)
+	{
+		if (ftruncate(fd, diskSize) != 0)
+			return -errno;
+		return 0;
+	}
+
+	int err = posix_fallocate(fd, 0, diskSize);
+	if (err == 0)
+		return 0;
+	else if ((err != EINVAL)
+	      && (err != EOPNOTSUPP))
+		return -err;
+
+	/* not supported by the file system */
+	return zero_fill(disk, diskSize, buffer, bufferSize);
+}
+
 int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *kernel)
+{
+	return bmfs_initialize_flags(diskname, size, mbr, boot, kernel, 0);
+}
+
+int bmfs_initialize_flags(char *diskname, char *size, char *mbr, char *boot, char *kernel, int flags)
 {
 	unsigned long long diskSize = 0;
-	unsigned long long writeSize = 0;
 	const char *bootFileType = NULL;
-	size_t bufferSize = 50 * 1024;
+	size_t bufferSize = 1024 * 1024;
 	char * buffer = NULL;
 	FILE *mbrFile = NULL;
 	FILE *bootFile = NULL;
@@ -239,7 +721,7 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 	// actually write to the file.
 	if (ret == 0)
 	{
-		disk = fopen(diskname, "wb");
+		disk = fopen(diskname, "w+b");
 		if (disk == NULL)
 		{
 			printf("Error: Unable to open disk '%s'\n", diskname);
@@ -247,34 +729,13 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 		}
 	}
 
-	// Fill the disk image with zeros.
+	// Size the disk image, either sparse or with the space allocated.
 	if (ret == 0)
 	{
-		double percent;
-		memset(buffer, 0, bufferSize);
-		writeSize = 0;
-		while (writeSize < diskSize)
-		{
-			percent = writeSize;
-			percent /= diskSize;
-			percent *= 100;
-			printf("Formatting disk: %llu of %llu bytes (%.0f%%)...\r", writeSize, diskSize, percent);
-			chunkSize = bufferSize;
-			if (chunkSize > diskSize - writeSize)
-			{
-				chunkSize = diskSize - writeSize;
-			}
-			if (fwrite(buffer, chunkSize, 1, disk) != 1)
-			{
-				printf("Error: Failed to write disk '%s'\n", diskname);
-				ret = 1;
-				break;
-			}
-			writeSize += chunkSize;
-		}
-		if (ret == 0)
+		if (size_disk(disk, diskSize, flags, buffer, bufferSize) != 0)
 		{
-			printf("Formatting disk: %llu of %llu bytes (100%%)%9s\n", writeSize, diskSize, "");
+			printf("Error: Failed to write disk '%s'\n", diskname);
+			ret = 1;
 		}
 	}
 
@@ -283,7 +744,11 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 	{
 		struct BMFSDisk tmp_disk;
 		bmfs_disk_init_file(&tmp_disk, disk);
-		bmfs_disk_format(&tmp_disk);
+		if (bmfs_disk_format(&tmp_disk) != 0)
+		{
+			printf("Error: Failed to format disk '%s'\n", diskname);
+			ret = 1;
+		}
 	}
 
 	// Write the master boot record if it was specified by the caller.
@@ -392,155 +857,146 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 	return ret;
 }
 
-void bmfs_readfile(struct BMFSDisk *disk, const char *filename)
+int bmfs_readfile(struct BMFSDisk *disk, const char *filename)
 {
 	struct BMFSEntry tempentry;
 	FILE *tfile;
 	int slot;
+	int err;
 	unsigned long long bytestoread;
 	char *buffer;
 
-	if (bmfs_disk_find_file(disk, filename, &tempentry, &slot) != 0)
+	err = bmfs_disk_find_file(disk, filename, &tempentry, &slot);
+	if (err != 0)
 	{
 		printf("Error: File not found in BMFS.\n");
+		return err;
 	}
-	else
+
+	if ((tfile = fopen(tempentry.FileName, "wb")) == NULL)
 	{
-		if ((tfile = fopen(tempentry.FileName, "wb")) == NULL)
+		err = -errno;
+		printf("Error: Could not open local file '%s'\n", tempentry.FileName);
+		return err;
+	}
+
+	buffer = malloc(BMFS_BLOCK_SIZE);
+	if (buffer == NULL)
+	{
+		fclose(tfile);
+		printf("Error: Unable to allocate enough memory for buffer.\n");
+		return -ENOMEM;
+	}
+
+	bytestoread = tempentry.FileSize;
+	err = bmfs_disk_seek(disk, tempentry.StartingBlock*BMFS_BLOCK_SIZE, SEEK_SET); // Skip to the starting block in the disk
+
+	while ((err == 0) && (bytestoread != 0))
+	{
+		unsigned long long len = bytestoread;
+		if (len > BMFS_BLOCK_SIZE)
+			len = BMFS_BLOCK_SIZE;
+
+		err = bmfs_disk_read(disk, buffer, len, NULL);
+		if (err != 0)
+			printf("Error: Unexpected read length detected.\n");
+		else if (fwrite(buffer, len, 1, tfile) != 1)
 		{
-			printf("Error: Could not open local file '%s'\n", tempentry.FileName);
+			printf("Error: Could not write to local file '%s'\n", tempentry.FileName);
+			err = -EIO;
 		}
 		else
-		{
-			bytestoread = tempentry.FileSize;
-			bmfs_disk_seek(disk, tempentry.StartingBlock*BMFS_BLOCK_SIZE, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(BMFS_BLOCK_SIZE);
-			if (buffer == NULL)
-			{
-				printf("Error: Unable to allocate enough memory for buffer.\n");
-			}
-			else
-			{
-				while (bytestoread != 0)
-				{
-					if (bytestoread >= BMFS_BLOCK_SIZE)
-					{
-						if (bmfs_disk_read(disk, buffer, BMFS_BLOCK_SIZE, NULL) == 0)
-						{
-							fwrite(buffer, BMFS_BLOCK_SIZE, 1, tfile);
-							bytestoread -= BMFS_BLOCK_SIZE;
-						}
-						else
-						{
-							printf("Error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-					else
-					{
-						if (bmfs_disk_read(disk, buffer, bytestoread, NULL) == 0)
-						{
-							fwrite(buffer, bytestoread, 1, tfile);
-							bytestoread = 0;
-						}
-						else
-						{
-							printf("Error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-				}
-			}
-			fclose(tfile);
-		}
+			bytestoread -= len;
 	}
+
+	free(buffer);
+
+	if ((fclose(tfile) != 0)
+	 && (err == 0))
+		err = -errno;
+
+	return err;
 }
 
-void bmfs_writefile(struct BMFSDisk *disk, const char *filename)
+int bmfs_writefile(struct BMFSDisk *disk, const char *filename)
 {
-	struct BMFSDir dir;
-	struct BMFSEntry *entry;
+	struct BMFSEntry tempentry;
+	struct BMFSEntry *entry = &tempentry;
+	int slot;
 	FILE *tfile;
-	int retval;
-	unsigned long long tempfilesize;
+	int err;
+	long tempfilesize;
 	char *buffer;
 
-	if (bmfs_disk_read_dir(disk, &dir) != 0)
-		return;
-
-	entry = bmfs_dir_find(&dir, filename);
-	if (entry == NULL)
+	err = bmfs_disk_find_file(disk, filename, &tempentry, &slot);
+	if (err != 0)
 	{
 		printf("Error: File not found in BMFS\n");
 		printf("  A file must first be created\n");
-		return;
+		return err;
 	}
 
 	if ((tfile = fopen(filename, "rb")) == NULL)
 	{
+		err = -errno;
 		printf("Error: Could not open local file '%s'\n", entry->FileName);
-		return;
+		return err;
 	}
 
 	// Is there enough room in BMFS?
-	fseek(tfile, 0, SEEK_END);
-	tempfilesize = ftell(tfile);
+	if ((fseek(tfile, 0, SEEK_END) != 0)
+	 || ((tempfilesize = ftell(tfile)) < 0))
+	{
+		err = -errno;
+		fclose(tfile);
+		printf("Error: Could not get the size of local file '%s'\n", entry->FileName);
+		return err;
+	}
 	rewind(tfile);
-	if ((entry->ReservedBlocks*BMFS_BLOCK_SIZE) < tempfilesize)
+	if ((entry->ReservedBlocks*BMFS_BLOCK_SIZE) < (unsigned long long) tempfilesize)
 	{
 		fclose(tfile);
 		printf("Error: Not enough reserved space in BMFS.\n");
-		return;
+		return -ENOSPC;
 	}
 
-	retval = bmfs_disk_seek(disk, entry->StartingBlock*BMFS_BLOCK_SIZE, SEEK_SET);
-	if (retval != 0)
-		return;
-
 	buffer = malloc(BMFS_BLOCK_SIZE);
 	if (buffer == NULL)
 	{
 		fclose(tfile);
 		printf("Error: Unable to allocate enough memory for buffer.\n");
+		return -ENOMEM;
 	}
 
-	while (tempfilesize != 0)
+	err = bmfs_disk_seek(disk, entry->StartingBlock*BMFS_BLOCK_SIZE, SEEK_SET);
+
+	unsigned long long bytestowrite = tempfilesize;
+
+	while ((err == 0) && (bytestowrite != 0))
 	{
-		if (tempfilesize >= BMFS_BLOCK_SIZE)
-		{
-			retval = fread(buffer, BMFS_BLOCK_SIZE, 1, tfile);
-			if (retval == 1)
-			{
-				bmfs_disk_write(disk, buffer, BMFS_BLOCK_SIZE, NULL);
-				tempfilesize -= BMFS_BLOCK_SIZE;
-			}
-			else
-			{
-				printf("Error: Unexpected read length detected.\n");
-				tempfilesize = 0;
-			}
-		}
-		else
+		unsigned long long len = bytestowrite;
+		if (len > BMFS_BLOCK_SIZE)
+			len = BMFS_BLOCK_SIZE;
+
+		if (fread(buffer, len, 1, tfile) != 1)
 		{
-			retval = fread(buffer, tempfilesize, 1, tfile);
-			if (retval == 1)
-			{
-				memset(buffer+(tempfilesize), 0, (BMFS_BLOCK_SIZE-tempfilesize)); // 0 the rest of the buffer
-				bmfs_disk_write(disk, buffer, BMFS_BLOCK_SIZE, NULL);
-				tempfilesize = 0;
-			}
-			else
-			{
-				printf("Error: Unexpected read length detected.\n");
-				tempfilesize = 0;
-			}
+			printf("Error: Unexpected read length detected.\n");
+			err = -EIO;
+			break;
 		}
+
+		memset(buffer+len, 0, BMFS_BLOCK_SIZE-len); // 0 the rest of the buffer
+		err = bmfs_disk_write(disk, buffer, BMFS_BLOCK_SIZE, NULL);
+		bytestowrite -= len;
 	}
 
-	// Update directory
-	tempfilesize = ftell(tfile);
-	entry->FileSize = tempfilesize;
-	bmfs_disk_write_dir(disk, &dir);
+	free(buffer);
 	fclose(tfile);
+
+	// Update directory
+	if (err == 0)
+		err = bmfs_disk_set_file_size(disk, slot, tempfilesize);
+
+	return err;
 }
 